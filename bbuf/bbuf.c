@@ -15,6 +15,14 @@
  */
 #include "bbuf.h"
 #include "butil.h"
+#include "bfilesys.h"
+#include "bfind.h"
+#include "bsave.h"
+#include "bsyntax.h"
+#include "bcolumn.h"
+#include "boffset.h"
+#include "bmemory.h"
+#include "bpack.h"
     
 /// \file
 ///
@@ -63,7 +71,7 @@ static int buffer_get_unicode_char(buffer_t *buffer, text_encoding_t encoding, u
         
         // read more in
         //
-        result = buffer->file->file_read(buffer->file, buffer->vbuf + buffer->vbuf_tail, buffer->vbuf_size - buffer->vbuf_count);
+        result = buffer->file->file_read(buffer->file, buffer->vbuf + buffer->vbuf_count, buffer->vbuf_size - buffer->vbuf_count);
         if (result <= 0)
         {
             at_eof = true;
@@ -71,8 +79,13 @@ static int buffer_get_unicode_char(buffer_t *buffer, text_encoding_t encoding, u
         else
         {
             at_eof = false;
+            if (buffer->trigrams_building)
+            {
+                trigram_add(buffer->trigrams, buffer->vbuf_offset + buffer->vbuf_count, (uint8_t*)buffer->vbuf + buffer->vbuf_count, result);
+            }
             buffer->vbuf_count += result;
         }
+        avail = buffer->vbuf_count - buffer->vbuf_tail;
     }
     if (avail == 0)
     {
@@ -211,22 +224,17 @@ static int buffer_size_sandbox(buffer_t *buffer, size_t size)
         if (! buffer->sandbox)
         {
             butil_log(0, "%s: Can't alloc sandbox\n", __FUNCTION__);
+            buffer_account_memory(buffer, memorySandbox, buffer->sandbox_size, 0);
             buffer->sandbox_size = 0;
             return -1;
         }
+        buffer_account_memory(buffer, memorySandbox, buffer->sandbox_size, newsize);
         buffer->sandbox_size = newsize;
     }
     return 0;
 }
 
-/// \brief Move to line in buffer
-///
-/// @param[in] buffer - buffer to allocate sandbox in
-/// @param[in] line   - line (0 based) to move to
-///
-/// @return 0 on success
-///
-static int buffer_select_line(buffer_t *buffer, size_t line)
+int buffer_select_line(buffer_t *buffer, size_t line)
 {
     if (!buffer || !buffer->lines)
     {
@@ -276,7 +284,7 @@ buffer_t *buffer_create(const char *name, file_t *file, uint8_t *vbuf, size_t vb
         butil_log(1, "Can't alloc buffer\n");
         return NULL;
     }
-    memset(buffer, 0, sizeof(buffer));
+    memset(buffer, 0, sizeof(buffer_t));
     
     if (! vbufsize)
     {
@@ -308,6 +316,22 @@ buffer_t *buffer_create(const char *name, file_t *file, uint8_t *vbuf, size_t vb
     buffer->sandbox_size = 0;
     buffer->sandbox_count = 0;
     
+    pthread_mutex_init(&buffer->io_lock, NULL);
+    version_store_init(&buffer->versions);
+    pthread_mutex_init(&buffer->save_lock, NULL);
+    pthread_cond_init(&buffer->save_done, NULL);
+    buffer->syntax = NULL;
+    buffer->syntax_dirty_from = (size_t)-1;
+    buffer->syntax_dirty_to = 0;
+    buffer->syntax_threads = 0;
+    buffer->tab_width = 0;
+    buffer->columns = NULL;
+    buffer->offsets = NULL;
+    buffer->packing = NULL;
+    buffer->line_memory = 0;
+    buffer->vbuf_used = true;
+    buffer->memory_mark = 0;
+    memory_add_buffer(buffer);
     return buffer;
 }
 
@@ -317,6 +341,12 @@ void buffer_destroy(buffer_t *buffer)
     {
         return;
     }
+    // saves still running hold snapshots of the buffer
+    //
+    buffer_save_cancel(buffer);
+    buffer_save_wait(buffer);
+    memory_remove_buffer(buffer);
+    
     if (buffer->vbuf && buffer->vbuf_alloced)
     {
         free(buffer->vbuf);
@@ -325,6 +355,325 @@ void buffer_destroy(buffer_t *buffer)
     {
         free(buffer->sandbox);
     }
+    if (buffer->trigrams)
+    {
+        trigram_destroy(buffer->trigrams);
+    }
+    if (buffer->undos)
+    {
+        undo_log_destroy(buffer->undos);
+    }
+    if (buffer->journal)
+    {
+        // keep the journal, edits not saved can be replayed
+        journal_close(buffer->journal, false);
+    }
+    if (buffer->syntax)
+    {
+        free(buffer->syntax);
+    }
+    buffer_forget_columns(buffer, NULL);
+    buffer_forget_offsets(buffer);
+    buffer_forget_packing(buffer);
+    version_store_deinit(&buffer->versions);
+    pthread_cond_destroy(&buffer->save_done);
+    pthread_mutex_destroy(&buffer->save_lock);
+    pthread_mutex_destroy(&buffer->io_lock);
+}
+
+int buffer_set_trigram_index(buffer_t *buffer, bool use)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    buffer->use_trigrams = use;
+    if (!use && buffer->trigrams)
+    {
+        trigram_destroy(buffer->trigrams);
+        buffer->trigrams = NULL;
+    }
+    return 0;
+}
+
+/// \brief Load a buffer's trigram index, or start building one
+///
+/// @param[in]  buffer    - buffer to index
+/// @param[out] file_size - size of file when index started
+/// @param[out] mod_time  - modification time of file when index started
+///
+static void buffer_open_trigrams(buffer_t *buffer, size_t *file_size, time_t *mod_time)
+{
+    char sidecar[MAX_PATH];
+
+    *file_size = 0;
+    *mod_time = 0;
+    
+    if (buffer->trigrams)
+    {
+        trigram_destroy(buffer->trigrams);
+        buffer->trigrams = NULL;
+    }
+    buffer->trigrams_building = false;
+
+    if (! buffer->use_trigrams)
+    {
+        return;
+    }
+    // only local files have a place to keep a sidecar
+    //
+    if (file_get_scheme(buffer->file->url, NULL, 0) != schemeFILE)
+    {
+        return;
+    }
+    // the index is checked against the file as it is now, not as it was
+    //
+    filesys_forget_info(buffer->file->url);
+    if (filesys_info(buffer->file->url, file_size, mod_time))
+    {
+        return;
+    }
+    if (! trigram_sidecar_url(buffer->file->url, sidecar, sizeof(sidecar)))
+    {
+        buffer->trigrams = trigram_load(sidecar, *file_size, *mod_time);
+        if (buffer->trigrams)
+        {
+            butil_log(4, "%s: Using index %s\n", __FUNCTION__, sidecar);
+            return;
+        }
+    }
+    buffer->trigrams = trigram_create(0);
+    if (buffer->trigrams)
+    {
+        buffer->trigrams->mod_time = *mod_time;
+        buffer->trigrams_building = true;
+    }
+}
+
+/// \brief Finish building a buffer's trigram index and save it
+///
+static void buffer_close_trigrams(buffer_t *buffer, size_t file_size)
+{
+    char sidecar[MAX_PATH];
+
+    if (! buffer->trigrams_building)
+    {
+        return;
+    }
+    buffer->trigrams_building = false;
+
+    if (!buffer->trigrams->valid || buffer->trigrams->file_size != file_size)
+    {
+        // file changed while reading or data was missed, don't trust it
+        //
+        butil_log(2, "%s: Index incomplete, not used\n", __FUNCTION__);
+        trigram_destroy(buffer->trigrams);
+        buffer->trigrams = NULL;
+        return;
+    }
+    if (! trigram_sidecar_url(buffer->file->url, sidecar, sizeof(sidecar)))
+    {
+        if (trigram_save(buffer->trigrams, sidecar))
+        {
+            // still use it for this session
+            butil_log(3, "%s: Can't save index %s\n", __FUNCTION__, sidecar);
+        }
+    }
+}
+
+int buffer_set_journal(buffer_t *buffer, bool use, int interval)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    buffer->use_journal = use;
+    buffer->journal_interval = interval;
+    if (!use && buffer->journal)
+    {
+        journal_close(buffer->journal, false);
+        buffer->journal = NULL;
+    }
+    return 0;
+}
+
+int buffer_sync_journal(buffer_t *buffer)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    if (! buffer->journal)
+    {
+        return 0;
+    }
+    return journal_sync(buffer->journal);
+}
+
+int buffer_reset_journal(buffer_t *buffer)
+{
+    size_t file_size;
+    time_t mod_time;
+    
+    if (! buffer || ! buffer->file)
+    {
+        return -1;
+    }
+    if (! buffer->journal)
+    {
+        return 0;
+    }
+    if (filesys_info(buffer->file->url, &file_size, &mod_time))
+    {
+        return -1;
+    }
+    return journal_reset(buffer->journal, file_size, mod_time);
+}
+
+int buffer_journal_edit(buffer_t *buffer, const journal_rec_t *rec)
+{
+    if (! buffer || ! buffer->journal)
+    {
+        return 0;
+    }
+    if (journal_append(buffer->journal, rec))
+    {
+        // a journal missing an edit would replay wrong after it, so
+        // stop here, leaving what was journaled so far to be replayed
+        //
+        butil_log(1, "%s: Can't journal edit, journal stopped\n", __FUNCTION__);
+        journal_close(buffer->journal, false);
+        buffer->journal = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/// \brief Add a simple edit to a buffer's journal
+///
+static void buffer_journal_op(buffer_t *buffer, journal_op_t op, size_t line, size_t column, size_t count,
+                            const char *text, size_t length)
+{
+    journal_rec_t rec;
+    
+    if (! buffer->journal)
+    {
+        return;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.line = line;
+    rec.column = column;
+    rec.count = count;
+    rec.text = (const uint8_t*)text;
+    rec.text_length = length;
+    buffer_journal_edit(buffer, &rec);
+}
+
+/// \brief Replay an edit from a buffer's journal, callback for ::journal_open
+///
+static int buffer_replay_journal(void *priv, const journal_rec_t *rec)
+{
+    buffer_t *buffer = (buffer_t*)priv;
+    int result;
+    
+    switch (rec->op)
+    {
+    case journalInsertText:
+        result = buffer_insert_text(buffer, rec->line, rec->column, (const char*)rec->text, rec->text_length);
+        break;
+    case journalDeleteText:
+        result = buffer_delete_text(buffer, rec->line, rec->column, rec->count);
+        break;
+    case journalInsertLines:
+        result = buffer_insert_lines(buffer, rec->line, (const char*)rec->text, rec->text_length);
+        break;
+    case journalDeleteLines:
+        result = buffer_delete_lines(buffer, rec->line, rec->count);
+        break;
+    case journalBeginGroup:
+        result = buffer_begin_undo_group(buffer);
+        break;
+    case journalEndGroup:
+        result = buffer_end_undo_group(buffer);
+        break;
+    case journalUndo:
+        result = buffer_undo(buffer);
+        break;
+    case journalRedo:
+        result = buffer_redo(buffer);
+        break;
+    case journalReplaceAll:
+        result = buffer_replace_all(buffer, (const char*)rec->text, rec->text_length,
+                                    (const char*)rec->text2, rec->text2_length,
+                                    (find_options_t)rec->options, 0, NULL);
+        break;
+    case journalSealUndo:
+        result = buffer_seal_undo(buffer);
+        break;
+    default:
+        result = -1;
+        break;
+    }
+    if (result < 0)
+    {
+        // only edits that were made are journaled, so one that can't be
+        // made again leaves the buffer as it was then, stop there
+        //
+        butil_log(1, "%s: Replayed edit %d at line %zu failed\n", __FUNCTION__, rec->op, rec->line);
+        return result;
+    }
+    return 0;
+}
+
+/// \brief Open a buffer's journal, replaying edits left in it on the lines just read
+///
+/// @param[in] buffer    - buffer to journal
+/// @param[in] file_size - size of file when read
+/// @param[in] mod_time  - modification time of file when read
+///
+static void buffer_open_journal(buffer_t *buffer, size_t file_size, time_t mod_time)
+{
+    char sidecar[MAX_PATH];
+    journal_t *journal;
+    
+    if (! buffer->use_journal)
+    {
+        return;
+    }
+    // only local files have a place to keep a sidecar
+    //
+    if (file_get_scheme(buffer->file->url, NULL, 0) != schemeFILE)
+    {
+        return;
+    }
+    if (journal_sidecar_url(buffer->file->url, sidecar, sizeof(sidecar)))
+    {
+        return;
+    }
+    // replayed edits aren't journaled again, they already are
+    //
+    journal = journal_open(sidecar, file_size, mod_time, buffer->journal_interval, buffer_replay_journal, buffer);
+    if (! journal)
+    {
+        butil_log(2, "%s: Can't open journal %s\n", __FUNCTION__, sidecar);
+        return;
+    }
+    buffer->journal = journal;
+    
+    // replay leaves the current line anywhere
+    buffer->curr_line = buffer->lines;
+    buffer->curr_linenum = 0;
+}
+
+/// \brief Free a line dropped from a buffer or its undo log, callback for ::undo_log_set_line_free
+///
+static void buffer_free_line(void *priv, line_t *line)
+{
+    buffer_account_memory((buffer_t*)priv, memoryLines, line_data_size(line), 0);
+    buffer_forget_packed((buffer_t*)priv, line);
+    buffer_forget_columns((buffer_t*)priv, line);
+    version_bury(&((buffer_t*)priv)->versions, line);
 }
 
 int buffer_read(buffer_t *buffer)
@@ -333,13 +682,21 @@ int buffer_read(buffer_t *buffer)
     int fudge;
     uint64_t line_offset;
     line_t *line;
+    line_t *next;
     unicode_char_t ucode;
+    size_t file_size;
+    time_t mod_time;
     
-    if (!buffer || !buffer->file || !buffer->vbuf)
+    if (!buffer || !buffer->file)
     {
         butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
         return -1;
     }
+    result = buffer_need_vbuf(buffer);
+    if (result)
+    {
+        return result;
+    }
     // make sure at start of file
     //
     result = buffer->file->file_seek(buffer->file, 0);
@@ -347,17 +704,60 @@ int buffer_read(buffer_t *buffer)
     {
         return result;
     }
+    // edits to the old lines can't be undone in the new ones
+    //
+    undo_log_clear(buffer->undos);
+
+    // the old lines go, and their memory with them
+    //
+    for (line = buffer->lines; line; line = next)
+    {
+        next = line->next;
+        buffer_free_line(buffer, line);
+    }
+    buffer->lines = NULL;
+    buffer->line_count = 0;
+    buffer_forget_columns(buffer, NULL);
+    buffer_forget_offsets(buffer);
+    buffer_forget_packed(buffer, NULL);
+    
+    if (buffer->journal)
+    {
+        journal_close(buffer->journal, false);
+        buffer->journal = NULL;
+    }
+    // get or start a trigram index if wanted
+    //
+    buffer_open_trigrams(buffer, &file_size, &mod_time);
+    if (buffer->use_journal && ! buffer->use_trigrams)
+    {
+        filesys_forget_info(buffer->file->url);
+        if (file_get_scheme(buffer->file->url, NULL, 0) != schemeFILE
+            || filesys_info(buffer->file->url, &file_size, &mod_time))
+        {
+            file_size = 0;
+            mod_time = 0;
+        }
+    }
+    
     // read a buffer's worth and sniff file encoding
     //
     result = buffer->file->file_read(buffer->file, buffer->vbuf, buffer->vbuf_size);
     if (result < 0)
     {
         butil_log(2, "%s: Can't read file\n", __FUNCTION__);
+        trigram_destroy(buffer->trigrams);
+        buffer->trigrams = NULL;
+        buffer->trigrams_building = false;
         return result;
     }
     buffer->vbuf_tail = 0;
     buffer->vbuf_offset = 0;
     buffer->vbuf_count = result;
+    if (buffer->trigrams_building)
+    {
+        trigram_add(buffer->trigrams, 0, (uint8_t*)buffer->vbuf, result);
+    }
     buffer->original_encoding = file_sniff_encoding(buffer->vbuf, buffer->vbuf_count);
     buffer->original_lineends = file_sniff_line_endings(buffer->vbuf, buffer->vbuf_count);
 
@@ -420,6 +820,7 @@ int buffer_read(buffer_t *buffer)
             }
             else
             {
+                line->generation = buffer->versions.generation;
                 line->prev = buffer->curr_line;
                 line->next = NULL;
                 if (buffer->curr_line)
@@ -450,6 +851,7 @@ int buffer_read(buffer_t *buffer)
         }
         else
         {
+            line->generation = buffer->versions.generation;
             line->prev = buffer->curr_line;
             line->next = NULL;
             if (buffer->curr_line)
@@ -465,58 +867,312 @@ int buffer_read(buffer_t *buffer)
         }
     }
     buffer->line_count = buffer->curr_linenum;
+    buffer_close_trigrams(buffer, file_size);
+    if (buffer->syntax)
+    {
+        // none of the new lines are lexed
+        buffer->syntax_dirty_from = 0;
+        buffer->syntax_dirty_to = buffer->line_count;
+    }
     butil_log(3, "%s: %d lines from %d bytes\n", __FUNCTION__, buffer->line_count, buffer->vbuf_offset + buffer->vbuf_count);
 
     // leave with line at top
     buffer->curr_line = buffer->lines;
     buffer->curr_linenum = 0;
+    
+    // apply any edits not saved last time
+    //
+    buffer_open_journal(buffer, file_size, mod_time);
     return 0;
 }
 
-int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding)
+buffer_snapshot_t *buffer_snapshot(buffer_t *buffer)
 {
-    uint8_t *linedata;
-    char    *linetext;
-    size_t   linenum;
-    size_t   length;
-    size_t   count;
-    size_t   used;
-    size_t   index;
-    size_t   outdex;
-    uint32_t unicode;
-    int      result;
+    buffer_snapshot_t *snapshot;
     
-    if (!buffer || !buffer->file || !outfile)
+    if (! buffer)
     {
         butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
-        return -1;
+        return NULL;
     }
-    result = file_write_BOM(outfile, encoding);
+    // versions are made of lines in memory, not packed ones
+    //
+    if (buffer_unpack_lines(buffer))
+    {
+        butil_log(0, "%s: Can't unpack lines\n", __FUNCTION__);
+        return NULL;
+    }
+    snapshot = (buffer_snapshot_t*)malloc(sizeof(buffer_snapshot_t));
+    if (! snapshot)
+    {
+        butil_log(0, "%s: Can't alloc snapshot\n", __FUNCTION__);
+        return NULL;
+    }
+    if (version_open(&buffer->versions, &snapshot->generation))
+    {
+        butil_log(0, "%s: Can't start snapshot\n", __FUNCTION__);
+        free(snapshot);
+        return NULL;
+    }
+    // the list is shared as it is, the buffer saves what it changes from here on
+    //
+    snapshot->buffer = buffer;
+    snapshot->lines = buffer->lines;
+    snapshot->line_count = buffer->line_count;
+    snapshot->original_encoding = buffer->original_encoding;
+    snapshot->original_lineends = buffer->original_lineends;
+    snapshot->refs = 1;
+    return snapshot;
+}
+
+buffer_snapshot_t *buffer_snapshot_retain(buffer_snapshot_t *snapshot)
+{
+    if (snapshot)
+    {
+        pthread_mutex_lock(&snapshot->buffer->versions.lock);
+        snapshot->refs++;
+        pthread_mutex_unlock(&snapshot->buffer->versions.lock);
+    }
+    return snapshot;
+}
+
+void buffer_snapshot_release(buffer_snapshot_t *snapshot)
+{
+    int refs;
     
-    if (buffer->original_encoding == encoding)
+    if (! snapshot)
     {
-        // special case writing file in same encoding to avoid double buffering
-        //
-        for (linenum = 0; linenum < buffer->line_count; linenum++)
-        {
-            result = buffer_get_line_content(buffer, linenum, &linedata, &length);
-            if (result)
-            {
-                // assume buffer line count is wrong?  or error?
-                break;
-            }
-            // if line is in memory, it is in utf-8 (native) format, so transcode
-            // to output format as needed, otherwise directly write file data
-            //
-            if (buffer->curr_line->location == lineInMemory)
-            {
-                switch (encoding)
-                {
-                case textBINARY:
-                case textASCII:
-                case textUTF8:
-                default:
-                    // use line content directly in memory with no transcoding
+        return;
+    }
+    pthread_mutex_lock(&snapshot->buffer->versions.lock);
+    refs = --snapshot->refs;
+    pthread_mutex_unlock(&snapshot->buffer->versions.lock);
+    
+    if (refs == 0)
+    {
+        version_close(&snapshot->buffer->versions, snapshot->generation);
+        free(snapshot);
+    }
+}
+
+int buffer_snapshot_next_line(buffer_snapshot_t *snapshot, snapshot_cursor_t *cursor,
+                                uint8_t **content, size_t *length, bool *in_memory)
+{
+    line_t state;
+    uint8_t *data;
+    int result;
+    
+    if (!snapshot || !cursor || !content || !length)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! cursor->started)
+    {
+        cursor->next = snapshot->lines;
+        cursor->linenum = 0;
+        cursor->started = true;
+    }
+    if (cursor->linenum >= snapshot->line_count || ! cursor->next)
+    {
+        return 1;
+    }
+    result = version_resolve(&snapshot->buffer->versions, snapshot->generation, cursor->next,
+                            &state, &cursor->data, &cursor->data_size);
+    if (result)
+    {
+        return result;
+    }
+    if (state.location == lineInFile)
+    {
+        // file content doesn't change, so is read without holding anything
+        //
+        if (cursor->data_size < state.length + 1 || ! cursor->data)
+        {
+            data = (uint8_t*)realloc(cursor->data, state.length + 1);
+            if (! data)
+            {
+                return -1;
+            }
+            cursor->data = data;
+            cursor->data_size = state.length + 1;
+        }
+        result = buffer_read_at(snapshot->buffer, state.position.offset, cursor->data, state.length);
+        if (result < 0 || (size_t)result != state.length)
+        {
+            butil_log(1, "%s: Can't read line %u\n", __FUNCTION__, cursor->linenum);
+            return -1;
+        }
+        cursor->data[state.length] = '\0';
+    }
+    else if (state.location == lineInPieces)
+    {
+        // data holds the copy of the pieces, put the line together beside it
+        //
+        if (cursor->text_size < state.length + 1 || ! cursor->text)
+        {
+            data = (uint8_t*)realloc(cursor->text, state.length + 1);
+            if (! data)
+            {
+                return -1;
+            }
+            cursor->text = data;
+            cursor->text_size = state.length + 1;
+        }
+        result = buffer_read_line(snapshot->buffer, &state, 0, cursor->text, state.length);
+        if (result < 0 || (size_t)result != state.length)
+        {
+            butil_log(1, "%s: Can't read line %u\n", __FUNCTION__, cursor->linenum);
+            return -1;
+        }
+        cursor->text[state.length] = '\0';
+    }
+    *content = (state.location == lineInPieces) ? cursor->text : cursor->data;
+    *length = state.length;
+    if (in_memory)
+    {
+        *in_memory = (state.location == lineInMemory);
+    }
+    cursor->next = state.next;
+    cursor->linenum++;
+    return 0;
+}
+
+void buffer_snapshot_end(snapshot_cursor_t *cursor)
+{
+    if (! cursor)
+    {
+        return;
+    }
+    if (cursor->data)
+    {
+        free(cursor->data);
+    }
+    if (cursor->text)
+    {
+        free(cursor->text);
+    }
+    memset(cursor, 0, sizeof(snapshot_cursor_t));
+}
+
+/// \brief Write the raw bytes of a line to a file without getting all of it at once
+///
+/// @return 0 on success
+///
+static int buffer_write_slices(buffer_t *buffer, size_t line, file_t *outfile)
+{
+    uint8_t *slice;
+    uint64_t offset;
+    size_t length;
+    size_t count;
+    int result;
+
+    for (offset = 0; ; offset += length)
+    {
+        result = buffer_get_line_slice(buffer, line, offset, &slice, &length);
+        if (result)
+        {
+            return result;
+        }
+        if (! length)
+        {
+            return 0;
+        }
+        count = outfile->file_write(outfile, slice, length);
+        if (count != length)
+        {
+            butil_log(1, "%s: Can't write output file\n", __FUNCTION__);
+            return -1;
+        }
+    }
+}
+
+int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding)
+{
+    uint8_t *linedata;
+    char    *linetext;
+    size_t   linenum;
+    size_t   length;
+    size_t   count;
+    size_t   used;
+    size_t   index;
+    size_t   outdex;
+    uint32_t unicode;
+    int      result;
+    
+    if (!buffer || !buffer->file || !outfile)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = file_write_BOM(outfile, encoding);
+    
+    if (buffer->original_encoding == encoding)
+    {
+        // special case writing file in same encoding to avoid double buffering
+        //
+        for (linenum = 0; linenum < buffer->line_count; linenum++)
+        {
+            result = buffer_select_line(buffer, linenum);
+            if (result)
+            {
+                break;
+            }
+            if (
+                    buffer->curr_line->location == lineInPieces
+                ||  (buffer->curr_line->location == lineInFile && buffer->curr_line->length > buffer->vbuf_size)
+            )
+            {
+                // raw bytes of a line too long for vbuf are written a slice at a time
+                //
+                result = buffer_write_slices(buffer, linenum, outfile);
+                if (result)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (buffer->curr_line->location == lineInBlock)
+            {
+                // read a packed line in vbuf, writing isn't a use of it
+                //
+                result = buffer_need_vbuf(buffer);
+                if (result)
+                {
+                    break;
+                }
+                buffer->vbuf_offset = 0;
+                buffer->vbuf_count = 0;
+                buffer->vbuf_tail = 0;
+                length = buffer->curr_line->length;
+                linedata = (uint8_t*)buffer->vbuf;
+                if (buffer_read_line(buffer, buffer->curr_line, 0, linedata, length) != (int)length)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+            else
+            {
+                result = buffer_get_line_content(buffer, linenum, &linedata, &length);
+                if (result)
+                {
+                    // assume buffer line count is wrong?  or error?
+                    break;
+                }
+            }
+            // if line is in memory, it is in utf-8 (native) format, so transcode
+            // to output format as needed, otherwise directly write file data
+            //
+            if (buffer->curr_line->location == lineInMemory || buffer->curr_line->location == lineInBlock)
+            {
+                switch (encoding)
+                {
+                case textBINARY:
+                case textASCII:
+                case textUTF8:
+                default:
+                    // use line content directly in memory with no transcoding
                     break;
                 case textUCS2LE:
                 case textUCS2BE:
@@ -599,7 +1255,7 @@ int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding)
             case textUTF8:
             default:
                 // use line content directly in memory with no transcoding
-                newline == NULL;
+                linedata = (uint8_t*)linetext;
                 break;
             case textUCS2LE:
             case textUCS2BE:
@@ -676,140 +1332,354 @@ int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding)
     return 0;
 }
 
-int buffer_get_line_content(buffer_t *buffer, size_t line, uint8_t **content, size_t *length)
+int buffer_read_at(buffer_t *buffer, uint64_t offset, uint8_t *data, size_t count)
 {
-    uint64_t offset;
+    size_t total;
     int result;
     
-    if (!content || !length)
+    if (!buffer || !buffer->file || !data)
     {
         return -1;
     }
-    *content = "";
-    *length = 0;
-
-    if (!buffer || !buffer->lines)
+    pthread_mutex_lock(&buffer->io_lock);
+    
+    result = buffer->file->file_seek(buffer->file, offset);
+    if (result)
     {
+        pthread_mutex_unlock(&buffer->io_lock);
+        butil_log(1, "%s: Can't reposition in file\n", __FUNCTION__);
         return -1;
     }
-    result = buffer_select_line(buffer, line);
-    if (result)
+    // a read can be short, so keep reading until count or end of file
+    //
+    total = 0;
+    while (total < count)
+    {
+        result = buffer->file->file_read(buffer->file, data + total, count - total);
+        if (result <= 0)
+        {
+            break;
+        }
+        total += result;
+    }
+    pthread_mutex_unlock(&buffer->io_lock);
+    
+    if (result < 0 && total == 0)
     {
         return result;
     }
-    // if line is already in memory, all set
-    //
-    if (buffer->curr_line->location == lineInMemory)
+    return (int)total;
+}
+
+int buffer_read_line(buffer_t *buffer, const line_t *line, uint64_t offset, uint8_t *data, size_t count)
+{
+    const line_pieces_t *pieces;
+    const line_piece_t *piece;
+    uint64_t start;
+    size_t total;
+    size_t skip;
+    size_t chunk;
+    size_t i;
+    int result;
+
+    if (!buffer || !line || (!data && count))
+    {
+        return -1;
+    }
+    if (offset >= line->length)
     {
-        *content = buffer->curr_line->position.data;
-        *length = buffer->curr_line->length;
         return 0;
     }
-    // check that the line is wholly inside the buffer's vbuf and if not
-    // re-buffer around the region
-    //
-    if (
-            (buffer->curr_line->position.offset < buffer->vbuf_offset)
-        ||  ((buffer->curr_line->position.offset + buffer->curr_line->length)> (buffer->vbuf_offset + buffer->vbuf_count))
-    )
+    if (count > (line->length - offset))
     {
-        size_t margin;
-        int result;
-        
-        // center position in vbuf
-        //
-        if (buffer->curr_line->length > buffer->vbuf_size)
-        {
-            butil_log(1, "%s: Line of %d can't fit in vbuf of size %d\n", __FUNCTION__, 
-                buffer->curr_line->length, buffer->vbuf_size);
-            return -1;
-        }
-        margin = (buffer->vbuf_size - buffer->curr_line->length) / 2;
-        offset = buffer->curr_line->position.offset;
-        if (offset > margin)
+        count = (size_t)(line->length - offset);
+    }
+    switch (line->location)
+    {
+    case lineInFile:
+        return buffer_read_at(buffer, line->position.offset + offset, data, count);
+    case lineInMemory:
+        memcpy(data, line->position.data + offset, count);
+        return (int)count;
+    case lineInBlock:
+        return buffer_read_packed(buffer, line, offset, data, count);
+    default:
+        break;
+    }
+    pieces = line->position.pieces;
+    total = 0;
+
+    for (i = 0, start = 0; i < pieces->count && total < count; start += pieces->piece[i].length, i++)
+    {
+        piece = &pieces->piece[i];
+        if ((start + piece->length) <= offset)
         {
-            offset -= margin;
+            continue;
         }
-        offset &= ~0x1F; // align to 32 bytes
-        
-        // reposition file at offset and read a chunk
-        //
-        result = buffer->file->file_seek(buffer->file, offset);
-        if (result)
+        skip = (offset > start) ? (size_t)(offset - start) : 0;
+        chunk = piece->length - skip;
+        if (chunk > (count - total))
         {
-            butil_log(1, "%s: Can't reposition in file\n", __FUNCTION__);
-            return -1;
+            chunk = count - total;
         }
-        buffer->vbuf_offset = offset;
-
-        result = buffer->file->file_read(buffer->file, buffer->vbuf, buffer->vbuf_size);
-        if (result <= 0)
+        if (piece->in_file)
         {
-            butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
-            return -1;
+            result = buffer_read_at(buffer, piece->offset + skip, data + total, chunk);
+            if (result != (int)chunk)
+            {
+                butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+                return -1;
+            }
         }
         else
         {
-            buffer->vbuf_count = result;
+            memcpy(data + total, LINE_PIECES_TEXT(pieces) + piece->offset + skip, chunk);
         }
+        total += chunk;
     }
-    
-    // location in vbuf where line starts
-    //
-    offset = buffer->curr_line->position.offset - buffer->vbuf_offset;
-
-    // for convenience, set read tail to start of curr_line content in vbuf
-    buffer->vbuf_tail = offset;
-    
-    *content = buffer->vbuf + offset;
-    *length = buffer->curr_line->length;
-    return 0;
+    return (int)total;
 }
 
-int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
+int buffer_get_line_slice(buffer_t *buffer, size_t line, uint64_t offset, uint8_t **content, size_t *length)
 {
-    uint8_t *content;
-    uint8_t *pdest;
-    size_t rawlength;
+    const line_pieces_t *pieces;
+    const line_piece_t *piece;
+    line_t *pline;
+    uint64_t start;
+    uint64_t where;
+    size_t avail;
     size_t i;
-    uint32_t ucode;
     int result;
-    
-    if (text)
+
+    if (!content || !length)
     {
-        *text = "";
+        return -1;
     }
-    if (length)
+    *content = "";
+    *length = 0;
+
+    if (!buffer || !buffer->lines)
     {
-        *length = 0;
+        return -1;
     }
-    buffer->sandbox_count = 0;
-    
-    // get raw bytes in file
-    //
-    result = buffer_get_line_content(buffer, line, &content, &rawlength);
+    result = buffer_select_line(buffer, line);
     if (result)
     {
         return result;
     }
-    // check sandbox size, need to maybe grow times 4 for utf-8 encoding
-    //
-    result = buffer_size_sandbox(buffer, rawlength * 4 + 4);
+    pline = buffer->curr_line;
+    result = buffer_unpack_block(buffer, pline);
     if (result)
     {
         return result;
     }
-    switch (buffer->original_encoding)
+    if (offset >= pline->length)
     {
-    case textBINARY:
-    case textASCII:
-    case textUTF8:
-    default:
-        memcpy(buffer->sandbox, content, rawlength);
-        pdest = buffer->sandbox + rawlength;
+        return 0;
+    }
+    avail = (size_t)(pline->length - offset);
+
+    switch (pline->location)
+    {
+    case lineInMemory:
+        *content = (uint8_t*)pline->position.data + offset;
+        *length = (avail > buffer->vbuf_size) ? buffer->vbuf_size : avail;
+        return 0;
+    case lineInFile:
+        where = pline->position.offset + offset;
+        break;
+    default:
+        // find the piece the offset is in, a slice ends with its piece
+        //
+        pieces = pline->position.pieces;
+        for (i = 0, start = 0; i < pieces->count; start += pieces->piece[i].length, i++)
+        {
+            if ((start + pieces->piece[i].length) > offset)
+            {
+                break;
+            }
+        }
+        if (i >= pieces->count)
+        {
+            return -1;
+        }
+        piece = &pieces->piece[i];
+        avail = (size_t)(start + piece->length - offset);
+        if (! piece->in_file)
+        {
+            *content = LINE_PIECES_TEXT(pieces) + piece->offset + (offset - start);
+            *length = (avail > buffer->vbuf_size) ? buffer->vbuf_size : avail;
+            return 0;
+        }
+        where = piece->offset + (offset - start);
+        break;
+    }
+    result = buffer_need_vbuf(buffer);
+    if (result)
+    {
+        return result;
+    }
+    if (avail > buffer->vbuf_size)
+    {
+        avail = buffer->vbuf_size;
+    }
+    if (
+            (where < buffer->vbuf_offset)
+        ||  ((where + avail) > (buffer->vbuf_offset + buffer->vbuf_count))
+    )
+    {
+        result = buffer_read_at(buffer, where, (uint8_t*)buffer->vbuf, buffer->vbuf_size);
+        if (result < (int)avail)
+        {
+            butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+            return -1;
+        }
+        buffer->vbuf_offset = where;
+        buffer->vbuf_count = result;
+    }
+    buffer->vbuf_tail = (size_t)(where - buffer->vbuf_offset);
+    *content = (uint8_t*)buffer->vbuf + buffer->vbuf_tail;
+    *length = avail;
+    return 0;
+}
+
+int buffer_get_line_content(buffer_t *buffer, size_t line, uint8_t **content, size_t *length)
+{
+    uint64_t offset;
+    int result;
+    
+    if (!content || !length)
+    {
+        return -1;
+    }
+    *content = "";
+    *length = 0;
+
+    if (!buffer || !buffer->lines)
+    {
+        return -1;
+    }
+    result = buffer_select_line(buffer, line);
+    if (result)
+    {
+        return result;
+    }
+    // a packed line is unpacked with its block, the lines near it are
+    // likely to be wanted too
+    //
+    result = buffer_unpack_block(buffer, buffer->curr_line);
+    if (result)
+    {
+        return result;
+    }
+    // if line is already in memory, all set
+    //
+    if (buffer->curr_line->location == lineInMemory)
+    {
+        buffer_touch_line(buffer, buffer->curr_line);
+        *content = buffer->curr_line->position.data;
+        *length = buffer->curr_line->length;
+        return 0;
+    }
+    result = buffer_need_vbuf(buffer);
+    if (result)
+    {
+        return result;
+    }
+    if (buffer->curr_line->location == lineInPieces)
+    {
+        // put the pieces together in vbuf, which then holds nothing of the file
+        //
+        if (buffer->curr_line->length > buffer->vbuf_size)
+        {
+            butil_log(1, "%s: Line of %d can't fit in vbuf of size %d\n", __FUNCTION__, 
+                buffer->curr_line->length, buffer->vbuf_size);
+            return -1;
+        }
+        buffer->vbuf_offset = 0;
+        buffer->vbuf_count = 0;
+        buffer->vbuf_tail = 0;
+        result = buffer_read_line(buffer, buffer->curr_line, 0, (uint8_t*)buffer->vbuf, buffer->curr_line->length);
+        if (result != (int)buffer->curr_line->length)
+        {
+            return -1;
+        }
+        *content = (uint8_t*)buffer->vbuf;
+        *length = buffer->curr_line->length;
+        return 0;
+    }
+    // check that the line is wholly inside the buffer's vbuf and if not
+    // re-buffer around the region
+    //
+    if (
+            (buffer->curr_line->position.offset < buffer->vbuf_offset)
+        ||  ((buffer->curr_line->position.offset + buffer->curr_line->length)> (buffer->vbuf_offset + buffer->vbuf_count))
+    )
+    {
+        size_t margin;
+        int result;
+        
+        // center position in vbuf
+        //
+        if (buffer->curr_line->length > buffer->vbuf_size)
+        {
+            butil_log(1, "%s: Line of %d can't fit in vbuf of size %d\n", __FUNCTION__, 
+                buffer->curr_line->length, buffer->vbuf_size);
+            return -1;
+        }
+        margin = (buffer->vbuf_size - buffer->curr_line->length) / 2;
+        offset = buffer->curr_line->position.offset;
+        if (offset > margin)
+        {
+            offset -= margin;
+        }
+        offset &= ~0x1F; // align to 32 bytes
+        
+        // reposition file at offset and read a chunk
+        //
+        buffer->vbuf_offset = offset;
+
+        result = buffer_read_at(buffer, offset, buffer->vbuf, buffer->vbuf_size);
+        if (result <= 0)
+        {
+            butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+            return -1;
+        }
+        else
+        {
+            buffer->vbuf_count = result;
+        }
+    }
+    
+    // location in vbuf where line starts
+    //
+    offset = buffer->curr_line->position.offset - buffer->vbuf_offset;
+
+    // for convenience, set read tail to start of curr_line content in vbuf
+    buffer->vbuf_tail = offset;
+    
+    *content = buffer->vbuf + offset;
+    *length = buffer->curr_line->length;
+    return 0;
+}
+
+size_t buffer_decode_text(text_encoding_t encoding, const uint8_t *content, size_t rawlength, uint8_t *text)
+{
+    uint8_t *pdest;
+    size_t i;
+    uint32_t ucode;
+    
+    switch (encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+    default:
+        memcpy(text, content, rawlength);
+        pdest = text + rawlength;
         break;
     case textUCS2LE:
-        for (i = 0, pdest = buffer->sandbox; i < rawlength; i+= 2)
+        for (i = 0, pdest = text; i < rawlength; i+= 2)
         {
             ucode = ((uint32_t)content[i]) | ((uint32_t)content[i + 1] << 8);
             butil_utf8_encode(ucode, pdest);
@@ -820,7 +1690,7 @@ int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
         }
         break;
     case textUCS2BE:
-        for (i = 0, pdest = buffer->sandbox; i < rawlength; i+= 2)
+        for (i = 0, pdest = text; i < rawlength; i+= 2)
         {
             ucode = ((uint32_t)content[i] << 8) | ((uint32_t)content[i + 1]);
             butil_utf8_encode(ucode, pdest);
@@ -831,7 +1701,7 @@ int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
         }
         break;
     case textUCS4LE:
-        for (i = 0, pdest = buffer->sandbox; i < rawlength; i+= 4)
+        for (i = 0, pdest = text; i < rawlength; i+= 4)
         {
             ucode  = ((uint32_t)content[i]) | ((uint32_t)content[i + 1] << 8);
             ucode |= ((uint32_t)content[i + 2] << 16) | ((uint32_t)content[i + 3] << 24);
@@ -844,7 +1714,7 @@ int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
         }
         break;
     case textUCS4BE:
-        for (i = 0, pdest = buffer->sandbox; i < rawlength; i+= 4)
+        for (i = 0, pdest = text; i < rawlength; i+= 4)
         {
             ucode  = ((uint32_t)content[i] << 24) | ((uint32_t)content[i + 1] << 16);
             ucode |= ((uint32_t)content[i + 2] << 8) | ((uint32_t)content[i + 3]);
@@ -856,6 +1726,102 @@ int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
         }
         break;
     }
+    return pdest - text;
+}
+
+size_t buffer_encode_text(text_encoding_t encoding, const uint8_t *text, size_t length, uint8_t *content)
+{
+    uint8_t *pdest;
+    size_t index;
+    size_t used;
+    uint32_t unicode;
+    
+    switch (encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+    default:
+        memcpy(content, text, length);
+        return length;
+    case textUCS2LE:
+    case textUCS2BE:
+    case textUCS4LE:
+    case textUCS4BE:
+        break;
+    }
+    for (index = 0, pdest = content; index < length; index += used)
+    {
+        used = butil_utf8_decode((uint8_t*)text + index, length - index, &unicode);
+        if (! used)
+        {
+            break;
+        }
+        switch (encoding)
+        {
+        default:
+        case textUCS2LE:
+            *pdest++ = unicode & 0xFF;
+            *pdest++ = (unicode >> 8) & 0xFF;
+            break;
+        case textUCS2BE:
+            *pdest++ = (unicode >> 8) & 0xFF;
+            *pdest++ = unicode & 0xFF;
+            break;
+        case textUCS4LE:
+            *pdest++ = unicode & 0xFF;
+            *pdest++ = (unicode >> 8) & 0xFF;
+            *pdest++ = (unicode >> 16) & 0xFF;
+            *pdest++ = (unicode >> 24) & 0xFF;
+            break;
+        case textUCS4BE:
+            *pdest++ = (unicode >> 24) & 0xFF;
+            *pdest++ = (unicode >> 16) & 0xFF;
+            *pdest++ = (unicode >> 8) & 0xFF;
+            *pdest++ = unicode & 0xFF;
+            break;
+        }
+    }
+    return pdest - content;
+}
+
+int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
+{
+    uint8_t *content;
+    uint8_t *pdest;
+    size_t rawlength;
+    int result;
+    
+    if (text)
+    {
+        *text = "";
+    }
+    if (length)
+    {
+        *length = 0;
+    }
+    buffer->sandbox_count = 0;
+    
+    // get raw bytes in file
+    //
+    result = buffer_get_line_content(buffer, line, &content, &rawlength);
+    if (result)
+    {
+        return result;
+    }
+    // check sandbox size, need to maybe grow times 4 for utf-8 encoding
+    //
+    result = buffer_size_sandbox(buffer, rawlength * 4 + 4);
+    if (result)
+    {
+        return result;
+    }
+    // lines in memory are already utf-8, only file bytes are in the file's encoding
+    //
+    pdest = buffer->sandbox + buffer_decode_text(
+                (buffer->curr_line->location == lineInMemory) ? textUTF8 : buffer->original_encoding,
+                content, rawlength, buffer->sandbox);
+
     // null terminate the sandbox and remember length in bytes
     //
     *pdest = '\0';
@@ -872,3 +1838,835 @@ int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length)
     return 0;
 }
 
+void buffer_line_changed(buffer_t *buffer, line_t *line, size_t linenum)
+{
+    buffer_syntax_changed(buffer, line, linenum);
+    buffer_forget_columns(buffer, line);
+    buffer_offsets_changed(buffer, linenum);
+}
+
+int buffer_preserve_line(buffer_t *buffer, line_t *line)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    return version_preserve(&buffer->versions, line);
+}
+
+undo_log_t *buffer_undo_log(buffer_t *buffer)
+{
+    if (! buffer)
+    {
+        return NULL;
+    }
+    if (! buffer->undos)
+    {
+        buffer->undos = undo_log_create();
+        
+        // lines the log drops may still be seen by snapshots
+        undo_log_set_line_free(buffer->undos, buffer_free_line, buffer);
+    }
+    return buffer->undos;
+}
+
+/// \brief Check if a line is edited as pieces rather than moved to memory
+///
+/// Only lines too long for vbuf, in encodings whose bytes are the
+/// utf-8 text edited, are kept in pieces
+///
+static bool buffer_use_pieces(buffer_t *buffer, const line_t *line)
+{
+    switch (buffer->original_encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+        break;
+    default:
+        return false;
+    }
+    return (line->location == lineInPieces)
+        || (line->location == lineInFile && line->length > buffer->vbuf_size);
+}
+
+/// \brief Replace a range of bytes in a line kept in pieces
+///
+/// Only the replaced range is read, to record it for undo. The edit is
+/// made in place if the pieces have room for it, else in new pieces
+///
+/// @return 0 on success
+///
+static int buffer_splice_pieces(buffer_t *buffer, size_t line, line_t *pline, size_t column, size_t count,
+                                const char *text, size_t length, bool record)
+{
+    line_pieces_t *pieces;
+    uint8_t *deleted;
+    bool in_place;
+    int result;
+
+    if (column > pline->length || count > (pline->length - column))
+    {
+        butil_log(1, "%s: Range %u+%u outside line of %u\n", __FUNCTION__, column, count, pline->length);
+        return -1;
+    }
+    deleted = NULL;
+    if (record && count)
+    {
+        deleted = (uint8_t*)malloc(count);
+        if (! deleted)
+        {
+            butil_log(0, "%s: Can't alloc text\n", __FUNCTION__);
+            return -1;
+        }
+        result = buffer_read_line(buffer, pline, column, deleted, count);
+        if (result != (int)count)
+        {
+            free(deleted);
+            return -1;
+        }
+    }
+    in_place = line_pieces_room(pline, length);
+    pieces = NULL;
+    if (! in_place)
+    {
+        pieces = line_pieces_edit(pline, column, count, (const uint8_t*)text, length);
+        if (! pieces)
+        {
+            butil_log(0, "%s: Can't alloc pieces\n", __FUNCTION__);
+            if (deleted)
+            {
+                free(deleted);
+            }
+            return -1;
+        }
+    }
+    // the line is only changed once nothing more can fail, and after
+    // snapshots have its state as it was
+    //
+    result = version_preserve(&buffer->versions, pline);
+    if (! result && record)
+    {
+        result = undo_add_text(buffer_undo_log(buffer), line, column, deleted, count, (uint8_t*)text, length);
+    }
+    if (deleted)
+    {
+        free(deleted);
+    }
+    if (result)
+    {
+        if (pieces)
+        {
+            free(pieces);
+        }
+        return result;
+    }
+    if (in_place)
+    {
+        line_pieces_edit_in_place(pline, column, count, (const uint8_t*)text, length);
+    }
+    else
+    {
+        buffer_account_memory(buffer, memoryLines, line_data_size(pline), pieces->size);
+        if (pline->location == lineInPieces)
+        {
+            free(pline->position.pieces);
+        }
+        pline->location = lineInPieces;
+        pline->position.pieces = pieces;
+    }
+    pline->length = pline->length - count + length;
+    buffer_line_changed(buffer, pline, line);
+    return 0;
+}
+
+/// \brief Replace a range of bytes in a line's utf-8 text
+///
+/// The line is moved to memory if it isn't already, unless it is
+/// too long for vbuf, see ::buffer_use_pieces
+///
+/// @param[in] buffer - buffer to edit
+/// @param[in] line   - line to edit
+/// @param[in] column - byte offset in line of range
+/// @param[in] count  - bytes in range to remove
+/// @param[in] text   - text to put in place of range
+/// @param[in] length - length of text in bytes
+/// @param[in] record - add the edit to the undo log
+///
+/// @return 0 on success
+///
+static int buffer_splice_text(buffer_t *buffer, size_t line, size_t column, size_t count,
+                                const char *text, size_t length, bool record)
+{
+    line_t *pline;
+    char *content;
+    char *data;
+    size_t curlen;
+    size_t newlen;
+    int result;
+    
+    result = buffer_select_line(buffer, line);
+    if (result)
+    {
+        return result;
+    }
+    pline = buffer->curr_line;
+    result = buffer_unpack_block(buffer, pline);
+    if (result)
+    {
+        return result;
+    }
+    if (buffer_use_pieces(buffer, pline))
+    {
+        return buffer_splice_pieces(buffer, line, pline, column, count, text, length, record);
+    }
+    if (pline->location == lineInMemory)
+    {
+        content = pline->position.data;
+        curlen = pline->length;
+    }
+    else
+    {
+        result = buffer_edit_line(buffer, line, &content, &curlen);
+        if (result)
+        {
+            return result;
+        }
+    }
+    if (column > curlen || count > (curlen - column))
+    {
+        butil_log(1, "%s: Range %u+%u outside line of %u\n", __FUNCTION__, column, count, curlen);
+        return -1;
+    }
+    newlen = curlen - count + length;
+    data = (char*)malloc(newlen + 1);
+    if (! data)
+    {
+        butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+        return -1;
+    }
+    memcpy(data, content, column);
+    if (length)
+    {
+        memcpy(data + column, text, length);
+    }
+    memcpy(data + column + length, content + column + count, curlen - column - count);
+    data[newlen] = '\0';
+    
+    result = version_preserve(&buffer->versions, pline);
+    if (result)
+    {
+        free(data);
+        return result;
+    }
+    if (record)
+    {
+        result = undo_add_text(buffer_undo_log(buffer), line, column,
+                            (uint8_t*)content + column, count, (uint8_t*)text, length);
+        if (result)
+        {
+            free(data);
+            return result;
+        }
+    }
+    buffer_account_memory(buffer, memoryLines, line_data_size(pline), newlen + 1);
+    if (pline->location == lineInMemory && pline->position.data)
+    {
+        free(pline->position.data);
+    }
+    pline->location = lineInMemory;
+    pline->position.data = data;
+    pline->length = newlen;
+    buffer_touch_line(buffer, pline);
+    buffer_line_changed(buffer, pline, line);
+    return 0;
+}
+
+/// \brief Save the lines whose links change when a chain is linked or unlinked
+///
+/// @return 0 on success
+///
+static int buffer_preserve_ends(buffer_t *buffer, line_t *prev, line_t *first, line_t *last, line_t *next)
+{
+    if (
+            version_preserve(&buffer->versions, prev)
+        ||  version_preserve(&buffer->versions, first)
+        ||  version_preserve(&buffer->versions, last)
+        ||  version_preserve(&buffer->versions, next)
+    )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/// \brief Unpack the lines of a chain linked in while snapshots are open
+///
+/// Lines held for undo can be packed, and snapshots only see lines in memory,
+/// so all of a chain is unpacked, however long. It's packed again by a pass
+/// once the snapshots are released
+///
+/// @return 0 on success
+///
+static int buffer_unpack_chain(buffer_t *buffer, line_t *first, line_t *last)
+{
+    line_t *line;
+    bool live;
+
+    if (! buffer->packing)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&buffer->versions.lock);
+    live = (buffer->versions.nlive > 0);
+    pthread_mutex_unlock(&buffer->versions.lock);
+    if (! live)
+    {
+        return 0;
+    }
+    for (line = first; line; line = (line == last) ? NULL : line->next)
+    {
+        if (buffer_unpack_block(buffer, line))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// \brief Link a chain of lines into a buffer
+///
+/// @param[in] buffer - buffer to link into
+/// @param[in] line   - line number the first line will have
+/// @param[in] first  - first line of chain
+/// @param[in] last   - last line of chain
+/// @param[in] count  - lines in chain
+///
+/// @return 0 on success
+///
+static int buffer_link_lines(buffer_t *buffer, size_t line, line_t *first, line_t *last, size_t count)
+{
+    line_t *prev;
+    line_t *next;
+    
+    if (line > buffer->line_count)
+    {
+        return -1;
+    }
+    if (line == 0)
+    {
+        prev = NULL;
+        next = buffer->lines;
+    }
+    else
+    {
+        if (buffer_select_line(buffer, line - 1))
+        {
+            return -1;
+        }
+        prev = buffer->curr_line;
+        next = prev->next;
+    }
+    if (buffer_unpack_chain(buffer, first, last))
+    {
+        return -1;
+    }
+    if (buffer_preserve_ends(buffer, prev, first, last, next))
+    {
+        return -1;
+    }
+    first->prev = prev;
+    last->next = next;
+    if (prev)
+    {
+        prev->next = first;
+    }
+    else
+    {
+        buffer->lines = first;
+    }
+    if (next)
+    {
+        next->prev = last;
+    }
+    buffer->line_count += count;
+    buffer->curr_line = first;
+    buffer->curr_linenum = line;
+    
+    // the lines at both joins start from a different line than before
+    //
+    buffer_syntax_moved(buffer, line, count, 0);
+    buffer_syntax_changed(buffer, first, line);
+    buffer_syntax_changed(buffer, next, line + count);
+    buffer_offsets_moved(buffer, line, first, count, 0);
+    return 0;
+}
+
+/// \brief Unlink a chain of lines from a buffer
+///
+/// @param[in] buffer - buffer to unlink from
+/// @param[in] line   - line number of the first line
+/// @param[in] first  - first line of chain
+/// @param[in] last   - last line of chain
+/// @param[in] count  - lines in chain
+///
+/// @return 0 on success
+///
+static int buffer_unlink_lines(buffer_t *buffer, size_t line, line_t *first, line_t *last, size_t count)
+{
+    line_t *prev;
+    line_t *next;
+    
+    prev = first->prev;
+    next = last->next;
+    if (buffer_preserve_ends(buffer, prev, first, last, next))
+    {
+        return -1;
+    }
+    if (prev)
+    {
+        prev->next = next;
+    }
+    else
+    {
+        buffer->lines = next;
+    }
+    if (next)
+    {
+        next->prev = prev;
+    }
+    first->prev = NULL;
+    last->next = NULL;
+    buffer->line_count -= count;
+    buffer_syntax_moved(buffer, line, 0, count);
+    buffer_syntax_changed(buffer, next, line);
+    buffer_offsets_moved(buffer, line, next, 0, count);
+    
+    // current line might have been unlinked
+    //
+    if (next)
+    {
+        buffer->curr_line = next;
+        buffer->curr_linenum = line;
+    }
+    else if (prev)
+    {
+        buffer->curr_line = prev;
+        buffer->curr_linenum = line - 1;
+    }
+    else
+    {
+        buffer->curr_line = NULL;
+        buffer->curr_linenum = 0;
+    }
+    return 0;
+}
+
+int buffer_insert_text(buffer_t *buffer, size_t line, size_t column, const char *text, size_t length)
+{
+    int result;
+    
+    if (!buffer || (!text && length))
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! length)
+    {
+        return 0;
+    }
+    result = buffer_splice_text(buffer, line, column, 0, text, length, true);
+    if (! result)
+    {
+        buffer_journal_op(buffer, journalInsertText, line, column, 0, text, length);
+    }
+    buffer_govern_memory(buffer);
+    return result;
+}
+
+int buffer_delete_text(buffer_t *buffer, size_t line, size_t column, size_t count)
+{
+    int result;
+    
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! count)
+    {
+        return 0;
+    }
+    result = buffer_splice_text(buffer, line, column, count, NULL, 0, true);
+    if (! result)
+    {
+        buffer_journal_op(buffer, journalDeleteText, line, column, count, NULL, 0);
+    }
+    buffer_govern_memory(buffer);
+    return result;
+}
+
+int buffer_insert_lines(buffer_t *buffer, size_t line, const char *text, size_t length)
+{
+    line_t *first;
+    line_t *last;
+    line_t *newline;
+    const char *eol;
+    const char *journal_text;
+    size_t journal_length;
+    size_t count;
+    size_t linelen;
+    size_t added;
+    int result;
+    
+    if (!buffer || !text || !length || line > buffer->line_count)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    // journaled once made, text and length are used up making the lines
+    //
+    journal_text = text;
+    journal_length = length;
+    
+    // make a chain of the new lines
+    //
+    first = NULL;
+    last = NULL;
+    count = 0;
+    added = 0;
+    
+    while (length)
+    {
+        eol = memchr(text, '\n', length);
+        linelen = eol ? (eol - text + 1) : length;
+        
+        newline = line_create_from_data((uint8_t*)text, linelen, true);
+        if (! newline)
+        {
+            butil_log(0, "%s: Can't make line\n", __FUNCTION__);
+            while (first)
+            {
+                newline = first->next;
+                line_destroy(first);
+                first = newline;
+            }
+            return -1;
+        }
+        newline->attributes = 0;
+        newline->generation = buffer->versions.generation;
+        newline->prev = last;
+        newline->next = NULL;
+        if (last)
+        {
+            last->next = newline;
+        }
+        else
+        {
+            first = newline;
+        }
+        last = newline;
+        count++;
+        added += line_data_size(newline);
+        text += linelen;
+        length -= linelen;
+    }
+    result = buffer_link_lines(buffer, line, first, last, count);
+    if (! result)
+    {
+        result = undo_add_lines(buffer_undo_log(buffer), undoInsertLines, line, count, first, last);
+        if (result)
+        {
+            buffer_unlink_lines(buffer, line, first, last, count);
+        }
+    }
+    if (result)
+    {
+        while (first)
+        {
+            newline = first->next;
+            line_destroy(first);
+            first = newline;
+        }
+        return result;
+    }
+    buffer_journal_op(buffer, journalInsertLines, line, 0, 0, journal_text, journal_length);
+    buffer_account_memory(buffer, memoryLines, 0, added);
+    buffer_govern_memory(buffer);
+    return 0;
+}
+
+int buffer_delete_lines(buffer_t *buffer, size_t line, size_t count)
+{
+    line_t *first;
+    line_t *last;
+    size_t n;
+    int result;
+    
+    if (!buffer || !count || line >= buffer->line_count || count > (buffer->line_count - line))
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = buffer_select_line(buffer, line);
+    if (result)
+    {
+        return result;
+    }
+    first = buffer->curr_line;
+    for (n = 1, last = first; n < count && last->next; n++)
+    {
+        last = last->next;
+    }
+    if (n < count)
+    {
+        // line count is wrong?
+        return -1;
+    }
+    // save lines for snapshots first, so unlinking can't fail once recorded
+    //
+    result = buffer_preserve_ends(buffer, first->prev, first, last, last->next);
+    if (result)
+    {
+        return result;
+    }
+    result = undo_add_lines(buffer_undo_log(buffer), undoDeleteLines, line, count, first, last);
+    if (result)
+    {
+        return result;
+    }
+    result = buffer_unlink_lines(buffer, line, first, last, count);
+    if (! result)
+    {
+        buffer_journal_op(buffer, journalDeleteLines, line, 0, count, NULL, 0);
+    }
+    buffer_govern_memory(buffer);
+    return result;
+}
+
+int buffer_set_undo_memory_cap(buffer_t *buffer, size_t cap)
+{
+    undo_log_t *log;
+    
+    log = buffer_undo_log(buffer);
+    if (! log)
+    {
+        return -1;
+    }
+    undo_log_set_memory_cap(log, cap);
+    return 0;
+}
+
+int buffer_begin_undo_group(buffer_t *buffer)
+{
+    undo_log_t *log;
+    
+    log = buffer_undo_log(buffer);
+    if (! log)
+    {
+        return -1;
+    }
+    undo_begin_group(log);
+    buffer_journal_op(buffer, journalBeginGroup, 0, 0, 0, NULL, 0);
+    return 0;
+}
+
+int buffer_end_undo_group(buffer_t *buffer)
+{
+    if (! buffer || ! buffer->undos)
+    {
+        return -1;
+    }
+    undo_end_group(buffer->undos);
+    buffer_journal_op(buffer, journalEndGroup, 0, 0, 0, NULL, 0);
+    return 0;
+}
+
+int buffer_seal_undo(buffer_t *buffer)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    if (! buffer->undos)
+    {
+        // nothing to merge into yet
+        return 0;
+    }
+    undo_seal(buffer->undos);
+    buffer_journal_op(buffer, journalSealUndo, 0, 0, 0, NULL, 0);
+    return 0;
+}
+
+/// \brief Apply an undo record to a buffer, backwards or forwards
+///
+/// @param[in] buffer - buffer to change
+/// @param[in] rec    - record of edit
+/// @param[in] undo   - true to undo the edit, false to redo it
+///
+/// @return 0 on success
+///
+static int buffer_apply_undo(buffer_t *buffer, undorec_t *rec, bool undo)
+{
+    size_t before;
+    int result;
+    
+    switch (rec->type)
+    {
+    case undoText:
+        if (undo)
+        {
+            return buffer_splice_text(buffer, rec->line, rec->column, rec->inserted,
+                                (char*)UNDO_DELETED_TEXT(rec), rec->deleted, false);
+        }
+        return buffer_splice_text(buffer, rec->line, rec->column, rec->deleted,
+                                (char*)UNDO_INSERTED_TEXT(rec), rec->inserted, false);
+    
+    case undoInsertLines:
+        if (undo)
+        {
+            return buffer_unlink_lines(buffer, rec->line, rec->first, rec->last, rec->inserted);
+        }
+        return buffer_link_lines(buffer, rec->line, rec->first, rec->last, rec->inserted);
+    
+    case undoDeleteLines:
+        if (undo)
+        {
+            return buffer_link_lines(buffer, rec->line, rec->first, rec->last, rec->deleted);
+        }
+        return buffer_unlink_lines(buffer, rec->line, rec->first, rec->last, rec->deleted);
+    
+    case undoSetLine:
+        result = buffer_select_line(buffer, rec->line);
+        if (result)
+        {
+            return result;
+        }
+        result = buffer_unpack_block(buffer, buffer->curr_line);
+        if (result)
+        {
+            return result;
+        }
+        result = version_preserve(&buffer->versions, buffer->curr_line);
+        if (result)
+        {
+            return result;
+        }
+        before = line_data_size(buffer->curr_line);
+        result = undo_swap_line_content(buffer->undos, rec, buffer->curr_line);
+        if (! result)
+        {
+            buffer_account_memory(buffer, memoryLines, before, line_data_size(buffer->curr_line));
+            buffer_line_changed(buffer, buffer->curr_line, rec->line);
+        }
+        return result;
+    
+    default:
+        butil_log(0, "%s: Bad undo record type %d\n", __FUNCTION__, rec->type);
+        return -1;
+    }
+}
+
+/// \brief Put back the records of a group applied before one of them failed,
+/// so the buffer isn't left part way through the group
+///
+/// @param[in] buffer - buffer changed
+/// @param[in] count  - records applied, next to the undo cursor
+/// @param[in] undo   - true if they were undone, so are redone, false if redone
+///
+static void buffer_undo_rollback(buffer_t *buffer, size_t count, bool undo)
+{
+    undorec_t *rec;
+    
+    while (count-- > 0)
+    {
+        rec = undo ? undo_step_forward(buffer->undos) : undo_step_back(buffer->undos);
+        if (! rec || buffer_apply_undo(buffer, rec, ! undo))
+        {
+            butil_log(0, "%s: Can't put back a group part %s\n", __FUNCTION__, undo ? "undone" : "redone");
+            return;
+        }
+    }
+}
+
+int buffer_undo(buffer_t *buffer)
+{
+    undorec_t *rec;
+    size_t applied;
+    int result;
+    
+    if (! buffer)
+    {
+        return -1;
+    }
+    rec = undo_step_back(buffer->undos);
+    if (! rec)
+    {
+        return 1;
+    }
+    applied = 0;
+    do
+    {
+        result = buffer_apply_undo(buffer, rec, true);
+        if (result)
+        {
+            // leave the record to be undone again, and the group as it was
+            undo_step_forward(buffer->undos);
+            buffer_undo_rollback(buffer, applied, true);
+            butil_log(1, "%s: Can't undo\n", __FUNCTION__);
+            return result;
+        }
+        applied++;
+        if (! (rec->flags & undoChained))
+        {
+            break;
+        }
+        rec = undo_step_back(buffer->undos);
+    }
+    while (rec);
+    
+    // journalled once the whole group is undone, so replaying it matches
+    //
+    buffer_journal_op(buffer, journalUndo, 0, 0, 0, NULL, 0);
+    buffer_govern_memory(buffer);
+    return 0;
+}
+
+int buffer_redo(buffer_t *buffer)
+{
+    undorec_t *rec;
+    size_t applied;
+    int result;
+    
+    if (! buffer)
+    {
+        return -1;
+    }
+    rec = undo_step_forward(buffer->undos);
+    if (! rec)
+    {
+        return 1;
+    }
+    applied = 0;
+    while (rec)
+    {
+        result = buffer_apply_undo(buffer, rec, false);
+        if (result)
+        {
+            undo_step_back(buffer->undos);
+            buffer_undo_rollback(buffer, applied, false);
+            butil_log(1, "%s: Can't redo\n", __FUNCTION__);
+            return result;
+        }
+        applied++;
+        rec = undo_peek_forward(buffer->undos);
+        if (! rec || ! (rec->flags & undoChained))
+        {
+            break;
+        }
+        rec = undo_step_forward(buffer->undos);
+    }
+    buffer_journal_op(buffer, journalRedo, 0, 0, 0, NULL, 0);
+    buffer_govern_memory(buffer);
+    return 0;
+}
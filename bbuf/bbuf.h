@@ -18,9 +18,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "bline.h"
 #include "bfile.h"
 #include "bundo.h"
+#include "btrigram.h"
+#include "bjournal.h"
+#include "bversion.h"
 
 /// \file
 ///
@@ -42,7 +46,7 @@ typedef struct tag_buffer
 	line_t		   *curr_line;			///< current line, for performance
 	size_t			curr_linenum;		///< line number at current line	
 	// protected
-	undorec_t	   *undos;				///< list of undos
+	undo_log_t	   *undos;				///< undo history, NULL until first edit
 	// private
 	char	 	   *vbuf;				///< buffer of file data "around" current line
 	size_t			vbuf_size;			///< how large vbuf is in bytes
@@ -53,9 +57,65 @@ typedef struct tag_buffer
 	uint8_t        *sandbox;			///< scratch buffer
 	size_t          sandbox_size;		///< allocated size of scratch buffer
 	size_t			sandbox_count;		///< bytes valid in sandbox
+	pthread_mutex_t	io_lock;			///< serializes seek/read pairs on file
+	bool			use_trigrams;		///< keep a trigram index of the file
+	bool			trigrams_building;	///< trigram index is being built by buffer_read
+	trigram_index_t *trigrams;			///< trigram index of file, if any
+	bool			use_journal;		///< keep a journal of edits to the file
+	int				journal_interval;	///< milliseconds between journal syncs
+	journal_t	   *journal;			///< journal of edits, if any
+	version_store_t	versions;			///< line versions held for snapshots
+	pthread_mutex_t	save_lock;			///< protects saves
+	pthread_cond_t	save_done;			///< signalled when a save ends
+	struct tag_buffer_save *saves;		///< background saves, see ::buffer_save_async
+	struct tag_syntax *syntax;			///< syntax lines are lexed with, if any
+	size_t			syntax_dirty_from;	///< first line to lex, see ::buffer_update_syntax
+	size_t			syntax_dirty_to;	///< last line to lex, none if less than from
+	int				syntax_threads;		///< threads lexing many lines uses, 0 for one per processor
+	size_t			tab_width;			///< columns between tab stops, 0 for the default
+	struct tag_column_index *columns;	///< indexes of long lines, most recently used first
+	struct tag_offset_index *offsets;	///< index of line offsets, see ::buffer_line_from_offset
+	struct tag_line_packing *packing;	///< packing of lines not used lately, see ::buffer_set_line_packing
+	size_t			line_memory;		///< bytes of line text held in memory, see ::buffer_account_memory
+	bool			vbuf_used;			///< vbuf used since the last ::memory_reclaim
+	size_t			memory_mark;		///< memory in use after the last trim, see ::buffer_govern_memory
+	struct tag_buffer *memory_next;		///< next buffer whose memory is counted
 }
 buffer_t;
 
+/// Snapshot - an unchanging view of a buffer's lines at one moment
+///
+/// A snapshot shares the buffer's lines, the buffer saves the state of
+/// a line the snapshot can see before changing it. It can be read on
+/// another thread while the buffer is edited, and must be released
+/// before the buffer is destroyed
+///
+typedef struct tag_buffer_snapshot
+{
+	struct tag_buffer *buffer;			///< buffer snapshot is of
+	uint32_t		generation;			///< generation of the snapshot in the buffer's versions
+	line_t		   *lines;				///< first line, as the snapshot sees it
+	size_t			line_count;			///< count of lines
+	text_encoding_t original_encoding;	///< encoding of lines still in the file
+	line_ending_t   original_lineends;	///< original line endings
+	int				refs;				///< references, under the buffer's version lock
+}
+buffer_snapshot_t;
+
+/// Cursor for reading the lines of a snapshot in order, zero it to start
+///
+typedef struct tag_snapshot_cursor
+{
+	const line_t   *next;				///< next line to read
+	size_t			linenum;			///< line number of next line
+	bool			started;			///< reading has started
+	uint8_t		   *data;				///< content of line last read, or its pieces
+	size_t			data_size;			///< bytes allocated for data
+	uint8_t		   *text;				///< content of line last read, if in pieces
+	size_t			text_size;			///< bytes allocated for text
+}
+snapshot_cursor_t;
+
 /// \brief Create a buffer
 ///
 /// @param[in] name 	- name to give the buffer. if NULL, the file's name will be used
@@ -83,6 +143,134 @@ void buffer_destroy(buffer_t *buffer);
 ///
 int buffer_read(buffer_t *buffer);
 
+/// \brief Set whether a buffer keeps a trigram index of its file
+///
+/// The index is loaded from a sidecar file next to the buffer's file by
+/// ::buffer_read if that is still current, else it is built as the file
+/// is read and saved to the sidecar. Finds use it to skip blocks of the
+/// file that can't contain a match. Call this before ::buffer_read
+///
+/// @param[in] buffer - buffer to set
+/// @param[in] use    - true to keep an index
+///
+/// @return 0 on success
+///
+int buffer_set_trigram_index(buffer_t *buffer, bool use);
+
+/// \brief Set whether a buffer keeps a journal of its edits
+///
+/// Edits are written ahead to a journal file next to the buffer's file
+/// and synced in groups every interval. If the buffer isn't saved, as
+/// when the process dies, ::buffer_read replays the journal on top of
+/// the same file, restoring the edits and their undo history. Call this
+/// before ::buffer_read
+///
+/// @param[in] buffer   - buffer to set
+/// @param[in] use      - true to keep a journal
+/// @param[in] interval - milliseconds between syncs, 0 to sync each edit, < 0 for default
+///
+/// @return 0 on success
+///
+int buffer_set_journal(buffer_t *buffer, bool use, int interval);
+
+/// \brief Write and sync a buffer's journal now
+///
+/// @param[in] buffer - buffer to sync journal of
+///
+/// @return 0 on success
+///
+int buffer_sync_journal(buffer_t *buffer);
+
+/// \brief Start a buffer's journal over
+///
+/// Call once the buffer has been saved over its file, so the edits
+/// so far aren't replayed again
+///
+/// @param[in] buffer - buffer to reset journal of
+///
+/// @return 0 on success
+///
+int buffer_reset_journal(buffer_t *buffer);
+
+/// \brief Save a line's state for snapshots before changing it
+///
+/// For code that changes a buffer's lines, see ::version_preserve
+///
+/// @param[in] buffer - buffer line is in
+/// @param[in] line   - line about to change
+///
+/// @return 0 on success
+///
+int buffer_preserve_line(buffer_t *buffer, line_t *line);
+
+/// \brief Note that a line's content changed
+///
+/// For code that changes a buffer's lines, drops anything kept about
+/// the line's old content
+///
+/// @param[in] buffer  - buffer line is in
+/// @param[in] line    - line that changed
+/// @param[in] linenum - its line number
+///
+void buffer_line_changed(buffer_t *buffer, line_t *line, size_t linenum);
+
+/// \brief Add an edit to a buffer's journal
+///
+/// For code that edits a buffer, called before the edit is made
+///
+/// @param[in] buffer - buffer edited
+/// @param[in] rec    - the edit
+///
+/// @return 0 on success, or if there is no journal
+///
+int buffer_journal_edit(buffer_t *buffer, const journal_rec_t *rec);
+
+/// \brief Take a snapshot of a buffer
+///
+/// Takes the same time for any size buffer, no lines are copied
+///
+/// @param[in] buffer - buffer to snapshot
+///
+/// @return the snapshot, release with ::buffer_snapshot_release, or NULL on error
+///
+buffer_snapshot_t *buffer_snapshot(buffer_t *buffer);
+
+/// \brief Add a reference to a snapshot
+///
+/// @param[in] snapshot - snapshot to reference
+///
+/// @return the snapshot
+///
+buffer_snapshot_t *buffer_snapshot_retain(buffer_snapshot_t *snapshot);
+
+/// \brief Drop a reference to a snapshot, freeing it and what only it holds on the last
+///
+/// @param[in] snapshot - snapshot to release
+///
+void buffer_snapshot_release(buffer_snapshot_t *snapshot);
+
+/// \brief Read the next line of a snapshot
+///
+/// Content of a line that is in memory is utf-8, content of a line still
+/// in the file is in the snapshot's original_encoding
+///
+/// @param[in]     snapshot  - snapshot to read
+/// @param[in,out] cursor    - position in snapshot, zeroed to read the first line
+/// @param[out]    content   - gets line content, valid until the next read with the cursor
+/// @param[out]    length    - gets bytes in content
+/// @param[out]    in_memory - gets true if the line is in memory, may be NULL
+///
+/// @return 0 on success, 1 past the last line, < 0 on error
+///
+int buffer_snapshot_next_line(buffer_snapshot_t *snapshot, snapshot_cursor_t *cursor,
+                                uint8_t **content, size_t *length, bool *in_memory);
+
+/// \brief Free what a snapshot cursor holds
+///
+/// @param[in] cursor - cursor done with
+///
+void buffer_snapshot_end(snapshot_cursor_t *cursor);
+
 /// \brief Write a buffer
 ///
 /// Writes the contents of the buffer's line structure from the buffer's file
@@ -99,6 +287,32 @@ int buffer_read(buffer_t *buffer);
 ///
 int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding);
 
+/// \brief Move to line in buffer
+///
+/// Sets the buffer's current line to the given line, walking the
+/// line list from the current line
+///
+/// @param[in] buffer - buffer to move in
+/// @param[in] line   - line (0 based) to move to
+///
+/// @return 0 on success
+///
+int buffer_select_line(buffer_t *buffer, size_t line);
+
+/// \brief Read bytes from a buffer's file at an offset
+///
+/// The seek and read are done under the buffer's io lock so this
+/// can be called from more than one thread at a time
+///
+/// @param[in]  buffer - buffer to read file of
+/// @param[in]  offset - offset in file to read from
+/// @param[out] data   - where to read to
+/// @param[in]  count  - bytes to read
+///
+/// @return bytes read, which is less than count only at end of file, or < 0 on error
+///
+int buffer_read_at(buffer_t *buffer, uint64_t offset, uint8_t *data, size_t count);
+
 /// \brief Get a pointer to a line's data
 ///
 /// The pointer returned could be either the line's contents in memory
@@ -115,6 +329,61 @@ int buffer_write(buffer_t *buffer, file_t *outfile, text_encoding_t encoding);
 ///
 int buffer_get_line_content(buffer_t *buffer, size_t line, uint8_t **content, size_t *length);
 
+/// \brief Read a range of a line's raw bytes, wherever the line is
+///
+/// Can be called from more than one thread at a time, as long as the
+/// line isn't changed meanwhile
+///
+/// @param[in]  buffer - buffer line is in
+/// @param[in]  line   - the line, or a state of it from ::version_resolve
+/// @param[in]  offset - byte offset in line to read from
+/// @param[out] data   - where to read to
+/// @param[in]  count  - bytes to read
+///
+/// @return bytes read, which is less than count only at end of line, or < 0 on error
+///
+int buffer_read_line(buffer_t *buffer, const line_t *line, uint64_t offset, uint8_t *data, size_t count);
+
+/// \brief Get a pointer to part of a line's data
+///
+/// For lines too long for ::buffer_get_line_content, a line is read as
+/// slices, starting at offset 0 and adding each slice's length to the
+/// offset for the next, until a slice of length 0. Slices are at most
+/// the size of vbuf and, like ::buffer_get_line_content, are RAW file
+/// data valid until the buffer is next used
+///
+/// @param[in]  buffer  - buffer to get line in
+/// @param[in]  line    - line number, 0-based
+/// @param[in]  offset  - byte offset in line of slice
+/// @param[out] content - pointer to slice of line
+/// @param[out] length  - length of slice in bytes, 0 at the end of the line
+///
+/// @return 0 on success
+///
+int buffer_get_line_slice(buffer_t *buffer, size_t line, uint64_t offset, uint8_t **content, size_t *length);
+
+/// \brief Decode raw file text to utf-8
+///
+/// @param[in]  encoding - text encoding of content
+/// @param[in]  content  - raw text, as from ::buffer_get_line_content
+/// @param[in]  length   - length of content in bytes
+/// @param[out] text     - where to put utf-8, must have room for length * 4 bytes
+///
+/// @return length of text in bytes
+///
+size_t buffer_decode_text(text_encoding_t encoding, const uint8_t *content, size_t length, uint8_t *text);
+
+/// \brief Encode utf-8 text in a file encoding
+///
+/// @param[in]  encoding - text encoding to make
+/// @param[in]  text     - utf-8 text
+/// @param[in]  length   - length of text in bytes
+/// @param[out] content  - where to put encoded text, must have room for length * 4 bytes
+///
+/// @return length of content in bytes
+///
+size_t buffer_encode_text(text_encoding_t encoding, const uint8_t *text, size_t length, uint8_t *content);
+
 /// \brief Move a buffer line into the sandbox decoding any text encoding
 ///
 /// @param[in] buffer - buffer to get line from
@@ -126,4 +395,129 @@ int buffer_get_line_content(buffer_t *buffer, size_t line, uint8_t **content, si
 ///
 int buffer_edit_line(buffer_t *buffer, size_t line, char **text, size_t *length);
 
+/// \brief Get a buffer's undo log, creating it if needed
+///
+/// For code that changes lines directly, which must record the change
+/// in the log before making it
+///
+/// @param[in] buffer - buffer to get log of
+///
+/// @return the log, or NULL if no memory
+///
+undo_log_t *buffer_undo_log(buffer_t *buffer);
+
+/// \brief Insert text in a line
+///
+/// The text should not contain line endings, use ::buffer_insert_lines
+/// to add lines. Consecutive inserts are undone together
+///
+/// A line longer than vbuf in a file whose bytes are its utf-8 text is
+/// not loaded to edit it, it becomes pieces of the file and the text
+/// inserted, see ::buffer_get_line_slice to read it
+///
+/// @param[in] buffer - buffer to edit
+/// @param[in] line   - line (0 based) to insert in
+/// @param[in] column - byte offset in the line's utf-8 text to insert at
+/// @param[in] text   - text to insert, utf-8
+/// @param[in] length - length of text in bytes
+///
+/// @return 0 on success
+///
+int buffer_insert_text(buffer_t *buffer, size_t line, size_t column, const char *text, size_t length);
+
+/// \brief Delete text from a line
+///
+/// Like ::buffer_insert_text, a long line is not loaded to edit it
+///
+/// @param[in] buffer - buffer to edit
+/// @param[in] line   - line (0 based) to delete in
+/// @param[in] column - byte offset in the line's utf-8 text to delete at
+/// @param[in] count  - bytes to delete
+///
+/// @return 0 on success
+///
+int buffer_delete_text(buffer_t *buffer, size_t line, size_t column, size_t count);
+
+/// \brief Insert lines in a buffer
+///
+/// Text is split into lines after each newline, a last line without
+/// one is inserted as it is
+///
+/// @param[in] buffer - buffer to edit
+/// @param[in] line   - line (0 based) to insert before, line_count to append
+/// @param[in] text   - text of lines, utf-8, including line endings
+/// @param[in] length - length of text in bytes
+///
+/// @return 0 on success
+///
+int buffer_insert_lines(buffer_t *buffer, size_t line, const char *text, size_t length);
+
+/// \brief Delete lines from a buffer
+///
+/// The lines are unlinked, not freed, so undoing the delete only relinks
+/// them no matter how many there are
+///
+/// @param[in] buffer - buffer to edit
+/// @param[in] line   - first line (0 based) to delete
+/// @param[in] count  - count of lines to delete
+///
+/// @return 0 on success
+///
+int buffer_delete_lines(buffer_t *buffer, size_t line, size_t count);
+
+/// \brief Set the memory a buffer's undo history can use
+///
+/// Past this, older history is spilled to a temporary file and read
+/// back when undone. See ::undo_set_global_memory_cap for the cap on
+/// all buffers together
+///
+/// @param[in] buffer - buffer to set cap of
+/// @param[in] cap    - bytes, 0 for default
+///
+/// @return 0 on success
+///
+int buffer_set_undo_memory_cap(buffer_t *buffer, size_t cap);
+
+/// \brief Start a group of edits which are undone and redone as one
+///
+/// @param[in] buffer - buffer to group edits in
+///
+/// @return 0 on success
+///
+int buffer_begin_undo_group(buffer_t *buffer);
+
+/// \brief End a group of edits started with ::buffer_begin_undo_group
+///
+/// @param[in] buffer - buffer to group edits in
+///
+/// @return 0 on success
+///
+int buffer_end_undo_group(buffer_t *buffer);
+
+/// \brief Stop further typing merging into the last edit's undo record
+///
+/// Call when the edit position moves, so typing after that is undone separately
+///
+/// @param[in] buffer - buffer to seal
+///
+/// @return 0 on success
+///
+int buffer_seal_undo(buffer_t *buffer);
+
+/// \brief Undo the last edit, or group of edits, to a buffer
+///
+/// @param[in] buffer - buffer to undo in
+///
+/// @return 0 on success, 1 if there is nothing to undo, < 0 on error
+///
+int buffer_undo(buffer_t *buffer);
+
+/// \brief Redo the last edit, or group of edits, undone
+///
+/// @param[in] buffer - buffer to redo in
+///
+/// @return 0 on success, 1 if there is nothing to redo, < 0 on error
+///
+int buffer_redo(buffer_t *buffer);
+
 #endif
@@ -2,6 +2,15 @@
 #include <stdlib.h>
 
 #include "bbuf.h"
+#include "bfind.h"
+#include "bregex.h"
+#include "bgrep.h"
+#include "bsave.h"
+#include "bsyntax.h"
+#include "bcolumn.h"
+#include "boffset.h"
+#include "bmemory.h"
+#include "bpack.h"
 #include "bfile.h"
 #include "bfilesys.h"
 #include "butil.h"
@@ -390,6 +399,7 @@ int test_unicode_read(text_encoding_t encoding, bool nobom)
 	}	
 	file_destroy(file);
 	filesys_delete(filename);
+	return 0;
 }
 
 int test_unicode_write(text_encoding_t encoding)
@@ -524,6 +534,7 @@ int test_unicode_write(text_encoding_t encoding)
 	filesys_delete(tmpoutfilename);
 	file_destroy(file);
 	filesys_delete(filename);
+	return 0;
 }
 
 int unicodetest()
@@ -563,24 +574,2435 @@ int unicodetest()
 	return 0;
 }
 
-int main(int argc, char **argv)
+static int make_buffer_with_text(const char *text, size_t textlen, size_t vbufsize, buffer_t **pbuffer, file_t **pfile, char *name, size_t nname)
 {
-	
-	butil_set_log_level(5);
+	file_t *file;
+	buffer_t *buffer;
+	int cnt;
+	int result;
 
-	if (httpbuffertest())
+	result = create_temp_file(&file, name, nname);
+	TEST_CHECK(result == 0, "Can't make temp file");
+
+	cnt = file->file_write(file, (uint8_t*)text, textlen);
+	TEST_CHECK(cnt == textlen, "Can't write File");
+	file_destroy(file);
+
+	file = file_create(name, openForRead);
+	TEST_CHECK(file != NULL, "Could not open file for read");
+
+	buffer = buffer_create("testing", file, NULL, vbufsize);
+	TEST_CHECK(buffer != NULL, "Could not make buffer");
+
+	result = buffer_read(buffer);
+	TEST_CHECK(result == 0, "Could not read buffer");
+
+	*pbuffer = buffer;
+	*pfile = file;
+	return 0;
+}
+
+int findtest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	char filename[MAX_PATH];
+	char text[8192];
+	size_t textlen;
+	size_t line;
+	size_t column;
+	int i;
+	int result;
+
+	// lots of lines, and a small vbuf, so the search has to window the file
+	//
+	textlen = 0;
+	for (i = 0; i < 200; i++)
 	{
-		return -1;
+		textlen += snprintf(text + textlen, sizeof(text) - textlen, "line %d of Needle text\n", i);
 	}
-	if (ftpbuffertest())
+	result = make_buffer_with_text(text, textlen, 64, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->line_count == 200, "Expected 200 lines");
+
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "line 150 ", 9, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find line 150");
+	TEST_CHECK(line == 150 && column == 0, "Wrong position for line 150");
+
+	result = buffer_find(buffer, "needle", 6, 0, &line, &column);
+	TEST_CHECK(result == 1, "Found needle with wrong case");
+
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "needle", 6, findIgnoreCase, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find needle ignoring case");
+	TEST_CHECK(line == 0 && column == 10, "Wrong position for needle");
+
+	result = buffer_find_next(buffer, "Needle", 6, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find next Needle");
+	TEST_CHECK(line == 1 && column == 10, "Wrong position for next Needle");
+
+	line = 199;
+	column = 0;
+	result = buffer_find_prev(buffer, "Needle", 6, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find previous Needle");
+	TEST_CHECK(line == 198 && column == 12, "Wrong position for previous Needle");
+
+	result = buffer_find_prev(buffer, "line 3 ", 7, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find line 3 backwards");
+	TEST_CHECK(line == 3 && column == 0, "Wrong position for line 3");
+
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "haystack", 8, 0, &line, &column);
+	TEST_CHECK(result == 1, "Found text that isn't there");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// unicode file, needle is transcoded to the file's encoding
+	//
+	result = make_buffer_with_text(ucs2le_txt, ucs2le_txt_len, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->original_encoding == textUCS2LE, "Didn't sniff UCS2-LE");
+
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "ucs2", 4, findIgnoreCase, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find UCS2 in UCS2-LE file");
+	TEST_CHECK(line == 0 && column == 16, "Wrong position for UCS2");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// only ASCII code units are folded, U+0141 doesn't match U+0161 for
+	// having the low byte of an upper case letter
+	//
+	for (i = 0; i < 2; i++)
 	{
-		return -1;
+		text[0] = (char)(i ? 0xFE : 0xFF);
+		text[1] = (char)(i ? 0xFF : 0xFE);
+		textlen = 2;
+		for (line = 0; line < 4; line++)
+		{
+			textlen += buffer_encode_text(i ? textUCS2BE : textUCS2LE,
+							(uint8_t*)"some text \xC5\xA1 in a line of ASCII Text\n", 41, (uint8_t*)text + textlen);
+		}
+		result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+		TEST_CHECK(result == 0, "Can't make buffer");
+		line = 0;
+		column = 0;
+		result = buffer_find(buffer, "\xC5\x81", 2, findIgnoreCase, &line, &column);
+		TEST_CHECK(result == 1, "Folded a non-ASCII code unit");
+		result = buffer_find(buffer, "\xC5\xA1 in", 5, findIgnoreCase, &line, &column);
+		TEST_CHECK(result == 0 && line == 0, "Didn't find non-ASCII code unit");
+		result = buffer_find(buffer, "ascii text", 10, findIgnoreCase, &line, &column);
+		TEST_CHECK(result == 0 && line == 0, "Didn't fold ASCII code units");
+
+		buffer_destroy(buffer);
+		file_destroy(file);
+		filesys_delete(filename);
 	}
-	if (buffertest())
+	return 0;
+}
+
+int regextest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	bregex_t *regex;
+	regex_results_t results;
+	char filename[MAX_PATH];
+	char *text;
+	size_t textlen;
+	int i;
+	int result;
+
+	regex = regex_create("a.c$", textUTF8, 0, 0);
+	TEST_CHECK(regex != NULL, "Can't compile a.c$");
+	result = regex_match(regex, (uint8_t*)"xa\xC3\xA9" "c", 5);
+	TEST_CHECK(result == 1, "Dot didn't match a utf-8 character");
+	result = regex_match(regex, (uint8_t*)"abcd", 4);
+	TEST_CHECK(result == 0, "Matched past end of line");
+	regex_destroy(regex);
+
+	regex = regex_create("(ab", textUTF8, 0, 0);
+	TEST_CHECK(regex == NULL, "Compiled a bad pattern");
+
+	// enough lines that the search is split over threads
+	//
+	text = (char*)malloc(3000 * 32);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 3000; i++)
+	{
+		textlen += snprintf(text + textlen, 32, "line %d of Needle text\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->line_count == 3000, "Expected 3000 lines");
+
+	result = buffer_regex_search(buffer, "^line 1[0-9]{2} ", 0, 4, &results);
+	TEST_CHECK(result == 0, "Search failed");
+	TEST_CHECK(results.count == 100, "Expected 100 matching lines");
+	for (i = 0; i < 100; i++)
+	{
+		TEST_CHECK(results.lines[i] == (size_t)(100 + i), "Lines out of order");
+	}
+	regex_results_free(&results);
+
+	result = buffer_regex_search(buffer, "line (12|2345) of", 0, 0, &results);
+	TEST_CHECK(result == 0, "Search failed");
+	TEST_CHECK(results.count == 2, "Expected 2 matching lines");
+	TEST_CHECK(results.lines[0] == 12 && results.lines[1] == 2345, "Wrong lines for alternation");
+	regex_results_free(&results);
+
+	result = buffer_regex_search(buffer, "needle TEXT$", regexIgnoreCase | regexCountOnly, 0, &results);
+	TEST_CHECK(result == 0, "Search failed");
+	TEST_CHECK(results.count == 3000 && results.lines == NULL, "Expected count of all lines");
+
+	result = buffer_regex_search(buffer, "\\d{5}", 0, 0, &results);
+	TEST_CHECK(result == 0 && results.count == 0, "Matched a 5 digit number");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// unicode file, matched in its own encoding
+	//
+	result = make_buffer_with_text(ucs2le_txt, ucs2le_txt_len, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	result = buffer_regex_search(buffer, "^.*[u]cs2", regexIgnoreCase, 1, &results);
+	TEST_CHECK(result == 0, "Search failed");
+	TEST_CHECK(results.count >= 1 && results.lines[0] == 0, "Didn't match UCS2 in UCS2-LE file");
+	regex_results_free(&results);
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	return 0;
+}
+
+int replacetest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	line_t *line;
+	char filename[MAX_PATH];
+	char expected[64];
+	char *text;
+	size_t textlen;
+	size_t replaced;
+	size_t length;
+	int i;
+	int result;
+
+	// only every 7th line has the needle
+	//
+	text = (char*)malloc(3000 * 32);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 3000; i++)
+	{
+		textlen += snprintf(text + textlen, 32, "line %d of %s text\n", i, (i % 7) ? "hay" : "Needle");
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	result = buffer_replace_all(buffer, "needle", 6, "pin", 3, findIgnoreCase, 4, &replaced);
+	TEST_CHECK(result == 0, "Replace failed");
+	TEST_CHECK(replaced == 429, "Expected 429 replacements");
+
+	for (i = 0, line = buffer->lines; line; i++, line = line->next)
+	{
+		TEST_CHECK((line->location == lineInMemory) == ((i % 7) == 0), "Wrong lines changed");
+	}
+	TEST_CHECK(i == 3000, "Line count changed");
+
+	result = buffer_edit_line(buffer, 700, &text, &length);
+	TEST_CHECK(result == 0, "Can't get line 700");
+	snprintf(expected, sizeof(expected), "line 700 of pin text\n");
+	TEST_CHECK(length == strlen(expected) && ! memcmp(text, expected, length), "Wrong text after replace");
+
+	result = buffer_edit_line(buffer, 701, &text, &length);
+	TEST_CHECK(result == 0, "Can't get line 701");
+	snprintf(expected, sizeof(expected), "line 701 of hay text\n");
+	TEST_CHECK(length == strlen(expected) && ! memcmp(text, expected, length), "Unchanged line is wrong");
+
+	// replacing in lines already in memory
+	//
+	result = buffer_replace_all(buffer, "pin", 3, "p", 1, 0, 0, &replaced);
+	TEST_CHECK(result == 0 && replaced == 429, "Replace in memory lines failed");
+	result = buffer_edit_line(buffer, 0, &text, &length);
+	TEST_CHECK(result == 0 && length == 17 && ! memcmp(text, "line 0 of p text\n", 17), "Wrong text after second replace");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// unicode file, replacement lines are in utf-8
+	//
+	result = make_buffer_with_text(ucs2le_txt, ucs2le_txt_len, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	result = buffer_replace_all(buffer, "ucs2", 4, "wide", 4, findIgnoreCase, 1, &replaced);
+	TEST_CHECK(result == 0 && replaced >= 1, "Replace in UCS2-LE file failed");
+	TEST_CHECK(buffer->lines->location == lineInMemory, "First line not replaced");
+	TEST_CHECK(! memcmp(buffer->lines->position.data, "This is wideLE\n", 15), "Wrong replacement in UCS2-LE line");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	return 0;
+}
+
+int trigramtest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	trigram_index_t *index;
+	FILE *out;
+	char filename[MAX_PATH];
+	char sidecar[MAX_PATH];
+	char *text;
+	size_t textlen;
+	size_t line;
+	size_t column;
+	size_t size;
+	time_t mod_time;
+	int pass;
+	int i;
+	int result;
+
+	// several index blocks, and the needle only in one of them
+	//
+	text = (char*)malloc(40000 * 32);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 40000; i++)
+	{
+		textlen += snprintf(text + textlen, 32, "line %d of %s text\n", i, (i == 30000) ? "Needle" : "hay");
+	}
+	result = create_temp_file(&file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make temp file");
+	result = file->file_write(file, (uint8_t*)text, textlen);
+	TEST_CHECK(result == textlen, "Can't write File");
+	file_destroy(file);
+	free(text);
+
+	result = trigram_sidecar_url(filename, sidecar, sizeof(sidecar));
+	TEST_CHECK(result == 0, "Can't make sidecar name");
+	filesys_delete(sidecar);
+
+	// first pass builds the index, second loads it from the sidecar
+	//
+	for (pass = 0; pass < 2; pass++)
+	{
+		file = file_create(filename, openForRead);
+		TEST_CHECK(file != NULL, "Could not open file for read");
+		buffer = buffer_create("testing", file, NULL, 0);
+		TEST_CHECK(buffer != NULL, "Could not make buffer");
+		buffer_set_trigram_index(buffer, true);
+
+		result = buffer_read(buffer);
+		TEST_CHECK(result == 0, "Could not read buffer");
+		TEST_CHECK(buffer->line_count == 40000, "Expected 40000 lines");
+		TEST_CHECK(buffer->trigrams != NULL, "No trigram index");
+		TEST_CHECK(buffer->trigrams->block_count > 2, "Expected more blocks");
+
+		result = filesys_info(sidecar, NULL, NULL);
+		TEST_CHECK(result == 0, "No sidecar index saved");
+
+		TEST_CHECK(! trigram_block_may_match(buffer->trigrams, 0, (uint8_t*)"needle", 6), "Index didn't rule out block 0");
+
+		line = 0;
+		column = 0;
+		result = buffer_find(buffer, "needle", 6, findIgnoreCase, &line, &column);
+		TEST_CHECK(result == 0, "Didn't find needle");
+		TEST_CHECK(line == 30000 && column == 14, "Wrong position for needle");
+
+		result = buffer_find_next(buffer, "needle", 6, findIgnoreCase, &line, &column);
+		TEST_CHECK(result == 1, "Found a second needle");
+
+		line = 39999;
+		column = 0;
+		result = buffer_find_prev(buffer, "Needle", 6, 0, &line, &column);
+		TEST_CHECK(result == 0 && line == 30000, "Didn't find needle backwards");
+
+		line = 0;
+		column = 0;
+		result = buffer_find(buffer, "line 39998 ", 11, 0, &line, &column);
+		TEST_CHECK(result == 0 && line == 39998, "Didn't find line at end of file");
+
+		buffer_destroy(buffer);
+		file_destroy(file);
+	}
+	// a changed file makes the sidecar stale
+	//
+	result = filesys_info(filename, &size, &mod_time);
+	TEST_CHECK(result == 0, "No info for file");
+	index = trigram_load(sidecar, size + 1, mod_time);
+	TEST_CHECK(index == NULL, "Loaded stale index");
+	index = trigram_load(sidecar, size, mod_time);
+	TEST_CHECK(index != NULL, "Didn't load current index");
+	trigram_destroy(index);
+
+	// a file changed by another program since its info was last got
+	// isn't searched with the old index
+	//
+	out = fopen(filename, "w");
+	TEST_CHECK(out != NULL, "Can't rewrite file");
+	for (i = 0; i < 40000; i++)
+	{
+		fprintf(out, "line %d of %s text\n", i, (i == 10) ? "moved Needle" : "hay");
+	}
+	fclose(out);
+	file = file_create(filename, openForRead);
+	TEST_CHECK(file != NULL, "Could not open file for read");
+	buffer = buffer_create("testing", file, NULL, 0);
+	TEST_CHECK(buffer != NULL, "Could not make buffer");
+	buffer_set_trigram_index(buffer, true);
+	result = buffer_read(buffer);
+	TEST_CHECK(result == 0, "Could not read buffer");
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "needle", 6, findIgnoreCase, &line, &column);
+	TEST_CHECK(result == 0 && line == 10, "Searched file changed elsewhere with stale index");
+	buffer_destroy(buffer);
+	file_destroy(file);
+
+	filesys_delete(sidecar);
+	filesys_delete(filename);
+	return 0;
+}
+
+typedef struct tag_grep_check
+{
+	size_t			results;
+	size_t			matches;
+	size_t			errors;
+	size_t			last_file;
+	size_t			last_line;
+	bool			in_order;
+	bool			long_line_ok;
+}
+grep_check_t;
+
+static int grep_check_callback(void *priv, const grep_result_t *result)
+{
+	grep_check_t *check = (grep_check_t*)priv;
+
+	if (check->results && result->file_index < check->last_file)
+	{
+		check->in_order = false;
+	}
+	if (
+			check->results && result->file_index == check->last_file
+		&&	result->text && result->line <= check->last_line
+	)
+	{
+		check->in_order = false;
+	}
+	if (result->error)
+	{
+		check->errors++;
+	}
+	else if (result->text)
+	{
+		check->matches++;
+		if (result->length == GREP_MAX_TEXT && result->text[0] == 'x')
+		{
+			check->long_line_ok = true;
+		}
+	}
+	else
+	{
+		check->matches += result->count;
+	}
+	check->results++;
+	check->last_file = result->file_index;
+	check->last_line = result->line;
+	return 0;
+}
+
+int greptest()
+{
+	grep_check_t check;
+	file_t *file;
+	char names[12][MAX_PATH];
+	const char *urls[13];
+	char line[64];
+	size_t expected;
+	size_t i;
+	int f;
+	int n;
+	int result;
+
+	// files with a match on every 3rd line, more lines in each file
+	//
+	expected = 0;
+	for (f = 0; f < 10; f++)
 	{
+		result = create_temp_file(&file, names[f], sizeof(names[f]));
+		TEST_CHECK(result == 0, "Can't make temp file");
+		for (n = 0; n < 100 * (f + 1); n++)
+		{
+			snprintf(line, sizeof(line), "file %d line %d %s\r\n", f, n, (n % 3) ? "hay" : "needle");
+			result = file->file_write(file, (uint8_t*)line, strlen(line));
+			TEST_CHECK(result == strlen(line), "Can't write File");
+			expected += (n % 3) ? 0 : 1;
+		}
+		file_destroy(file);
+		urls[f] = names[f];
+	}
+	// a line longer than the grep window, matching at its end
+	//
+	result = create_temp_file(&file, names[10], sizeof(names[10]));
+	TEST_CHECK(result == 0, "Can't make temp file");
+	memset(line, 'x', sizeof(line));
+	for (n = 0; n < (int)(GREP_WINDOW_SIZE * 3 / sizeof(line)); n++)
+	{
+		result = file->file_write(file, (uint8_t*)line, sizeof(line));
+		TEST_CHECK(result == sizeof(line), "Can't write File");
+	}
+	result = file->file_write(file, (uint8_t*)"needle\nshort\n", 14);
+	TEST_CHECK(result == 14, "Can't write File");
+	file_destroy(file);
+	urls[10] = names[10];
+	expected++;
+
+	// a UCS2-LE file, which has one line with "ucs2"
+	//
+	result = create_temp_file(&file, names[11], sizeof(names[11]));
+	TEST_CHECK(result == 0, "Can't make temp file");
+	result = file->file_write(file, ucs2le_txt, ucs2le_txt_len);
+	TEST_CHECK(result == ucs2le_txt_len, "Can't write File");
+	file_destroy(file);
+	urls[11] = names[11];
+
+	urls[12] = "/no/such/file/for/bgrep";
+
+	// tiny memory cap, so threads have to wait for their turn
+	//
+	memset(&check, 0, sizeof(check));
+	check.in_order = true;
+	result = grep_files(urls, 13, "needle$|UCS2", regexIgnoreCase, 4, 1, grep_check_callback, &check);
+	TEST_CHECK(result == 0, "Grep failed");
+	TEST_CHECK(check.in_order, "Results out of order");
+	TEST_CHECK(check.matches == expected + 1, "Wrong count of matches");
+	TEST_CHECK(check.errors == 1, "Expected error for missing file");
+	TEST_CHECK(check.long_line_ok, "Long line text wrong");
+
+	memset(&check, 0, sizeof(check));
+	check.in_order = true;
+	result = grep_files(urls, 12, "needle", regexCountOnly, 0, 0, grep_check_callback, &check);
+	TEST_CHECK(result == 0, "Grep count failed");
+	TEST_CHECK(check.results == 12 && check.matches == expected, "Wrong counts");
+
+	result = grep_files(urls, 12, "needle(", 0, 0, 0, grep_check_callback, &check);
+	TEST_CHECK(result < 0, "Bad pattern accepted");
+
+	for (i = 0; i < 12; i++)
+	{
+		filesys_delete(names[i]);
+	}
+	return 0;
+}
+
+static int check_line_text(buffer_t *buffer, size_t line, const char *expected)
+{
+	char *text;
+	size_t length;
+	int result;
+
+	result = buffer_edit_line(buffer, line, &text, &length);
+	if (result || length != strlen(expected) || memcmp(text, expected, length))
+	{
+		butil_log(0, "Line %u is \"%.*s\" not \"%s\"\n", (unsigned)line, (int)length, text, expected);
 		return -1;
 	}
-	if (unicodetest())
+	return 0;
+}
+
+int undotest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	char filename[MAX_PATH];
+	char expected[64];
+	char *text;
+	size_t textlen;
+	size_t replaced;
+	int i;
+	int result;
+
+	text = (char*)malloc(200000 * 16);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 200000; i++)
+	{
+		textlen += snprintf(text + textlen, 16, "line %d\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	result = buffer_undo(buffer);
+	TEST_CHECK(result == 1, "Undo with no edits");
+
+	// typing merges into one record
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 2, 0, "a", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_insert_text(buffer, 2, 1, "b", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_insert_text(buffer, 2, 2, "c", 1) == 0, "Insert failed");
+	TEST_CHECK(check_line_text(buffer, 2, "abcline 2\n") == 0, "Wrong text after typing");
+	TEST_CHECK(buffer->undos->records == 1, "Typing not merged");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(check_line_text(buffer, 2, "line 2\n") == 0, "Wrong text after undo typing");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo failed");
+	TEST_CHECK(check_line_text(buffer, 2, "abcline 2\n") == 0, "Wrong text after redo typing");
+	TEST_CHECK(buffer_redo(buffer) == 1, "Redo past end");
+
+	// backspacing merges, and doesn't merge into the typing
+	//
+	TEST_CHECK(buffer_delete_text(buffer, 2, 2, 1) == 0, "Delete failed");
+	TEST_CHECK(buffer_delete_text(buffer, 2, 1, 1) == 0, "Delete failed");
+	TEST_CHECK(check_line_text(buffer, 2, "aline 2\n") == 0, "Wrong text after backspace");
+	TEST_CHECK(buffer->undos->records == 2, "Backspace not merged");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(check_line_text(buffer, 2, "abcline 2\n") == 0, "Wrong text after undo backspace");
+
+	// a new edit drops what could be redone
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 5, 4, "!", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_redo(buffer) == 1, "Redo after new edit");
+	TEST_CHECK(check_line_text(buffer, 5, "line! 5\n") == 0, "Wrong text after insert");
+
+	// sealing stops typing merging
+	//
+	TEST_CHECK(buffer_seal_undo(buffer) == 0, "Can't seal");
+	TEST_CHECK(buffer_insert_text(buffer, 5, 5, "?", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(check_line_text(buffer, 5, "line! 5\n") == 0, "Typing merged after seal");
+
+	// grouped edits undo as one
+	//
+	TEST_CHECK(buffer_begin_undo_group(buffer) == 0, "Can't begin group");
+	TEST_CHECK(buffer_insert_lines(buffer, 0, "new 0\nnew 1\n", 12) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_delete_text(buffer, 4, 0, 3) == 0, "Delete failed");
+	TEST_CHECK(buffer_end_undo_group(buffer) == 0, "Can't end group");
+	TEST_CHECK(buffer->line_count == 200002, "Wrong count after insert lines");
+	TEST_CHECK(check_line_text(buffer, 1, "new 1\n") == 0, "Wrong inserted line");
+	TEST_CHECK(check_line_text(buffer, 4, "line 2\n") == 0, "Wrong text after grouped delete");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo group failed");
+	TEST_CHECK(buffer->line_count == 200000, "Wrong count after undo group");
+	TEST_CHECK(check_line_text(buffer, 0, "line 0\n") == 0, "Wrong first line after undo group");
+	TEST_CHECK(check_line_text(buffer, 2, "abcline 2\n") == 0, "Wrong text after undo group");
+
+	// bulk delete undoes by relinking the lines
+	//
+	TEST_CHECK(buffer_delete_lines(buffer, 10, 199980) == 0, "Bulk delete failed");
+	TEST_CHECK(buffer->line_count == 20, "Wrong count after bulk delete");
+	TEST_CHECK(buffer->undos->memory <= UNDO_CHUNK_SIZE, "Bulk delete record too large");
+	TEST_CHECK(check_line_text(buffer, 10, "line 199990\n") == 0, "Wrong line after bulk delete");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo bulk delete failed");
+	TEST_CHECK(buffer->line_count == 200000, "Wrong count after undo bulk delete");
+	TEST_CHECK(check_line_text(buffer, 10, "line 10\n") == 0, "Wrong line after undo bulk delete");
+	TEST_CHECK(check_line_text(buffer, 199989, "line 199989\n") == 0, "Wrong line after undo bulk delete");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo bulk delete failed");
+	TEST_CHECK(buffer->line_count == 20, "Wrong count after redo bulk delete");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo bulk delete failed");
+
+	// replace all is one undo, and restores lines to the file
+	//
+	result = buffer_replace_all(buffer, "line 1", 6, "LINE 1", 6, 0, 2, &replaced);
+	TEST_CHECK(result == 0 && replaced == 111111, "Replace failed");
+	TEST_CHECK(check_line_text(buffer, 123456, "LINE 123456\n") == 0, "Wrong text after replace");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo replace failed");
+	TEST_CHECK(check_line_text(buffer, 123456, "line 123456\n") == 0, "Wrong text after undo replace");
+	TEST_CHECK(buffer->curr_line->location == lineInFile, "Line not restored to file");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo replace failed");
+	TEST_CHECK(check_line_text(buffer, 199999, "LINE 199999\n") == 0, "Wrong text after redo replace");
+
+	// undo everything
+	//
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Undo all failed");
+	for (i = 0; i < 200000; i += 9999)
+	{
+		snprintf(expected, sizeof(expected), "line %d\n", i);
+		TEST_CHECK(check_line_text(buffer, i, expected) == 0, "Wrong text after undo all");
+	}
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// history past the memory cap spills to disk and pages back in
+	//
+	text = (char*)malloc(20000 * 16);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 20000; i++)
+	{
+		textlen += snprintf(text + textlen, 16, "line %d\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	TEST_CHECK(buffer_set_undo_memory_cap(buffer, UNDO_CHUNK_SIZE) == 0, "Can't set undo cap");
+	result = buffer_replace_all(buffer, "line", 4, "LINE", 4, 0, 0, &replaced);
+	TEST_CHECK(result == 0 && replaced == 20000, "Replace failed");
+	for (i = 0; i < 20000; i += 97)
+	{
+		TEST_CHECK(buffer_insert_text(buffer, i, 0, "+", 1) == 0, "Insert failed");
+	}
+	TEST_CHECK(buffer->undos->spill_size > 0, "Nothing spilled");
+	TEST_CHECK(buffer->undos->memory <= 3 * UNDO_CHUNK_SIZE, "Undo memory over cap");
+	TEST_CHECK(undo_global_memory() >= buffer->undos->memory, "Global undo memory not counted");
+
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		TEST_CHECK(buffer->undos->memory <= 3 * UNDO_CHUNK_SIZE, "Undo memory over cap while undoing");
+	}
+	TEST_CHECK(result == 1, "Undo all failed");
+	for (i = 0; i < 20000; i += 101)
+	{
+		snprintf(expected, sizeof(expected), "line %d\n", i);
+		TEST_CHECK(check_line_text(buffer, i, expected) == 0, "Wrong text after undoing spilled history");
+	}
+	while ((result = buffer_redo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Redo all failed");
+	TEST_CHECK(check_line_text(buffer, 97, "+LINE 97\n") == 0, "Wrong text after redoing spilled history");
+	TEST_CHECK(check_line_text(buffer, 19999, "LINE 19999\n") == 0, "Wrong text after redoing spilled history");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	return 0;
+}
+
+static int open_journaled_buffer(const char *filename, int interval, buffer_t **pbuffer, file_t **pfile)
+{
+	file_t *file;
+	buffer_t *buffer;
+	int result;
+
+	file = file_create(filename, openForRead);
+	TEST_CHECK(file != NULL, "Could not open file for read");
+	buffer = buffer_create("journaled", file, NULL, 0);
+	TEST_CHECK(buffer != NULL, "Could not make buffer");
+	TEST_CHECK(buffer_set_journal(buffer, true, interval) == 0, "Can't set journal");
+	result = buffer_read(buffer);
+	TEST_CHECK(result == 0, "Could not read buffer");
+	*pbuffer = buffer;
+	*pfile = file;
+	return 0;
+}
+
+static void close_journaled_buffer(buffer_t *buffer, file_t *file)
+{
+	buffer_destroy(buffer);
+	free(buffer);
+	file_destroy(file);
+}
+
+int journaltest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	file_t *jfile;
+	journal_rec_t rec;
+	FILE *out;
+	char filename[MAX_PATH];
+	char journalname[MAX_PATH];
+	char text[4096];
+	size_t textlen;
+	size_t replaced;
+	int i;
+	int result;
+
+	textlen = 0;
+	for (i = 0; i < 100; i++)
+	{
+		textlen += snprintf(text + textlen, sizeof(text) - textlen, "line %d\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	close_journaled_buffer(buffer, file);
+	result = journal_sidecar_url(filename, journalname, sizeof(journalname));
+	TEST_CHECK(result == 0, "Can't make journal name");
+	filesys_delete(journalname);
+
+	// edits synced one at a time, then the buffer goes away unsaved
+	//
+	result = open_journaled_buffer(filename, 0, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(buffer->journal != NULL, "No journal");
+	TEST_CHECK(buffer_insert_text(buffer, 1, 0, "ab", 2) == 0, "Insert failed");
+	TEST_CHECK(buffer_insert_text(buffer, 1, 2, "c", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 3, 0, 5) == 0, "Delete failed");
+	TEST_CHECK(buffer_begin_undo_group(buffer) == 0, "Can't begin group");
+	TEST_CHECK(buffer_insert_lines(buffer, 0, "new 0\nnew 1\n", 12) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_delete_lines(buffer, 50, 10) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_end_undo_group(buffer) == 0, "Can't end group");
+	result = buffer_replace_all(buffer, "line 9", 6, "LINE 9", 6, 0, 0, &replaced);
+	TEST_CHECK(result == 0 && replaced == 11, "Replace failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo failed");
+	TEST_CHECK(buffer_insert_text(buffer, 7, 0, "x", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	close_journaled_buffer(buffer, file);
+
+	// reopening replays the edits and their history
+	//
+	result = open_journaled_buffer(filename, 0, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(buffer->line_count == 92, "Wrong count after replay");
+	TEST_CHECK(check_line_text(buffer, 0, "new 0\n") == 0, "Wrong inserted line after replay");
+	TEST_CHECK(check_line_text(buffer, 3, "abcline 1\n") == 0, "Wrong text after replay");
+	TEST_CHECK(check_line_text(buffer, 5, "3\n") == 0, "Wrong deleted text after replay");
+	TEST_CHECK(check_line_text(buffer, 7, "line 5\n") == 0, "Undone edit replayed");
+	TEST_CHECK(check_line_text(buffer, 50, "line 58\n") == 0, "Wrong line after replayed delete");
+	TEST_CHECK(check_line_text(buffer, 91, "LINE 99\n") == 0, "Wrong text after replayed replace");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo after replay failed");
+	TEST_CHECK(check_line_text(buffer, 7, "xline 5\n") == 0, "Wrong text after redo");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo after replay failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo after replay failed");
+	TEST_CHECK(check_line_text(buffer, 91, "line 99\n") == 0, "Wrong text after undo replace");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo after replay failed");
+	TEST_CHECK(buffer->line_count == 100, "Wrong count after undo group");
+	close_journaled_buffer(buffer, file);
+
+	// group commit, then a torn entry at the end is dropped
+	//
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(buffer->line_count == 100, "Wrong count after replay with undos");
+	TEST_CHECK(buffer_insert_text(buffer, 20, 0, "#", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_sync_journal(buffer) == 0, "Can't sync journal");
+	close_journaled_buffer(buffer, file);
+
+	result = filesys_info(journalname, &textlen, NULL);
+	TEST_CHECK(result == 0, "Can't get journal size");
+	jfile = file_create(journalname, openForAppend);
+	TEST_CHECK(jfile != NULL, "Can't open journal");
+	TEST_CHECK(jfile->file_seek(jfile, textlen) == 0, "Can't seek journal");
+	TEST_CHECK(jfile->file_write(jfile, (uint8_t*)"JENT garbage", 12) == 12, "Can't write journal");
+	file_destroy(jfile);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 20, "#line 20\n") == 0, "Wrong text after torn replay");
+	TEST_CHECK(buffer_insert_text(buffer, 21, 0, "$", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 20, "#line 20\n") == 0, "Lost edit before torn entry");
+	TEST_CHECK(check_line_text(buffer, 21, "$line 21\n") == 0, "Lost edit after torn entry");
+
+	// once saved, the journal starts over
+	//
+	TEST_CHECK(buffer_reset_journal(buffer) == 0, "Can't reset journal");
+	close_journaled_buffer(buffer, file);
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 20, "line 20\n") == 0, "Edits replayed after reset");
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "%", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+
+	// an edit that fails isn't journaled, and replay stops at one that
+	// can't be made again, dropping it and what follows
+	//
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 0, "%line 0\n") == 0, "Wrong text after replay");
+	TEST_CHECK(buffer_delete_text(buffer, 0, 100, 5) < 0, "Deleted past end of line");
+	memset(&rec, 0, sizeof(rec));
+	rec.op = journalDeleteLines;
+	rec.line = 1000;
+	rec.count = 1;
+	TEST_CHECK(journal_append(buffer->journal, &rec) == 0, "Can't journal bad edit");
+	TEST_CHECK(buffer_insert_text(buffer, 1, 0, "&", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 0, "%line 0\n") == 0, "Edit before failed one not replayed");
+	TEST_CHECK(check_line_text(buffer, 1, "line 1\n") == 0, "Edit after failed one replayed");
+	TEST_CHECK(buffer_insert_text(buffer, 2, 0, "*", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 1, "line 1\n") == 0, "Dropped edit replayed");
+	TEST_CHECK(check_line_text(buffer, 2, "*line 2\n") == 0, "Edit after dropped one not replayed");
+
+	// a seal is replayed, so typing either side of it is undone separately
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 3, 0, "1", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_seal_undo(buffer) == 0, "Can't seal");
+	TEST_CHECK(buffer_insert_text(buffer, 3, 1, "2", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 3, "12line 3\n") == 0, "Wrong text after replay");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo after replay failed");
+	TEST_CHECK(check_line_text(buffer, 3, "1line 3\n") == 0, "Seal not replayed");
+	close_journaled_buffer(buffer, file);
+
+	// a journal isn't replayed on a file that changed
+	//
+	file = file_create(filename, openForWrite);
+	TEST_CHECK(file != NULL, "Can't rewrite file");
+	TEST_CHECK(file->file_write(file, (uint8_t*)"other\n", 6) == 6, "Can't write file");
+	file_destroy(file);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(buffer->line_count == 1, "Wrong count for changed file");
+	TEST_CHECK(check_line_text(buffer, 0, "other\n") == 0, "Stale journal replayed");
+	close_journaled_buffer(buffer, file);
+
+	// nor on one changed by another program since its info was last got
+	//
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "%", 1) == 0, "Insert failed");
+	close_journaled_buffer(buffer, file);
+	out = fopen(filename, "w");
+	TEST_CHECK(out != NULL, "Can't rewrite file");
+	fputs("changed elsewhere\n", out);
+	fclose(out);
+
+	result = open_journaled_buffer(filename, 1000, &buffer, &file);
+	TEST_CHECK(result == 0, "Can't open buffer");
+	TEST_CHECK(check_line_text(buffer, 0, "changed elsewhere\n") == 0, "Journal replayed on file changed elsewhere");
+	close_journaled_buffer(buffer, file);
+
+	filesys_delete(journalname);
+	filesys_delete(filename);
+	return 0;
+}
+
+static int read_snapshot_text(buffer_snapshot_t *snapshot, char *text, size_t size, size_t *textlen)
+{
+	snapshot_cursor_t cursor;
+	uint8_t *content;
+	size_t length;
+	int result;
+
+	memset(&cursor, 0, sizeof(cursor));
+	*textlen = 0;
+	while ((result = buffer_snapshot_next_line(snapshot, &cursor, &content, &length, NULL)) == 0)
+	{
+		TEST_CHECK(*textlen + length <= size, "Snapshot too large");
+		memcpy(text + *textlen, content, length);
+		*textlen += length;
+	}
+	buffer_snapshot_end(&cursor);
+	TEST_CHECK(result == 1, "Can't read snapshot");
+	return 0;
+}
+
+static int read_buffer_text(buffer_t *buffer, char *text, size_t size, size_t *textlen)
+{
+	uint8_t *content;
+	size_t length;
+	size_t linenum;
+	int result;
+
+	*textlen = 0;
+	for (linenum = 0; linenum < buffer->line_count; linenum++)
+	{
+		result = buffer_get_line_content(buffer, linenum, &content, &length);
+		TEST_CHECK(result == 0, "Can't get line");
+		TEST_CHECK(*textlen + length <= size, "Buffer too large");
+		memcpy(text + *textlen, content, length);
+		*textlen += length;
+	}
+	return 0;
+}
+
+typedef struct
+{
+	buffer_snapshot_t *snapshot;
+	const char *expected;
+	size_t expected_length;
+	int passes;
+	int failed;
+}
+snapshot_reader_t;
+
+static void *snapshot_reader(void *priv)
+{
+	snapshot_reader_t *reader = (snapshot_reader_t*)priv;
+	char *text;
+	size_t textlen;
+	int pass;
+
+	text = (char*)malloc(reader->expected_length + 1);
+	for (pass = 0; text && pass < reader->passes; pass++)
+	{
+		if (
+				read_snapshot_text(reader->snapshot, text, reader->expected_length, &textlen)
+			||	textlen != reader->expected_length
+			||	memcmp(text, reader->expected, textlen)
+		)
+		{
+			reader->failed = 1;
+			break;
+		}
+	}
+	if (text)
+	{
+		free(text);
+	}
+	buffer_snapshot_release(reader->snapshot);
+	return NULL;
+}
+
+int snapshottest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	buffer_snapshot_t *first;
+	buffer_snapshot_t *second;
+	snapshot_reader_t reader;
+	pthread_t thread;
+	char filename[MAX_PATH];
+	char *original;
+	char *expected;
+	char *text;
+	size_t origlen;
+	size_t explen;
+	size_t textlen;
+	size_t replaced;
+	int i;
+	int result;
+
+	original = (char*)malloc(3 * 65536);
+	expected = (char*)malloc(3 * 65536);
+	text = (char*)malloc(3 * 65536);
+	TEST_CHECK(original && expected && text, "Can't alloc text");
+	origlen = 0;
+	for (i = 0; i < 2000; i++)
+	{
+		origlen += snprintf(original + origlen, 32, "line %d\n", i);
+	}
+	result = make_buffer_with_text(original, origlen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	// a snapshot doesn't see edits made after it
+	//
+	first = buffer_snapshot(buffer);
+	TEST_CHECK(first != NULL, "Can't snapshot");
+	TEST_CHECK(first->lines == buffer->lines, "Snapshot copied lines");
+	TEST_CHECK(buffer_insert_text(buffer, 5, 0, "abc", 3) == 0, "Insert failed");
+	TEST_CHECK(buffer_insert_text(buffer, 5, 3, "d", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 6, 0, 2) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 0, "new 0\nnew 1\n", 12) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_delete_lines(buffer, 100, 100) == 0, "Delete lines failed");
+	result = buffer_replace_all(buffer, "line 1", 6, "LINE 1", 6, 0, 0, &replaced);
+	TEST_CHECK(result == 0 && replaced > 0, "Replace failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_redo(buffer) == 0, "Redo failed");
+
+	TEST_CHECK(read_snapshot_text(first, text, 3 * 65536, &textlen) == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == origlen && ! memcmp(text, original, origlen), "Snapshot changed by edits");
+	TEST_CHECK(buffer->versions.versions > 0, "No versions saved");
+
+	// a second snapshot sees the edits so far, and not those after it
+	//
+	second = buffer_snapshot(buffer);
+	TEST_CHECK(second != NULL, "Can't snapshot");
+	TEST_CHECK(read_buffer_text(buffer, expected, 3 * 65536, &explen) == 0, "Can't read buffer");
+	TEST_CHECK(buffer_delete_lines(buffer, 0, 50) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "xyz", 3) == 0, "Insert failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_insert_text(buffer, 1, 0, "!", 1) == 0, "Insert failed");
+
+	TEST_CHECK(read_snapshot_text(first, text, 3 * 65536, &textlen) == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == origlen && ! memcmp(text, original, origlen), "First snapshot changed");
+	buffer_snapshot_release(first);
+	TEST_CHECK(read_snapshot_text(second, text, 3 * 65536, &textlen) == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == explen && ! memcmp(text, expected, explen), "Second snapshot changed");
+
+	// lines dropped by the buffer wait for the snapshot
+	//
+	TEST_CHECK(buffer_read(buffer) == 0, "Can't reread buffer");
+	TEST_CHECK(buffer->versions.nburied > 0, "Dropped lines not kept");
+	TEST_CHECK(read_snapshot_text(second, text, 3 * 65536, &textlen) == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == explen && ! memcmp(text, expected, explen), "Snapshot changed by reread");
+	buffer_snapshot_release(second);
+	TEST_CHECK(buffer->versions.versions == 0, "Versions left after release");
+	TEST_CHECK(buffer->versions.nburied == 0, "Lines left after release");
+	TEST_CHECK(buffer->versions.memory == 0, "Memory left after release");
+
+	// read on another thread while editing
+	//
+	TEST_CHECK(read_buffer_text(buffer, expected, 3 * 65536, &explen) == 0, "Can't read buffer");
+	reader.snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(reader.snapshot != NULL, "Can't snapshot");
+	reader.expected = expected;
+	reader.expected_length = explen;
+	reader.passes = 20;
+	reader.failed = 0;
+	result = pthread_create(&thread, NULL, snapshot_reader, &reader);
+	TEST_CHECK(result == 0, "Can't start reader");
+	for (i = 0; i < 2000; i++)
+	{
+		switch (i % 4)
+		{
+		case 0:
+			buffer_insert_text(buffer, (i * 7) % 1000, 0, "ab", 2);
+			break;
+		case 1:
+			buffer_delete_text(buffer, (i * 7) % 1000, 0, 1);
+			break;
+		case 2:
+			buffer_insert_lines(buffer, (i * 13) % 1000, "more\n", 5);
+			break;
+		case 3:
+			buffer_delete_lines(buffer, (i * 11) % 1000, 2);
+			break;
+		}
+	}
+	while (buffer_undo(buffer) == 0)
+	{
+		;
+	}
+	pthread_join(thread, NULL);
+	TEST_CHECK(reader.failed == 0, "Snapshot changed while read on another thread");
+	TEST_CHECK(buffer->versions.versions == 0, "Versions left after release");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	free(original);
+	free(expected);
+	free(text);
+	return 0;
+}
+
+typedef struct
+{
+	int progress_calls;
+	save_status_t status;
+	size_t lines_written;
+}
+save_state_t;
+
+static void save_callback(void *priv, const save_progress_t *progress)
+{
+	save_state_t *state = (save_state_t*)priv;
+
+	state->status = progress->status;
+	state->lines_written = progress->lines_written;
+	if (progress->status == saveRunning)
+	{
+		state->progress_calls++;
+	}
+}
+
+static int check_file_text(const char *filename, const char *expected, size_t explen)
+{
+	file_t *file;
+	char *text;
+	size_t size;
+	size_t total;
+	int count;
+
+	TEST_CHECK(filesys_info(filename, &size, NULL) == 0, "Can't stat saved file");
+	TEST_CHECK(size == explen, "Saved file is the wrong size");
+	text = (char*)malloc(size + 1);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	file = file_create(filename, openForRead);
+	TEST_CHECK(file != NULL, "Can't open saved file");
+	for (total = 0; total < size; total += count)
+	{
+		count = file->file_read(file, (uint8_t*)text + total, size - total);
+		if (count <= 0)
+		{
+			break;
+		}
+	}
+	file_destroy(file);
+	count = (total == size) && ! memcmp(text, expected, size);
+	free(text);
+	TEST_CHECK(count, "Saved file has the wrong text");
+	return 0;
+}
+
+int savetest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	save_state_t states[3];
+	char filename[MAX_PATH];
+	char outname[MAX_PATH];
+	char *text;
+	char *expected;
+	size_t textlen;
+	size_t explen;
+	int i;
+	int result;
+
+	text = (char*)malloc(200000 * 16);
+	expected = (char*)malloc(200000 * 16 + 4096);
+	TEST_CHECK(text && expected, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 200000; i++)
+	{
+		textlen += snprintf(text + textlen, 16, "line %d\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+	result = filesys_get_temp("savetest", outname, sizeof(outname));
+	TEST_CHECK(result == 0, "Can't make temp name");
+
+	// saves the buffer as it was when the save started
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 10, 0, "edited ", 7) == 0, "Insert failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 500, "inserted\n", 9) == 0, "Insert lines failed");
+	TEST_CHECK(read_buffer_text(buffer, expected, 200000 * 16 + 4096, &explen) == 0, "Can't read buffer");
+	memset(states, 0, sizeof(states));
+	result = buffer_save_async(buffer, outname, buffer->original_encoding, save_callback, &states[0]);
+	TEST_CHECK(result == 0, "Can't start save");
+	TEST_CHECK(buffer_delete_lines(buffer, 0, 1000) == 0, "Delete lines failed");
+	for (i = 0; i < 1000; i++)
+	{
+		TEST_CHECK(buffer_insert_text(buffer, i * 100, 0, "x", 1) == 0, "Insert failed");
+	}
+	TEST_CHECK(buffer_save_wait(buffer) == 0, "Save failed");
+	TEST_CHECK(states[0].status == saveDone, "Save didn't finish");
+	TEST_CHECK(states[0].lines_written == 200001, "Wrong count of lines saved");
+	TEST_CHECK(states[0].progress_calls == 200001 / SAVE_PROGRESS_LINES, "Wrong count of progress calls");
+	TEST_CHECK(check_file_text(outname, expected, explen) == 0, "Wrong text saved");
+
+	// saves to the same url coalesce into the last one
+	//
+	memset(states, 0, sizeof(states));
+	for (i = 0; i < 3; i++)
+	{
+		TEST_CHECK(buffer_insert_text(buffer, i, 0, "again ", 6) == 0, "Insert failed");
+		result = buffer_save_async(buffer, outname, buffer->original_encoding, save_callback, &states[i]);
+		TEST_CHECK(result == 0, "Can't start save");
+	}
+	TEST_CHECK(read_buffer_text(buffer, expected, 200000 * 16 + 4096, &explen) == 0, "Can't read buffer");
+	TEST_CHECK(buffer_save_wait(buffer) == 0, "Save failed");
+	TEST_CHECK(states[0].status == saveCancelled || states[0].status == saveDone, "Superseded save in wrong state");
+	TEST_CHECK(states[1].status == saveCancelled || states[1].status == saveDone, "Superseded save in wrong state");
+	TEST_CHECK(states[2].status == saveDone, "Last save didn't finish");
+	TEST_CHECK(check_file_text(outname, expected, explen) == 0, "Wrong text after coalesced saves");
+
+	// a cancelled save leaves the file as it was
+	//
+	memset(states, 0, sizeof(states));
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "cancelled ", 10) == 0, "Insert failed");
+	result = buffer_save_async(buffer, outname, buffer->original_encoding, save_callback, &states[0]);
+	TEST_CHECK(result == 0, "Can't start save");
+	buffer_save_cancel(buffer);
+	TEST_CHECK(buffer_save_wait(buffer) == 0, "Cancelled save failed");
+	TEST_CHECK(states[0].status == saveCancelled || states[0].status == saveDone, "Cancelled save in wrong state");
+	if (states[0].status == saveCancelled)
+	{
+		TEST_CHECK(check_file_text(outname, expected, explen) == 0, "Cancelled save changed file");
+	}
+	// a save that can't be written fails
+	//
+	memset(states, 0, sizeof(states));
+	result = buffer_save_async(buffer, "/nonexistent/dir/file.txt", textASCII, save_callback, &states[0]);
+	TEST_CHECK(result == 0, "Can't start save");
+	TEST_CHECK(buffer_save_wait(buffer) < 0, "Save to bad path didn't fail");
+	TEST_CHECK(states[0].status == saveFailed, "Bad save in wrong state");
+
+	// a failed save that ended before the next one started is reported
+	// when that one starts
+	//
+	memset(states, 0, sizeof(states));
+	result = buffer_save_async(buffer, "/nonexistent/dir/file.txt", textASCII, save_callback, &states[0]);
+	TEST_CHECK(result == 0, "Can't start save");
+	pthread_mutex_lock(&buffer->save_lock);
+	while (! buffer->saves->finished)
+	{
+		pthread_cond_wait(&buffer->save_done, &buffer->save_lock);
+	}
+	pthread_mutex_unlock(&buffer->save_lock);
+	result = buffer_save_async(buffer, outname, buffer->original_encoding, save_callback, &states[1]);
+	TEST_CHECK(result == 1, "Earlier failed save not reported");
+	TEST_CHECK(buffer_save_wait(buffer) == 0, "Save failed");
+	TEST_CHECK(states[1].status == saveDone, "Save after failed one didn't finish");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	filesys_delete(outname);
+	free(expected);
+	return 0;
+}
+
+static int check_syntax_attributes(buffer_t *buffer, size_t line, line_attribute_t expected)
+{
+	line_attribute_t flags = (line_attribute_t)-1;
+
+	if (buffer_select_line(buffer, line) == 0)
+	{
+		flags = buffer->curr_line->attributes & (lineStartsSpanningComment | lineEndsSpanningComment);
+	}
+	return flags == expected;
+}
+
+static int check_syntax_rebuilt(buffer_t *buffer, const syntax_t *syntax)
+{
+	line_attribute_t *states;
+	line_t *line;
+	size_t n;
+	int same;
+
+	// lexing all the lines again must come out the same as the updates did
+	//
+	states = (line_attribute_t*)malloc(buffer->line_count * sizeof(line_attribute_t));
+	TEST_CHECK(states != NULL, "Can't alloc states");
+	TEST_CHECK(buffer_update_syntax(buffer, NULL) == 0, "Update failed");
+	for (n = 0, line = buffer->lines; line; line = line->next, n++)
+	{
+		states[n] = line->attributes;
+	}
+	TEST_CHECK(buffer_set_syntax(buffer, syntax) == 0, "Can't set syntax");
+	TEST_CHECK(buffer_update_syntax(buffer, NULL) == 0, "Update failed");
+	for (same = 1, n = 0, line = buffer->lines; line; line = line->next, n++)
+	{
+		if (line->attributes != states[n])
+		{
+			same = 0;
+		}
+	}
+	free(states);
+	TEST_CHECK(same, "Lexer state differs from a full lex");
+	return 0;
+}
+
+int syntaxtest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	syntax_t syntax;
+	char filename[MAX_PATH];
+	char *text;
+	size_t textlen;
+	size_t relexed;
+	uint8_t state;
+	int i;
+	int result;
+
+	text = (char*)malloc(200000 * 40);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 200000; i++)
+	{
+		switch (i)
+		{
+		case 100:
+			textlen += sprintf(text + textlen, "int a; /* spans\n");
+			break;
+		case 101:
+		case 102:
+		case 104:
+			textlen += sprintf(text + textlen, "commented %d\n", i);
+			break;
+		case 103:
+			textlen += sprintf(text + textlen, "end */ int b; /* opens again\n");
+			break;
+		case 105:
+			textlen += sprintf(text + textlen, "*/\n");
+			break;
+		case 200:
+			textlen += sprintf(text + textlen, "char *s = \"/* not a comment\"; // nor /*\n");
+			break;
+		case 300:
+			textlen += sprintf(text + textlen, "char *t = \"continued \\\n");
+			break;
+		case 301:
+			textlen += sprintf(text + textlen, "/* still the string\";\n");
+			break;
+		default:
+			if (i == 99 || (i > 100000 && (i % 50000) == 99))
+			{
+				textlen += sprintf(text + textlen, "x = %d; /* short */\n", i);
+			}
+			else
+			{
+				textlen += sprintf(text + textlen, "x = %d; // note\n", i);
+			}
+			break;
+		}
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	syntax_init_c(&syntax);
+	TEST_CHECK(buffer_set_syntax(buffer, &syntax) == 0, "Can't set syntax");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed == 200000, "First update didn't lex every line");
+	TEST_CHECK(check_syntax_attributes(buffer, 100, lineStartsSpanningComment), "Comment start not marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 101, 0), "Line inside comment marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 103, lineStartsSpanningComment | lineEndsSpanningComment), "Comment end and start not marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 105, lineEndsSpanningComment), "Comment end not marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 200, 0), "Comment in string marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 301, 0), "Comment in continued string marked");
+	TEST_CHECK(buffer_get_syntax_state(buffer, 102, &state) == 0 && state == lexBlockComment, "Wrong state in comment");
+	TEST_CHECK(buffer_get_syntax_state(buffer, 300, &state) == 0 && state == lexString, "Wrong state in string");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0 && relexed == 0, "Update with no edits lexed lines");
+
+	// typing lexes the line typed in and nothing else
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 150000, 0, "y", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed == 1, "One char edit lexed too many lines");
+	TEST_CHECK(buffer_delete_text(buffer, 150000, 0, 1) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 150000, "int z;\n", 7) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed <= 3, "Line insert lexed too many lines");
+
+	// opening a comment lexes on until it is closed
+	//
+	TEST_CHECK(buffer_delete_text(buffer, 99, 17, 2) == 0, "Delete failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed == 2, "Comment open lexed wrong lines");
+	TEST_CHECK(check_syntax_attributes(buffer, 99, lineStartsSpanningComment), "New comment start not marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 100, 0), "Comment start inside comment marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 103, lineStartsSpanningComment | lineEndsSpanningComment), "Comment end moved");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(check_syntax_attributes(buffer, 99, 0), "Undone comment still marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 100, lineStartsSpanningComment), "Comment start not restored");
+
+	// deleting the line that closes a comment comments out the rest of the file
+	//
+	TEST_CHECK(buffer_delete_lines(buffer, 105, 1) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed == 100098 - 105 + 1, "Unclosed comment didn't lex to where it closes");
+	TEST_CHECK(buffer_get_syntax_state(buffer, 100097, &state) == 0 && state == lexBlockComment, "Lines not commented out");
+	TEST_CHECK(check_syntax_attributes(buffer, 100098, lineEndsSpanningComment), "Comment end not marked");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(check_syntax_rebuilt(buffer, &syntax) == 0, "Undone delete lexed wrong");
+	TEST_CHECK(check_syntax_attributes(buffer, 105, lineEndsSpanningComment), "Comment end not restored");
+
+	// replacing, more edits and undoing them all
+	//
+	TEST_CHECK(buffer_replace_all(buffer, "short", 5, "*/ /*", 5, 0, 0, NULL) == 0, "Replace failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 10, "/*\n", 3) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_update_syntax(buffer, NULL) == 0, "Update failed");
+	TEST_CHECK(buffer_delete_lines(buffer, 5, 20) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_insert_text(buffer, 2, 0, "\"", 1) == 0, "Insert failed");
+	TEST_CHECK(check_syntax_rebuilt(buffer, &syntax) == 0, "Edits lexed wrong");
+	while (buffer_undo(buffer) == 0)
+	{
+		;
+	}
+	TEST_CHECK(check_syntax_rebuilt(buffer, &syntax) == 0, "Undos lexed wrong");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	return 0;
+}
+
+int syntaxthreadtest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	syntax_t syntax;
+	char filename[MAX_PATH];
+	char *text;
+	uint8_t *content;
+	size_t textlen;
+	size_t length;
+	size_t relexed;
+	size_t n;
+	line_attribute_t flags;
+	uint8_t state;
+	int differ;
+	int i;
+	int result;
+
+	// comments and strings spanning the runs of lines each thread gets,
+	// with text in them that lexes differently outside them
+	//
+	text = (char*)malloc(300000 * 40);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	textlen = 0;
+	for (i = 0; i < 300000; i++)
+	{
+		if (i == 50000 || i == 180000)
+		{
+			textlen += sprintf(text + textlen, "x = %d; /* opens\n", i);
+		}
+		else if (i == 150000 || i == 180500)
+		{
+			textlen += sprintf(text + textlen, "closes */ y = %d;\n", i);
+		}
+		else if (i > 50000 && i < 150000)
+		{
+			textlen += sprintf(text + textlen, "in comment \"%d // '\n", i);
+		}
+		else if (i >= 200000 && i < 240000)
+		{
+			textlen += sprintf(text + textlen, "s%d = \"in string /* \\\n", i);
+		}
+		else if (i >= 260000 && i < 275000)
+		{
+			textlen += sprintf(text + textlen, "// line comment %d /* \\\n", i);
+		}
+		else
+		{
+			textlen += sprintf(text + textlen, "x = %d; // note\n", i);
+		}
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	free(text);
+	TEST_CHECK(result == 0, "Can't make buffer");
+
+	syntax_init_c(&syntax);
+	TEST_CHECK(buffer_set_syntax_threads(buffer, 8) == 0, "Can't set threads");
+	TEST_CHECK(buffer_set_syntax(buffer, &syntax) == 0, "Can't set syntax");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(relexed == 300000, "Not every line lexed");
+
+	// must be just what lexing one line after another gets
+	//
+	state = lexNormal;
+	for (n = 0, differ = 0; n < buffer->line_count && ! differ; n++)
+	{
+		TEST_CHECK(buffer_get_line_content(buffer, n, &content, &length) == 0, "Can't get line");
+		state = syntax_lex_line(&syntax, state, content, length, &flags);
+		TEST_CHECK(buffer_select_line(buffer, n) == 0, "Can't select line");
+		differ = (buffer->curr_line->attributes & (lineSyntaxValid | lineStartsSpanningComment | lineEndsSpanningComment))
+				!= (lineSyntaxValid | flags)
+			||  LINE_SYNTAX_STATE(buffer->curr_line->attributes) != state;
+	}
+	TEST_CHECK(! differ, "Threaded lexing differs from serial");
+	TEST_CHECK(check_syntax_attributes(buffer, 50000, lineStartsSpanningComment), "Comment start not marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 100000, 0), "Line in comment marked");
+	TEST_CHECK(check_syntax_attributes(buffer, 150000, lineEndsSpanningComment), "Comment end not marked");
+
+	// and edits after go on from there
+	//
+	TEST_CHECK(buffer_delete_lines(buffer, 150000, 1) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_update_syntax(buffer, &relexed) == 0, "Update failed");
+	TEST_CHECK(check_syntax_attributes(buffer, 180499, lineEndsSpanningComment), "Comment end not moved");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(buffer_set_syntax_threads(buffer, 1) == 0, "Can't set threads");
+	TEST_CHECK(check_syntax_rebuilt(buffer, &syntax) == 0, "Serial lexing differs");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	return 0;
+}
+
+static int check_column_positions(buffer_t *buffer, size_t line, size_t shift)
+{
+	// each repeat of "\tab<wide><2 byte><3 byte>\t" is 7 chars, 16 columns, 12 bytes
+	//
+	static const size_t display[7] = { 0, 8, 9, 10, 12, 13, 14 };
+	static const size_t offset[7] = { 0, 1, 2, 3, 6, 8, 11 };
+	column_position_t pos;
+	size_t k;
+	size_t j;
+	int i;
+
+	for (i = 0; i < 200; i++)
+	{
+		k = 1 + (i * 997) % 39999;
+		j = i % 7;
+		TEST_CHECK(buffer_line_position(buffer, line, columnChars, shift + 7 * k + j, &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.display == 16 * k + display[j] && pos.offset == shift + 12 * k + offset[j], "Wrong position of char");
+		TEST_CHECK(buffer_line_position(buffer, line, columnDisplay, 16 * k + display[j], &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.chars == shift + 7 * k + j, "Wrong char at column");
+		TEST_CHECK(buffer_line_position(buffer, line, columnBytes, shift + 12 * k + offset[j], &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.chars == shift + 7 * k + j, "Wrong char at offset");
+
+		// inside a tab, a wide char and a multibyte char
+		//
+		TEST_CHECK(buffer_line_position(buffer, line, columnDisplay, 16 * k + 3, &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.chars == shift + 7 * k && pos.display == 16 * k, "Wrong char inside tab");
+		TEST_CHECK(buffer_line_position(buffer, line, columnDisplay, 16 * k + 11, &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.chars == shift + 7 * k + 3, "Wrong char inside wide char");
+		TEST_CHECK(buffer_line_position(buffer, line, columnBytes, shift + 12 * k + 7, &pos) == 0, "Lookup failed");
+		TEST_CHECK(pos.chars == shift + 7 * k + 4 && pos.offset == shift + 12 * k + 6, "Wrong char inside utf-8");
+	}
+	TEST_CHECK(buffer_line_position(buffer, line, columnChars, 1000000000, &pos) == 0, "Lookup failed");
+	TEST_CHECK(pos.chars == shift + 280000 && pos.offset == shift + 480000 && pos.display == 640000, "Wrong end of line");
+	return 0;
+}
+
+int columntest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	column_position_t pos;
+	char filename[MAX_PATH];
+	char *text;
+	uint8_t *encoded;
+	size_t textlen;
+	size_t enclen;
+	int i;
+	int result;
+
+	text = (char*)malloc(40000 * 12 + 64);
+	encoded = (uint8_t*)malloc(40000 * 12 * 2 + 64);
+	TEST_CHECK(text && encoded, "Can't alloc text");
+	textlen = sprintf(text, "\xEF\xBB\xBF");
+	for (i = 0; i < 40000; i++)
+	{
+		textlen += sprintf(text + textlen, "\tab\xE4\xB8\xAD\xC3\xA9\xE2\x82\xAC\t");
+	}
+	textlen += sprintf(text + textlen, "\nab\tline\n");
+
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->original_encoding == textUTF8, "Expected utf-8");
+
+	// a long line in the file gets indexed as it is looked up
+	//
+	TEST_CHECK(check_column_positions(buffer, 0, 0) == 0, "Wrong positions in file");
+	TEST_CHECK(buffer->columns != NULL && buffer->columns->count > 200, "Long line not indexed");
+	TEST_CHECK(buffer->columns->count <= 280000 / COLUMN_CHECKPOINT_CHARS + 1, "Too many checkpoints");
+	TEST_CHECK(buffer_line_position(buffer, 1, columnChars, 3, &pos) == 0, "Lookup failed");
+	TEST_CHECK(pos.display == 8 && pos.offset == 3, "Wrong position in short line");
+	TEST_CHECK(buffer->columns->next == NULL, "Short line indexed");
+
+	// editing the line drops its index
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "x", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer->columns == NULL, "Index kept after edit");
+	TEST_CHECK(check_column_positions(buffer, 0, 1) == 0, "Wrong positions in memory");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(check_column_positions(buffer, 0, 0) == 0, "Wrong positions after undo");
+
+	// tab width
+	//
+	TEST_CHECK(buffer_set_tab_width(buffer, 4) == 0, "Can't set tab width");
+	TEST_CHECK(buffer_line_position(buffer, 1, columnDisplay, 4, &pos) == 0, "Lookup failed");
+	TEST_CHECK(pos.chars == 3, "Wrong char with tab width 4");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// the same in a ucs-2 file
+	//
+	encoded[0] = 0xFF;
+	encoded[1] = 0xFE;
+	enclen = 2 + buffer_encode_text(textUCS2LE, (uint8_t*)text + 3, textlen - 3, encoded + 2);
+	result = make_buffer_with_text((char*)encoded, enclen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->original_encoding == textUCS2LE, "Expected ucs-2");
+	TEST_CHECK(check_column_positions(buffer, 0, 0) == 0, "Wrong positions in ucs-2 file");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	free(text);
+	free(encoded);
+	return 0;
+}
+
+static int read_buffer_slices(buffer_t *buffer, char *text, size_t size, size_t *textlen)
+{
+	uint8_t *content;
+	uint64_t offset;
+	size_t length;
+	size_t linenum;
+	int result;
+
+	*textlen = 0;
+	for (linenum = 0; linenum < buffer->line_count; linenum++)
+	{
+		for (offset = 0; ; offset += length)
+		{
+			result = buffer_get_line_slice(buffer, linenum, offset, &content, &length);
+			TEST_CHECK(result == 0, "Can't get slice");
+			TEST_CHECK(length <= buffer->vbuf_size, "Slice larger than vbuf");
+			if (! length)
+			{
+				break;
+			}
+			TEST_CHECK(*textlen + length <= size, "Buffer too large");
+			memcpy(text + *textlen, content, length);
+			*textlen += length;
+		}
+	}
+	return 0;
+}
+
+static int check_slices_text(buffer_t *buffer, const char *expect, size_t explen)
+{
+	char *text;
+	size_t textlen;
+	int result;
+
+	text = (char*)malloc(explen + 64);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	result = read_buffer_slices(buffer, text, explen + 64, &textlen);
+	if (! result && (textlen != explen || memcmp(text, expect, explen)))
+	{
+		butil_log(0, "FAIL: %s:%d Slices don't match text\n", __FUNCTION__, __LINE__);
+		result = -1;
+	}
+	free(text);
+	return result;
+}
+
+static void splice_expect(char *expect, size_t *explen, size_t at, size_t count, const char *text, size_t length)
+{
+	memmove(expect + at + length, expect + at + count, *explen - at - count);
+	memcpy(expect + at, text, length);
+	*explen = *explen - count + length;
+}
+
+int slicetest()
+{
+	buffer_t *buffer;
+	buffer_snapshot_t *snapshot;
+	file_t *file;
+	file_t *outfile;
+	char filename[MAX_PATH];
+	char outname[MAX_PATH];
+	char *text;
+	char *expect;
+	char *before;
+	char needle[16];
+	uint8_t *content;
+	const line_pieces_t *pieces;
+	size_t textlen;
+	size_t explen;
+	size_t beforelen;
+	size_t length;
+	size_t start;
+	size_t line;
+	size_t column;
+	int moves;
+	int i;
+	int result;
+
+	// a line far longer than vbuf, between two short ones
+	//
+	text = (char*)malloc(200000);
+	expect = (char*)malloc(200000);
+	before = (char*)malloc(200000);
+	TEST_CHECK(text && expect && before, "Can't alloc text");
+	textlen = sprintf(text, "first line\n");
+	start = textlen;
+	for (i = 0; i < 20000; i++)
+	{
+		textlen += sprintf(text + textlen, "%05d,", i);
+	}
+	textlen += sprintf(text + textlen, "\nlast line\n");
+	memcpy(expect, text, textlen);
+	explen = textlen;
+
+	result = make_buffer_with_text(text, textlen, 4096, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer->line_count == 3, "Expected 3 lines");
+	TEST_CHECK(buffer_get_line_content(buffer, 1, &content, &length) != 0, "Long line fit in vbuf");
+	TEST_CHECK(check_slices_text(buffer, expect, explen) == 0, "Wrong slices of file");
+
+	// edits in the long line only keep what they add
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 1, 50000, "NEEDLE", 6) == 0, "Insert failed");
+	splice_expect(expect, &explen, start + 50000, 0, "NEEDLE", 6);
+	TEST_CHECK(buffer_select_line(buffer, 1) == 0, "Can't select line");
+	TEST_CHECK(buffer->curr_line->location == lineInPieces, "Long line not in pieces");
+	TEST_CHECK(buffer->curr_line->position.pieces->text_length == 6, "Pieces hold more than the insert");
+	TEST_CHECK(check_slices_text(buffer, expect, explen) == 0, "Wrong slices after insert");
+
+	TEST_CHECK(buffer_delete_text(buffer, 1, 49998, 4) == 0, "Delete failed");
+	splice_expect(expect, &explen, start + 49998, 4, "", 0);
+	TEST_CHECK(buffer_insert_text(buffer, 1, 0, "<", 1) == 0, "Insert at start failed");
+	splice_expect(expect, &explen, start, 0, "<", 1);
+	TEST_CHECK(buffer_insert_text(buffer, 1, 120003, ">", 1) == 0, "Insert at end failed");
+	splice_expect(expect, &explen, start + 120003, 0, ">", 1);
+	TEST_CHECK(buffer_delete_text(buffer, 1, 90000, 20000) == 0, "Long delete failed");
+	splice_expect(expect, &explen, start + 90000, 20000, "", 0);
+	TEST_CHECK(check_slices_text(buffer, expect, explen) == 0, "Wrong slices after edits");
+	TEST_CHECK(buffer_select_line(buffer, 1) == 0, "Can't select line");
+	TEST_CHECK(buffer->curr_line->location == lineInPieces, "Long line not in pieces");
+	TEST_CHECK(buffer->curr_line->position.pieces->count == 7, "Wrong count of pieces");
+	TEST_CHECK(buffer_delete_text(buffer, 1, 200000, 1) != 0, "Delete past end of line");
+
+	// find a needle straddling the file and inserted text, both ways
+	//
+	memcpy(needle, expect + start + 49995, 8);
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, needle, 8, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find needle");
+	TEST_CHECK(line == 1 && column == 49995, "Wrong position for needle");
+	line = 2;
+	column = 0;
+	result = buffer_find_prev(buffer, needle, 8, 0, &line, &column);
+	TEST_CHECK(result == 0, "Didn't find needle backward");
+	TEST_CHECK(line == 1 && column == 49995, "Wrong position for needle backward");
+
+	// typing mostly edits the pieces in place, growing them now and then
+	//
+	TEST_CHECK(buffer_select_line(buffer, 1) == 0, "Can't select line");
+	pieces = buffer->curr_line->position.pieces;
+	moves = 0;
+	for (i = 0; i < 1000; i++)
+	{
+		TEST_CHECK(buffer_insert_text(buffer, 1, 60000 + i, "abcdefghij" + (i % 10), 1) == 0, "Typing failed");
+		splice_expect(expect, &explen, start + 60000 + i, 0, "abcdefghij" + (i % 10), 1);
+		TEST_CHECK(buffer_select_line(buffer, 1) == 0, "Can't select line");
+		if (buffer->curr_line->position.pieces != pieces)
+		{
+			pieces = buffer->curr_line->position.pieces;
+			moves++;
+		}
+	}
+	TEST_CHECK(moves < 20, "Pieces reallocated for most edits");
+	TEST_CHECK(check_slices_text(buffer, expect, explen) == 0, "Wrong slices after typing");
+
+	// a snapshot keeps the pieces as they were
+	//
+	memcpy(before, expect, explen);
+	beforelen = explen;
+	snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(snapshot != NULL, "Can't take snapshot");
+	TEST_CHECK(buffer_insert_text(buffer, 1, 10, "later", 5) == 0, "Insert failed");
+	splice_expect(expect, &explen, start + 10, 0, "later", 5);
+	result = read_snapshot_text(snapshot, text, 200000, &textlen);
+	TEST_CHECK(result == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == beforelen && ! memcmp(text, before, beforelen), "Snapshot changed");
+	buffer_snapshot_release(snapshot);
+
+	// written out whole
+	//
+	result = create_temp_file(&outfile, outname, sizeof(outname));
+	TEST_CHECK(result == 0, "Can't make out temp file");
+	TEST_CHECK(buffer_write(buffer, outfile, buffer->original_encoding) == 0, "Can't write buffer");
+	file_destroy(outfile);
+	outfile = file_create(outname, openForRead);
+	TEST_CHECK(outfile != NULL, "Can't open out file");
+	textlen = 0;
+	while ((result = outfile->file_read(outfile, (uint8_t*)text + textlen, 200000 - textlen)) > 0)
+	{
+		textlen += result;
+	}
+	file_destroy(outfile);
+	filesys_delete(outname);
+	TEST_CHECK(textlen == explen && ! memcmp(text, expect, explen), "Wrong text written");
+
+	// undo all the way back to the file, and redo
+	//
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Undo failed");
+	textlen = sprintf(text, "first line\n");
+	for (i = 0; i < 20000; i++)
+	{
+		textlen += sprintf(text + textlen, "%05d,", i);
+	}
+	textlen += sprintf(text + textlen, "\nlast line\n");
+	TEST_CHECK(check_slices_text(buffer, text, textlen) == 0, "Wrong slices after undo");
+	while ((result = buffer_redo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Redo failed");
+	TEST_CHECK(check_slices_text(buffer, expect, explen) == 0, "Wrong slices after redo");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	free(text);
+	free(expect);
+	free(before);
+	return 0;
+}
+
+static int check_line_offsets(buffer_t *buffer)
+{
+	uint8_t *content;
+	uint64_t expect;
+	uint64_t offset;
+	size_t length;
+	size_t linenum;
+	size_t line;
+	size_t column;
+	int result;
+
+	// every line, and every few offsets, against the lines walked in order
+	//
+	for (linenum = 0, expect = 0; linenum < buffer->line_count; linenum++)
+	{
+		result = buffer_offset_from_line(buffer, linenum, &offset);
+		TEST_CHECK(result == 0, "Can't get offset of line");
+		TEST_CHECK(offset == expect, "Wrong offset of line");
+		result = buffer_get_line_content(buffer, linenum, &content, &length);
+		TEST_CHECK(result == 0, "Can't get line");
+		if (length > 2)
+		{
+			result = buffer_line_from_offset(buffer, expect + length - 2, &line, &column);
+			TEST_CHECK(result == 0, "Can't get line of offset");
+			TEST_CHECK(line == linenum && column == length - 2, "Wrong line of offset");
+		}
+		result = buffer_line_from_offset(buffer, expect, &line, &column);
+		TEST_CHECK(result == 0, "Can't get line of offset");
+		TEST_CHECK(line == linenum && column == 0, "Wrong line of line start");
+		expect += length;
+	}
+	result = buffer_offset_from_line(buffer, buffer->line_count, &offset);
+	TEST_CHECK(result == 0 && offset == expect, "Wrong offset of end");
+	TEST_CHECK(buffer_line_from_offset(buffer, expect, &line, &column) != 0, "Found line past end");
+	return 0;
+}
+
+int offsettest()
+{
+	buffer_t *buffer;
+	file_t *file;
+	file_t *outfile;
+	char filename[MAX_PATH];
+	char outname[MAX_PATH];
+	char *text;
+	uint64_t offset;
+	size_t textlen;
+	size_t line;
+	size_t column;
+	int i;
+	int result;
+
+	text = (char*)malloc(5000 * 40);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	for (i = 0, textlen = 0; i < 5000; i++)
+	{
+		textlen += sprintf(text + textlen, "line %d %.*s\n", i, i % 17, "abcdefghijklmnopq");
+	}
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets in file");
+	TEST_CHECK(buffer_line_from_offset(buffer, textlen - 1, &line, &column) == 0, "Can't find last byte");
+	TEST_CHECK(line == 4999, "Wrong line of last byte");
+
+	// edits move the offsets of every line after them
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 1000, 3, "inserted", 8) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 3000, 0, 4) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 0, "new first\nnew second\n", 21) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_insert_lines(buffer, 2500, "middle\n", 7) == 0, "Insert lines failed");
+	TEST_CHECK(buffer_delete_lines(buffer, 200, 700) == 0, "Delete lines failed");
+	TEST_CHECK(buffer_delete_lines(buffer, 0, 1) == 0, "Delete first line failed");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets after edits");
+
+	// a block growing too large has the index built again
+	//
+	for (i = 0; i < 1200; i++)
+	{
+		TEST_CHECK(buffer_insert_lines(buffer, 1000, "grown\n", 6) == 0, "Insert lines failed");
+	}
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets after growth");
+
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		TEST_CHECK(buffer_line_from_offset(buffer, 0, &line, &column) == 0 && line == 0, "Can't find start");
+	}
+	TEST_CHECK(result == 1, "Undo failed");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets after undo");
+	while ((result = buffer_redo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Redo failed");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets after redo");
+
+	TEST_CHECK(buffer_delete_lines(buffer, 0, buffer->line_count) == 0, "Delete all failed");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets of empty buffer");
+	TEST_CHECK(buffer_insert_lines(buffer, 0, "only\n", 5) == 0, "Insert lines failed");
+	TEST_CHECK(check_line_offsets(buffer) == 0, "Wrong offsets of one line");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+
+	// a line edited in a ucs-2 file counts as the code units it'd be written as
+	//
+	textlen = 2 + buffer_encode_text(textUCS2LE, (uint8_t*)"abc", 3, (uint8_t*)text + 2);
+	text[0] = (char)0xFF;
+	text[1] = (char)0xFE;
+	result = make_buffer_with_text(text, textlen, 0, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer_insert_text(buffer, 0, 1, "\xC3\xA9\xE2\x82\xAC", 5) == 0, "Insert failed");
+	TEST_CHECK(buffer_offset_from_line(buffer, 1, &offset) == 0, "Can't get offset of end");
+	TEST_CHECK(offset == 10, "Wrong offset after ucs-2 line");
+	TEST_CHECK(buffer_line_from_offset(buffer, 9, &line, &column) == 0, "Can't get line of offset");
+	TEST_CHECK(line == 0 && column == 9, "Wrong line of offset in ucs-2");
+
+	// and is saved from its utf-8 to another encoding as it is, not decoded twice
+	//
+	TEST_CHECK(create_temp_file(&outfile, outname, sizeof(outname)) == 0, "Can't make out file");
+	TEST_CHECK(buffer_write(buffer, outfile, textUTF8) == 0, "Can't save as utf-8");
+	file_destroy(outfile);
+	TEST_CHECK(check_file_text(outname, "\xEF\xBB\xBF" "a\xC3\xA9\xE2\x82\xAC" "bc", 11) == 0, "Wrong utf-8 text saved");
+	filesys_delete(outname);
+
+	TEST_CHECK(create_temp_file(&outfile, outname, sizeof(outname)) == 0, "Can't make out file");
+	TEST_CHECK(buffer_write(buffer, outfile, textUCS2BE) == 0, "Can't save as ucs-2 be");
+	file_destroy(outfile);
+	TEST_CHECK(check_file_text(outname, "\xFE\xFF\0a\0\xE9\x20\xAC\0b\0c", 12) == 0, "Wrong ucs-2 be text saved");
+	filesys_delete(outname);
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	free(text);
+	return 0;
+}
+
+/// \brief Get where a line is kept
+///
+static int line_location(buffer_t *buffer, size_t line)
+{
+	if (buffer_select_line(buffer, line))
+	{
+		return -1;
+	}
+	return (int)buffer->curr_line->location;
+}
+
+int memorytest()
+{
+	buffer_t *buffer;
+	buffer_snapshot_t *snapshot;
+	file_t *file;
+	char filename[MAX_PATH];
+	char *text;
+	char *check;
+	size_t textlen;
+	size_t checklen;
+	size_t released;
+	memory_usage_t usage;
+	memory_usage_t all;
+	int i;
+	int result;
+
+	text = (char*)malloc(2000 * 16);
+	check = (char*)malloc(2000 * 16 + 64);
+	TEST_CHECK(text != NULL && check != NULL, "Can't alloc text");
+	for (i = 0, textlen = 0; i < 2000; i++)
+	{
+		textlen += sprintf(text + textlen, "line %d\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 4096, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.vbufs == 4096 && usage.lines == 0, "Wrong usage of file just read");
+
+	// lines edited back to what they were, at the start, alone and in a
+	// run, and one line that stays changed
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 0, 0, "x", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 0, 0, 1) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_text(buffer, 10, 4, "xyz", 3) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 10, 4, 3) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_text(buffer, 11, 0, "y", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 20, 0, 5) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_text(buffer, 20, 0, "line ", 5) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 21, 0, 5) == 0, "Delete failed");
+	TEST_CHECK(buffer_insert_text(buffer, 21, 0, "line ", 5) == 0, "Insert failed");
+	TEST_CHECK(check_line_text(buffer, 11, "yline 11\n") == 0, "Wrong edited line");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.lines == 8 + 9 + 10 + 9 + 9, "Wrong usage of edited lines");
+	TEST_CHECK(usage.sandboxes > 0, "No sandbox used");
+	TEST_CHECK(line_location(buffer, 10) == lineInMemory, "Edited line not in memory");
+
+	memory_get_usage(&all);
+	TEST_CHECK(all.vbufs >= usage.vbufs && all.lines >= usage.lines, "Wrong usage of all buffers");
+	TEST_CHECK(all.total >= usage.total, "Wrong total of all buffers");
+
+	// trimming leaves only the changed line in memory
+	//
+	released = buffer_trim_memory(buffer, true);
+	TEST_CHECK(released == usage.vbufs + usage.sandboxes + usage.lines - 10, "Wrong memory given back");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.vbufs == 0 && usage.sandboxes == 0 && usage.lines == 10, "Wrong usage after trim");
+	TEST_CHECK(line_location(buffer, 0) == lineInFile, "First line not back in file");
+	TEST_CHECK(line_location(buffer, 10) == lineInFile, "Line not back in file");
+	TEST_CHECK(line_location(buffer, 11) == lineInMemory, "Changed line not in memory");
+	TEST_CHECK(line_location(buffer, 20) == lineInFile, "Line in run not back in file");
+	TEST_CHECK(line_location(buffer, 21) == lineInFile, "Line in run not back in file");
+
+	// the vbuf comes back when needed, and the edits still undo
+	//
+	TEST_CHECK(read_buffer_text(buffer, check, 2000 * 16 + 64, &checklen) == 0, "Can't read buffer");
+	TEST_CHECK(checklen == textlen + 1 && ! memcmp(check + 78, "yline 11\n", 9), "Wrong text after trim");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0 && usage.vbufs == 4096, "Vbuf not allocated again");
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Undo failed");
+	TEST_CHECK(read_buffer_text(buffer, check, 2000 * 16 + 64, &checklen) == 0, "Can't read buffer");
+	TEST_CHECK(checklen == textlen && ! memcmp(check, text, textlen), "Wrong text after undo");
+	while ((result = buffer_redo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Redo failed");
+	TEST_CHECK(check_line_text(buffer, 11, "yline 11\n") == 0, "Wrong line after redo");
+	TEST_CHECK(check_line_text(buffer, 21, "line 21\n") == 0, "Wrong line after redo");
+
+	// lines a snapshot may be reading stay as they are
+	//
+	snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(snapshot != NULL, "Can't snapshot");
+	TEST_CHECK(buffer_insert_text(buffer, 40, 0, "z", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 40, 0, 1) == 0, "Delete failed");
+	buffer_trim_memory(buffer, false);
+	TEST_CHECK(line_location(buffer, 40) == lineInMemory, "Line of snapshot trimmed");
+	buffer_snapshot_release(snapshot);
+	buffer_trim_memory(buffer, false);
+	TEST_CHECK(line_location(buffer, 40) == lineInFile, "Line not back in file");
+
+	// a buffer over budget trims itself after an edit, but keeps its vbuf
+	//
+	memory_set_budget(1);
+	TEST_CHECK(memory_get_budget() == 1, "Wrong budget");
+	TEST_CHECK(buffer_insert_text(buffer, 50, 0, "z", 1) == 0, "Insert failed");
+	TEST_CHECK(buffer_delete_text(buffer, 50, 0, 1) == 0, "Delete failed");
+	TEST_CHECK(line_location(buffer, 50) == lineInMemory, "Trimmed again without growing");
+	TEST_CHECK(buffer_insert_text(buffer, 60, 0, "z", 1) == 0, "Insert failed");
+	TEST_CHECK(line_location(buffer, 50) == lineInFile, "Line not trimmed over budget");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.vbufs == 4096 && usage.sandboxes == 0, "Wrong usage over budget");
+	memory_set_budget(0);
+
+	// reading the file again frees the old lines, keeping them for a snapshot
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 70, 0, "z", 1) == 0, "Insert failed");
+	TEST_CHECK(read_buffer_text(buffer, check, 2000 * 16 + 64, &checklen) == 0, "Can't read buffer");
+	snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(snapshot != NULL, "Can't snapshot");
+	released = buffer->versions.nburied;
+	TEST_CHECK(buffer_read(buffer) == 0, "Can't read again");
+	TEST_CHECK(buffer->versions.nburied >= released + 2000, "Old lines not freed");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0 && usage.lines == 0, "Wrong usage read again");
+	TEST_CHECK(check_line_text(buffer, 70, "line 70\n") == 0, "Wrong line read again");
+	result = read_snapshot_text(snapshot, text, 2000 * 16, &textlen);
+	TEST_CHECK(result == 0, "Can't read snapshot");
+	TEST_CHECK(textlen == checklen && ! memcmp(text, check, checklen), "Snapshot changed by reading again");
+	buffer_snapshot_release(snapshot);
+
+	memory_get_usage(&all);
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	memory_get_usage(&usage);
+	TEST_CHECK(usage.vbufs == all.vbufs - 4096, "Destroyed buffer still counted");
+	free(check);
+	free(text);
+	return 0;
+}
+
+int packtest()
+{
+	buffer_t *buffer;
+	buffer_snapshot_t *snapshot;
+	file_t *file;
+	file_t *outfile;
+	char filename[MAX_PATH];
+	char outname[MAX_PATH];
+	char *text;
+	char *expect;
+	char *check;
+	uint8_t *content;
+	uint8_t *packed;
+	size_t textlen;
+	size_t explen;
+	size_t checklen;
+	size_t length;
+	size_t replaced;
+	size_t saved;
+	size_t line;
+	size_t column;
+	memory_usage_t before;
+	memory_usage_t usage;
+	memory_usage_t unpacked;
+	uint32_t seed;
+	int i;
+	int result;
+
+	text = (char*)malloc(3000 * 64);
+	expect = (char*)malloc(3000 * 64);
+	check = (char*)malloc(3000 * 64);
+	packed = (uint8_t*)malloc(3000 * 64);
+	TEST_CHECK(text && expect && check && packed, "Can't alloc text");
+
+	// the codec round trips text, runs and bytes that don't compress
+	//
+	for (i = 0, textlen = 0; i < 1000; i++)
+	{
+		textlen += sprintf(text + textlen, "%d the quick brown fox\n", i);
+	}
+	memset(text + textlen, 'a', 1000);
+	textlen += 1000;
+	length = pack_compress((uint8_t*)text, textlen, packed, textlen);
+	TEST_CHECK(length > 0 && length < textlen / 2, "Text didn't compress");
+	result = pack_decompress(packed, length, (uint8_t*)check, textlen);
+	TEST_CHECK(result == (int)textlen && ! memcmp(check, text, textlen), "Text didn't round trip");
+	TEST_CHECK(pack_decompress(packed, length, (uint8_t*)check, textlen - 1) < 0, "Decompressed past room");
+	for (i = 0, textlen = 4096, seed = 1; i < (int)textlen; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		text[i] = (char)(seed >> 16);
+	}
+	TEST_CHECK(pack_compress((uint8_t*)text, textlen, packed, textlen - textlen / 8) == 0, "Noise compressed");
+	length = pack_compress((uint8_t*)text, textlen, packed, textlen * 2);
+	TEST_CHECK(length > 0, "Noise didn't fit");
+	result = pack_decompress(packed, length, (uint8_t*)check, textlen);
+	TEST_CHECK(result == (int)textlen && ! memcmp(check, text, textlen), "Noise didn't round trip");
+
+	// a buffer with every line edited
+	//
+	for (i = 0, textlen = 0; i < 3000; i++)
+	{
+		textlen += sprintf(text + textlen, "line %d of the file being packed\n", i);
+	}
+	result = make_buffer_with_text(text, textlen, 65536, &buffer, &file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't make buffer");
+	TEST_CHECK(buffer_set_line_packing(buffer, true) == 0, "Can't set packing");
+	result = buffer_replace_all(buffer, "line", 4, "LINE", 4, 0, 1, &replaced);
+	TEST_CHECK(result == 0 && replaced == 3000, "Replace failed");
+	for (i = 0, explen = 0; i < 3000; i++)
+	{
+		explen += sprintf(expect + explen, "LINE %d of the file being packed\n", i);
+	}
+	TEST_CHECK(line_location(buffer, 100) == lineInMemory, "Replaced line not in memory");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &before) == 0, "Can't get usage");
+
+	// packed into blocks, holding less
+	//
+	TEST_CHECK(buffer_pack_lines(buffer, &saved) == 0, "Can't pack");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(saved > 0 && usage.lines == before.lines - saved, "Wrong memory saved");
+	TEST_CHECK(usage.lines < before.lines / 2, "Lines didn't pack well");
+	TEST_CHECK(line_location(buffer, 100) == lineInBlock, "Line not packed");
+	TEST_CHECK(line_location(buffer, 2999) == lineInBlock, "Last line not packed");
+
+	// searched and written without unpacking
+	//
+	line = 0;
+	column = 0;
+	result = buffer_find(buffer, "LINE 2500 ", 10, 0, &line, &column);
+	TEST_CHECK(result == 0 && line == 2500 && column == 0, "Didn't find in packed line");
+	result = buffer_find_prev(buffer, "LINE 1200 ", 10, 0, &line, &column);
+	TEST_CHECK(result == 0 && line == 1200 && column == 0, "Didn't find packed line backward");
+	result = create_temp_file(&outfile, outname, sizeof(outname));
+	TEST_CHECK(result == 0, "Can't make out temp file");
+	TEST_CHECK(buffer_write(buffer, outfile, buffer->original_encoding) == 0, "Can't write buffer");
+	file_destroy(outfile);
+	outfile = file_create(outname, openForRead);
+	TEST_CHECK(outfile != NULL, "Can't open out file");
+	checklen = 0;
+	while ((result = outfile->file_read(outfile, (uint8_t*)check + checklen, 3000 * 64 - checklen)) > 0)
+	{
+		checklen += result;
+	}
+	file_destroy(outfile);
+	filesys_delete(outname);
+	TEST_CHECK(checklen == explen && ! memcmp(check, expect, explen), "Wrong text written");
+	TEST_CHECK(line_location(buffer, 2500) == lineInBlock, "Line unpacked by reading");
+
+	// getting a line's content unpacks its block, and keeps it out of the next pass
+	//
+	TEST_CHECK(buffer_get_line_content(buffer, 100, &content, &length) == 0, "Can't get line");
+	TEST_CHECK(length == 34 && ! memcmp(content, "LINE 100 of the file being packed\n", 34), "Wrong packed line");
+	TEST_CHECK(line_location(buffer, 100) == lineInMemory, "Block not unpacked");
+	TEST_CHECK(line_location(buffer, 2999) == lineInBlock, "Other block unpacked");
+	TEST_CHECK(buffer_pack_lines(buffer, &saved) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 100) == lineInMemory, "Used line packed");
+	TEST_CHECK(line_location(buffer, 99) == lineInBlock, "Line near used one not packed again");
+
+	// edits and undo through packed lines
+	//
+	TEST_CHECK(buffer_insert_text(buffer, 1500, 0, "x", 1) == 0, "Insert failed");
+	TEST_CHECK(check_line_text(buffer, 1500, "xLINE 1500 of the file being packed\n") == 0, "Wrong edited line");
+	TEST_CHECK(buffer_delete_lines(buffer, 1600, 2) == 0, "Delete failed");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	while ((result = buffer_undo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Undo failed");
+	TEST_CHECK(read_buffer_text(buffer, check, 3000 * 64, &checklen) == 0, "Can't read buffer");
+	TEST_CHECK(checklen == textlen && ! memcmp(check, text, textlen), "Wrong text after undo");
+	while ((result = buffer_redo(buffer)) == 0)
+	{
+		;
+	}
+	TEST_CHECK(result == 1, "Redo failed");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 10) == lineInBlock, "Line not packed after redo");
+	TEST_CHECK(check_line_text(buffer, 1500, "xLINE 1500 of the file being packed\n") == 0, "Wrong line after redo");
+	TEST_CHECK(check_line_text(buffer, 1600, "LINE 1602 of the file being packed\n") == 0, "Wrong line after redo");
+
+	// a snapshot unpacks every line, and none are packed while it is open
+	//
+	snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(snapshot != NULL, "Can't snapshot");
+	TEST_CHECK(line_location(buffer, 10) == lineInMemory, "Line packed under snapshot");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 10) == lineInMemory, "Line packed under snapshot");
+	buffer_snapshot_release(snapshot);
+
+	// lines undo brings back while a snapshot is open are unpacked too, so
+	// they're held at full size until packed again once it's released
+	//
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 1001) == lineInBlock, "Line not packed");
+	TEST_CHECK(buffer_delete_lines(buffer, 1000, 1000) == 0, "Delete failed");
+	snapshot = buffer_snapshot(buffer);
+	TEST_CHECK(snapshot != NULL, "Can't snapshot");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(buffer_undo(buffer) == 0, "Undo failed");
+	TEST_CHECK(line_location(buffer, 1001) == lineInMemory, "Line packed under snapshot");
+	TEST_CHECK(check_line_text(buffer, 1500, "xLINE 1500 of the file being packed\n") == 0, "Wrong line after undo");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &unpacked) == 0, "Can't get usage");
+	TEST_CHECK(unpacked.lines > usage.lines, "Undone lines not unpacked");
+	buffer_snapshot_release(snapshot);
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 1001) == lineInBlock, "Undone line not packed again");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.lines < unpacked.lines, "Undone lines not packed again");
+
+	// turning packing off unpacks everything
+	//
+	TEST_CHECK(buffer_pack_lines(buffer, NULL) == 0, "Can't pack");
+	TEST_CHECK(line_location(buffer, 10) == lineInBlock, "Line not packed");
+	TEST_CHECK(buffer_set_line_packing(buffer, false) == 0, "Can't set packing");
+	TEST_CHECK(line_location(buffer, 10) == lineInMemory, "Line still packed");
+	TEST_CHECK(buffer_get_memory_usage(buffer, &usage) == 0, "Can't get usage");
+	TEST_CHECK(usage.lines >= before.lines - 2 * 35, "Wrong usage unpacked");
+
+	buffer_destroy(buffer);
+	file_destroy(file);
+	filesys_delete(filename);
+	free(packed);
+	free(check);
+	free(expect);
+	free(text);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	
+	butil_set_log_level(5);
+
+	if (httpbuffertest())
+	{
+		return -1;
+	}
+	if (ftpbuffertest())
+	{
+		return -1;
+	}
+	if (buffertest())
+	{
+		return -1;
+	}
+	if (unicodetest())
+	{
+		return 1;
+	}
+	if (findtest())
+	{
+		return 1;
+	}
+	if (regextest())
+	{
+		return 1;
+	}
+	if (replacetest())
+	{
+		return 1;
+	}
+	if (trigramtest())
+	{
+		return 1;
+	}
+	if (greptest())
+	{
+		return 1;
+	}
+	if (undotest())
+	{
+		return 1;
+	}
+	if (journaltest())
+	{
+		return 1;
+	}
+	if (snapshottest())
+	{
+		return 1;
+	}
+	if (savetest())
+	{
+		return 1;
+	}
+	if (syntaxtest())
+	{
+		return 1;
+	}
+	if (syntaxthreadtest())
+	{
+		return 1;
+	}
+	if (columntest())
+	{
+		return 1;
+	}
+	if (slicetest())
+	{
+		return 1;
+	}
+	if (offsettest())
+	{
+		return 1;
+	}
+	if (memorytest())
+	{
+		return 1;
+	}
+	if (packtest())
 	{
 		return 1;
 	}
@@ -0,0 +1,481 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bcolumn.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// Bytes of file read at once when walking a line in the file
+#define COLUMN_WINDOW				(64*1024)
+
+/// Walks the characters of a line
+///
+typedef struct tag_column_walker
+{
+	buffer_t	   *buffer;
+	const line_t   *line;
+	text_encoding_t	encoding;			///< encoding of the line's data
+	size_t			tab_width;
+	const uint8_t  *data;				///< line data, or file data around the next character
+	uint64_t		data_raw;			///< offset in line of data
+	size_t			data_count;			///< bytes valid in data
+	uint8_t		   *window;				///< file data
+	column_checkpoint_t at;				///< position of the next character
+}
+column_walker_t;
+
+/// \brief Columns a character takes on screen
+///
+static size_t column_width(uint32_t ucode)
+{
+    if (
+            (ucode >= 0x0300 && ucode <= 0x036F)
+        ||  (ucode >= 0x200B && ucode <= 0x200F)
+    )
+    {
+        // combining marks and zero width spaces
+        return 0;
+    }
+    if (
+            (ucode >= 0x1100 && ucode <= 0x115F)
+        ||  (ucode >= 0x2E80 && ucode <= 0xA4CF && ucode != 0x303F)
+        ||  (ucode >= 0xAC00 && ucode <= 0xD7A3)
+        ||  (ucode >= 0xF900 && ucode <= 0xFAFF)
+        ||  (ucode >= 0xFE30 && ucode <= 0xFE4F)
+        ||  (ucode >= 0xFF00 && ucode <= 0xFF60)
+        ||  (ucode >= 0xFFE0 && ucode <= 0xFFE6)
+        ||  (ucode >= 0x1F300 && ucode <= 0x1F64F)
+        ||  (ucode >= 0x20000 && ucode <= 0x3FFFD)
+    )
+    {
+        // east asian wide characters
+        return 2;
+    }
+    return 1;
+}
+
+/// \brief Bytes a character takes in utf-8, as ::buffer_decode_text makes it
+///
+static size_t column_utf8_length(uint32_t ucode)
+{
+    if (ucode == 0)
+    {
+        return 0;
+    }
+    if (ucode < 0x80)
+    {
+        return 1;
+    }
+    if (ucode < 0x800)
+    {
+        return 2;
+    }
+    if (ucode < 0x10000)
+    {
+        return 3;
+    }
+    return 4;
+}
+
+/// \brief Make sure the data for the next character is at hand
+///
+/// @return 0 on success
+///
+static int column_load(column_walker_t *walker)
+{
+    uint64_t want;
+    size_t count;
+    int result;
+
+    if (walker->line->location == lineInMemory)
+    {
+        return 0;
+    }
+    // file lines and lines in pieces are read a window at a time, with
+    // room for the longest character, unless the line ends first
+    //
+    want = walker->line->length - walker->at.raw;
+    if (want > 4)
+    {
+        want = 4;
+    }
+    if (
+            walker->at.raw >= walker->data_raw
+        &&  (walker->at.raw + want) <= (walker->data_raw + walker->data_count)
+    )
+    {
+        return 0;
+    }
+    if (! walker->window)
+    {
+        walker->window = (uint8_t*)malloc(COLUMN_WINDOW);
+        if (! walker->window)
+        {
+            butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+            return -1;
+        }
+    }
+    count = COLUMN_WINDOW;
+    if (count > (walker->line->length - walker->at.raw))
+    {
+        count = (size_t)(walker->line->length - walker->at.raw);
+    }
+    result = buffer_read_line(walker->buffer, walker->line, walker->at.raw, walker->window, count);
+    if (result != (int)count)
+    {
+        butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+        return -1;
+    }
+    walker->data = walker->window;
+    walker->data_raw = walker->at.raw;
+    walker->data_count = count;
+    return 0;
+}
+
+/// \brief Step past the next character of a line
+///
+/// @return 0 on success, 1 at the end of the line, < 0 on error
+///
+static int column_next(column_walker_t *walker)
+{
+    const uint8_t *raw;
+    size_t avail;
+    size_t used;
+    size_t length;
+    uint32_t ucode;
+
+    if (walker->at.raw >= walker->line->length)
+    {
+        return 1;
+    }
+    if (column_load(walker))
+    {
+        return -1;
+    }
+    raw = walker->data + (walker->at.raw - walker->data_raw);
+    avail = (size_t)(walker->data_raw + walker->data_count - walker->at.raw);
+
+    switch (walker->encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    default:
+        // bytes are characters, and are the text as they are
+        ucode = raw[0];
+        used = 1;
+        length = 1;
+        break;
+    case textUTF8:
+        used = butil_utf8_decode((uint8_t*)raw, avail, &ucode);
+        if (! used)
+        {
+            ucode = raw[0];
+            used = 1;
+        }
+        length = used;
+        break;
+    case textUCS2LE:
+    case textUCS2BE:
+        if (avail < 2)
+        {
+            return 1;
+        }
+        if (walker->encoding == textUCS2LE)
+        {
+            ucode = ((uint32_t)raw[0]) | ((uint32_t)raw[1] << 8);
+        }
+        else
+        {
+            ucode = ((uint32_t)raw[0] << 8) | ((uint32_t)raw[1]);
+        }
+        used = 2;
+        length = column_utf8_length(ucode);
+        break;
+    case textUCS4LE:
+    case textUCS4BE:
+        if (avail < 4)
+        {
+            return 1;
+        }
+        if (walker->encoding == textUCS4LE)
+        {
+            ucode  = ((uint32_t)raw[0]) | ((uint32_t)raw[1] << 8);
+            ucode |= ((uint32_t)raw[2] << 16) | ((uint32_t)raw[3] << 24);
+        }
+        else
+        {
+            ucode  = ((uint32_t)raw[0] << 24) | ((uint32_t)raw[1] << 16);
+            ucode |= ((uint32_t)raw[2] << 8) | ((uint32_t)raw[3]);
+        }
+        used = 4;
+        length = column_utf8_length(ucode);
+        break;
+    }
+    if (ucode == '\n')
+    {
+        // the line ending isn't a position in the line
+        return 1;
+    }
+    if (ucode == '\t')
+    {
+        walker->at.display = (walker->at.display / walker->tab_width + 1) * walker->tab_width;
+    }
+    else
+    {
+        walker->at.display += column_width(ucode);
+    }
+    walker->at.chars++;
+    walker->at.offset += length;
+    walker->at.raw += used;
+    return 0;
+}
+
+/// \brief Value of a position in a unit
+///
+static inline uint64_t column_value(const column_checkpoint_t *point, column_unit_t unit)
+{
+    switch (unit)
+    {
+    case columnChars:
+        return point->chars;
+    case columnDisplay:
+        return point->display;
+    default:
+        return point->offset;
+    }
+}
+
+/// \brief Get the index of a long line, making it the most recently used
+///
+/// @return index, or NULL if no memory
+///
+static column_index_t *column_get_index(buffer_t *buffer, const line_t *line)
+{
+    column_index_t **plink;
+    column_index_t *index;
+    size_t count;
+
+    for (plink = &buffer->columns, count = 0; *plink; plink = &(*plink)->next, count++)
+    {
+        index = *plink;
+        if (index->line == line)
+        {
+            *plink = index->next;
+            index->next = buffer->columns;
+            buffer->columns = index;
+            return index;
+        }
+        if (! index->next && count >= (COLUMN_INDEX_LINES - 1))
+        {
+            // drop the least recently used
+            //
+            *plink = NULL;
+            free(index->points);
+            free(index);
+            break;
+        }
+    }
+    index = (column_index_t*)malloc(sizeof(column_index_t));
+    if (! index)
+    {
+        butil_log(0, "%s: Can't alloc index\n", __FUNCTION__);
+        return NULL;
+    }
+    index->size = 64;
+    index->points = (column_checkpoint_t*)malloc(index->size * sizeof(column_checkpoint_t));
+    if (! index->points)
+    {
+        free(index);
+        butil_log(0, "%s: Can't alloc index\n", __FUNCTION__);
+        return NULL;
+    }
+    // the start of the line is the first checkpoint
+    //
+    memset(&index->points[0], 0, sizeof(column_checkpoint_t));
+    index->count = 1;
+    index->line = line;
+    index->next = buffer->columns;
+    buffer->columns = index;
+    return index;
+}
+
+/// \brief Add a checkpoint to an index
+///
+static void column_add_point(column_index_t *index, const column_checkpoint_t *point)
+{
+    column_checkpoint_t *points;
+
+    if (index->count >= index->size)
+    {
+        points = (column_checkpoint_t*)realloc(index->points, index->size * 2 * sizeof(column_checkpoint_t));
+        if (! points)
+        {
+            // the index just stops growing
+            return;
+        }
+        index->points = points;
+        index->size *= 2;
+    }
+    index->points[index->count++] = *point;
+}
+
+int buffer_set_tab_width(buffer_t *buffer, size_t width)
+{
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    buffer->tab_width = width;
+
+    // display columns in the indexes are off now
+    //
+    buffer_forget_columns(buffer, NULL);
+    return 0;
+}
+
+int buffer_line_position(buffer_t *buffer, size_t line, column_unit_t unit, size_t value,
+                        column_position_t *position)
+{
+    column_walker_t walker;
+    column_checkpoint_t prev;
+    column_index_t *index;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+    int result;
+
+    if (!buffer || !position)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = buffer_select_line(buffer, line);
+    if (result)
+    {
+        return result;
+    }
+    memset(&walker, 0, sizeof(walker));
+    walker.buffer = buffer;
+    walker.line = buffer->curr_line;
+    walker.tab_width = buffer->tab_width ? buffer->tab_width : COLUMN_DEFAULT_TAB_WIDTH;
+
+    // text in memory is utf-8, unless the file's bytes are its characters
+    //
+    walker.encoding = buffer->original_encoding;
+    if (walker.line->location == lineInMemory)
+    {
+        walker.data = (const uint8_t*)(walker.line->position.data ? walker.line->position.data : "");
+        walker.data_count = walker.line->length;
+    }
+    if (walker.line->location == lineInMemory || walker.line->location == lineInBlock)
+    {
+        switch (walker.encoding)
+        {
+        case textBINARY:
+        case textASCII:
+            break;
+        default:
+            walker.encoding = textUTF8;
+            break;
+        }
+    }
+    index = NULL;
+    if (walker.line->length >= COLUMN_INDEX_LENGTH)
+    {
+        index = column_get_index(buffer, walker.line);
+    }
+    if (index)
+    {
+        // start at the last checkpoint at or before the value
+        //
+        lo = 0;
+        hi = index->count;
+        while ((hi - lo) > 1)
+        {
+            mid = (lo + hi) / 2;
+            if (column_value(&index->points[mid], unit) <= value)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        walker.at = index->points[lo];
+    }
+    result = 0;
+    while (column_value(&walker.at, unit) < value)
+    {
+        prev = walker.at;
+        result = column_next(&walker);
+        if (result)
+        {
+            break;
+        }
+        if (column_value(&walker.at, unit) > value)
+        {
+            // value is inside this character
+            walker.at = prev;
+            break;
+        }
+        if (
+                index
+            &&  walker.at.chars == (index->points[index->count - 1].chars + COLUMN_CHECKPOINT_CHARS)
+        )
+        {
+            column_add_point(index, &walker.at);
+        }
+    }
+    if (walker.window)
+    {
+        free(walker.window);
+    }
+    if (result < 0)
+    {
+        return result;
+    }
+    position->chars = (size_t)walker.at.chars;
+    position->display = (size_t)walker.at.display;
+    position->offset = (size_t)walker.at.offset;
+    return 0;
+}
+
+void buffer_forget_columns(buffer_t *buffer, const line_t *line)
+{
+    column_index_t **plink;
+    column_index_t *index;
+
+    if (! buffer)
+    {
+        return;
+    }
+    plink = &buffer->columns;
+    while (*plink)
+    {
+        index = *plink;
+        if (line && index->line != line)
+        {
+            plink = &index->next;
+            continue;
+        }
+        *plink = index->next;
+        free(index->points);
+        free(index);
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BCOLUMN_H
+#define BCOLUMN_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Maps positions in a line between characters, display columns and byte
+/// offsets in the line's utf-8 text, the offsets the edit functions take.
+/// Finding a character means decoding the line from its start, so for
+/// lines longer than COLUMN_INDEX_LENGTH the position of every
+/// COLUMN_CHECKPOINT_CHARS'th character is kept as the line is walked,
+/// and a lookup decodes at most that many characters past the nearest
+/// checkpoint before it
+///
+/// Indexes are kept for the last COLUMN_INDEX_LINES long lines looked up,
+/// and dropped when a line changes
+
+/// Lines at least this many bytes long get an index
+#define COLUMN_INDEX_LENGTH			(64*1024)
+
+/// Characters between checkpoints in an index
+#define COLUMN_CHECKPOINT_CHARS		(1024)
+
+/// Most lines indexed at once
+#define COLUMN_INDEX_LINES			(32)
+
+/// Default distance between tab stops
+#define COLUMN_DEFAULT_TAB_WIDTH	(8)
+
+/// Unit of a position in a line
+///
+typedef enum
+{
+	columnChars,						///< characters (unicode code points) from the start of the line
+	columnDisplay,						///< display columns, with tabs expanded and wide characters taking two
+	columnBytes							///< bytes of utf-8 text from the start of the line
+}
+column_unit_t;
+
+/// Position of a character in a line, in each unit
+///
+typedef struct tag_column_position
+{
+	size_t			chars;				///< characters before it
+	size_t			display;			///< display column it starts in
+	size_t			offset;				///< byte offset of it in the line's utf-8 text
+}
+column_position_t;
+
+/// Checkpoint - a position in a line, and where it is in the line's raw data
+///
+typedef struct tag_column_checkpoint
+{
+	uint64_t		chars;
+	uint64_t		display;
+	uint64_t		offset;
+	uint64_t		raw;				///< byte offset in the line's data, in memory or in the file
+}
+column_checkpoint_t;
+
+/// Index of a long line
+///
+typedef struct tag_column_index
+{
+	const line_t   *line;				///< line indexed
+	column_checkpoint_t *points;		///< checkpoints, every COLUMN_CHECKPOINT_CHARS characters so far
+	size_t			count;				///< checkpoints in points
+	size_t			size;				///< checkpoints allocated
+	struct tag_column_index *next;		///< next less recently used index
+}
+column_index_t;
+
+/// \brief Set the distance between tab stops
+///
+/// @param[in] buffer - buffer to set
+/// @param[in] width  - columns between tab stops, 0 for the default
+///
+/// @return 0 on success
+///
+int buffer_set_tab_width(buffer_t *buffer, size_t width);
+
+/// \brief Find a position in a line
+///
+/// A value past the end of the line gets the position of the end of the
+/// line, before its line ending. A display column or byte offset inside a
+/// character gets the position of that character
+///
+/// @param[in]  buffer   - buffer line is in
+/// @param[in]  line     - line number
+/// @param[in]  unit     - unit of value
+/// @param[in]  value    - position in line, in unit
+/// @param[out] position - gets the position in every unit
+///
+/// @return 0 on success
+///
+int buffer_line_position(buffer_t *buffer, size_t line, column_unit_t unit, size_t value,
+						column_position_t *position);
+
+/// \brief Drop the index of a line that changed or was freed
+///
+/// @param[in] buffer - buffer line is in
+/// @param[in] line   - line, or NULL to drop all indexes
+///
+void buffer_forget_columns(buffer_t *buffer, const line_t *line);
+
+#endif
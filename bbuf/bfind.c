@@ -0,0 +1,1604 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfind.h"
+#include "butil.h"
+#include "bmemory.h"
+#include "bpack.h"
+
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// \file
+///
+
+/// Bytes of file a replace thread buffers at once
+#define FIND_REPLACE_WINDOW		(1024*1024)
+
+/// Most threads a replace will use
+#define FIND_MAX_THREADS		32
+
+/// \brief Fold an ASCII letter to lower case
+///
+static inline uint8_t find_fold(uint8_t byte)
+{
+    return (byte >= 'A' && byte <= 'Z') ? (byte + ('a' - 'A')) : byte;
+}
+
+/// \brief Check if a needle byte is folded, the low byte of an ASCII code unit
+///
+/// The other bytes of a unit are matched exactly, so a unit like U+0141
+/// only folds if they're zero, and doesn't match U+0161
+///
+static bool find_foldable(const find_needle_t *needle, size_t index)
+{
+    size_t start;
+    size_t i;
+
+    if (! needle->fold || ((index & (needle->unit - 1)) != needle->foldpos))
+    {
+        return false;
+    }
+    start = index - needle->foldpos;
+    for (i = start; i < start + needle->unit; i++)
+    {
+        if (i != index && needle->bytes[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// \brief Get the two byte values a needle byte can match
+///
+/// @param[in]  needle - prepared needle
+/// @param[in]  index  - index of byte in needle
+/// @param[out] lower  - byte value (lower case if folding)
+/// @param[out] upper  - alternate byte value (upper case if folding)
+///
+static void find_filter_bytes(const find_needle_t *needle, size_t index, uint8_t *lower, uint8_t *upper)
+{
+    uint8_t byte;
+
+    byte = needle->bytes[index];
+    *lower = byte;
+    *upper = byte;
+    if (find_foldable(needle, index))
+    {
+        *lower = find_fold(byte);
+        if (*lower >= 'a' && *lower <= 'z')
+        {
+            *upper = *lower - ('a' - 'A');
+        }
+    }
+}
+
+/// \brief Compare needle to data at a candidate position
+///
+/// @param[in] data   - candidate position in data, at least needle length bytes
+/// @param[in] needle - prepared needle
+///
+/// @return true if needle matches data
+///
+static bool find_match_at(const uint8_t *data, const find_needle_t *needle)
+{
+    size_t i;
+
+    if (! needle->fold)
+    {
+        return memcmp(data, needle->bytes, needle->length) == 0;
+    }
+    for (i = 0; i < needle->length; i++)
+    {
+        if (data[i] != needle->bytes[i])
+        {
+            // only the byte of an ASCII code unit gets folded, other bytes are exact
+            //
+            if (! find_foldable(needle, i))
+            {
+                return false;
+            }
+            if (find_fold(data[i]) != find_fold(needle->bytes[i]))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int find_needle_prepare(const char *needle, size_t length, text_encoding_t encoding, find_options_t options, find_needle_t *prepared)
+{
+    size_t index;
+    size_t outdex;
+    size_t used;
+    uint32_t unicode;
+
+    if (!needle || !length || !prepared)
+    {
+        return -1;
+    }
+    memset(prepared, 0, sizeof(find_needle_t));
+
+    switch (encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+    default:
+        prepared->unit = 1;
+        prepared->foldpos = 0;
+        break;
+    case textUCS2LE:
+        prepared->unit = 2;
+        prepared->foldpos = 0;
+        break;
+    case textUCS2BE:
+        prepared->unit = 2;
+        prepared->foldpos = 1;
+        break;
+    case textUCS4LE:
+        prepared->unit = 4;
+        prepared->foldpos = 0;
+        break;
+    case textUCS4BE:
+        prepared->unit = 4;
+        prepared->foldpos = 3;
+        break;
+    }
+    // each byte of utf-8 is at most one code unit once transcoded
+    //
+    prepared->bytes = (uint8_t*)malloc(length * prepared->unit + 1);
+    if (! prepared->bytes)
+    {
+        butil_log(0, "%s: Can't alloc needle\n", __FUNCTION__);
+        return -1;
+    }
+    if (prepared->unit == 1)
+    {
+        memcpy(prepared->bytes, needle, length);
+        outdex = length;
+    }
+    else
+    {
+        index = 0;
+        outdex = 0;
+
+        while (index < length)
+        {
+            used = butil_utf8_decode((uint8_t*)needle + index, length - index, &unicode);
+            if (used == 0)
+            {
+                break;
+            }
+            index += used;
+
+            switch (encoding)
+            {
+            default:
+            case textUCS2LE:
+                prepared->bytes[outdex++] = unicode & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 8) & 0xFF;
+                break;
+            case textUCS2BE:
+                prepared->bytes[outdex++] = (unicode >> 8) & 0xFF;
+                prepared->bytes[outdex++] = unicode & 0xFF;
+                break;
+            case textUCS4LE:
+                prepared->bytes[outdex++] = unicode & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 8) & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 16) & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 24) & 0xFF;
+                break;
+            case textUCS4BE:
+                prepared->bytes[outdex++] = (unicode >> 24) & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 16) & 0xFF;
+                prepared->bytes[outdex++] = (unicode >> 8) & 0xFF;
+                prepared->bytes[outdex++] = unicode & 0xFF;
+                break;
+            }
+        }
+    }
+    if (outdex == 0)
+    {
+        find_needle_free(prepared);
+        return -1;
+    }
+    prepared->length = outdex;
+    prepared->fold = (options & findIgnoreCase) ? true : false;
+
+    // filter candidates on the ASCII byte of the first and last code units
+    //
+    prepared->first = prepared->foldpos;
+    prepared->last  = prepared->length - prepared->unit + prepared->foldpos;
+    return 0;
+}
+
+void find_needle_free(find_needle_t *prepared)
+{
+    if (! prepared)
+    {
+        return;
+    }
+    if (prepared->bytes)
+    {
+        free(prepared->bytes);
+    }
+    prepared->bytes = NULL;
+    prepared->length = 0;
+}
+
+const uint8_t *find_bytes_forward(const uint8_t *data, size_t length, const find_needle_t *needle)
+{
+    size_t pos;
+    size_t last_pos;
+    uint8_t f1, f2;
+    uint8_t l1, l2;
+
+    if (!data || !needle || !needle->length || length < needle->length)
+    {
+        return NULL;
+    }
+    find_filter_bytes(needle, needle->first, &f1, &f2);
+    find_filter_bytes(needle, needle->last, &l1, &l2);
+
+    // last position a match could start at
+    //
+    last_pos = length - needle->length;
+    pos = 0;
+
+#if defined(__SSE2__)
+    {
+        __m128i vf1 = _mm_set1_epi8((char)f1);
+        __m128i vf2 = _mm_set1_epi8((char)f2);
+        __m128i vl1 = _mm_set1_epi8((char)l1);
+        __m128i vl2 = _mm_set1_epi8((char)l2);
+        __m128i bf, bl, eq;
+        unsigned int align_mask;
+        unsigned int mask;
+        unsigned int bit;
+
+        // candidates at multiples of the code unit only, pos stays 16-aligned
+        //
+        align_mask = (needle->unit == 4) ? 0x1111 : ((needle->unit == 2) ? 0x5555 : 0xFFFF);
+
+        // compare the first and last filter bytes of 16 positions at once
+        // and only do a full compare where both of them match
+        //
+        while (pos + 15 <= last_pos)
+        {
+            bf = _mm_loadu_si128((const __m128i*)(data + pos + needle->first));
+            bl = _mm_loadu_si128((const __m128i*)(data + pos + needle->last));
+            eq = _mm_and_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(bf, vf1), _mm_cmpeq_epi8(bf, vf2)),
+                        _mm_or_si128(_mm_cmpeq_epi8(bl, vl1), _mm_cmpeq_epi8(bl, vl2))
+                        );
+            mask = (unsigned int)_mm_movemask_epi8(eq) & align_mask;
+            while (mask)
+            {
+                bit = __builtin_ctz(mask);
+                if (find_match_at(data + pos + bit, needle))
+                {
+                    return data + pos + bit;
+                }
+                mask &= mask - 1;
+            }
+            pos += 16;
+        }
+    }
+#endif
+    if (needle->unit == 1 && f1 == f2)
+    {
+        const uint8_t *candidate;
+
+        // let memchr skip to each possible start
+        //
+        while (pos <= last_pos)
+        {
+            candidate = (const uint8_t*)memchr(data + pos, f1, last_pos - pos + 1);
+            if (! candidate)
+            {
+                return NULL;
+            }
+            pos = candidate - data;
+            if (find_match_at(candidate, needle))
+            {
+                return candidate;
+            }
+            pos++;
+        }
+        return NULL;
+    }
+    for (; pos <= last_pos; pos += needle->unit)
+    {
+        if (
+                (data[pos + needle->first] == f1 || data[pos + needle->first] == f2)
+            &&  (data[pos + needle->last] == l1 || data[pos + needle->last] == l2)
+            &&  find_match_at(data + pos, needle)
+        )
+        {
+            return data + pos;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *find_bytes_backward(const uint8_t *data, size_t length, const find_needle_t *needle)
+{
+    size_t pos;
+    size_t end;
+    uint8_t f1, f2;
+    uint8_t l1, l2;
+
+    if (!data || !needle || !needle->length || length < needle->length)
+    {
+        return NULL;
+    }
+    find_filter_bytes(needle, needle->first, &f1, &f2);
+    find_filter_bytes(needle, needle->last, &l1, &l2);
+
+    // count of positions a match could start at, scanned from the top down
+    //
+    end = length - needle->length + 1;
+
+#if defined(__SSE2__)
+    {
+        __m128i vf1 = _mm_set1_epi8((char)f1);
+        __m128i vf2 = _mm_set1_epi8((char)f2);
+        __m128i vl1 = _mm_set1_epi8((char)l1);
+        __m128i vl2 = _mm_set1_epi8((char)l2);
+        __m128i bf, bl, eq;
+        unsigned int align_mask;
+        unsigned int mask;
+        unsigned int bit;
+        size_t base;
+        size_t shift;
+
+        align_mask = (needle->unit == 4) ? 0x1111 : ((needle->unit == 2) ? 0x5555 : 0xFFFF);
+
+        while (end >= 16)
+        {
+            base = end - 16;
+
+            // rotate the alignment mask so its bits land on code unit boundaries
+            //
+            shift = (needle->unit - (base & (needle->unit - 1))) & (needle->unit - 1);
+
+            bf = _mm_loadu_si128((const __m128i*)(data + base + needle->first));
+            bl = _mm_loadu_si128((const __m128i*)(data + base + needle->last));
+            eq = _mm_and_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(bf, vf1), _mm_cmpeq_epi8(bf, vf2)),
+                        _mm_or_si128(_mm_cmpeq_epi8(bl, vl1), _mm_cmpeq_epi8(bl, vl2))
+                        );
+            mask = (unsigned int)_mm_movemask_epi8(eq) & ((align_mask << shift) & 0xFFFF);
+
+            // highest candidate first, like memrchr
+            //
+            while (mask)
+            {
+                bit = 31 - __builtin_clz(mask);
+                if (find_match_at(data + base + bit, needle))
+                {
+                    return data + base + bit;
+                }
+                mask &= ~(1u << bit);
+            }
+            end = base;
+        }
+    }
+#endif
+    while (end > 0)
+    {
+        pos = --end;
+        if (
+                ((pos & (needle->unit - 1)) == 0)
+            &&  (data[pos + needle->first] == f1 || data[pos + needle->first] == f2)
+            &&  (data[pos + needle->last] == l1 || data[pos + needle->last] == l2)
+            &&  find_match_at(data + pos, needle)
+        )
+        {
+            return data + pos;
+        }
+    }
+    return NULL;
+}
+
+/// \brief Get a window of file data into the buffer's vbuf
+///
+/// Uses the data already in vbuf if it covers the window, else reads
+/// a vbuf's worth of file starting at offset
+///
+/// @param[in]  buffer - buffer to read file of
+/// @param[in]  offset - offset in file of window
+/// @param[in]  count  - bytes wanted, clipped to vbuf size
+/// @param[out] data   - pointer to window data
+/// @param[out] got    - bytes available at data, up to count
+///
+/// @return 0 on success
+///
+static int find_load_window(buffer_t *buffer, uint64_t offset, size_t count, const uint8_t **data, size_t *got)
+{
+    size_t total;
+    int result;
+
+    result = buffer_need_vbuf(buffer);
+    if (result)
+    {
+        return result;
+    }
+    if (count > buffer->vbuf_size)
+    {
+        count = buffer->vbuf_size;
+    }
+    if (
+            (offset >= buffer->vbuf_offset)
+        &&  ((offset + count) <= (buffer->vbuf_offset + buffer->vbuf_count))
+    )
+    {
+        *data = (uint8_t*)buffer->vbuf + (offset - buffer->vbuf_offset);
+        *got = count;
+        return 0;
+    }
+    result = buffer_read_at(buffer, offset, (uint8_t*)buffer->vbuf, buffer->vbuf_size);
+    if (result < 0)
+    {
+        return result;
+    }
+    total = (size_t)result;
+    buffer->vbuf_offset = offset;
+    buffer->vbuf_count = total;
+    buffer->vbuf_tail = 0;
+
+    if (total < count)
+    {
+        butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+        return -1;
+    }
+    *data = (uint8_t*)buffer->vbuf;
+    *got = count;
+    return 0;
+}
+
+/// \brief Scan a range of the buffer's file for the first match
+///
+/// @param[in]  buffer - buffer to search
+/// @param[in]  needle - needle prepared for the file's encoding
+/// @param[in]  start  - offset in file to start search
+/// @param[in]  end    - offset in file to end search (exclusive)
+/// @param[out] found  - offset of match in file
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_scan_forward(buffer_t *buffer, const find_needle_t *needle, uint64_t start, uint64_t end, uint64_t *found)
+{
+    const uint8_t *data;
+    const uint8_t *match;
+    uint64_t pos;
+    size_t want;
+    size_t got;
+    size_t step;
+    int result;
+
+    pos = start;
+    while ((pos + needle->length) <= end)
+    {
+        want = ((end - pos) > buffer->vbuf_size) ? buffer->vbuf_size : (size_t)(end - pos);
+        result = find_load_window(buffer, pos, want, &data, &got);
+        if (result)
+        {
+            return result;
+        }
+        match = find_bytes_forward(data, got, needle);
+        if (match)
+        {
+            *found = pos + (match - data);
+            return 0;
+        }
+        if ((pos + got) >= end)
+        {
+            break;
+        }
+        // overlap windows by needle length so no match straddles a boundary
+        //
+        if (got < needle->length)
+        {
+            return -1;
+        }
+        step = (got - (needle->length - 1)) & ~(needle->unit - 1);
+        if (step == 0)
+        {
+            butil_log(1, "%s: needle of %u doesn't fit in vbuf\n", __FUNCTION__, needle->length);
+            return -1;
+        }
+        pos += step;
+    }
+    return 1;
+}
+
+/// \brief Scan a range of the buffer's file for the last match
+///
+/// @param[in]  buffer - buffer to search
+/// @param[in]  needle - needle prepared for the file's encoding
+/// @param[in]  start  - offset in file to start search
+/// @param[in]  end    - offset in file to end search (exclusive)
+/// @param[out] found  - offset of match in file
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_scan_backward(buffer_t *buffer, const find_needle_t *needle, uint64_t start, uint64_t end, uint64_t *found)
+{
+    const uint8_t *data;
+    const uint8_t *match;
+    uint64_t lo;
+    uint64_t hi;
+    size_t want;
+    size_t got;
+    size_t misalign;
+    int result;
+
+    hi = end;
+    while (hi >= (start + needle->length))
+    {
+        want = ((hi - start) > buffer->vbuf_size) ? buffer->vbuf_size : (size_t)(hi - start);
+        lo = hi - want;
+
+        // keep window start on a code unit boundary
+        //
+        misalign = (size_t)(lo - start) & (needle->unit - 1);
+        if (misalign)
+        {
+            lo += needle->unit - misalign;
+        }
+        result = find_load_window(buffer, lo, (size_t)(hi - lo), &data, &got);
+        if (result)
+        {
+            return result;
+        }
+        match = find_bytes_backward(data, got, needle);
+        if (match)
+        {
+            *found = lo + (match - data);
+            return 0;
+        }
+        if (lo == start)
+        {
+            break;
+        }
+        if (got <= needle->length - 1)
+        {
+            butil_log(1, "%s: needle of %u doesn't fit in vbuf\n", __FUNCTION__, needle->length);
+            return -1;
+        }
+        hi = lo + needle->length - 1;
+    }
+    return 1;
+}
+
+/// \brief Check if the buffer's trigram index can be used for a needle
+///
+static bool find_use_trigrams(buffer_t *buffer, const find_needle_t *needle)
+{
+    return buffer->trigrams
+        && ! buffer->trigrams_building
+        && needle->length >= 3
+        && needle->length <= buffer->trigrams->block_size;
+}
+
+/// \brief Get the range of blocks which could hold the start of a match
+///
+/// Moves block forward (or backward) past blocks the index rules out,
+/// then past the run of blocks it doesn't
+///
+/// @return false if there are no more candidate blocks
+///
+static bool find_candidate_run(buffer_t *buffer, const find_needle_t *needle, bool forward, size_t first, size_t last, size_t *block, size_t *runend)
+{
+    size_t b;
+
+    b = *block;
+    if (forward)
+    {
+        while (b <= last && ! trigram_block_may_match(buffer->trigrams, b, needle->bytes, needle->length))
+        {
+            b++;
+        }
+        if (b > last)
+        {
+            return false;
+        }
+        *block = b;
+        while (b < last && trigram_block_may_match(buffer->trigrams, b + 1, needle->bytes, needle->length))
+        {
+            b++;
+        }
+        *runend = b;
+        return true;
+    }
+    while (b >= first && ! trigram_block_may_match(buffer->trigrams, b, needle->bytes, needle->length))
+    {
+        if (b == first)
+        {
+            return false;
+        }
+        b--;
+    }
+    *runend = b;
+    while (b > first && trigram_block_may_match(buffer->trigrams, b - 1, needle->bytes, needle->length))
+    {
+        b--;
+    }
+    *block = b;
+    return true;
+}
+
+/// \brief Find first match in a range of the buffer's file
+///
+/// If the buffer has a trigram index, only runs of blocks that could
+/// hold the start of a match are scanned
+///
+/// @param[in]  buffer - buffer to search
+/// @param[in]  needle - needle prepared for the file's encoding
+/// @param[in]  start  - offset in file to start search
+/// @param[in]  end    - offset in file to end search (exclusive)
+/// @param[out] found  - offset of match in file
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_file_forward(buffer_t *buffer, const find_needle_t *needle, uint64_t start, uint64_t end, uint64_t *found)
+{
+    uint64_t lo;
+    uint64_t hi;
+    size_t block_size;
+    size_t block;
+    size_t last;
+    size_t runend;
+    int result;
+
+    if (! find_use_trigrams(buffer, needle) || end <= start)
+    {
+        return find_scan_forward(buffer, needle, start, end, found);
+    }
+    block_size = buffer->trigrams->block_size;
+    block = (size_t)(start / block_size);
+    last = (size_t)((end - 1) / block_size);
+
+    while (find_candidate_run(buffer, needle, true, block, last, &block, &runend))
+    {
+        // matches starting in the run can run into the next block
+        //
+        lo = (uint64_t)block * block_size;
+        hi = (uint64_t)(runend + 1) * block_size + needle->length - 1;
+        if (lo < start)
+        {
+            lo = start;
+        }
+        if (hi > end)
+        {
+            hi = end;
+        }
+        result = find_scan_forward(buffer, needle, lo, hi, found);
+        if (result <= 0)
+        {
+            return result;
+        }
+        block = runend + 1;
+    }
+    return 1;
+}
+
+/// \brief Find last match in a range of the buffer's file
+///
+/// @param[in]  buffer - buffer to search
+/// @param[in]  needle - needle prepared for the file's encoding
+/// @param[in]  start  - offset in file to start search
+/// @param[in]  end    - offset in file to end search (exclusive)
+/// @param[out] found  - offset of match in file
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_file_backward(buffer_t *buffer, const find_needle_t *needle, uint64_t start, uint64_t end, uint64_t *found)
+{
+    uint64_t lo;
+    uint64_t hi;
+    size_t block_size;
+    size_t block;
+    size_t first;
+    size_t runend;
+    int result;
+
+    if (! find_use_trigrams(buffer, needle) || end <= start)
+    {
+        return find_scan_backward(buffer, needle, start, end, found);
+    }
+    block_size = buffer->trigrams->block_size;
+    first = (size_t)(start / block_size);
+    block = (size_t)((end - 1) / block_size);
+
+    while (find_candidate_run(buffer, needle, false, first, block, &block, &runend))
+    {
+        lo = (uint64_t)block * block_size;
+        hi = (uint64_t)(runend + 1) * block_size + needle->length - 1;
+        if (lo < start)
+        {
+            lo = start;
+        }
+        if (hi > end)
+        {
+            hi = end;
+        }
+        result = find_scan_backward(buffer, needle, lo, hi, found);
+        if (result <= 0)
+        {
+            return result;
+        }
+        if (block == first)
+        {
+            break;
+        }
+        block--;
+    }
+    return 1;
+}
+
+/// \brief Leave buffer at the line of a match and return position
+///
+static int find_set_result(buffer_t *buffer, line_t *line, size_t linenum, size_t column, size_t *pline, size_t *pcolumn)
+{
+    buffer->curr_line = line;
+    buffer->curr_linenum = linenum;
+    *pline = linenum;
+    *pcolumn = column;
+    return 0;
+}
+
+/// \brief Find first match in a line in pieces, at or after a column
+///
+/// The line is read a window at a time, windows overlapping by the
+/// needle's length so no match straddles a boundary
+///
+/// @param[in]  buffer - buffer line is in
+/// @param[in]  line   - line to search
+/// @param[in]  needle - needle prepared for utf-8
+/// @param[in]  skip   - column to start search at
+/// @param[out] column - column of match
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_pieces_forward(buffer_t *buffer, line_t *line, const find_needle_t *needle, size_t skip, size_t *column)
+{
+    const uint8_t *match;
+    uint8_t *window;
+    uint64_t pos;
+    int got;
+    int result;
+
+    if (needle->length > FIND_REPLACE_WINDOW)
+    {
+        butil_log(1, "%s: needle of %u doesn't fit in window\n", __FUNCTION__, needle->length);
+        return -1;
+    }
+    window = (uint8_t*)malloc(FIND_REPLACE_WINDOW);
+    if (! window)
+    {
+        butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+        return -1;
+    }
+    result = 1;
+    for (pos = skip; (pos + needle->length) <= line->length; pos += got - (needle->length - 1))
+    {
+        got = buffer_read_line(buffer, line, pos, window, FIND_REPLACE_WINDOW);
+        if (got < (int)needle->length)
+        {
+            result = (got < 0) ? got : 1;
+            break;
+        }
+        match = find_bytes_forward(window, got, needle);
+        if (match)
+        {
+            *column = (size_t)(pos + (match - window));
+            result = 0;
+            break;
+        }
+        if ((pos + got) >= line->length)
+        {
+            break;
+        }
+    }
+    free(window);
+    return result;
+}
+
+/// \brief Find last match in the first bytes of a line in pieces
+///
+/// @param[in]  buffer - buffer line is in
+/// @param[in]  line   - line to search
+/// @param[in]  needle - needle prepared for utf-8
+/// @param[in]  haylen - bytes of line to search
+/// @param[out] column - column of match
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+static int find_pieces_backward(buffer_t *buffer, line_t *line, const find_needle_t *needle, size_t haylen, size_t *column)
+{
+    const uint8_t *match;
+    uint8_t *window;
+    size_t lo;
+    size_t hi;
+    int got;
+    int result;
+
+    if (needle->length > FIND_REPLACE_WINDOW)
+    {
+        butil_log(1, "%s: needle of %u doesn't fit in window\n", __FUNCTION__, needle->length);
+        return -1;
+    }
+    window = (uint8_t*)malloc(FIND_REPLACE_WINDOW);
+    if (! window)
+    {
+        butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+        return -1;
+    }
+    result = 1;
+    for (hi = haylen; hi >= needle->length; hi = lo + needle->length - 1)
+    {
+        lo = (hi > FIND_REPLACE_WINDOW) ? (hi - FIND_REPLACE_WINDOW) : 0;
+        got = buffer_read_line(buffer, line, lo, window, hi - lo);
+        if (got != (int)(hi - lo))
+        {
+            result = -1;
+            break;
+        }
+        match = find_bytes_backward(window, got, needle);
+        if (match)
+        {
+            *column = lo + (match - window);
+            result = 0;
+            break;
+        }
+        if (lo == 0)
+        {
+            break;
+        }
+    }
+    free(window);
+    return result;
+}
+
+/// \brief Search forward from a position in a buffer
+///
+/// Consecutive lines that are still contiguous in the file are searched
+/// together as one range of the file, in-memory lines are searched in place
+///
+static int find_forward(buffer_t *buffer, const find_needle_t *native, const find_needle_t *encoded, size_t *pline, size_t *pcolumn)
+{
+    line_t *line;
+    line_t *last;
+    size_t linenum;
+    size_t lastnum;
+    size_t skip;
+    uint64_t start;
+    uint64_t end;
+    uint64_t found;
+    const uint8_t *match;
+    size_t column;
+    int result;
+
+    result = buffer_select_line(buffer, *pline);
+    if (result)
+    {
+        return result;
+    }
+    line = buffer->curr_line;
+    linenum = buffer->curr_linenum;
+    skip = *pcolumn;
+
+    while (line)
+    {
+        if (line->location == lineInPieces || line->location == lineInBlock)
+        {
+            result = find_pieces_forward(buffer, line, native, skip, &column);
+            if (result < 0)
+            {
+                return result;
+            }
+            if (result == 0)
+            {
+                return find_set_result(buffer, line, linenum, column, pline, pcolumn);
+            }
+            line = line->next;
+            linenum++;
+            skip = 0;
+            continue;
+        }
+        if (line->location == lineInMemory)
+        {
+            if (skip > line->length)
+            {
+                skip = line->length;
+            }
+            match = find_bytes_forward((uint8_t*)line->position.data + skip, line->length - skip, native);
+            if (match)
+            {
+                return find_set_result(buffer, line, linenum, match - (uint8_t*)line->position.data, pline, pcolumn);
+            }
+            line = line->next;
+            linenum++;
+            skip = 0;
+            continue;
+        }
+        // round start column up to a code unit
+        //
+        skip = (skip + encoded->unit - 1) & ~(encoded->unit - 1);
+        if (skip > line->length)
+        {
+            skip = line->length;
+        }
+        start = line->position.offset + skip;
+        end = line->position.offset + line->length;
+        last = line;
+        lastnum = linenum;
+
+        while (
+                last->next
+            &&  last->next->location == lineInFile
+            &&  last->next->position.offset == end
+        )
+        {
+            last = last->next;
+            lastnum++;
+            end += last->length;
+        }
+        result = find_file_forward(buffer, encoded, start, end, &found);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 0)
+        {
+            // map file offset of match back to a line
+            //
+            while (line != last && found >= (line->position.offset + line->length))
+            {
+                line = line->next;
+                linenum++;
+            }
+            return find_set_result(buffer, line, linenum, (size_t)(found - line->position.offset), pline, pcolumn);
+        }
+        line = last->next;
+        linenum = lastnum + 1;
+        skip = 0;
+    }
+    return 1;
+}
+
+/// \brief Search backward from a position in a buffer
+///
+static int find_backward(buffer_t *buffer, const find_needle_t *native, const find_needle_t *encoded, size_t *pline, size_t *pcolumn)
+{
+    const find_needle_t *needle;
+    line_t *line;
+    line_t *first;
+    size_t linenum;
+    size_t firstnum;
+    size_t limit;
+    size_t haylen;
+    uint64_t start;
+    uint64_t end;
+    uint64_t found;
+    const uint8_t *match;
+    size_t column;
+    int result;
+
+    result = buffer_select_line(buffer, *pline);
+    if (result)
+    {
+        return result;
+    }
+    line = buffer->curr_line;
+    linenum = buffer->curr_linenum;
+    limit = *pcolumn;
+
+    while (line)
+    {
+        // a match has to start before limit, but can extend past it
+        //
+        needle = (line->location == lineInFile) ? encoded : native;
+        haylen = line->length;
+        if (limit < haylen && (haylen - limit) > (needle->length - 1))
+        {
+            haylen = limit + needle->length - 1;
+        }
+        if (line->location == lineInPieces || line->location == lineInBlock)
+        {
+            result = find_pieces_backward(buffer, line, native, haylen, &column);
+            if (result < 0)
+            {
+                return result;
+            }
+            if (result == 0)
+            {
+                return find_set_result(buffer, line, linenum, column, pline, pcolumn);
+            }
+            line = line->prev;
+            linenum--;
+            limit = (size_t)-1;
+            continue;
+        }
+        if (line->location == lineInMemory)
+        {
+            match = find_bytes_backward((uint8_t*)line->position.data, haylen, native);
+            if (match)
+            {
+                return find_set_result(buffer, line, linenum, match - (uint8_t*)line->position.data, pline, pcolumn);
+            }
+            line = line->prev;
+            linenum--;
+            limit = (size_t)-1;
+            continue;
+        }
+        start = line->position.offset;
+        end = line->position.offset + haylen;
+        first = line;
+        firstnum = linenum;
+
+        while (
+                first->prev
+            &&  first->prev->location == lineInFile
+            &&  (first->prev->position.offset + first->prev->length) == start
+        )
+        {
+            first = first->prev;
+            firstnum--;
+            start = first->position.offset;
+        }
+        result = find_file_backward(buffer, encoded, start, end, &found);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 0)
+        {
+            while (line != first && found < line->position.offset)
+            {
+                line = line->prev;
+                linenum--;
+            }
+            return find_set_result(buffer, line, linenum, (size_t)(found - line->position.offset), pline, pcolumn);
+        }
+        line = first->prev;
+        linenum = firstnum - 1;
+        limit = (size_t)-1;
+    }
+    return 1;
+}
+
+/// \brief Prepare needles for in-memory (utf-8) lines and for file lines
+///
+static int find_prepare(buffer_t *buffer, const char *needle, size_t length, find_options_t options, find_needle_t *native, find_needle_t *encoded)
+{
+    int result;
+
+    result = find_needle_prepare(needle, length, textUTF8, options, native);
+    if (result)
+    {
+        return result;
+    }
+    result = find_needle_prepare(needle, length, buffer->original_encoding, options, encoded);
+    if (result)
+    {
+        find_needle_free(native);
+        return result;
+    }
+    return 0;
+}
+
+int buffer_find(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column)
+{
+    find_needle_t native;
+    find_needle_t encoded;
+    int result;
+
+    if (!buffer || !buffer->lines || !buffer->file || !needle || !length || !line || !column)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = find_prepare(buffer, needle, length, options, &native, &encoded);
+    if (result)
+    {
+        return result;
+    }
+    result = find_forward(buffer, &native, &encoded, line, column);
+
+    find_needle_free(&native);
+    find_needle_free(&encoded);
+    return result;
+}
+
+int buffer_find_next(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column)
+{
+    size_t next_line;
+    size_t next_column;
+    int result;
+
+    if (!line || !column)
+    {
+        return -1;
+    }
+    next_line = *line;
+    next_column = *column + 1;
+
+    result = buffer_find(buffer, needle, length, options, &next_line, &next_column);
+    if (result == 0)
+    {
+        *line = next_line;
+        *column = next_column;
+    }
+    return result;
+}
+
+int buffer_find_prev(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column)
+{
+    find_needle_t native;
+    find_needle_t encoded;
+    int result;
+
+    if (!buffer || !buffer->lines || !buffer->file || !needle || !length || !line || !column)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = find_prepare(buffer, needle, length, options, &native, &encoded);
+    if (result)
+    {
+        return result;
+    }
+    result = find_backward(buffer, &native, &encoded, line, column);
+
+    find_needle_free(&native);
+    find_needle_free(&encoded);
+    return result;
+}
+
+
+/// \brief A line's new content, made by a replace thread
+///
+typedef struct tag_find_edit
+{
+	line_t		   *line;				///< line to change
+	size_t			linenum;			///< line number of line
+	char		   *data;				///< new content, utf-8
+	size_t			length;				///< length of new content
+}
+find_edit_t;
+
+/// \brief State of one replace thread
+///
+typedef struct tag_find_worker
+{
+	buffer_t	   *buffer;
+	const find_needle_t *native;		///< needle for in-memory lines
+	const find_needle_t *encoded;		///< needle for file lines
+	const char	   *replacement;		///< replacement text, utf-8
+	size_t			replacement_length;
+	line_t		   *first;				///< first line to search
+	size_t			first_linenum;		///< line number of first line
+	size_t			count;				///< lines to search
+	find_edit_t	   *edits;				///< lines changed
+	size_t			nedits;
+	size_t			edits_size;
+	size_t			replaced;			///< count of occurrences replaced
+	uint8_t		   *window;				///< file data
+	uint64_t		window_offset;		///< offset in file of window
+	size_t			window_count;		///< bytes valid in window
+	uint8_t		   *scratch;			///< line decoded to utf-8
+	size_t			scratch_size;
+	pthread_t		thread;
+	bool			started;			///< thread was started
+	int				result;
+}
+find_worker_t;
+
+/// \brief Make a line's new content with every occurrence replaced
+///
+/// @param[in] text   - line content, utf-8
+/// @param[in] length - length of text
+///
+static int find_replace_text(find_worker_t *worker, const uint8_t *text, size_t length)
+{
+    const uint8_t *hit;
+    const uint8_t *from;
+    find_edit_t *edits;
+    size_t newlength;
+    size_t count;
+    char *data;
+    char *pdest;
+
+    // count occurrences to size the new line
+    //
+    count = 0;
+    for (from = text; (hit = find_bytes_forward(from, length - (from - text), worker->native)) != NULL; )
+    {
+        count++;
+        from = hit + worker->native->length;
+    }
+    if (! count)
+    {
+        return 0;
+    }
+    newlength = length - count * worker->native->length + count * worker->replacement_length;
+    data = (char*)malloc(newlength + 1);
+    if (! data)
+    {
+        butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+        return -1;
+    }
+    pdest = data;
+    for (from = text; (hit = find_bytes_forward(from, length - (from - text), worker->native)) != NULL; )
+    {
+        memcpy(pdest, from, hit - from);
+        pdest += hit - from;
+        memcpy(pdest, worker->replacement, worker->replacement_length);
+        pdest += worker->replacement_length;
+        from = hit + worker->native->length;
+    }
+    memcpy(pdest, from, length - (from - text));
+    data[newlength] = '\0';
+
+    if (worker->nedits >= worker->edits_size)
+    {
+        worker->edits_size = worker->edits_size ? worker->edits_size * 2 : 256;
+        edits = (find_edit_t*)realloc(worker->edits, worker->edits_size * sizeof(find_edit_t));
+        if (! edits)
+        {
+            free(data);
+            return -1;
+        }
+        worker->edits = edits;
+    }
+    worker->edits[worker->nedits].data = data;
+    worker->edits[worker->nedits].length = newlength;
+    worker->nedits++;
+    worker->replaced += count;
+    return 1;
+}
+
+/// \brief Replace in a line in the file, in pieces or in a block, only decoding it if the needle is in it
+///
+static int find_replace_file_line(find_worker_t *worker, line_t *line)
+{
+    const uint8_t *content;
+    uint8_t *whole;
+    size_t length;
+    int result;
+
+    whole = NULL;
+
+    if (line->location != lineInFile || line->length > FIND_REPLACE_WINDOW)
+    {
+        whole = (uint8_t*)malloc(line->length + 1);
+        if (! whole)
+        {
+            butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+            return -1;
+        }
+        result = buffer_read_line(worker->buffer, line, 0, whole, line->length);
+        if (result != (int)line->length)
+        {
+            free(whole);
+            return -1;
+        }
+        content = whole;
+    }
+    else
+    {
+        if (
+                line->position.offset < worker->window_offset
+            ||  (line->position.offset + line->length) > (worker->window_offset + worker->window_count)
+        )
+        {
+            result = buffer_read_at(worker->buffer, line->position.offset, worker->window, FIND_REPLACE_WINDOW);
+            if (result < (int)line->length)
+            {
+                butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+                return -1;
+            }
+            worker->window_offset = line->position.offset;
+            worker->window_count = result;
+        }
+        content = worker->window + (line->position.offset - worker->window_offset);
+    }
+    result = 0;
+
+    if (line->location == lineInBlock)
+    {
+        // packed text is already utf-8
+        //
+        result = find_replace_text(worker, content, line->length);
+    }
+    else if (find_bytes_forward(content, line->length, worker->encoded))
+    {
+        // make sure there's room to decode the line
+        //
+        if ((line->length * 4 + 4) > worker->scratch_size)
+        {
+            free(worker->scratch);
+            worker->scratch_size = line->length * 4 + 4;
+            worker->scratch = (uint8_t*)malloc(worker->scratch_size);
+            if (! worker->scratch)
+            {
+                worker->scratch_size = 0;
+                result = -1;
+            }
+        }
+        if (! result)
+        {
+            length = buffer_decode_text(worker->buffer->original_encoding, content, line->length, worker->scratch);
+            result = find_replace_text(worker, worker->scratch, length);
+        }
+    }
+    if (whole)
+    {
+        free(whole);
+    }
+    return result;
+}
+
+/// \brief Find and make replacements in a run of lines
+///
+static void *find_replace_thread(void *param)
+{
+    find_worker_t *worker = (find_worker_t*)param;
+    line_t *line;
+    size_t n;
+    int result;
+
+    worker->window = (uint8_t*)malloc(FIND_REPLACE_WINDOW);
+    if (! worker->window)
+    {
+        worker->result = -1;
+        return NULL;
+    }
+    result = 0;
+
+    for (n = 0, line = worker->first; n < worker->count && line; n++, line = line->next)
+    {
+        if (line->location == lineInMemory)
+        {
+            result = find_replace_text(worker, (uint8_t*)line->position.data, line->length);
+        }
+        else
+        {
+            result = find_replace_file_line(worker, line);
+        }
+        if (result < 0)
+        {
+            break;
+        }
+        if (result > 0)
+        {
+            worker->edits[worker->nedits - 1].line = line;
+            worker->edits[worker->nedits - 1].linenum = worker->first_linenum + n;
+            result = 0;
+        }
+    }
+    free(worker->window);
+    worker->window = NULL;
+    if (worker->scratch)
+    {
+        free(worker->scratch);
+        worker->scratch = NULL;
+    }
+    worker->result = result;
+    return NULL;
+}
+
+int buffer_replace_all(buffer_t *buffer, const char *needle, size_t length, const char *replacement, size_t replacement_length, find_options_t options, int threads, size_t *replaced)
+{
+    find_needle_t native;
+    find_needle_t encoded;
+    find_worker_t *workers;
+    find_edit_t *edit;
+    undo_log_t *log;
+    line_t *line;
+    size_t per_thread;
+    size_t total;
+    size_t before;
+    size_t n;
+    int nworkers;
+    int i;
+    int result;
+
+    if (replaced)
+    {
+        *replaced = 0;
+    }
+    if (!buffer || !buffer->file || !needle || !length || (!replacement && replacement_length))
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (!buffer->lines || !buffer->line_count)
+    {
+        return 0;
+    }
+    result = find_prepare(buffer, needle, length, options, &native, &encoded);
+    if (result)
+    {
+        return result;
+    }
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > FIND_MAX_THREADS)
+    {
+        threads = FIND_MAX_THREADS;
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if ((buffer->line_count / 1024) < (size_t)threads)
+    {
+        threads = (int)(buffer->line_count / 1024) + 1;
+    }
+    workers = (find_worker_t*)calloc(threads, sizeof(find_worker_t));
+    if (! workers)
+    {
+        find_needle_free(&native);
+        find_needle_free(&encoded);
+        return -1;
+    }
+    // hand out consecutive runs of lines
+    //
+    per_thread = (buffer->line_count + threads - 1) / threads;
+    line = buffer->lines;
+
+    for (nworkers = 0; nworkers < threads && line; nworkers++)
+    {
+        workers[nworkers].buffer = buffer;
+        workers[nworkers].native = &native;
+        workers[nworkers].encoded = &encoded;
+        workers[nworkers].replacement = replacement;
+        workers[nworkers].replacement_length = replacement_length;
+        workers[nworkers].first = line;
+        workers[nworkers].first_linenum = nworkers * per_thread;
+        workers[nworkers].count = per_thread;
+
+        for (n = 0; n < per_thread && line; n++)
+        {
+            line = line->next;
+        }
+    }
+    if (nworkers == 1)
+    {
+        find_replace_thread(&workers[0]);
+    }
+    else
+    {
+        for (i = 0; i < nworkers; i++)
+        {
+            workers[i].started = (pthread_create(&workers[i].thread, NULL, find_replace_thread, &workers[i]) == 0);
+            if (! workers[i].started)
+            {
+                find_replace_thread(&workers[i]);
+            }
+        }
+        for (i = 0; i < nworkers; i++)
+        {
+            if (workers[i].started)
+            {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+    }
+    find_needle_free(&native);
+    find_needle_free(&encoded);
+
+    result = 0;
+    total = 0;
+    for (i = 0; i < nworkers; i++)
+    {
+        if (workers[i].result)
+        {
+            result = workers[i].result;
+        }
+        total += workers[i].replaced;
+    }
+    // every line changed is made ready to change before any is, so if
+    // one can't be none are
+    //
+    for (i = 0; i < nworkers && ! result; i++)
+    {
+        for (n = 0, edit = workers[i].edits; n < workers[i].nedits; n++, edit++)
+        {
+            if (buffer_unpack_block(buffer, edit->line) || buffer_preserve_line(buffer, edit->line))
+            {
+                butil_log(1, "%s: Can't change line %zu\n", __FUNCTION__, edit->linenum);
+                result = -1;
+                break;
+            }
+        }
+    }
+    // install all the new lines at once, or none of them on error, lines
+    // without the needle are left as they are. the old content of each
+    // line goes to the undo log, all undone as one
+    //
+    log = result ? NULL : buffer_undo_log(buffer);
+    undo_begin_group(log);
+    
+    for (i = 0; i < nworkers; i++)
+    {
+        for (n = 0, edit = workers[i].edits; n < workers[i].nedits; n++, edit++)
+        {
+            if (result)
+            {
+                free(edit->data);
+                continue;
+            }
+            before = line_data_size(edit->line);
+            if (log && undo_add_line_content(log, edit->linenum, edit->line))
+            {
+                // better no history than a wrong one
+                butil_log(1, "%s: Can't record undo, history dropped\n", __FUNCTION__);
+                undo_end_group(log);
+                undo_log_clear(log);
+                log = NULL;
+            }
+            if (!log && edit->line->location != lineInFile && edit->line->position.data)
+            {
+                free(edit->line->position.data);
+            }
+            edit->line->location = lineInMemory;
+            edit->line->position.data = edit->data;
+            edit->line->length = edit->length;
+            buffer_account_memory(buffer, memoryLines, before, line_data_size(edit->line));
+            buffer_line_changed(buffer, edit->line, edit->linenum);
+        }
+        if (workers[i].edits)
+        {
+            free(workers[i].edits);
+        }
+    }
+    free(workers);
+    undo_end_group(log);
+    buffer_govern_memory(buffer);
+
+    // journaled once made, so replay makes it only if it was
+    //
+    if (! result && total && buffer->journal)
+    {
+        journal_rec_t rec;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.op = journalReplaceAll;
+        rec.options = options;
+        rec.text = (const uint8_t*)needle;
+        rec.text_length = length;
+        rec.text2 = (const uint8_t*)replacement;
+        rec.text2_length = replacement_length;
+        buffer_journal_edit(buffer, &rec);
+    }
+    if (! result && replaced)
+    {
+        *replaced = total;
+    }
+    return result;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFIND_H
+#define BFIND_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+
+/// \brief Options for finding text
+///
+#define findIgnoreCase		0x0001	///< fold ASCII letters when comparing
+
+/// Options a find can have
+///
+typedef uint32_t find_options_t;
+
+/// Needle - a search string prepared for one text encoding
+///
+typedef struct tag_find_needle
+{
+	uint8_t		   *bytes;				///< encoded needle
+	size_t			length;				///< length of encoded needle in bytes
+	size_t			unit;				///< size of one code unit in bytes (1, 2 or 4)
+	size_t			foldpos;			///< byte in each code unit that holds the ASCII value
+	size_t			first;				///< offset of first byte used to filter candidates
+	size_t			last;				///< offset of last byte used to filter candidates
+	bool			fold;				///< compare ASCII letters case-insensitively
+}
+find_needle_t;
+
+/// \brief Prepare a needle for searching data in an encoding
+///
+/// @param[in]  needle   - the text to find, in utf-8
+/// @param[in]  length   - length of text in bytes
+/// @param[in]  encoding - encoding of the data to be searched
+/// @param[in]  options  - find options, see ::find_options_t
+/// @param[out] prepared - needle to setup, free with ::find_needle_free
+///
+/// @return 0 on success
+///
+int find_needle_prepare(const char *needle, size_t length, text_encoding_t encoding, find_options_t options, find_needle_t *prepared);
+
+/// \brief Release the memory held by a prepared needle
+///
+/// @param[in] prepared - needle setup by ::find_needle_prepare
+///
+void find_needle_free(find_needle_t *prepared);
+
+/// \brief Find the first occurrence of a needle in a block of data
+///
+/// Only positions which are a multiple of the needle's code unit size
+/// from the start of data are considered
+///
+/// @param[in] data   - data to search
+/// @param[in] length - length of data in bytes
+/// @param[in] needle - prepared needle
+///
+/// @return pointer to the match in data, or NULL if not found
+///
+const uint8_t *find_bytes_forward(const uint8_t *data, size_t length, const find_needle_t *needle);
+
+/// \brief Find the last occurrence of a needle in a block of data
+///
+/// @param[in] data   - data to search
+/// @param[in] length - length of data in bytes
+/// @param[in] needle - prepared needle
+///
+/// @return pointer to the match in data, or NULL if not found
+///
+const uint8_t *find_bytes_backward(const uint8_t *data, size_t length, const find_needle_t *needle);
+
+/// \brief Find text in a buffer
+///
+/// Finds the first occurrence of needle which starts at or after the
+/// given position. The buffer's file is scanned directly in windows
+/// the size of the buffer's vbuf, so lines are not fetched one by one.
+/// Needle is utf-8 and is transcoded to match the buffer's encoding.
+/// The needle should not contain line endings
+///
+/// Columns are byte offsets into the line's content, as returned from
+/// ::buffer_get_line_content
+///
+/// @param[in]     buffer  - buffer to search
+/// @param[in]     needle  - text to find, in utf-8
+/// @param[in]     length  - length of needle in bytes
+/// @param[in]     options - find options, see ::find_options_t
+/// @param[in/out] line    - line to start at, set to line of match
+/// @param[in/out] column  - column to start at, set to column of match
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+int buffer_find(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column);
+
+/// \brief Find the next occurrence of text in a buffer
+///
+/// Like ::buffer_find but the match must start after the given position,
+/// so passing in the position of the last match moves on to the next one
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+int buffer_find_next(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column);
+
+/// \brief Find the previous occurrence of text in a buffer
+///
+/// Finds the last occurrence of needle which starts before the given position
+///
+/// @param[in]     buffer  - buffer to search
+/// @param[in]     needle  - text to find, in utf-8
+/// @param[in]     length  - length of needle in bytes
+/// @param[in]     options - find options, see ::find_options_t
+/// @param[in/out] line    - line to start at, set to line of match
+/// @param[in/out] column  - column to start at, set to column of match
+///
+/// @return 0 if found, 1 if not found, < 0 on error
+///
+int buffer_find_prev(buffer_t *buffer, const char *needle, size_t length, find_options_t options, size_t *line, size_t *column);
+
+/// \brief Replace every occurrence of text in a buffer
+///
+/// The line list is split into runs which are searched on separate
+/// threads. Lines with a match get new content in memory (utf-8), built
+/// on the thread that found them, and all the new lines are put in the
+/// buffer together when every thread is done. Lines without a match
+/// are left in the file
+///
+/// @param[in]  buffer             - buffer to change
+/// @param[in]  needle             - text to find, in utf-8
+/// @param[in]  length             - length of needle in bytes
+/// @param[in]  replacement        - text to put in place of needle, in utf-8
+/// @param[in]  replacement_length - length of replacement in bytes
+/// @param[in]  options            - find options, see ::find_options_t
+/// @param[in]  threads            - threads to use, 0 for one per cpu
+/// @param[out] replaced           - count of occurrences replaced, may be NULL
+///
+/// @return 0 on success, < 0 on error in which case the buffer is unchanged
+///
+int buffer_replace_all(buffer_t *buffer, const char *needle, size_t length, const char *replacement, size_t replacement_length, find_options_t options, int threads, size_t *replaced);
+
+#endif
@@ -0,0 +1,790 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bgrep.h"
+#include "bbuf.h"
+#include "butil.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/// \file
+///
+
+/// A result held until its file's turn
+///
+typedef struct tag_grep_held
+{
+	struct tag_grep_held *next;
+	size_t			size;				///< bytes this result takes
+	grep_result_t	result;
+	char			text[1];			///< text of result, allocated to fit
+}
+grep_held_t;
+
+/// Progress of a file
+///
+typedef struct tag_grep_file
+{
+	grep_held_t	   *first;				///< results held, in order
+	grep_held_t	   *last;
+	bool			done;				///< file has been searched
+}
+grep_file_t;
+
+/// Files queued to a thread. The owner takes from the head, in url
+/// order, and idle threads steal from the tail
+///
+typedef struct tag_grep_deque
+{
+	pthread_mutex_t	lock;
+	size_t		   *files;
+	size_t			head;
+	size_t			tail;
+}
+grep_deque_t;
+
+/// State shared by the threads of a search
+///
+typedef struct tag_grep_search
+{
+	const char	  **urls;
+	size_t			nurls;
+	const char	   *pattern;
+	regex_options_t	options;
+	grep_callback_t	callback;
+	void		   *priv;
+	grep_file_t	   *files;
+	grep_deque_t   *deques;
+	int				nthreads;
+	pthread_mutex_t	lock;				///< protects everything below, and calls to callback
+	pthread_cond_t	cond;				///< signaled when next_emit moves or held results are freed
+	size_t			next_emit;			///< file whose results go out next
+	size_t			held_bytes;			///< bytes of results held
+	size_t			memory_cap;			///< most bytes of results to hold
+	bool			stop;				///< callback asked to stop
+	bool			started;			///< all threads are made
+}
+grep_search_t;
+
+/// One search thread
+///
+typedef struct tag_grep_worker
+{
+	grep_search_t  *search;
+	int				id;
+	pthread_t		thread;
+	bregex_t	   *regex[textUCS4BE + 1];	///< expression for each encoding, made as needed
+	uint8_t		   *window;				///< file data
+	uint8_t		   *head;				///< start of a line too long for window
+	uint8_t		   *text;				///< utf-8 text of a result
+}
+grep_worker_t;
+
+/// \brief Pass a result to the callback, under the search lock
+///
+static void grep_call(grep_search_t *search, const grep_result_t *result)
+{
+    if (search->stop)
+    {
+        return;
+    }
+    if (search->callback(search->priv, result))
+    {
+        search->stop = true;
+    }
+}
+
+/// \brief Pass the held results of the file whose turn it is to the callback
+///
+static void grep_flush_held(grep_search_t *search)
+{
+    grep_file_t *file;
+    grep_held_t *held;
+
+    if (search->next_emit >= search->nurls)
+    {
+        return;
+    }
+    file = &search->files[search->next_emit];
+    while (file->first)
+    {
+        held = file->first;
+        file->first = held->next;
+        grep_call(search, &held->result);
+        search->held_bytes -= held->size;
+        free(held);
+    }
+    file->last = NULL;
+}
+
+/// \brief Hand a result on, holding it if it's not its file's turn yet
+///
+/// Waits if holding the result would go over the memory cap. The file
+/// whose turn it is never waits, so some thread can always move on
+///
+/// @return 0 to keep going, 1 if the search is stopped
+///
+static int grep_deliver(grep_search_t *search, const grep_result_t *result)
+{
+    grep_file_t *file;
+    grep_held_t *held;
+    size_t size;
+    int ret;
+
+    pthread_mutex_lock(&search->lock);
+
+    size = sizeof(grep_held_t) + result->length;
+    file = &search->files[result->file_index];
+
+    while (! search->stop)
+    {
+        if (result->file_index == search->next_emit)
+        {
+            grep_flush_held(search);
+            grep_call(search, result);
+            break;
+        }
+        if (search->held_bytes == 0 || (search->held_bytes + size) <= search->memory_cap)
+        {
+            held = (grep_held_t*)malloc(size);
+            if (! held)
+            {
+                // wait for memory like for the cap
+                pthread_cond_wait(&search->cond, &search->lock);
+                continue;
+            }
+            held->next = NULL;
+            held->size = size;
+            held->result = *result;
+            if (result->text)
+            {
+                memcpy(held->text, result->text, result->length);
+                held->result.text = held->text;
+            }
+            if (file->last)
+            {
+                file->last->next = held;
+            }
+            else
+            {
+                file->first = held;
+            }
+            file->last = held;
+            search->held_bytes += size;
+            break;
+        }
+        pthread_cond_wait(&search->cond, &search->lock);
+    }
+    ret = search->stop ? 1 : 0;
+    pthread_mutex_unlock(&search->lock);
+    return ret;
+}
+
+/// \brief Mark a file searched and pass on results of files now in turn
+///
+static void grep_file_done(grep_search_t *search, size_t index)
+{
+    pthread_mutex_lock(&search->lock);
+
+    search->files[index].done = true;
+
+    while (search->next_emit < search->nurls && search->files[search->next_emit].done)
+    {
+        grep_flush_held(search);
+        search->next_emit++;
+    }
+    // the file in turn now may have results held already
+    //
+    grep_flush_held(search);
+
+    pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+}
+
+/// \brief Get the next file for a thread, stealing one if it has none
+///
+/// @return true if there is a file
+///
+static bool grep_next_file(grep_worker_t *worker, size_t *index)
+{
+    grep_search_t *search = worker->search;
+    grep_deque_t *deque;
+    bool found;
+    int i;
+
+    for (i = 0; i < search->nthreads; i++)
+    {
+        deque = &search->deques[(worker->id + i) % search->nthreads];
+
+        pthread_mutex_lock(&deque->lock);
+        found = (deque->head < deque->tail);
+        if (found)
+        {
+            if (i == 0)
+            {
+                *index = deque->files[deque->head++];
+            }
+            else
+            {
+                *index = deque->files[--deque->tail];
+            }
+        }
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// \brief Read from a file until the window is full or the file ends
+///
+/// @return bytes now in window, or < 0 on error
+///
+static int grep_fill(file_t *file, uint8_t *window, size_t count)
+{
+    int result;
+
+    while (count < GREP_WINDOW_SIZE)
+    {
+        result = file->file_read(file, window + count, GREP_WINDOW_SIZE - count);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 0)
+        {
+            break;
+        }
+        count += result;
+    }
+    return (int)count;
+}
+
+/// \brief Find the first LF code unit in data
+///
+/// @return offset of LF or -1 if none
+///
+static long grep_find_newline(const uint8_t *data, size_t length, size_t unit, bool bigendian)
+{
+    const uint8_t *nl;
+    size_t low;
+    size_t i;
+    size_t b;
+
+    if (unit == 1)
+    {
+        nl = (const uint8_t*)memchr(data, '\n', length);
+        return nl ? (long)(nl - data) : -1;
+    }
+    low = bigendian ? (unit - 1) : 0;
+
+    for (i = 0; (i + unit) <= length; i += unit)
+    {
+        if (data[i + low] != '\n')
+        {
+            continue;
+        }
+        for (b = 0; b < unit; b++)
+        {
+            if (b != low && data[i + b])
+            {
+                break;
+            }
+        }
+        if (b == unit)
+        {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/// \brief Check if the code unit at the end of data is a CR
+///
+static bool grep_ends_in_cr(const uint8_t *data, size_t length, size_t unit, bool bigendian)
+{
+    size_t b;
+
+    if (length < unit)
+    {
+        return false;
+    }
+    data += length - unit;
+    for (b = 0; b < unit; b++)
+    {
+        if (data[b] != ((b == (bigendian ? (unit - 1) : 0)) ? '\r' : 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// \brief Get (or make) a thread's expression for an encoding
+///
+static bregex_t *grep_regex(grep_worker_t *worker, text_encoding_t encoding)
+{
+    if ((int)encoding < 0 || encoding > textUCS4BE)
+    {
+        encoding = textUTF8;
+    }
+    if (! worker->regex[encoding])
+    {
+        worker->regex[encoding] = regex_create(worker->search->pattern, encoding, worker->search->options, 0);
+    }
+    return worker->regex[encoding];
+}
+
+/// \brief Hand on a matching line
+///
+static int grep_deliver_line(grep_worker_t *worker, size_t index, size_t line, text_encoding_t encoding, size_t unit, const uint8_t *raw, size_t length)
+{
+    grep_result_t result;
+
+    if (length > GREP_MAX_TEXT)
+    {
+        length = GREP_MAX_TEXT;
+        if (unit == 1)
+        {
+            // don't cut a utf-8 character in two
+            while (length > 0 && (raw[length] & 0xC0) == 0x80)
+            {
+                length--;
+            }
+        }
+    }
+    length &= ~(unit - 1);
+
+    memset(&result, 0, sizeof(result));
+    result.url = worker->search->urls[index];
+    result.file_index = index;
+    result.line = line;
+    result.text = (char*)worker->text;
+    result.length = buffer_decode_text(encoding, raw, length, worker->text);
+    return grep_deliver(worker->search, &result);
+}
+
+/// \brief Hand on a per-file result with no line text
+///
+static int grep_deliver_file(grep_worker_t *worker, size_t index, size_t count, int error)
+{
+    grep_result_t result;
+
+    memset(&result, 0, sizeof(result));
+    result.url = worker->search->urls[index];
+    result.file_index = index;
+    result.count = count;
+    result.error = error;
+    return grep_deliver(worker->search, &result);
+}
+
+/// \brief Search one file, streaming it through the thread's window
+///
+/// @return 0 to keep going, 1 if the search is stopped
+///
+static int grep_search_file(grep_worker_t *worker, size_t index)
+{
+    regex_cursor_t cursor;
+    text_encoding_t encoding;
+    bregex_t *regex;
+    file_t *file;
+    size_t count;
+    size_t pos;
+    size_t end;
+    size_t unit;
+    size_t linenum;
+    size_t matches;
+    size_t headlen;
+    bool bigendian;
+    bool at_eof;
+    bool long_line;
+    long nl;
+    int result;
+
+    file = file_create(worker->search->urls[index], openForRead);
+    if (! file)
+    {
+        return grep_deliver_file(worker, index, 0, -1);
+    }
+    result = grep_fill(file, worker->window, 0);
+    if (result < 0)
+    {
+        file_destroy(file);
+        return grep_deliver_file(worker, index, 0, result);
+    }
+    count = (size_t)result;
+    at_eof = (count < GREP_WINDOW_SIZE);
+
+    encoding = file_sniff_encoding(worker->window, count);
+    regex = grep_regex(worker, encoding);
+    if (! regex)
+    {
+        file_destroy(file);
+        return grep_deliver_file(worker, index, 0, -1);
+    }
+    // skip byte order mark, like buffer_read
+    //
+    bigendian = false;
+    switch (encoding)
+    {
+    case textUTF8:
+        unit = 1;
+        pos = (count >= 3 && worker->window[0] == 0xEF && worker->window[1] == 0xBB && worker->window[2] == 0xBF) ? 3 : 0;
+        break;
+    case textUCS2LE:
+        unit = 2;
+        pos = 2;
+        break;
+    case textUCS2BE:
+        unit = 2;
+        pos = 2;
+        bigendian = true;
+        break;
+    case textUCS4LE:
+        unit = 4;
+        pos = 4;
+        break;
+    case textUCS4BE:
+        unit = 4;
+        pos = 4;
+        bigendian = true;
+        break;
+    default:
+        unit = 1;
+        pos = 0;
+        break;
+    }
+    if (pos > count)
+    {
+        pos = count;
+    }
+    linenum = 0;
+    matches = 0;
+    headlen = 0;
+    long_line = false;
+    result = 0;
+
+    while (! result)
+    {
+        nl = grep_find_newline(worker->window + pos, count - pos, unit, bigendian);
+
+        if (nl >= 0 || at_eof)
+        {
+            if (nl < 0 && pos >= count && ! long_line)
+            {
+                // nothing after last line ending
+                break;
+            }
+            end = (nl >= 0) ? (pos + nl) : count;
+            if (grep_ends_in_cr(worker->window + pos, end - pos, unit, bigendian))
+            {
+                end -= unit;
+            }
+            if (long_line)
+            {
+                result = regex_match_feed(regex, &cursor, worker->window + pos, end - pos);
+                if (result == 0)
+                {
+                    result = regex_match_finish(regex, &cursor);
+                }
+            }
+            else
+            {
+                result = regex_match(regex, worker->window + pos, end - pos);
+            }
+            if (result < 0)
+            {
+                break;
+            }
+            if (result > 0)
+            {
+                result = 0;
+                matches++;
+                if (! (worker->search->options & regexCountOnly))
+                {
+                    if (long_line)
+                    {
+                        result = grep_deliver_line(worker, index, linenum, encoding, unit, worker->head, headlen);
+                    }
+                    else
+                    {
+                        result = grep_deliver_line(worker, index, linenum, encoding, unit, worker->window + pos, end - pos);
+                    }
+                }
+            }
+            linenum++;
+            long_line = false;
+
+            if (nl < 0)
+            {
+                break;
+            }
+            pos += nl + unit;
+            continue;
+        }
+        // no line ending in the rest of the window, so move the partial
+        // line to the start of the window and read more
+        //
+        if (pos == 0)
+        {
+            // line is longer than the window, match it in pieces keeping
+            // back the last code unit in case it's the CR of a CRLF
+            //
+            if (! long_line)
+            {
+                long_line = true;
+                headlen = (count > GREP_MAX_TEXT) ? GREP_MAX_TEXT : count;
+                memcpy(worker->head, worker->window, headlen);
+                result = regex_match_start(regex, &cursor);
+                if (result)
+                {
+                    break;
+                }
+            }
+            result = regex_match_feed(regex, &cursor, worker->window, count - unit);
+            if (result < 0)
+            {
+                break;
+            }
+            result = 0;
+            memmove(worker->window, worker->window + count - unit, unit);
+            count = unit;
+        }
+        else
+        {
+            memmove(worker->window, worker->window + pos, count - pos);
+            count -= pos;
+            pos = 0;
+        }
+        result = grep_fill(file, worker->window, count);
+        if (result < 0)
+        {
+            break;
+        }
+        count = (size_t)result;
+        at_eof = (count < GREP_WINDOW_SIZE);
+        result = 0;
+    }
+    file_destroy(file);
+
+    if (result < 0)
+    {
+        butil_log(2, "%s: Error searching %s\n", __FUNCTION__, worker->search->urls[index]);
+        return grep_deliver_file(worker, index, matches, result);
+    }
+    if (result)
+    {
+        return result;
+    }
+    if (worker->search->options & regexCountOnly)
+    {
+        return grep_deliver_file(worker, index, matches, 0);
+    }
+    return 0;
+}
+
+static int grep_compare_index(const void *a, const void *b)
+{
+    size_t ia = *(const size_t*)a;
+    size_t ib = *(const size_t*)b;
+
+    return (ia < ib) ? -1 : ((ia > ib) ? 1 : 0);
+}
+
+static void *grep_worker_thread(void *param)
+{
+    grep_worker_t *worker = (grep_worker_t*)param;
+    size_t index;
+    int result;
+
+    pthread_mutex_lock(&worker->search->lock);
+    while (! worker->search->started)
+    {
+        pthread_cond_wait(&worker->search->cond, &worker->search->lock);
+    }
+    pthread_mutex_unlock(&worker->search->lock);
+
+    while (grep_next_file(worker, &index))
+    {
+        result = grep_search_file(worker, index);
+        grep_file_done(worker->search, index);
+        if (result)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int grep_files(const char **urls, size_t nurls, const char *pattern, regex_options_t options, int threads, size_t memory_cap, grep_callback_t callback, void *priv)
+{
+    grep_search_t search;
+    grep_worker_t *workers;
+    bregex_t *check;
+    grep_held_t *held;
+    size_t n;
+    int result;
+    int i;
+    int e;
+
+    if (!urls || !pattern || !callback)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    check = regex_create(pattern, textUTF8, options, 0);
+    if (! check)
+    {
+        butil_log(1, "%s: Bad pattern %s\n", __FUNCTION__, pattern);
+        return -1;
+    }
+    regex_destroy(check);
+
+    if (! nurls)
+    {
+        return 0;
+    }
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > GREP_MAX_THREADS)
+    {
+        threads = GREP_MAX_THREADS;
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    if ((size_t)threads > nurls)
+    {
+        threads = (int)nurls;
+    }
+    memset(&search, 0, sizeof(search));
+    search.urls = urls;
+    search.nurls = nurls;
+    search.pattern = pattern;
+    search.options = options;
+    search.callback = callback;
+    search.priv = priv;
+    search.nthreads = threads;
+    search.memory_cap = memory_cap ? memory_cap : GREP_DEFAULT_MEMORY_CAP;
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_cond_init(&search.cond, NULL);
+
+    search.files = (grep_file_t*)calloc(nurls, sizeof(grep_file_t));
+    search.deques = (grep_deque_t*)calloc(threads, sizeof(grep_deque_t));
+    workers = (grep_worker_t*)calloc(threads, sizeof(grep_worker_t));
+    result = (search.files && search.deques && workers) ? 0 : -1;
+
+    for (i = 0; search.deques && i < threads; i++)
+    {
+        pthread_mutex_init(&search.deques[i].lock, NULL);
+    }
+
+    // deal files out in turn so each thread's first files are near the
+    // front of the list, where results are wanted first
+    //
+    for (i = 0; ! result && i < threads; i++)
+    {
+        search.deques[i].files = (size_t*)malloc(nurls * sizeof(size_t));
+        for (n = i; search.deques[i].files && n < nurls; n += threads)
+        {
+            search.deques[i].files[search.deques[i].tail++] = n;
+        }
+        workers[i].search = &search;
+        workers[i].id = i;
+        workers[i].window = (uint8_t*)malloc(GREP_WINDOW_SIZE);
+        workers[i].head = (uint8_t*)malloc(GREP_MAX_TEXT);
+        workers[i].text = (uint8_t*)malloc(GREP_MAX_TEXT * 4 + 4);
+        if (!search.deques[i].files || !workers[i].window || !workers[i].head || !workers[i].text)
+        {
+            butil_log(0, "%s: Can't alloc thread\n", __FUNCTION__);
+            result = -1;
+        }
+    }
+    if (! result)
+    {
+        // this thread is worker 0, the others wait until all are made
+        //
+        for (i = 1; i < threads; i++)
+        {
+            if (pthread_create(&workers[i].thread, NULL, grep_worker_thread, &workers[i]))
+            {
+                // no thread, so worker 0 takes its files, keeping them in order
+                //
+                butil_log(2, "%s: Can't make thread %d\n", __FUNCTION__, i);
+                workers[i].thread = 0;
+                while (search.deques[i].head < search.deques[i].tail)
+                {
+                    search.deques[0].files[search.deques[0].tail++] = search.deques[i].files[search.deques[i].head++];
+                }
+                qsort(search.deques[0].files, search.deques[0].tail, sizeof(size_t), grep_compare_index);
+            }
+        }
+        pthread_mutex_lock(&search.lock);
+        search.started = true;
+        pthread_cond_broadcast(&search.cond);
+        pthread_mutex_unlock(&search.lock);
+
+        grep_worker_thread(&workers[0]);
+
+        for (i = 1; i < threads; i++)
+        {
+            if (workers[i].thread)
+            {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+        result = search.stop ? 1 : 0;
+    }
+    // results can be left held only if the search stopped early
+    //
+    for (n = 0; search.files && n < nurls; n++)
+    {
+        while (search.files[n].first)
+        {
+            held = search.files[n].first;
+            search.files[n].first = held->next;
+            free(held);
+        }
+    }
+    for (i = 0; workers && i < threads; i++)
+    {
+        for (e = 0; e <= textUCS4BE; e++)
+        {
+            regex_destroy(workers[i].regex[e]);
+        }
+        free(workers[i].window);
+        free(workers[i].head);
+        free(workers[i].text);
+    }
+    for (i = 0; search.deques && i < threads; i++)
+    {
+        free(search.deques[i].files);
+        pthread_mutex_destroy(&search.deques[i].lock);
+    }
+    free(workers);
+    free(search.deques);
+    free(search.files);
+    pthread_cond_destroy(&search.cond);
+    pthread_mutex_destroy(&search.lock);
+    return result;
+}
+
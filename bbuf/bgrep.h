@@ -0,0 +1,95 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BGREP_H
+#define BGREP_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bfile.h"
+#include "bregex.h"
+
+/// \file
+///
+/// Searches many files for a regular expression on a pool of threads.
+/// Files are streamed through a fixed size window, split into lines in
+/// their own encoding and matched without building a line list, so a
+/// file of any size costs the same memory to search
+///
+/// Results are handed to a callback strictly in the order of the urls,
+/// and in line order within each file. Results for files finished ahead
+/// of their turn are held until then, up to a memory cap, after which
+/// the threads that made them wait
+
+/// Default bytes of results held for files finished ahead of their turn
+#define GREP_DEFAULT_MEMORY_CAP		(16*1024*1024) /* 16Mb */
+
+/// Bytes of file a thread reads at once
+#define GREP_WINDOW_SIZE			(256*1024)
+
+/// Most bytes of a matching line's text passed in a result
+#define GREP_MAX_TEXT				(4*1024)
+
+/// Most threads a search will use
+#define GREP_MAX_THREADS			64
+
+/// A search result
+///
+/// For each matching line, line is the line number (0 based) and text is
+/// the line's content in utf-8 without its line ending, cut off after
+/// GREP_MAX_TEXT bytes. When counting only, there is one result per file
+/// with count set and no text. A file that can't be searched gets one
+/// result with error set
+///
+typedef struct tag_grep_result
+{
+	const char	   *url;				///< url of file
+	size_t			file_index;			///< index of url in list of urls
+	size_t			line;				///< line number of match
+	const char	   *text;				///< line text, utf-8, not null terminated, NULL if none
+	size_t			length;				///< length of text in bytes
+	size_t			count;				///< matching lines in file, if counting only
+	int				error;				///< non-0 if file couldn't be searched
+}
+grep_result_t;
+
+/// Result callback
+///
+/// Called for each result, one at a time and in order, from any thread
+///
+/// @param[in] priv   - caller's context
+/// @param[in] result - the result, only valid during the call
+///
+/// @return 0 to continue, non-0 to stop searching
+///
+typedef int (*grep_callback_t)(void *priv, const grep_result_t *result);
+
+/// \brief Search files for lines matching a regular expression
+///
+/// @param[in] urls       - urls of files to search, opened with ::file_create
+/// @param[in] nurls      - count of urls
+/// @param[in] pattern    - regular expression, in utf-8
+/// @param[in] options    - see ::regex_options_t
+/// @param[in] threads    - threads to use, 0 for one per cpu
+/// @param[in] memory_cap - bytes of results to hold for out of order files, 0 for default
+/// @param[in] callback   - function to pass results to
+/// @param[in] priv       - context for callback
+///
+/// @return 0 on success, 1 if stopped by callback, < 0 on error (a bad pattern)
+///
+int grep_files(const char **urls, size_t nurls, const char *pattern, regex_options_t options, int threads, size_t memory_cap, grep_callback_t callback, void *priv);
+
+#endif
+
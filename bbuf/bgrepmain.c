@@ -0,0 +1,112 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgrep.h"
+#include "butil.h"
+
+static int grep_print(void *priv, const grep_result_t *result)
+{
+	size_t *matched = (size_t*)priv;
+
+	if (result->error)
+	{
+		fprintf(stderr, "bgrep: can't search %s\n", result->url);
+		return 0;
+	}
+	if (! result->text)
+	{
+		printf("%s:%u\n", result->url, (unsigned)result->count);
+		*matched += result->count;
+		return 0;
+	}
+	printf("%s:%u:%.*s\n", result->url, (unsigned)(result->line + 1), (int)result->length, result->text);
+	*matched += 1;
+	return 0;
+}
+
+static int usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i] [-c] [-j threads] [-m megabytes] [-v loglevel] pattern url...\n", progname);
+	fprintf(stderr, "  -i  ignore case\n");
+	fprintf(stderr, "  -c  only count matching lines in each file\n");
+	fprintf(stderr, "  -j  threads to use, default one per cpu\n");
+	fprintf(stderr, "  -m  megabytes of results to hold for files found out of order\n");
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	regex_options_t options;
+	const char *progname;
+	const char *pattern;
+	size_t memory_cap;
+	size_t matched;
+	int threads;
+	int result;
+	int argn;
+
+	progname = argv[0];
+	options = 0;
+	threads = 0;
+	memory_cap = 0;
+
+	butil_set_log_level(0);
+
+	for (argn = 1; argn < argc && argv[argn][0] == '-'; argn++)
+	{
+		if (! strcmp(argv[argn], "-i"))
+		{
+			options |= regexIgnoreCase;
+		}
+		else if (! strcmp(argv[argn], "-c"))
+		{
+			options |= regexCountOnly;
+		}
+		else if (! strcmp(argv[argn], "-j") && (argn + 1) < argc)
+		{
+			threads = strtol(argv[++argn], NULL, 0);
+		}
+		else if (! strcmp(argv[argn], "-m") && (argn + 1) < argc)
+		{
+			memory_cap = strtoul(argv[++argn], NULL, 0) * 1024 * 1024;
+		}
+		else if (! strcmp(argv[argn], "-v") && (argn + 1) < argc)
+		{
+			butil_set_log_level(strtol(argv[++argn], NULL, 0));
+		}
+		else
+		{
+			return usage(progname);
+		}
+	}
+	if ((argn + 2) > argc)
+	{
+		return usage(progname);
+	}
+	pattern = argv[argn++];
+	matched = 0;
+
+	result = grep_files((const char **)(argv + argn), argc - argn, pattern, options, threads, memory_cap, grep_print, &matched);
+	if (result < 0)
+	{
+		return 2;
+	}
+	return matched ? 0 : 1;
+}
+
@@ -0,0 +1,614 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bjournal.h"
+#include "bfile.h"
+#include "bfilesys.h"
+#include "butil.h"
+
+#include <errno.h>
+
+/// \file
+///
+
+/// Identifies a journal file
+#define JOURNAL_MAGIC		0x4E524A42 /* BJRN */
+
+/// Starts each entry
+#define JOURNAL_ENTRY_MAGIC	0x544E454A /* JENT */
+
+/// Version of journal layout
+#define JOURNAL_VERSION		1
+
+/// Bytes read at once when replaying
+#define JOURNAL_READ_SIZE	(64*1024)
+
+/// \brief Header of a journal file
+///
+typedef struct tag_journal_header
+{
+	uint32_t		magic;
+	uint32_t		version;
+	uint64_t		file_size;			///< size of file edits apply to
+	int64_t			mod_time;			///< modification time of file edits apply to
+}
+journal_header_t;
+
+/// \brief Header of a journal entry, followed by its text then text2
+///
+typedef struct tag_journal_entry
+{
+	uint32_t		magic;
+	uint32_t		check;				///< checksum of entry, with check 0, and its text
+	uint32_t		op;
+	uint32_t		options;
+	uint64_t		line;
+	uint64_t		column;
+	uint64_t		count;
+	uint64_t		text_length;
+	uint64_t		text2_length;
+}
+journal_entry_t;
+
+/// \brief Buffered reader for replay
+///
+typedef struct tag_journal_reader
+{
+	file_t		   *file;
+	uint8_t		   *data;
+	size_t			count;				///< bytes in data
+	size_t			tail;				///< bytes of data used
+}
+journal_reader_t;
+
+static uint32_t journal_checksum(uint32_t hash, const uint8_t *data, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int journal_sidecar_url(const char *url, char *sidecar, size_t nsidecar)
+{
+    int len;
+
+    if (!url || !sidecar)
+    {
+        return -1;
+    }
+    len = snprintf(sidecar, nsidecar, "%s%s", url, JOURNAL_SIDECAR_EXTENSION);
+    if (len < 0 || (size_t)len >= nsidecar)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/// \brief Read bytes for replay
+///
+/// @return 0 if all count bytes were read
+///
+static int journal_read(journal_reader_t *reader, uint8_t *data, size_t count)
+{
+    size_t avail;
+    int result;
+
+    while (count)
+    {
+        if (reader->tail >= reader->count)
+        {
+            result = reader->file->file_read(reader->file, reader->data, JOURNAL_READ_SIZE);
+            if (result <= 0)
+            {
+                return -1;
+            }
+            reader->count = result;
+            reader->tail = 0;
+        }
+        avail = reader->count - reader->tail;
+        if (avail > count)
+        {
+            avail = count;
+        }
+        memcpy(data, reader->data + reader->tail, avail);
+        reader->tail += avail;
+        data += avail;
+        count -= avail;
+    }
+    return 0;
+}
+
+/// \brief Pass each good entry of a journal file to a callback
+///
+/// @param[in]  file     - journal file, positioned after header
+/// @param[in]  limit    - bytes in the file after the header
+/// @param[in]  replay   - callback
+/// @param[in]  priv     - context for callback
+/// @param[out] good_end - bytes of entries replayed, up to the first that failed
+///
+/// @return count of entries replayed
+///
+static size_t journal_replay_entries(file_t *file, uint64_t limit, journal_replay_t replay, void *priv, uint64_t *good_end)
+{
+    journal_reader_t reader;
+    journal_entry_t entry;
+    journal_rec_t rec;
+    uint8_t *text;
+    uint32_t check;
+    uint64_t used;
+    size_t replayed;
+
+    *good_end = 0;
+
+    reader.file = file;
+    reader.data = (uint8_t*)malloc(JOURNAL_READ_SIZE);
+    reader.count = 0;
+    reader.tail = 0;
+    if (! reader.data)
+    {
+        return 0;
+    }
+    replayed = 0;
+    used = 0;
+
+    while (! journal_read(&reader, (uint8_t*)&entry, sizeof(entry)))
+    {
+        used += sizeof(entry);
+        if (
+                entry.magic != JOURNAL_ENTRY_MAGIC
+            ||  entry.text_length > limit || entry.text2_length > limit
+            ||  (used + entry.text_length + entry.text2_length) > limit
+        )
+        {
+            break;
+        }
+        text = (uint8_t*)malloc(entry.text_length + entry.text2_length + 1);
+        if (! text)
+        {
+            break;
+        }
+        if (journal_read(&reader, text, entry.text_length + entry.text2_length))
+        {
+            free(text);
+            break;
+        }
+        check = entry.check;
+        entry.check = 0;
+        if (check != journal_checksum(journal_checksum(2166136261u, (uint8_t*)&entry, sizeof(entry)),
+                                        text, entry.text_length + entry.text2_length))
+        {
+            butil_log(2, "%s: Damaged entry after %u edits\n", __FUNCTION__, replayed);
+            free(text);
+            break;
+        }
+        used += entry.text_length + entry.text2_length;
+
+        if (replay)
+        {
+            rec.op = (journal_op_t)entry.op;
+            rec.line = entry.line;
+            rec.column = entry.column;
+            rec.count = entry.count;
+            rec.options = entry.options;
+            rec.text = text;
+            rec.text_length = entry.text_length;
+            rec.text2 = text + entry.text_length;
+            rec.text2_length = entry.text2_length;
+
+            if (replay(priv, &rec))
+            {
+                // new entries go over this one and what follows, which
+                // were made on a buffer that replay couldn't rebuild
+                //
+                butil_log(1, "%s: Replay stopped at edit %u\n", __FUNCTION__, replayed);
+                free(text);
+                break;
+            }
+        }
+        *good_end = used;
+        free(text);
+        replayed++;
+    }
+    free(reader.data);
+    return replayed;
+}
+
+/// \brief Start a journal file over with just a header
+///
+/// @return 0 on success
+///
+static int journal_start_file(journal_t *journal, uint64_t file_size, time_t mod_time)
+{
+    journal_header_t header;
+    int count;
+
+    if (journal->file)
+    {
+        file_destroy(journal->file);
+    }
+    journal->file = file_create(journal->url, openForWrite);
+    if (! journal->file)
+    {
+        butil_log(1, "%s: Can't create %s\n", __FUNCTION__, journal->url);
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.file_size = file_size;
+    header.mod_time = (int64_t)mod_time;
+
+    count = journal->file->file_write(journal->file, (uint8_t*)&header, sizeof(header));
+    if (count != sizeof(header))
+    {
+        butil_log(1, "%s: Can't write %s\n", __FUNCTION__, journal->url);
+        return -1;
+    }
+    if (journal->file->file_sync)
+    {
+        journal->file->file_sync(journal->file);
+    }
+    journal->size = sizeof(header);
+    return 0;
+}
+
+/// \brief Write the queued entries of a journal and sync them
+///
+/// @return 0 on success
+///
+static int journal_flush(journal_t *journal)
+{
+    uint8_t *swap;
+    size_t swap_size;
+    size_t count;
+    size_t total;
+    bool failed;
+    int wc;
+    int result;
+
+    pthread_mutex_lock(&journal->io_lock);
+
+    // take the queue so edits can keep adding to an empty one
+    //
+    pthread_mutex_lock(&journal->lock);
+    swap = journal->writing;
+    swap_size = journal->writing_size;
+    journal->writing = journal->pending;
+    journal->writing_size = journal->pending_size;
+    journal->pending = swap;
+    journal->pending_size = swap_size;
+    count = journal->npending;
+    journal->npending = 0;
+    failed = journal->failed;
+    pthread_mutex_unlock(&journal->lock);
+
+    result = 0;
+    if (count && journal->file && ! failed)
+    {
+        for (total = 0; total < count; total += wc)
+        {
+            wc = journal->file->file_write(journal->file, journal->writing + total, count - total);
+            if (wc <= 0)
+            {
+                break;
+            }
+        }
+        if (total < count)
+        {
+            butil_log(0, "%s: Can't write %s, journal stopped\n", __FUNCTION__, journal->url);
+            pthread_mutex_lock(&journal->lock);
+            journal->failed = true;
+            pthread_mutex_unlock(&journal->lock);
+            result = -1;
+        }
+        else
+        {
+            journal->size += count;
+            if (journal->file->file_sync && journal->file->file_sync(journal->file) < 0)
+            {
+                butil_log(1, "%s: Can't sync %s\n", __FUNCTION__, journal->url);
+                result = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal->io_lock);
+    return result;
+}
+
+/// \brief Group commit thread, writes and syncs queued entries each interval
+///
+static void *journal_thread(void *param)
+{
+    journal_t *journal = (journal_t*)param;
+    struct timespec when;
+    bool flush;
+
+    pthread_mutex_lock(&journal->lock);
+    while (! journal->stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &when);
+        when.tv_sec += journal->interval / 1000;
+        when.tv_nsec += (long)(journal->interval % 1000) * 1000000;
+        if (when.tv_nsec >= 1000000000)
+        {
+            when.tv_sec++;
+            when.tv_nsec -= 1000000000;
+        }
+        while (! journal->stop)
+        {
+            if (pthread_cond_timedwait(&journal->wake, &journal->lock, &when) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+        flush = journal->npending > 0;
+        if (flush)
+        {
+            pthread_mutex_unlock(&journal->lock);
+            journal_flush(journal);
+            pthread_mutex_lock(&journal->lock);
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+journal_t *journal_open(const char *url, uint64_t file_size, time_t mod_time, int interval,
+                        journal_replay_t replay, void *priv)
+{
+    journal_header_t header;
+    journal_t *journal;
+    file_t *file;
+    size_t journal_size;
+    time_t journal_time;
+    uint64_t good_end;
+    size_t replayed;
+    bool valid;
+    int count;
+
+    if (! url)
+    {
+        return NULL;
+    }
+    journal = (journal_t*)malloc(sizeof(journal_t));
+    if (! journal)
+    {
+        butil_log(0, "%s: Can't alloc journal\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(journal, 0, sizeof(journal_t));
+    strncpy(journal->url, url, sizeof(journal->url) - 1);
+    journal->url[sizeof(journal->url) - 1] = '\0';
+    journal->interval = (interval < 0) ? JOURNAL_DEFAULT_INTERVAL : interval;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_mutex_init(&journal->io_lock, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+
+    // replay what's there if it applies to the file as it is
+    //
+    valid = false;
+    good_end = 0;
+
+    filesys_forget_info(url);
+    if (! filesys_info(url, &journal_size, &journal_time))
+    {
+        file = file_create(url, openForRead);
+        if (file)
+        {
+            count = file->file_read(file, (uint8_t*)&header, sizeof(header));
+            if (
+                    count == sizeof(header)
+                &&  header.magic == JOURNAL_MAGIC
+                &&  header.version == JOURNAL_VERSION
+                &&  header.file_size == file_size
+                &&  header.mod_time == (int64_t)mod_time
+            )
+            {
+                valid = true;
+                replayed = journal_replay_entries(file, journal_size - sizeof(header), replay, priv, &good_end);
+                butil_log(3, "%s: Replayed %u edits from %s\n", __FUNCTION__, replayed, url);
+            }
+            else
+            {
+                butil_log(2, "%s: %s is stale or not a journal, starting over\n", __FUNCTION__, url);
+            }
+            file_destroy(file);
+        }
+    }
+    if (valid)
+    {
+        // add after the last good entry, over anything torn
+        //
+        journal->file = file_create(url, openForAppend);
+        if (journal->file)
+        {
+            journal->size = sizeof(header) + good_end;
+            journal->file->file_seek(journal->file, journal->size);
+        }
+    }
+    else
+    {
+        journal_start_file(journal, file_size, mod_time);
+    }
+    if (! journal->file || ! journal->size)
+    {
+        journal_close(journal, false);
+        return NULL;
+    }
+    if (journal->interval > 0)
+    {
+        if (pthread_create(&journal->thread, NULL, journal_thread, journal))
+        {
+            // sync each edit instead
+            butil_log(1, "%s: Can't start sync thread\n", __FUNCTION__);
+            journal->interval = 0;
+        }
+        else
+        {
+            journal->thread_running = true;
+        }
+    }
+    return journal;
+}
+
+void journal_close(journal_t *journal, bool remove)
+{
+    if (! journal)
+    {
+        return;
+    }
+    if (journal->thread_running)
+    {
+        pthread_mutex_lock(&journal->lock);
+        journal->stop = true;
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->thread, NULL);
+        journal->thread_running = false;
+    }
+    if (journal->file)
+    {
+        journal_flush(journal);
+        file_destroy(journal->file);
+    }
+    if (remove)
+    {
+        filesys_delete(journal->url);
+    }
+    if (journal->pending)
+    {
+        free(journal->pending);
+    }
+    if (journal->writing)
+    {
+        free(journal->writing);
+    }
+    pthread_cond_destroy(&journal->wake);
+    pthread_mutex_destroy(&journal->io_lock);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+}
+
+int journal_append(journal_t *journal, const journal_rec_t *rec)
+{
+    journal_entry_t entry;
+    uint8_t *pending;
+    size_t need;
+    size_t newsize;
+    uint32_t check;
+
+    if (! journal || ! rec)
+    {
+        return -1;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = JOURNAL_ENTRY_MAGIC;
+    entry.op = (uint32_t)rec->op;
+    entry.options = rec->options;
+    entry.line = rec->line;
+    entry.column = rec->column;
+    entry.count = rec->count;
+    entry.text_length = rec->text_length;
+    entry.text2_length = rec->text2_length;
+
+    check = journal_checksum(2166136261u, (uint8_t*)&entry, sizeof(entry));
+    check = journal_checksum(check, rec->text, rec->text_length);
+    check = journal_checksum(check, rec->text2, rec->text2_length);
+    entry.check = check;
+
+    need = sizeof(entry) + rec->text_length + rec->text2_length;
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        return -1;
+    }
+    if ((journal->npending + need) > journal->pending_size)
+    {
+        newsize = journal->pending_size ? journal->pending_size : 4096;
+        while (newsize < (journal->npending + need))
+        {
+            newsize *= 2;
+        }
+        pending = (uint8_t*)realloc(journal->pending, newsize);
+        if (! pending)
+        {
+            journal->failed = true;
+            pthread_mutex_unlock(&journal->lock);
+            butil_log(0, "%s: Can't grow journal queue, journal stopped\n", __FUNCTION__);
+            return -1;
+        }
+        journal->pending = pending;
+        journal->pending_size = newsize;
+    }
+    memcpy(journal->pending + journal->npending, &entry, sizeof(entry));
+    journal->npending += sizeof(entry);
+    if (rec->text_length)
+    {
+        memcpy(journal->pending + journal->npending, rec->text, rec->text_length);
+        journal->npending += rec->text_length;
+    }
+    if (rec->text2_length)
+    {
+        memcpy(journal->pending + journal->npending, rec->text2, rec->text2_length);
+        journal->npending += rec->text2_length;
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    if (journal->interval == 0)
+    {
+        return journal_flush(journal);
+    }
+    return 0;
+}
+
+int journal_sync(journal_t *journal)
+{
+    if (! journal)
+    {
+        return -1;
+    }
+    return journal_flush(journal);
+}
+
+int journal_reset(journal_t *journal, uint64_t file_size, time_t mod_time)
+{
+    int result;
+
+    if (! journal)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&journal->io_lock);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->npending = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    result = journal_start_file(journal, file_size, mod_time);
+    pthread_mutex_lock(&journal->lock);
+    journal->failed = (result != 0);
+    pthread_mutex_unlock(&journal->lock);
+
+    pthread_mutex_unlock(&journal->io_lock);
+    return result;
+}
+
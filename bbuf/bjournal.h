@@ -0,0 +1,176 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BJOURNAL_H
+#define BJOURNAL_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "bfile.h"
+
+/// \file
+///
+/// An edit journal is an append-only file of the edits made to a buffer,
+/// written ahead of each edit, kept in a sidecar file next to the buffer's
+/// file. Its header holds the size and modification time of the file the
+/// edits apply to, so a journal left behind by a process that died can be
+/// replayed on top of the same file, and is ignored if the file changed
+///
+/// Edits are queued in memory and written and synced to disk in groups,
+/// by a thread, on an interval, so editing never waits for the disk.
+/// Each entry has a checksum, and replay stops at the first entry that
+/// is torn or damaged
+
+/// Extension added to a file's name to make its journal name
+#define JOURNAL_SIDECAR_EXTENSION	".journal"
+
+/// Default milliseconds between syncs of a journal
+#define JOURNAL_DEFAULT_INTERVAL	(200)
+
+/// Operations in a journal
+///
+typedef enum
+{
+	journalInsertText,					///< ::buffer_insert_text
+	journalDeleteText,					///< ::buffer_delete_text
+	journalInsertLines,					///< ::buffer_insert_lines
+	journalDeleteLines,					///< ::buffer_delete_lines
+	journalBeginGroup,					///< ::buffer_begin_undo_group
+	journalEndGroup,					///< ::buffer_end_undo_group
+	journalUndo,						///< ::buffer_undo
+	journalRedo,						///< ::buffer_redo
+	journalReplaceAll,					///< ::buffer_replace_all
+	journalSealUndo						///< ::buffer_seal_undo
+}
+journal_op_t;
+
+/// An edit in a journal
+///
+typedef struct tag_journal_rec
+{
+	journal_op_t	op;					///< operation
+	uint64_t		line;				///< line edited
+	uint64_t		column;				///< byte offset in line edited
+	uint64_t		count;				///< bytes or lines deleted
+	uint32_t		options;			///< find options, for journalReplaceAll
+	const uint8_t  *text;				///< text inserted, or needle
+	size_t			text_length;		///< bytes of text
+	const uint8_t  *text2;				///< replacement, for journalReplaceAll
+	size_t			text2_length;		///< bytes of text2
+}
+journal_rec_t;
+
+/// Journal - the edit journal of a buffer
+///
+typedef struct tag_journal
+{
+	char			url[MAX_PATH];		///< url of journal file
+	file_t		   *file;				///< journal file, for writing
+	uint64_t		size;				///< bytes written to file
+	uint8_t		   *pending;			///< entries not yet written
+	size_t			npending;			///< bytes in pending
+	size_t			pending_size;		///< bytes allocated for pending
+	uint8_t		   *writing;			///< entries being written, swapped with pending
+	size_t			writing_size;		///< bytes allocated for writing
+	int				interval;			///< milliseconds between syncs, 0 to sync each entry
+	bool			failed;				///< journal couldn't be written, stopped
+	pthread_mutex_t	lock;				///< protects pending, failed and stop
+	pthread_mutex_t	io_lock;			///< serializes writes and syncs
+	pthread_cond_t	wake;				///< wakes the sync thread
+	pthread_t		thread;				///< sync thread
+	bool			thread_running;		///< sync thread was started
+	bool			stop;				///< tells sync thread to end
+}
+journal_t;
+
+/// Replay callback
+///
+/// @param[in] priv - caller's context
+/// @param[in] rec  - the edit, only valid during the call
+///
+/// @return 0 to continue, non-0 to stop replay
+///
+typedef int (*journal_replay_t)(void *priv, const journal_rec_t *rec);
+
+/// \brief Make the url of the journal file for a file
+///
+/// @param[in]  url      - url of file
+/// @param[out] sidecar  - gets url of journal
+/// @param[in]  nsidecar - size of sidecar in bytes
+///
+/// @return 0 on success
+///
+int journal_sidecar_url(const char *url, char *sidecar, size_t nsidecar);
+
+/// \brief Open a journal, replaying any edits already in it
+///
+/// If the journal exists and was started on the file as it is now, each
+/// edit in it is passed to the replay callback and new edits are added
+/// after them. Otherwise a new, empty journal is started
+///
+/// @param[in] url       - url of journal file
+/// @param[in] file_size - current size of file journaled
+/// @param[in] mod_time  - current modification time of file journaled
+/// @param[in] interval  - milliseconds between syncs, 0 to sync each edit, < 0 for default
+/// @param[in] replay    - callback for edits already in journal, may be NULL
+/// @param[in] priv      - context for callback
+///
+/// @return the journal, or NULL on error
+///
+journal_t *journal_open(const char *url, uint64_t file_size, time_t mod_time, int interval,
+						journal_replay_t replay, void *priv);
+
+/// \brief Sync and close a journal
+///
+/// @param[in] journal - journal to close
+/// @param[in] remove  - true to delete the journal file, once edits aren't needed
+///
+void journal_close(journal_t *journal, bool remove);
+
+/// \brief Add an edit to a journal
+///
+/// The edit is written and synced by the next group commit, or before
+/// returning if the journal's interval is 0
+///
+/// @param[in] journal - journal to add to
+/// @param[in] rec     - edit to add
+///
+/// @return 0 on success
+///
+int journal_append(journal_t *journal, const journal_rec_t *rec);
+
+/// \brief Write and sync all edits added to a journal now
+///
+/// @param[in] journal - journal to sync
+///
+/// @return 0 on success
+///
+int journal_sync(journal_t *journal);
+
+/// \brief Empty a journal and start it over on a file
+///
+/// For when the edits so far have been saved to the file
+///
+/// @param[in] journal   - journal to reset
+/// @param[in] file_size - current size of file journaled
+/// @param[in] mod_time  - current modification time of file journaled
+///
+/// @return 0 on success
+///
+int journal_reset(journal_t *journal, uint64_t file_size, time_t mod_time);
+
+#endif
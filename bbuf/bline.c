@@ -28,6 +28,8 @@ line_t *line_create_from_location(uint64_t offset, size_t length)
         return NULL;
     }
     line->location = lineInFile;
+    line->generation = 0;
+    line->attributes = 0;
     line->position.offset = offset;
     line->length = length;
     return line;
@@ -43,6 +45,8 @@ line_t *line_create_from_data(uint8_t *data, size_t length, bool copy)
         return NULL;
     }
     line->location = lineInMemory;
+    line->generation = 0;
+    line->attributes = 0;
     if (copy)
     {
         uint8_t *newdata = (uint8_t*)malloc(length + 1);
@@ -60,4 +64,212 @@ line_t *line_create_from_data(uint8_t *data, size_t length, bool copy)
     return line;
 }
 
+size_t line_data_size(const line_t *line)
+{
+    switch (line->location)
+    {
+    case lineInMemory:
+        return line->position.data ? line->length + 1 : 0;
+    case lineInPieces:
+        return line->position.pieces ? line->position.pieces->size : 0;
+    default:
+        return 0;
+    }
+}
+
+/// \brief Add a run to the end of pieces being made, joining it to the last if they touch
+///
+/// @param[in] pieces - pieces being made, with room for one more
+/// @param[in] in_file - run is in the file
+/// @param[in] offset - offset of run in file, or in the pieces' text if text is NULL
+/// @param[in] text   - bytes of run to add to the text, if not in_file
+/// @param[in] length - length of run in bytes
+///
+static void line_pieces_add(line_pieces_t *pieces, bool in_file, uint64_t offset, const uint8_t *text, size_t length)
+{
+    line_piece_t *last;
+
+    if (! length)
+    {
+        return;
+    }
+    if (! in_file && text)
+    {
+        // text is always added at the end, so a text run before it ends where this starts
+        //
+        memcpy(LINE_PIECES_TEXT(pieces) + pieces->text_length, text, length);
+        offset = pieces->text_length;
+        pieces->text_length += length;
+    }
+    last = pieces->count ? &pieces->piece[pieces->count - 1] : NULL;
+    if (last && last->in_file == in_file && (last->offset + last->length) == offset)
+    {
+        last->length += length;
+        return;
+    }
+    last = &pieces->piece[pieces->count++];
+    last->in_file = in_file;
+    last->offset = offset;
+    last->length = length;
+}
+
+/// \brief Make the pieces of a line with a range replaced
+///
+/// @param[in] pieces  - pieces being made, with room for two more than src
+/// @param[in] src     - pieces of the line as it is
+/// @param[in] npieces - count of src
+/// @param[in] srctext - text of src's pieces to copy, NULL if it's pieces' own text
+/// @param[in] column  - byte offset in line of range
+/// @param[in] count   - bytes in range to remove
+/// @param[in] text    - text to put in place of range
+/// @param[in] length  - length of text in bytes
+///
+static void line_pieces_splice(line_pieces_t *pieces, const line_piece_t *src, size_t npieces, const uint8_t *srctext,
+                                uint64_t column, size_t count, const uint8_t *text, size_t length)
+{
+    line_piece_t piece;
+    size_t i;
+    uint64_t start;
+    uint64_t end;
+    uint64_t from;
+    uint64_t to;
+    bool inserted;
+
+    inserted = false;
+    for (i = 0, start = 0; i < npieces; i++, start = end)
+    {
+        // pieces made in place can overwrite the one being read
+        //
+        piece = src[i];
+        end = start + piece.length;
+
+        // part before the range
+        //
+        if (start < column)
+        {
+            to = (end < column) ? end : column;
+            line_pieces_add(pieces, piece.in_file, piece.offset,
+                    (piece.in_file || ! srctext) ? NULL : srctext + piece.offset, (size_t)(to - start));
+        }
+        if (! inserted && column <= end)
+        {
+            line_pieces_add(pieces, false, 0, text, length);
+            inserted = true;
+        }
+        // part after the range
+        //
+        if (end > (column + count))
+        {
+            from = (start > (column + count)) ? start : (column + count);
+            line_pieces_add(pieces, piece.in_file, piece.offset + (from - start),
+                    (piece.in_file || ! srctext) ? NULL : srctext + piece.offset + (from - start), (size_t)(end - from));
+        }
+    }
+    if (! inserted)
+    {
+        line_pieces_add(pieces, false, 0, text, length);
+    }
+}
+
+line_pieces_t *line_pieces_edit(const line_t *line, uint64_t column, size_t count, const uint8_t *text, size_t length)
+{
+    const line_pieces_t *old;
+    const line_piece_t *src;
+    line_piece_t whole;
+    line_pieces_t *pieces;
+    size_t npieces;
+    size_t slots;
+    size_t text_size;
+
+    if (line->location == lineInPieces)
+    {
+        old = line->position.pieces;
+        src = old->piece;
+        npieces = old->count;
+        text_size = old->text_length;
+    }
+    else if (line->location == lineInFile)
+    {
+        old = NULL;
+        whole.offset = line->position.offset;
+        whole.length = line->length;
+        whole.in_file = true;
+        src = &whole;
+        npieces = 1;
+        text_size = 0;
+    }
+    else
+    {
+        return NULL;
+    }
+    // an edit splits at most one piece in two and adds one, the first
+    // edit gets just that, later ones twice what they need so the edits
+    // after them fit in place
+    //
+    slots = npieces + 2;
+    text_size += length;
+    if (old)
+    {
+        slots *= 2;
+        text_size *= 2;
+    }
+    pieces = (line_pieces_t*)malloc(sizeof(line_pieces_t) + slots * sizeof(line_piece_t) + text_size);
+    if (! pieces)
+    {
+        return NULL;
+    }
+    pieces->size = sizeof(line_pieces_t) + slots * sizeof(line_piece_t) + text_size;
+    pieces->slots = slots;
+    pieces->count = 0;
+    pieces->text_offset = sizeof(line_pieces_t) + slots * sizeof(line_piece_t);
+    pieces->text_length = 0;
+
+    // only text still in the line is copied, so the new pieces start without
+    // what was deleted
+    //
+    line_pieces_splice(pieces, src, npieces, old ? LINE_PIECES_TEXT(old) : NULL, column, count, text, length);
+    return pieces;
+}
+
+bool line_pieces_room(const line_t *line, size_t length)
+{
+    const line_pieces_t *pieces;
+
+    if (line->location != lineInPieces)
+    {
+        return false;
+    }
+    pieces = line->position.pieces;
+    return (pieces->count + 2) <= pieces->slots
+        && length <= (pieces->size - pieces->text_offset - pieces->text_length);
+}
+
+void line_pieces_edit_in_place(line_t *line, uint64_t column, size_t count, const uint8_t *text, size_t length)
+{
+    line_pieces_t *pieces;
+    size_t npieces;
+
+    pieces = line->position.pieces;
+    npieces = pieces->count;
+
+    // move the pieces up past the two an edit can add, and remake them
+    // from there, the text stays where it is and the new text goes after it
+    //
+    memmove(pieces->piece + 2, pieces->piece, npieces * sizeof(line_piece_t));
+    pieces->count = 0;
+    line_pieces_splice(pieces, pieces->piece + 2, npieces, NULL, column, count, text, length);
+}
+
+void line_destroy(line_t *line)
+{
+    if (! line)
+    {
+        return;
+    }
+    if (line->location != lineInFile && line->location != lineInBlock && line->position.data)
+    {
+        free(line->position.data);
+    }
+    free(line);
+}
 
@@ -27,6 +27,14 @@
 ///
 #define	lineStartsSpanningComment	0x0001	///< the line starts a spanning comment block
 #define lineEndsSpanningComment		0x0002	///< the line ends a spanning comment block
+#define lineSyntaxValid				0x0100	///< the lexer state cached in the line is current
+#define lineTouched					0x0200	///< the line's text was used since the last packing pass, see ::buffer_pack_lines
+
+/// Lexer state at the end of a line is cached in the top bits of its attributes
+#define LINE_SYNTAX_SHIFT			(16)
+
+/// \brief Lexer state cached in a line's attributes
+#define LINE_SYNTAX_STATE(attributes)	((uint8_t)((attributes) >> LINE_SYNTAX_SHIFT))
 
 /// Attributes a line can have
 ///
@@ -36,26 +44,69 @@ typedef uint32_t line_attribute_t;
 ///
 typedef uint16_t unicode_char_t;
 
+/// A run of a line's bytes, in the file or in the text of its pieces
+///
+typedef struct tag_line_piece
+{
+	uint64_t	offset;		///< offset into the file, or into the pieces' text
+	size_t		length;		///< length of run in bytes
+	bool		in_file;	///< run is in the file
+}
+line_piece_t;
+
+/// Pieces of a long line edited in place, one allocation
+///
+/// Offsets of text are from the start of the allocation, so a copy
+/// made with memcpy is as good as the original. There is room for more
+/// pieces and text than are used, so most edits are made in place,
+/// adding their text after what is there
+///
+typedef struct tag_line_pieces
+{
+	size_t		size;		///< bytes allocated for all of this
+	size_t		slots;		///< room for pieces
+	size_t		count;		///< pieces in the line
+	size_t		text_offset;	///< offset of text of pieces not in the file
+	size_t		text_length;	///< bytes of text used, some by pieces deleted since
+	line_piece_t piece[];	///< the pieces, in order
+}
+line_pieces_t;
+
+/// Text of pieces not in the file
+#define LINE_PIECES_TEXT(p)	((uint8_t*)(p) + (p)->text_offset)
+
 /// Line - represents a line in a file
 ///
 /// The line exists in either a file or in memory
 ///   If in a file, the location is specified
 ///   by an offset into the file
 ///   If in memory, the location is a pointer to the allocated buffer
+///   If in pieces, the line is a list of runs of the file and of
+///   inserted text, so editing a line too long to load only costs
+///   what the edit adds
+///   If in a block, the line's text is compressed along with the text
+///   of lines near it, see ::buffer_pack_lines
 ///
 typedef struct tag_line
 {
 	enum
 	{
 		lineInFile,			///< the line is in the file
-		lineInMemory		///< the line has been buffered in memory
+		lineInMemory,		///< the line has been buffered in memory
+		lineInPieces,		///< the line is pieces of the file and memory
+		lineInBlock			///< the line is packed in a block of lines in memory
 	}
 	location;				///< the line's location
 	
+	/// Snapshot generation the line's state was made in, see ::version_preserve
+	uint32_t generation;
+	
 	union
 	{
 		uint64_t offset;	///< offset into the file, if location is lineInFile
 		char   	*data;		///< buffered line data, if location is lineInMemory
+		line_pieces_t *pieces;	///< pieces of line, if location is lineInPieces
+		struct tag_line_block *block;	///< block line is packed in, if location is lineInBlock
 	}
 	position;				///< the lines position in its location
 
@@ -89,4 +140,55 @@ line_t *line_create_from_location(uint64_t offset, size_t length);
 ///
 line_t *line_create_from_data(uint8_t *data, size_t length, bool copy);
 
+/// \brief Get the bytes of memory a line's content owns
+///
+/// @param[in] line - line to size
+///
+/// @return bytes allocated for data or pieces, 0 if in the file or a block
+///
+size_t line_data_size(const line_t *line);
+
+/// \brief Replace a range of bytes of a line, making it pieces
+///
+/// Makes new pieces for the line with the range replaced, leaving the
+/// line as it is. The line must be in the file or in pieces
+///
+/// @param[in] line   - line to edit
+/// @param[in] column - byte offset in line of range
+/// @param[in] count  - bytes in range to remove
+/// @param[in] text   - text to put in place of range
+/// @param[in] length - length of text in bytes
+///
+/// @return the new pieces, or NULL if no memory
+///
+line_pieces_t *line_pieces_edit(const line_t *line, uint64_t column, size_t count, const uint8_t *text, size_t length);
+
+/// \brief Check if an edit fits in the room a line's pieces have
+///
+/// @param[in] line   - line to edit
+/// @param[in] length - length of text the edit adds
+///
+/// @return true if the line is in pieces and ::line_pieces_edit_in_place can make the edit
+///
+bool line_pieces_room(const line_t *line, size_t length);
+
+/// \brief Replace a range of bytes of a line in pieces, in the room they have
+///
+/// Only the new text is copied, so edits in place cost what they add.
+/// Check there is room with ::line_pieces_room first
+///
+/// @param[in] line   - line to edit, its length is left for the caller
+/// @param[in] column - byte offset in line of range
+/// @param[in] count  - bytes in range to remove
+/// @param[in] text   - text to put in place of range
+/// @param[in] length - length of text in bytes
+///
+void line_pieces_edit_in_place(line_t *line, uint64_t column, size_t count, const uint8_t *text, size_t length);
+
+/// \brief Destroy a line, and its data if in memory
+///
+/// @param[in] line - line to destroy, which must not be in a buffer's list
+///
+void line_destroy(line_t *line);
+
 #endif
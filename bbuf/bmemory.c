@@ -0,0 +1,501 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bmemory.h"
+#include "bcolumn.h"
+#include "bpack.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// Buffers counted, and the memory they hold
+static pthread_mutex_t s_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t s_memory[memoryLines + 1];
+static size_t s_memory_budget;
+
+/// Buffers counted, kept apart from the counts since trimming changes them
+static pthread_mutex_t s_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static buffer_t *s_buffers;
+
+/// \brief Memory a buffer holds of a kind
+///
+static size_t memory_held(buffer_t *buffer, memory_kind_t kind)
+{
+    switch (kind)
+    {
+    case memoryVbuf:
+        return (buffer->vbuf && buffer->vbuf_alloced) ? buffer->vbuf_size : 0;
+    case memorySandbox:
+        return buffer->sandbox ? buffer->sandbox_size : 0;
+    default:
+        return buffer->line_memory;
+    }
+}
+
+/// \brief Memory held by all buffers that trimming can give back, and undo logs
+///
+static size_t memory_in_use(void)
+{
+    size_t memory;
+
+    pthread_mutex_lock(&s_memory_lock);
+    memory = s_memory[memoryVbuf] + s_memory[memorySandbox] + s_memory[memoryLines];
+    pthread_mutex_unlock(&s_memory_lock);
+    return memory + undo_global_memory();
+}
+
+void memory_set_budget(size_t budget)
+{
+    pthread_mutex_lock(&s_memory_lock);
+    s_memory_budget = budget;
+    pthread_mutex_unlock(&s_memory_lock);
+}
+
+size_t memory_get_budget(void)
+{
+    size_t budget;
+
+    pthread_mutex_lock(&s_memory_lock);
+    budget = s_memory_budget;
+    pthread_mutex_unlock(&s_memory_lock);
+    return budget;
+}
+
+/// \brief Memory held by a buffer's versions
+///
+static size_t memory_versions(buffer_t *buffer)
+{
+    size_t memory;
+
+    pthread_mutex_lock(&buffer->versions.lock);
+    memory = buffer->versions.memory;
+    pthread_mutex_unlock(&buffer->versions.lock);
+    return memory;
+}
+
+void memory_get_usage(memory_usage_t *usage)
+{
+    buffer_t *buffer;
+
+    if (! usage)
+    {
+        return;
+    }
+    memset(usage, 0, sizeof(memory_usage_t));
+
+    pthread_mutex_lock(&s_buffers_lock);
+    for (buffer = s_buffers; buffer; buffer = buffer->memory_next)
+    {
+        usage->versions += memory_versions(buffer);
+    }
+    pthread_mutex_unlock(&s_buffers_lock);
+
+    pthread_mutex_lock(&s_memory_lock);
+    usage->vbufs = s_memory[memoryVbuf];
+    usage->sandboxes = s_memory[memorySandbox];
+    usage->lines = s_memory[memoryLines];
+    pthread_mutex_unlock(&s_memory_lock);
+
+    usage->undo = undo_global_memory();
+    usage->total = usage->vbufs + usage->sandboxes + usage->lines + usage->undo + usage->versions;
+}
+
+int buffer_get_memory_usage(buffer_t *buffer, memory_usage_t *usage)
+{
+    if (!buffer || !usage)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    memset(usage, 0, sizeof(memory_usage_t));
+
+    pthread_mutex_lock(&s_memory_lock);
+    usage->vbufs = memory_held(buffer, memoryVbuf);
+    usage->sandboxes = memory_held(buffer, memorySandbox);
+    usage->lines = memory_held(buffer, memoryLines);
+    pthread_mutex_unlock(&s_memory_lock);
+
+    usage->undo = buffer->undos ? buffer->undos->memory : 0;
+    usage->versions = memory_versions(buffer);
+    usage->total = usage->vbufs + usage->sandboxes + usage->lines + usage->undo + usage->versions;
+    return 0;
+}
+
+void memory_add_buffer(buffer_t *buffer)
+{
+    memory_kind_t kind;
+
+    if (! buffer)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_buffers_lock);
+    buffer->memory_next = s_buffers;
+    s_buffers = buffer;
+    pthread_mutex_unlock(&s_buffers_lock);
+
+    pthread_mutex_lock(&s_memory_lock);
+    for (kind = memoryVbuf; kind <= memoryLines; kind++)
+    {
+        s_memory[kind] += memory_held(buffer, kind);
+    }
+    pthread_mutex_unlock(&s_memory_lock);
+}
+
+void memory_remove_buffer(buffer_t *buffer)
+{
+    buffer_t **plink;
+    memory_kind_t kind;
+
+    if (! buffer)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_buffers_lock);
+    for (plink = &s_buffers; *plink; plink = &(*plink)->memory_next)
+    {
+        if (*plink == buffer)
+        {
+            *plink = buffer->memory_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_buffers_lock);
+
+    pthread_mutex_lock(&s_memory_lock);
+    for (kind = memoryVbuf; kind <= memoryLines; kind++)
+    {
+        s_memory[kind] -= memory_held(buffer, kind);
+    }
+    pthread_mutex_unlock(&s_memory_lock);
+}
+
+void buffer_account_memory(buffer_t *buffer, memory_kind_t kind, size_t before, size_t after)
+{
+    if (! buffer || before == after)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_memory_lock);
+    s_memory[kind] = s_memory[kind] - before + after;
+    if (kind == memoryLines)
+    {
+        buffer->line_memory = buffer->line_memory - before + after;
+    }
+    pthread_mutex_unlock(&s_memory_lock);
+}
+
+int buffer_need_vbuf(buffer_t *buffer)
+{
+    if (! buffer)
+    {
+        return -1;
+    }
+    buffer->vbuf_used = true;
+    if (buffer->vbuf)
+    {
+        return 0;
+    }
+    buffer->vbuf = (char*)malloc(buffer->vbuf_size);
+    if (! buffer->vbuf)
+    {
+        butil_log(0, "%s: Can't alloc vbuf\n", __FUNCTION__);
+        return -1;
+    }
+    buffer->vbuf_alloced = true;
+    buffer->vbuf_offset = 0;
+    buffer->vbuf_count = 0;
+    buffer->vbuf_tail = 0;
+    buffer_account_memory(buffer, memoryVbuf, 0, buffer->vbuf_size);
+    return 0;
+}
+
+/// \brief Check if a line's text is the same as the file's bytes at an offset
+///
+/// @return 1 if the same, 0 if not, < 0 if the file can't be read
+///
+static int memory_line_matches(buffer_t *buffer, const line_t *line, uint64_t offset,
+                                uint8_t *window, uint8_t *text)
+{
+    uint64_t done;
+    size_t count;
+    int result;
+
+    for (done = 0; done < line->length; done += count)
+    {
+        count = MEMORY_COMPARE_WINDOW;
+        if (count > (line->length - done))
+        {
+            count = (size_t)(line->length - done);
+        }
+        result = buffer_read_at(buffer, offset + done, window, count);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result != (int)count)
+        {
+            // the file ends first
+            return 0;
+        }
+        if (line->location == lineInMemory)
+        {
+            if (memcmp(window, line->position.data + done, count))
+            {
+                return 0;
+            }
+            continue;
+        }
+        result = buffer_read_line(buffer, line, done, text, count);
+        if (result != (int)count)
+        {
+            return -1;
+        }
+        if (memcmp(window, text, count))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// \brief Make lines whose text is still what the file has into file lines
+///
+/// A line edited back to what it was sits right after the file line
+/// before it, or right before the file line after it, so only those
+/// offsets are compared
+///
+/// @return bytes given back
+///
+static size_t memory_evict_lines(buffer_t *buffer)
+{
+    line_t *line;
+    uint64_t expect;
+    uint64_t offset;
+    bool known;
+    uint8_t *window;
+    uint8_t *text;
+    size_t size;
+    size_t released;
+    int result;
+
+    switch (buffer->original_encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+        break;
+    default:
+        // text in memory isn't the file's bytes
+        return 0;
+    }
+    if (! buffer->file || ! buffer->line_memory)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&buffer->versions.lock);
+    result = (buffer->versions.nlive > 0);
+    pthread_mutex_unlock(&buffer->versions.lock);
+    if (result)
+    {
+        // snapshots may be reading the lines
+        return 0;
+    }
+    window = (uint8_t*)malloc(MEMORY_COMPARE_WINDOW * 2);
+    if (! window)
+    {
+        butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+        return 0;
+    }
+    text = window + MEMORY_COMPARE_WINDOW;
+    released = 0;
+    expect = 0;
+    known = false;
+
+    for (line = buffer->lines; line; line = line->next)
+    {
+        if (line->location == lineInFile)
+        {
+            expect = line->position.offset + line->length;
+            known = true;
+            continue;
+        }
+        if (known)
+        {
+            offset = expect;
+        }
+        else if (
+                    line->next
+                &&  line->next->location == lineInFile
+                &&  line->next->position.offset >= line->length
+        )
+        {
+            offset = line->next->position.offset - line->length;
+        }
+        else
+        {
+            continue;
+        }
+        result = memory_line_matches(buffer, line, offset, window, text);
+        if (result < 0)
+        {
+            // a file that can't be read again has nothing to go back to
+            break;
+        }
+        if (! result)
+        {
+            known = false;
+            continue;
+        }
+        size = line_data_size(line);
+        if (line->location == lineInMemory)
+        {
+            free(line->position.data);
+        }
+        else if (line->location == lineInBlock)
+        {
+            buffer_forget_packed(buffer, line);
+        }
+        else
+        {
+            free(line->position.pieces);
+        }
+        line->location = lineInFile;
+        line->position.offset = offset;
+        buffer_forget_columns(buffer, line);
+        buffer_account_memory(buffer, memoryLines, size, 0);
+        released += size;
+
+        expect = offset + line->length;
+        known = true;
+    }
+    free(window);
+    return released;
+}
+
+size_t buffer_trim_memory(buffer_t *buffer, bool release_vbuf)
+{
+    size_t released;
+    size_t saved;
+
+    if (! buffer)
+    {
+        return 0;
+    }
+    released = 0;
+    if (buffer->sandbox)
+    {
+        released += buffer->sandbox_size;
+        buffer_account_memory(buffer, memorySandbox, buffer->sandbox_size, 0);
+        free(buffer->sandbox);
+        buffer->sandbox = NULL;
+        buffer->sandbox_size = 0;
+        buffer->sandbox_count = 0;
+    }
+    released += memory_evict_lines(buffer);
+
+    if (buffer->packing)
+    {
+        buffer_forget_packed(buffer, NULL);
+        if (! buffer_pack_lines(buffer, &saved))
+        {
+            released += saved;
+        }
+    }
+
+    if (release_vbuf && buffer->vbuf && buffer->vbuf_alloced)
+    {
+        released += buffer->vbuf_size;
+        buffer_account_memory(buffer, memoryVbuf, buffer->vbuf_size, 0);
+        free(buffer->vbuf);
+        buffer->vbuf = NULL;
+        buffer->vbuf_offset = 0;
+        buffer->vbuf_count = 0;
+        buffer->vbuf_tail = 0;
+    }
+    return released;
+}
+
+size_t memory_reclaim(void)
+{
+    buffer_t *buffer;
+    size_t budget;
+    size_t released;
+    int pass;
+
+    budget = memory_get_budget();
+    released = 0;
+
+    pthread_mutex_lock(&s_buffers_lock);
+    for (pass = 0; pass < 2; pass++)
+    {
+        // idle buffers first, then the rest
+        //
+        for (buffer = s_buffers; buffer; buffer = buffer->memory_next)
+        {
+            if (budget && memory_in_use() <= budget)
+            {
+                break;
+            }
+            if (buffer->vbuf_used == (pass == 0))
+            {
+                continue;
+            }
+            released += buffer_trim_memory(buffer, pass == 0);
+        }
+    }
+    for (buffer = s_buffers; buffer; buffer = buffer->memory_next)
+    {
+        buffer->vbuf_used = false;
+    }
+    pthread_mutex_unlock(&s_buffers_lock);
+    return released;
+}
+
+void buffer_govern_memory(buffer_t *buffer)
+{
+    size_t budget;
+    size_t memory;
+
+    if (! buffer)
+    {
+        return;
+    }
+    buffer_check_packing(buffer);
+
+    budget = memory_get_budget();
+    if (! budget)
+    {
+        return;
+    }
+    memory = memory_in_use();
+    if (memory <= budget)
+    {
+        buffer->memory_mark = 0;
+        return;
+    }
+    if (buffer->memory_mark && memory < (buffer->memory_mark + MEMORY_TRIM_SLACK(budget)))
+    {
+        // trimmed lately, and not much has changed since
+        return;
+    }
+    buffer_trim_memory(buffer, false);
+    buffer->memory_mark = memory_in_use();
+    if (! buffer->memory_mark)
+    {
+        buffer->memory_mark = 1;
+    }
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BMEMORY_H
+#define BMEMORY_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Counts the memory all buffers in the process hold and keeps it under a
+/// budget, see ::memory_set_budget
+///
+/// Memory a buffer can do without is given back by trimming it: its
+/// sandbox is freed, lines in memory or in pieces whose text is the same
+/// as the file's bytes where they sit are made file lines again, and the
+/// vbuf, if the buffer allocated it, is freed and allocated again when
+/// next needed. Only lines of encodings whose bytes are the utf-8 text
+/// edited are compared with the file, and not while snapshots are open.
+/// A buffer packing its lines packs those it still holds as well, see
+/// ::buffer_set_line_packing
+///
+/// A buffer over budget after an edit trims itself, but leaves its vbuf,
+/// which it is likely to need again. Vbufs of buffers not used for a
+/// while are freed by ::memory_reclaim. Lines held only by undo logs and
+/// versions can't be trimmed, undo logs have their own cap, see
+/// ::undo_set_global_memory_cap
+
+/// Memory in use over the budget can grow this fraction of the budget
+/// after a buffer is trimmed before it is trimmed again
+#define MEMORY_TRIM_SLACK(budget)	((budget) / 16)
+
+/// Bytes compared at once when checking a line against the file
+#define MEMORY_COMPARE_WINDOW		(64*1024)
+
+/// Kinds of memory counted
+///
+typedef enum
+{
+	memoryVbuf,							///< vbufs allocated by buffers
+	memorySandbox,						///< sandboxes
+	memoryLines							///< text of lines in memory or pieces, linked or held for undo
+}
+memory_kind_t;
+
+/// Memory in use, by kind
+///
+typedef struct tag_memory_usage
+{
+	size_t			vbufs;				///< vbufs allocated by buffers
+	size_t			sandboxes;			///< sandboxes
+	size_t			lines;				///< text of lines in memory or pieces
+	size_t			undo;				///< undo records and the text they hold
+	size_t			versions;			///< line versions and lines held for snapshots
+	size_t			total;				///< all of the above
+}
+memory_usage_t;
+
+/// \brief Set the budget for memory all buffers hold together
+///
+/// @param[in] budget - bytes, 0 for no budget
+///
+void memory_set_budget(size_t budget);
+
+/// \brief Get the budget for memory all buffers hold together
+///
+/// @return budget in bytes, 0 if none
+///
+size_t memory_get_budget(void);
+
+/// \brief Get the memory all buffers hold
+///
+/// @param[out] usage - gets memory in use
+///
+void memory_get_usage(memory_usage_t *usage);
+
+/// \brief Get the memory a buffer holds
+///
+/// @param[in]  buffer - buffer to count
+/// @param[out] usage  - gets memory in use by buffer
+///
+/// @return 0 on success
+///
+int buffer_get_memory_usage(buffer_t *buffer, memory_usage_t *usage);
+
+/// \brief Give back the memory a buffer can do without
+///
+/// @param[in] buffer       - buffer to trim
+/// @param[in] release_vbuf - free the buffer's vbuf as well, if it allocated it
+///
+/// @return bytes given back
+///
+size_t buffer_trim_memory(buffer_t *buffer, bool release_vbuf);
+
+/// \brief Trim buffers until the memory they hold is within the budget
+///
+/// Buffers whose vbuf hasn't been used since the last reclaim are trimmed
+/// first, and lose their vbuf, then the others, keeping theirs. With no
+/// budget every buffer is trimmed. Buffers are changed without their own
+/// callers knowing, so call this when no other thread is using a buffer,
+/// an editor's idle loop for example
+///
+/// @return bytes given back
+///
+size_t memory_reclaim(void);
+
+/// \brief Start counting a buffer's memory
+///
+/// For ::buffer_create
+///
+/// @param[in] buffer - buffer to count
+///
+void memory_add_buffer(buffer_t *buffer);
+
+/// \brief Stop counting a buffer's memory
+///
+/// For ::buffer_destroy
+///
+/// @param[in] buffer - buffer to stop counting
+///
+void memory_remove_buffer(buffer_t *buffer);
+
+/// \brief Account for a change in the memory a buffer holds
+///
+/// For code that allocates or frees a buffer's memory
+///
+/// @param[in] buffer - buffer memory belongs to
+/// @param[in] kind   - kind of memory
+/// @param[in] before - bytes held before the change
+/// @param[in] after  - bytes held after the change
+///
+void buffer_account_memory(buffer_t *buffer, memory_kind_t kind, size_t before, size_t after);
+
+/// \brief Make sure a buffer has a vbuf, allocating one if it was freed
+///
+/// For code that uses a buffer's vbuf
+///
+/// @param[in] buffer - buffer to get vbuf for
+///
+/// @return 0 on success
+///
+int buffer_need_vbuf(buffer_t *buffer);
+
+/// \brief Trim a buffer if all buffers are over the budget
+///
+/// For the end of calls that edit a buffer, when nothing points into its
+/// sandbox or vbuf
+///
+/// @param[in] buffer - buffer just edited
+///
+void buffer_govern_memory(buffer_t *buffer);
+
+#endif
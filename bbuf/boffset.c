@@ -0,0 +1,521 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "boffset.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// \brief Bytes a line takes in the buffer's text
+///
+/// Lines in memory or in blocks are utf-8, which for ucs encodings is
+/// counted as the code units ::buffer_encode_text would make of it
+///
+static uint64_t offset_line_bytes(buffer_t *buffer, const line_t *line)
+{
+    const uint8_t *data;
+    uint8_t chunk[256];
+    uint64_t chars;
+    uint64_t done;
+    size_t unit;
+    size_t i;
+    int count;
+
+    switch (buffer->original_encoding)
+    {
+    case textUCS2LE:
+    case textUCS2BE:
+        unit = 2;
+        break;
+    case textUCS4LE:
+    case textUCS4BE:
+        unit = 4;
+        break;
+    default:
+        return line->length;
+    }
+    if (line->location == lineInBlock)
+    {
+        for (done = 0, chars = 0; done < line->length; done += count)
+        {
+            count = buffer_read_line(buffer, line, done, chunk, sizeof(chunk));
+            if (count <= 0)
+            {
+                break;
+            }
+            for (i = 0; i < (size_t)count; i++)
+            {
+                if ((chunk[i] & 0xC0) != 0x80)
+                {
+                    chars++;
+                }
+            }
+        }
+        return chars * unit;
+    }
+    if (line->location != lineInMemory)
+    {
+        return line->length;
+    }
+    data = (const uint8_t*)line->position.data;
+    for (i = 0, chars = 0; i < line->length; i++)
+    {
+        if ((data[i] & 0xC0) != 0x80)
+        {
+            chars++;
+        }
+    }
+    return chars * unit;
+}
+
+/// \brief Add to the count of lines in a block, subtract by adding the negative
+///
+static void offset_add_lines(offset_index_t *index, size_t block, size_t delta)
+{
+    size_t i;
+
+    index->blocks[block].lines += delta;
+    for (i = block + 1; i <= index->count; i += i & (~i + 1))
+    {
+        index->line_tree[i] += delta;
+    }
+}
+
+/// \brief Add to the count of bytes in a block, subtract by adding the negative
+///
+static void offset_add_bytes(offset_index_t *index, size_t block, uint64_t delta)
+{
+    size_t i;
+
+    index->blocks[block].bytes += delta;
+    for (i = block + 1; i <= index->count; i += i & (~i + 1))
+    {
+        index->byte_tree[i] += delta;
+    }
+}
+
+/// \brief Count of lines in the blocks before a block
+///
+static size_t offset_lines_before(offset_index_t *index, size_t block)
+{
+    size_t total;
+    size_t i;
+
+    for (i = block, total = 0; i > 0; i -= i & (~i + 1))
+    {
+        total += index->line_tree[i];
+    }
+    return total;
+}
+
+/// \brief Count of bytes in the blocks before a block
+///
+static uint64_t offset_bytes_before(offset_index_t *index, size_t block)
+{
+    uint64_t total;
+    size_t i;
+
+    for (i = block, total = 0; i > 0; i -= i & (~i + 1))
+    {
+        total += index->byte_tree[i];
+    }
+    return total;
+}
+
+/// \brief Largest power of two no more than the count of blocks
+///
+static size_t offset_top(offset_index_t *index)
+{
+    size_t step;
+
+    for (step = 1; (step << 1) <= index->count; step <<= 1)
+    {
+        ;
+    }
+    return step;
+}
+
+/// \brief Find the block a line is in
+///
+/// @param[in]  index  - index to look in
+/// @param[in]  line   - line number
+/// @param[out] before - gets count of lines before the block
+///
+/// @return block, count of blocks if line is past the last
+///
+static size_t offset_find_line(offset_index_t *index, size_t line, size_t *before)
+{
+    size_t pos;
+    size_t rem;
+    size_t step;
+
+    for (step = offset_top(index), pos = 0, rem = line; step; step >>= 1)
+    {
+        if ((pos + step) <= index->count && index->line_tree[pos + step] <= rem)
+        {
+            pos += step;
+            rem -= index->line_tree[pos];
+        }
+    }
+    *before = line - rem;
+    return pos;
+}
+
+/// \brief Find the block a byte offset is in
+///
+/// @param[in]  index  - index to look in
+/// @param[in]  offset - byte offset
+/// @param[out] before - gets count of bytes before the block
+///
+/// @return block, count of blocks if offset is past the last
+///
+static size_t offset_find_byte(offset_index_t *index, uint64_t offset, uint64_t *before)
+{
+    uint64_t rem;
+    size_t pos;
+    size_t step;
+
+    for (step = offset_top(index), pos = 0, rem = offset; step; step >>= 1)
+    {
+        if ((pos + step) <= index->count && index->byte_tree[pos + step] <= rem)
+        {
+            pos += step;
+            rem -= index->byte_tree[pos];
+        }
+    }
+    *before = offset - rem;
+    return pos;
+}
+
+/// \brief Mark a block to have its bytes counted again
+///
+static void offset_mark(offset_index_t *index, size_t block)
+{
+    if (block < index->count && ! index->blocks[block].dirty)
+    {
+        index->blocks[block].dirty = true;
+        index->dirty[index->ndirty++] = block;
+    }
+}
+
+/// \brief Count the bytes of the blocks whose lines changed
+///
+static void offset_settle(buffer_t *buffer, offset_index_t *index)
+{
+    offset_block_t *block;
+    line_t *line;
+    uint64_t bytes;
+    size_t n;
+    size_t i;
+
+    for (i = 0; i < index->ndirty; i++)
+    {
+        block = &index->blocks[index->dirty[i]];
+        for (n = 0, bytes = 0, line = block->first; n < block->lines && line; n++, line = line->next)
+        {
+            bytes += offset_line_bytes(buffer, line);
+        }
+        offset_add_bytes(index, index->dirty[i], bytes - block->bytes);
+        block->dirty = false;
+    }
+    index->ndirty = 0;
+}
+
+/// \brief Build the index of a buffer's lines
+///
+/// @return index, or NULL if no memory
+///
+static offset_index_t *offset_build(buffer_t *buffer)
+{
+    offset_index_t *index;
+    line_t *line;
+    size_t count;
+    size_t b;
+    size_t i;
+    size_t j;
+
+    count = (buffer->line_count + OFFSET_BLOCK_LINES - 1) / OFFSET_BLOCK_LINES;
+    if (count == 0)
+    {
+        // lines inserted in an empty buffer go in the first block
+        count = 1;
+    }
+    index = (offset_index_t*)calloc(1, sizeof(offset_index_t));
+    if (! index)
+    {
+        butil_log(0, "%s: Can't alloc index\n", __FUNCTION__);
+        return NULL;
+    }
+    index->count = count;
+    index->blocks = (offset_block_t*)calloc(count, sizeof(offset_block_t));
+    index->line_tree = (size_t*)calloc(count + 1, sizeof(size_t));
+    index->byte_tree = (uint64_t*)calloc(count + 1, sizeof(uint64_t));
+    index->dirty = (size_t*)malloc(count * sizeof(size_t));
+    if (! index->blocks || ! index->line_tree || ! index->byte_tree || ! index->dirty)
+    {
+        butil_log(0, "%s: Can't alloc index\n", __FUNCTION__);
+        free(index->blocks);
+        free(index->line_tree);
+        free(index->byte_tree);
+        free(index->dirty);
+        free(index);
+        return NULL;
+    }
+    for (i = 0, line = buffer->lines; i < buffer->line_count && line; i++, line = line->next)
+    {
+        b = i / OFFSET_BLOCK_LINES;
+        if (! index->blocks[b].lines)
+        {
+            index->blocks[b].first = line;
+        }
+        index->blocks[b].lines++;
+        index->blocks[b].bytes += offset_line_bytes(buffer, line);
+    }
+    // each node of the trees adds itself into its parent
+    //
+    for (i = 1; i <= count; i++)
+    {
+        index->line_tree[i] += index->blocks[i - 1].lines;
+        index->byte_tree[i] += index->blocks[i - 1].bytes;
+        j = i + (i & (~i + 1));
+        if (j <= count)
+        {
+            index->line_tree[j] += index->line_tree[i];
+            index->byte_tree[j] += index->byte_tree[i];
+        }
+    }
+    return index;
+}
+
+/// \brief Get a buffer's index, up to date
+///
+/// @return index, or NULL if no memory
+///
+static offset_index_t *offset_get_index(buffer_t *buffer)
+{
+    if (buffer->offsets && buffer->offsets->rebuild)
+    {
+        buffer_forget_offsets(buffer);
+    }
+    if (! buffer->offsets)
+    {
+        buffer->offsets = offset_build(buffer);
+        if (! buffer->offsets)
+        {
+            return NULL;
+        }
+    }
+    offset_settle(buffer, buffer->offsets);
+    return buffer->offsets;
+}
+
+int buffer_line_from_offset(buffer_t *buffer, uint64_t offset, size_t *line, size_t *column)
+{
+    offset_index_t *index;
+    offset_block_t *block;
+    line_t *pline;
+    uint64_t pos;
+    uint64_t bytes;
+    size_t linenum;
+    size_t b;
+    size_t n;
+
+    if (!buffer || !line)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    index = offset_get_index(buffer);
+    if (! index)
+    {
+        return -1;
+    }
+    b = offset_find_byte(index, offset, &pos);
+    if (b >= index->count)
+    {
+        butil_log(2, "%s: Offset %llu past end of text\n", __FUNCTION__, (unsigned long long)offset);
+        return -1;
+    }
+    block = &index->blocks[b];
+    linenum = offset_lines_before(index, b);
+
+    for (n = 0, pline = block->first; n < block->lines && pline; n++, pline = pline->next)
+    {
+        bytes = offset_line_bytes(buffer, pline);
+        if (offset < (pos + bytes))
+        {
+            buffer->curr_line = pline;
+            buffer->curr_linenum = linenum + n;
+            *line = linenum + n;
+            if (column)
+            {
+                *column = (size_t)(offset - pos);
+            }
+            return 0;
+        }
+        pos += bytes;
+    }
+    butil_log(0, "%s: Index doesn't match lines\n", __FUNCTION__);
+    index->rebuild = true;
+    return -1;
+}
+
+int buffer_offset_from_line(buffer_t *buffer, size_t line, uint64_t *offset)
+{
+    offset_index_t *index;
+    offset_block_t *block;
+    line_t *pline;
+    uint64_t pos;
+    size_t before;
+    size_t b;
+    size_t n;
+
+    if (!buffer || !offset || line > buffer->line_count)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    index = offset_get_index(buffer);
+    if (! index)
+    {
+        return -1;
+    }
+    if (line == buffer->line_count)
+    {
+        *offset = offset_bytes_before(index, index->count);
+        return 0;
+    }
+    b = offset_find_line(index, line, &before);
+    if (b >= index->count)
+    {
+        butil_log(0, "%s: Index doesn't match lines\n", __FUNCTION__);
+        index->rebuild = true;
+        return -1;
+    }
+    block = &index->blocks[b];
+    pos = offset_bytes_before(index, b);
+
+    for (n = before, pline = block->first; n < line && pline; n++, pline = pline->next)
+    {
+        pos += offset_line_bytes(buffer, pline);
+    }
+    if (! pline)
+    {
+        butil_log(0, "%s: Index doesn't match lines\n", __FUNCTION__);
+        index->rebuild = true;
+        return -1;
+    }
+    buffer->curr_line = pline;
+    buffer->curr_linenum = line;
+    *offset = pos;
+    return 0;
+}
+
+void buffer_offsets_changed(buffer_t *buffer, size_t linenum)
+{
+    offset_index_t *index;
+    size_t before;
+
+    if (! buffer || ! buffer->offsets || buffer->offsets->rebuild)
+    {
+        return;
+    }
+    index = buffer->offsets;
+    offset_mark(index, offset_find_line(index, linenum, &before));
+}
+
+void buffer_offsets_moved(buffer_t *buffer, size_t linenum, line_t *first, size_t inserted, size_t deleted)
+{
+    offset_index_t *index;
+    size_t before;
+    size_t take;
+    size_t skip;
+    size_t b;
+
+    if (! buffer || ! buffer->offsets || buffer->offsets->rebuild)
+    {
+        return;
+    }
+    index = buffer->offsets;
+
+    if (deleted)
+    {
+        // take the lines out of each block they were in, the blocks
+        // they started then start with the line after them
+        //
+        b = offset_find_line(index, linenum, &before);
+        skip = linenum - before;
+        while (deleted && b < index->count)
+        {
+            take = index->blocks[b].lines - skip;
+            if (take > deleted)
+            {
+                take = deleted;
+            }
+            offset_add_lines(index, b, (size_t)0 - take);
+            if (skip == 0)
+            {
+                index->blocks[b].first = first;
+            }
+            offset_mark(index, b);
+            deleted -= take;
+            skip = 0;
+            b++;
+        }
+    }
+    if (inserted)
+    {
+        // lines join the block of the line before them
+        //
+        if (linenum == 0)
+        {
+            b = 0;
+            index->blocks[0].first = first;
+        }
+        else
+        {
+            b = offset_find_line(index, linenum - 1, &before);
+        }
+        if (b >= index->count)
+        {
+            index->rebuild = true;
+            return;
+        }
+        offset_add_lines(index, b, inserted);
+        offset_mark(index, b);
+        if (index->blocks[b].lines > (OFFSET_BLOCK_LINES * OFFSET_BLOCK_GROWTH))
+        {
+            index->rebuild = true;
+        }
+    }
+}
+
+void buffer_forget_offsets(buffer_t *buffer)
+{
+    offset_index_t *index;
+
+    if (! buffer || ! buffer->offsets)
+    {
+        return;
+    }
+    index = buffer->offsets;
+    free(index->blocks);
+    free(index->line_tree);
+    free(index->byte_tree);
+    free(index->dirty);
+    free(index);
+    buffer->offsets = NULL;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BOFFSET_H
+#define BOFFSET_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Maps between line numbers and byte offsets in a buffer's text, the
+/// offsets a line would have in the file if the buffer were written in
+/// its original encoding, after any byte order mark
+///
+/// The lines are split in blocks of about OFFSET_BLOCK_LINES lines, and
+/// the count of lines and bytes in each block are kept in binary indexed
+/// trees, so the block holding a line or an offset is found in O(log n)
+/// and at most a block of lines is walked from there. An edit only
+/// changes the counts of the block it is in, so a line that changes
+/// length displaces every line after it without any of them being
+/// touched. A block that grows past OFFSET_BLOCK_GROWTH times its size
+/// has the index built again on the next lookup
+///
+/// The index is built on the first lookup
+
+/// Lines in a block when the index is built
+#define OFFSET_BLOCK_LINES			(256)
+
+/// Times its size a block can grow to before the index is built again
+#define OFFSET_BLOCK_GROWTH			(4)
+
+/// A run of lines
+///
+typedef struct tag_offset_block
+{
+	line_t		   *first;				///< first line of block, if it has any
+	size_t			lines;				///< count of lines in block
+	uint64_t		bytes;				///< bytes in the lines, as of the last count
+	bool			dirty;				///< lines changed since bytes was counted
+}
+offset_block_t;
+
+/// Index of the offsets of a buffer's lines
+///
+typedef struct tag_offset_index
+{
+	offset_block_t *blocks;				///< blocks, in order
+	size_t			count;				///< count of blocks
+	size_t		   *line_tree;			///< binary indexed tree of lines in blocks, 1 based
+	uint64_t	   *byte_tree;			///< binary indexed tree of bytes in blocks, 1 based
+	size_t		   *dirty;				///< blocks whose bytes need counting
+	size_t			ndirty;				///< count of dirty blocks
+	bool			rebuild;			///< a block grew too large, build again
+}
+offset_index_t;
+
+/// \brief Get the line a byte offset is in
+///
+/// @param[in]  buffer - buffer to look in
+/// @param[in]  offset - byte offset in buffer's text
+/// @param[out] line   - gets line number (0 based) of line with offset
+/// @param[out] column - gets byte offset in the line, may be NULL
+///
+/// @return 0 on success, < 0 on error or if offset is past the end of the text
+///
+int buffer_line_from_offset(buffer_t *buffer, uint64_t offset, size_t *line, size_t *column);
+
+/// \brief Get the byte offset a line starts at
+///
+/// @param[in]  buffer - buffer to look in
+/// @param[in]  line   - line number (0 based), line_count for the end of the text
+/// @param[out] offset - gets byte offset in buffer's text
+///
+/// @return 0 on success
+///
+int buffer_offset_from_line(buffer_t *buffer, size_t line, uint64_t *offset);
+
+/// \brief Account for a line whose content changed
+///
+/// For code that changes a buffer's lines
+///
+/// @param[in] buffer  - buffer line is in
+/// @param[in] linenum - line number of line
+///
+void buffer_offsets_changed(buffer_t *buffer, size_t linenum);
+
+/// \brief Account for lines linked into or unlinked from a buffer
+///
+/// Call after the lines are linked or unlinked
+///
+/// @param[in] buffer   - buffer lines moved in
+/// @param[in] linenum  - line number of first line linked or unlinked
+/// @param[in] first    - first line linked in, or the line after those unlinked
+/// @param[in] inserted - count of lines linked in
+/// @param[in] deleted  - count of lines unlinked
+///
+void buffer_offsets_moved(buffer_t *buffer, size_t linenum, line_t *first, size_t inserted, size_t deleted);
+
+/// \brief Drop a buffer's index of offsets
+///
+/// @param[in] buffer - buffer to drop index of
+///
+void buffer_forget_offsets(buffer_t *buffer);
+
+#endif
@@ -0,0 +1,777 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bpack.h"
+#include "bmemory.h"
+#include "butil.h"
+
+/// \file
+///
+/// Packed data is a list of sequences, each a token byte, literal bytes
+/// and a match. The token's high four bits are the count of literals, its
+/// low four the length of the match less PACK_MIN_MATCH, with 15 in
+/// either meaning more of the count follows in bytes, added up to the
+/// first that isn't 255. The match is a two byte little endian distance
+/// back in the output, then any more of its length. The last sequence has
+/// only literals
+
+/// Shortest match encoded
+#define PACK_MIN_MATCH				(4)
+
+/// Bits in the hash of four bytes used to find matches
+#define PACK_HASH_BITS				(12)
+
+/// Bytes at the end of the data always left as literals
+#define PACK_TAIL					(5)
+
+/// \brief Hash of the four bytes at a position
+///
+static inline size_t pack_hash(const uint8_t *data)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return (size_t)((value * 2654435761U) >> (32 - PACK_HASH_BITS));
+}
+
+/// \brief Put a count of more than 14 after a token
+///
+/// @return bytes put, 0 if no room
+///
+static size_t pack_put_count(uint8_t *packed, size_t room, size_t count)
+{
+    size_t used;
+
+    for (used = 0; count >= 255; count -= 255)
+    {
+        if (used >= room)
+        {
+            return 0;
+        }
+        packed[used++] = 255;
+    }
+    if (used >= room)
+    {
+        return 0;
+    }
+    packed[used++] = (uint8_t)count;
+    return used;
+}
+
+/// \brief Put a sequence
+///
+/// @return bytes put, 0 if no room
+///
+static size_t pack_put_sequence(uint8_t *packed, size_t room, const uint8_t *literals, size_t nliterals,
+                                size_t distance, size_t match)
+{
+    size_t used;
+    size_t n;
+
+    if (room < 1)
+    {
+        return 0;
+    }
+    used = 1;
+    packed[0] = (uint8_t)(((nliterals < 15) ? nliterals : 15) << 4);
+    if (nliterals >= 15)
+    {
+        n = pack_put_count(packed + used, room - used, nliterals - 15);
+        if (! n)
+        {
+            return 0;
+        }
+        used += n;
+    }
+    if (nliterals > (room - used))
+    {
+        return 0;
+    }
+    memcpy(packed + used, literals, nliterals);
+    used += nliterals;
+
+    if (! match)
+    {
+        // the last sequence
+        return used;
+    }
+    if ((room - used) < 2)
+    {
+        return 0;
+    }
+    packed[used++] = (uint8_t)(distance & 0xFF);
+    packed[used++] = (uint8_t)(distance >> 8);
+
+    match -= PACK_MIN_MATCH;
+    packed[0] |= (uint8_t)((match < 15) ? match : 15);
+    if (match >= 15)
+    {
+        n = pack_put_count(packed + used, room - used, match - 15);
+        if (! n)
+        {
+            return 0;
+        }
+        used += n;
+    }
+    return used;
+}
+
+size_t pack_compress(const uint8_t *data, size_t length, uint8_t *packed, size_t room)
+{
+    uint16_t table[1 << PACK_HASH_BITS];
+    size_t anchor;
+    size_t pos;
+    size_t cand;
+    size_t match;
+    size_t out;
+    size_t used;
+    size_t h;
+
+    if (!data || !packed || length > 0xFFFF)
+    {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+    anchor = 0;
+    pos = 0;
+    out = 0;
+
+    while (length > (PACK_MIN_MATCH + PACK_TAIL) && pos < (length - PACK_MIN_MATCH - PACK_TAIL))
+    {
+        h = pack_hash(data + pos);
+        cand = table[h];
+        table[h] = (uint16_t)pos;
+
+        if (cand >= pos || memcmp(data + cand, data + pos, PACK_MIN_MATCH))
+        {
+            pos++;
+            continue;
+        }
+        for (match = PACK_MIN_MATCH; (pos + match) < (length - PACK_TAIL); match++)
+        {
+            if (data[cand + match] != data[pos + match])
+            {
+                break;
+            }
+        }
+        used = pack_put_sequence(packed + out, room - out, data + anchor, pos - anchor, pos - cand, match);
+        if (! used)
+        {
+            return 0;
+        }
+        out += used;
+        pos += match;
+        anchor = pos;
+    }
+    used = pack_put_sequence(packed + out, room - out, data + anchor, length - anchor, 0, 0);
+    if (! used)
+    {
+        return 0;
+    }
+    return out + used;
+}
+
+/// \brief Get a count of more than 14 after a token
+///
+/// @return 0 on success
+///
+static int pack_get_count(const uint8_t *packed, size_t length, size_t *in, size_t *count)
+{
+    uint8_t b;
+
+    do
+    {
+        if (*in >= length)
+        {
+            return -1;
+        }
+        b = packed[(*in)++];
+        *count += b;
+    }
+    while (b == 255);
+    return 0;
+}
+
+int pack_decompress(const uint8_t *packed, size_t length, uint8_t *data, size_t room)
+{
+    size_t in;
+    size_t out;
+    size_t nliterals;
+    size_t distance;
+    size_t match;
+    uint8_t token;
+
+    if (!packed || !data)
+    {
+        return -1;
+    }
+    in = 0;
+    out = 0;
+
+    while (in < length)
+    {
+        token = packed[in++];
+        nliterals = token >> 4;
+        if (nliterals == 15 && pack_get_count(packed, length, &in, &nliterals))
+        {
+            return -1;
+        }
+        if (nliterals > (length - in) || nliterals > (room - out))
+        {
+            return -1;
+        }
+        memcpy(data + out, packed + in, nliterals);
+        in += nliterals;
+        out += nliterals;
+
+        if (in >= length)
+        {
+            break;
+        }
+        if ((length - in) < 2)
+        {
+            return -1;
+        }
+        distance = (size_t)packed[in] | ((size_t)packed[in + 1] << 8);
+        in += 2;
+        match = token & 0x0F;
+        if (match == 15 && pack_get_count(packed, length, &in, &match))
+        {
+            return -1;
+        }
+        match += PACK_MIN_MATCH;
+        if (! distance || distance > out || match > (room - out))
+        {
+            return -1;
+        }
+        if (distance >= match)
+        {
+            memcpy(data + out, data + out - distance, match);
+            out += match;
+        }
+        else
+        {
+            // the match overlaps what it makes, a run
+            for (; match; match--, out++)
+            {
+                data[out] = data[out - distance];
+            }
+        }
+    }
+    return (int)out;
+}
+
+/// \brief Find a line in its block
+///
+/// @return index of line, count of lines in block if not there
+///
+static size_t pack_line_index(const line_block_t *block, const line_t *line)
+{
+    size_t i;
+
+    for (i = 0; i < block->count; i++)
+    {
+        if (block->lines[i] == line)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/// \brief Drop a block from the blocks decoded for reading
+///
+static void pack_uncache(buffer_t *buffer, const line_block_t *block)
+{
+    size_t i;
+
+    if (! buffer->packing)
+    {
+        return;
+    }
+    pthread_mutex_lock(&buffer->packing->lock);
+    for (i = 0; i < PACK_CACHE_BLOCKS; i++)
+    {
+        if (buffer->packing->cache[i].block == block)
+        {
+            buffer->packing->cache[i].block = NULL;
+        }
+    }
+    pthread_mutex_unlock(&buffer->packing->lock);
+}
+
+/// \brief Free a block no line is left in
+///
+static void pack_free_block(buffer_t *buffer, line_block_t *block)
+{
+    pack_uncache(buffer, block);
+    buffer_account_memory(buffer, memoryLines, block->size, 0);
+    free(block);
+}
+
+/// \brief Pack a run of lines in memory into a block
+///
+/// @param[in] buffer - buffer lines are in
+/// @param[in] first  - first line of run
+/// @param[in] count  - lines in run
+/// @param[in] text   - room for the text of the lines, PACK_BLOCK_SIZE bytes
+/// @param[in] packed - room for the packed text, PACK_BLOCK_SIZE bytes
+///
+/// @return bytes of memory saved, 0 if the lines don't pack well enough
+///
+static size_t pack_run(buffer_t *buffer, line_t *first, size_t count, uint8_t *text, uint8_t *packed)
+{
+    line_block_t *block;
+    line_t *line;
+    size_t text_size;
+    size_t packed_size;
+    size_t before;
+    size_t i;
+
+    for (i = 0, line = first, text_size = 0, before = 0; i < count; i++, line = line->next)
+    {
+        memcpy(text + text_size, line->position.data, line->length);
+        text_size += line->length;
+        before += line_data_size(line);
+    }
+    // not worth it unless the text packs to 7/8 of its size
+    //
+    packed_size = pack_compress(text, text_size, packed, text_size - text_size / 8);
+    if (! packed_size)
+    {
+        return 0;
+    }
+    block = (line_block_t*)malloc(sizeof(line_block_t) + count * sizeof(line_t*)
+                                + (count + 1) * sizeof(uint32_t) + packed_size);
+    if (! block)
+    {
+        butil_log(0, "%s: Can't alloc block\n", __FUNCTION__);
+        return 0;
+    }
+    block->size = sizeof(line_block_t) + count * sizeof(line_t*) + (count + 1) * sizeof(uint32_t) + packed_size;
+    if (block->size >= before)
+    {
+        // short lines cost more in the block than they save
+        free(block);
+        return 0;
+    }
+    block->count = count;
+    block->remaining = count;
+    block->text_size = text_size;
+    block->packed_size = packed_size;
+    block->lines = (line_t**)(block + 1);
+    block->offsets = (uint32_t*)(block->lines + count);
+    block->packed = (uint8_t*)(block->offsets + count + 1);
+    memcpy(block->packed, packed, packed_size);
+
+    for (i = 0, line = first, text_size = 0; i < count; i++, line = line->next)
+    {
+        block->lines[i] = line;
+        block->offsets[i] = (uint32_t)text_size;
+        text_size += line->length;
+
+        free(line->position.data);
+        line->location = lineInBlock;
+        line->position.block = block;
+    }
+    block->offsets[count] = (uint32_t)text_size;
+    buffer_account_memory(buffer, memoryLines, before, block->size);
+    return before - block->size;
+}
+
+int buffer_set_line_packing(buffer_t *buffer, bool use)
+{
+    int result;
+
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (use && ! buffer->packing)
+    {
+        buffer->packing = (line_packing_t*)malloc(sizeof(line_packing_t));
+        if (! buffer->packing)
+        {
+            butil_log(0, "%s: Can't alloc packing\n", __FUNCTION__);
+            return -1;
+        }
+        memset(buffer->packing, 0, sizeof(line_packing_t));
+        pthread_mutex_init(&buffer->packing->lock, NULL);
+        buffer->packing->mark = buffer->line_memory;
+    }
+    else if (! use && buffer->packing)
+    {
+        result = buffer_unpack_lines(buffer);
+        if (result)
+        {
+            return result;
+        }
+        buffer_forget_packing(buffer);
+    }
+    return 0;
+}
+
+int buffer_pack_lines(buffer_t *buffer, size_t *saved)
+{
+    line_t *line;
+    line_t *first;
+    uint8_t *text;
+    uint8_t *packed;
+    size_t count;
+    size_t text_size;
+    size_t limit;
+    size_t total;
+    bool eligible;
+    bool live;
+
+    if (saved)
+    {
+        *saved = 0;
+    }
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! buffer->packing)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&buffer->versions.lock);
+    live = (buffer->versions.nlive > 0);
+    pthread_mutex_unlock(&buffer->versions.lock);
+    if (live)
+    {
+        // snapshots may be reading the lines
+        return 0;
+    }
+    text = (uint8_t*)malloc(PACK_BLOCK_SIZE * 2);
+    if (! text)
+    {
+        butil_log(0, "%s: Can't alloc text\n", __FUNCTION__);
+        return -1;
+    }
+    packed = text + PACK_BLOCK_SIZE;
+
+    // a block's lines have to fit in vbuf, to be written from there
+    //
+    limit = (buffer->vbuf_size < PACK_BLOCK_SIZE) ? buffer->vbuf_size : PACK_BLOCK_SIZE;
+    first = NULL;
+    count = 0;
+    text_size = 0;
+    total = 0;
+
+    for (line = buffer->lines; ; line = line->next)
+    {
+        eligible = false;
+        if (line && line->location == lineInMemory && line->position.data)
+        {
+            if (line->attributes & lineTouched)
+            {
+                // used lately, give it until the next pass
+                line->attributes &= ~lineTouched;
+            }
+            else
+            {
+                eligible = (line->length <= limit);
+            }
+        }
+        if (
+                eligible
+            &&  count < PACK_BLOCK_LINES
+            &&  (text_size + line->length) <= limit
+        )
+        {
+            if (! first)
+            {
+                first = line;
+            }
+            count++;
+            text_size += line->length;
+            continue;
+        }
+        if (count >= PACK_BLOCK_MIN_LINES)
+        {
+            total += pack_run(buffer, first, count, text, packed);
+        }
+        first = eligible ? line : NULL;
+        count = eligible ? 1 : 0;
+        text_size = eligible ? line->length : 0;
+        if (! line)
+        {
+            break;
+        }
+    }
+    free(text);
+    buffer->packing->mark = buffer->line_memory;
+    if (saved)
+    {
+        *saved = total;
+    }
+    butil_log(4, "%s: Saved %u bytes\n", __FUNCTION__, total);
+    return 0;
+}
+
+/// \brief Decode a block into the cache, lock held
+///
+/// @return decoded text, NULL on error
+///
+static const uint8_t *pack_decode(buffer_t *buffer, const line_block_t *block)
+{
+    line_packing_t *packing;
+    pack_cache_entry_t *entry;
+    size_t i;
+    int result;
+
+    packing = buffer->packing;
+    packing->clock++;
+    entry = &packing->cache[0];
+
+    for (i = 0; i < PACK_CACHE_BLOCKS; i++)
+    {
+        if (packing->cache[i].block == block)
+        {
+            packing->cache[i].used = packing->clock;
+            return packing->cache[i].text;
+        }
+        if (packing->cache[i].used < entry->used)
+        {
+            entry = &packing->cache[i];
+        }
+    }
+    // decode into the least recently used
+    //
+    if (! entry->text)
+    {
+        entry->text = (uint8_t*)malloc(PACK_BLOCK_SIZE);
+        if (! entry->text)
+        {
+            butil_log(0, "%s: Can't alloc text\n", __FUNCTION__);
+            return NULL;
+        }
+        buffer_account_memory(buffer, memorySandbox, 0, PACK_BLOCK_SIZE);
+    }
+    entry->block = NULL;
+    result = pack_decompress(block->packed, block->packed_size, entry->text, PACK_BLOCK_SIZE);
+    if (result != (int)block->text_size)
+    {
+        butil_log(0, "%s: Block is damaged\n", __FUNCTION__);
+        return NULL;
+    }
+    entry->block = block;
+    entry->used = packing->clock;
+    return entry->text;
+}
+
+int buffer_unpack_block(buffer_t *buffer, line_t *line)
+{
+    line_block_t *block;
+    line_t *member;
+    const uint8_t *text;
+    char *data;
+    size_t length;
+    size_t i;
+    int result;
+
+    if (!buffer || !line)
+    {
+        return -1;
+    }
+    if (line->location != lineInBlock)
+    {
+        return 0;
+    }
+    if (! buffer->packing)
+    {
+        return -1;
+    }
+    block = line->position.block;
+    result = 0;
+
+    pthread_mutex_lock(&buffer->packing->lock);
+    text = pack_decode(buffer, block);
+    if (! text)
+    {
+        pthread_mutex_unlock(&buffer->packing->lock);
+        return -1;
+    }
+    for (i = 0; i < block->count; i++)
+    {
+        member = block->lines[i];
+        if (! member)
+        {
+            continue;
+        }
+        length = block->offsets[i + 1] - block->offsets[i];
+        data = (char*)malloc(length + 1);
+        if (! data)
+        {
+            // the rest stay packed
+            butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+            result = -1;
+            break;
+        }
+        memcpy(data, text + block->offsets[i], length);
+        data[length] = '\0';
+        member->location = lineInMemory;
+        member->position.data = data;
+        block->lines[i] = NULL;
+        block->remaining--;
+        buffer_account_memory(buffer, memoryLines, 0, length + 1);
+    }
+    pthread_mutex_unlock(&buffer->packing->lock);
+
+    if (! block->remaining)
+    {
+        pack_free_block(buffer, block);
+    }
+    return result;
+}
+
+int buffer_unpack_lines(buffer_t *buffer)
+{
+    line_t *line;
+    int result;
+
+    if (! buffer)
+    {
+        return -1;
+    }
+    for (line = buffer->lines; line; line = line->next)
+    {
+        result = buffer_unpack_block(buffer, line);
+        if (result)
+        {
+            return result;
+        }
+    }
+    return 0;
+}
+
+int buffer_read_packed(buffer_t *buffer, const line_t *line, uint64_t offset, uint8_t *data, size_t count)
+{
+    const line_block_t *block;
+    const uint8_t *text;
+    size_t index;
+
+    if (!buffer || !line || !data || line->location != lineInBlock || !buffer->packing)
+    {
+        return -1;
+    }
+    block = line->position.block;
+    index = pack_line_index(block, line);
+    if (index >= block->count)
+    {
+        return -1;
+    }
+    if (offset >= line->length)
+    {
+        return 0;
+    }
+    if (count > (line->length - offset))
+    {
+        count = (size_t)(line->length - offset);
+    }
+    pthread_mutex_lock(&buffer->packing->lock);
+    text = pack_decode(buffer, block);
+    if (text)
+    {
+        memcpy(data, text + block->offsets[index] + offset, count);
+    }
+    pthread_mutex_unlock(&buffer->packing->lock);
+    return text ? (int)count : -1;
+}
+
+void buffer_forget_packed(buffer_t *buffer, line_t *line)
+{
+    line_block_t *block;
+    size_t index;
+    size_t i;
+
+    if (! buffer || ! buffer->packing)
+    {
+        return;
+    }
+    if (! line)
+    {
+        pthread_mutex_lock(&buffer->packing->lock);
+        for (i = 0; i < PACK_CACHE_BLOCKS; i++)
+        {
+            if (buffer->packing->cache[i].text)
+            {
+                free(buffer->packing->cache[i].text);
+                buffer_account_memory(buffer, memorySandbox, PACK_BLOCK_SIZE, 0);
+            }
+            memset(&buffer->packing->cache[i], 0, sizeof(pack_cache_entry_t));
+        }
+        pthread_mutex_unlock(&buffer->packing->lock);
+        return;
+    }
+    if (line->location != lineInBlock)
+    {
+        return;
+    }
+    block = line->position.block;
+    index = pack_line_index(block, line);
+    if (index < block->count)
+    {
+        block->lines[index] = NULL;
+        block->remaining--;
+    }
+    line->location = lineInFile;
+    line->position.offset = 0;
+    if (! block->remaining)
+    {
+        pack_free_block(buffer, block);
+    }
+}
+
+void buffer_touch_line(buffer_t *buffer, line_t *line)
+{
+    if (!buffer || !line || !buffer->packing || (line->attributes & lineTouched))
+    {
+        return;
+    }
+    // snapshots can be reading the line's attributes
+    //
+    pthread_mutex_lock(&buffer->versions.lock);
+    line->attributes |= lineTouched;
+    pthread_mutex_unlock(&buffer->versions.lock);
+}
+
+void buffer_check_packing(buffer_t *buffer)
+{
+    if (!buffer || !buffer->packing)
+    {
+        return;
+    }
+    if (buffer->line_memory > (buffer->packing->mark + PACK_PASS_GROWTH))
+    {
+        buffer_pack_lines(buffer, NULL);
+    }
+}
+
+void buffer_forget_packing(buffer_t *buffer)
+{
+    if (!buffer || !buffer->packing)
+    {
+        return;
+    }
+    buffer_forget_packed(buffer, NULL);
+    pthread_mutex_destroy(&buffer->packing->lock);
+    free(buffer->packing);
+    buffer->packing = NULL;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BPACK_H
+#define BPACK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Packs the text of edited lines that haven't been used lately into
+/// compressed blocks, so a buffer with many lines in memory holds a
+/// fraction of their size
+///
+/// A packing pass walks the lines in memory. A line whose text was used
+/// since the last pass, which has lineTouched set, is passed over this
+/// time, and runs of the others are packed, up to PACK_BLOCK_SIZE bytes
+/// of text in a block. The compression is a simple LZ77, byte aligned,
+/// that decodes at memory speed
+///
+/// Getting the content of a packed line unpacks its whole block back to
+/// lines in memory, since lines near it are likely to be wanted next.
+/// Reading a packed line, as searches and lexing do, decodes its block
+/// into a small cache of blocks and leaves it packed
+///
+/// Passes run when the text of a buffer's lines in memory has grown by
+/// PACK_PASS_GROWTH since the last one, or when the buffer is trimmed,
+/// see ::buffer_trim_memory. Lines aren't packed while snapshots are
+/// open, and all are unpacked when one is taken. Lines held for undo
+/// stay packed, but are unpacked when undo or redo brings them back while
+/// one is open, so undoing a large delete then holds all of its lines at
+/// full size until a pass after the last snapshot is released
+
+/// Most bytes of text in a block
+#define PACK_BLOCK_SIZE				(32*1024)
+
+/// Most lines in a block
+#define PACK_BLOCK_LINES			(512)
+
+/// Fewest lines worth a block
+#define PACK_BLOCK_MIN_LINES		(4)
+
+/// Growth in text of lines in memory that starts a packing pass
+#define PACK_PASS_GROWTH			(4*1024*1024)
+
+/// Blocks kept decoded for reading
+#define PACK_CACHE_BLOCKS			(16)
+
+/// Block of packed lines, one allocation
+///
+typedef struct tag_line_block
+{
+	size_t			size;				///< bytes allocated for all of this
+	size_t			count;				///< lines packed in block
+	size_t			remaining;			///< lines still in block
+	size_t			text_size;			///< bytes of text of the lines
+	size_t			packed_size;		///< bytes of packed text
+	line_t		  **lines;				///< the lines, in order, NULL where one left
+	uint32_t	   *offsets;			///< offset of each line's text in the block's, and the end
+	uint8_t		   *packed;				///< packed text
+}
+line_block_t;
+
+/// Decoded block
+///
+typedef struct tag_pack_cache_entry
+{
+	const line_block_t *block;			///< block decoded, NULL if none
+	uint8_t		   *text;				///< block's text
+	uint64_t		used;				///< clock when last used
+}
+pack_cache_entry_t;
+
+/// Packing state of a buffer
+///
+typedef struct tag_line_packing
+{
+	size_t			mark;				///< bytes of lines in memory after the last pass
+	pthread_mutex_t	lock;				///< protects cache
+	pack_cache_entry_t cache[PACK_CACHE_BLOCKS];
+	uint64_t		clock;				///< ticks once per cache lookup
+}
+line_packing_t;
+
+/// \brief Compress bytes
+///
+/// @param[in]  data   - bytes to compress, at most 64K
+/// @param[in]  length - count of bytes
+/// @param[out] packed - gets compressed bytes
+/// @param[in]  room   - bytes available at packed
+///
+/// @return bytes of compressed data, 0 if it doesn't fit in room
+///
+size_t pack_compress(const uint8_t *data, size_t length, uint8_t *packed, size_t room);
+
+/// \brief Decompress bytes made by ::pack_compress
+///
+/// @param[in]  packed - compressed bytes
+/// @param[in]  length - count of compressed bytes
+/// @param[out] data   - gets bytes
+/// @param[in]  room   - bytes available at data
+///
+/// @return count of bytes, < 0 if packed is damaged or the bytes don't fit
+///
+int pack_decompress(const uint8_t *packed, size_t length, uint8_t *data, size_t room);
+
+/// \brief Set if lines in memory that aren't used are packed
+///
+/// Turning packing off unpacks every line
+///
+/// @param[in] buffer - buffer to set
+/// @param[in] use    - pack lines if true
+///
+/// @return 0 on success
+///
+int buffer_set_line_packing(buffer_t *buffer, bool use);
+
+/// \brief Pack lines in memory not used since the last pass
+///
+/// @param[in]  buffer - buffer to pack lines of
+/// @param[out] saved  - gets bytes of memory saved, may be NULL
+///
+/// @return 0 on success, including when packing is off or can't be done
+///
+int buffer_pack_lines(buffer_t *buffer, size_t *saved);
+
+/// \brief Unpack the block a line is in, making its lines lines in memory
+///
+/// For code that uses the data of a line in memory
+///
+/// @param[in] buffer - buffer line is in
+/// @param[in] line   - line, does nothing unless it is in a block
+///
+/// @return 0 on success
+///
+int buffer_unpack_block(buffer_t *buffer, line_t *line);
+
+/// \brief Unpack every block of a buffer
+///
+/// @param[in] buffer - buffer to unpack
+///
+/// @return 0 on success
+///
+int buffer_unpack_lines(buffer_t *buffer);
+
+/// \brief Read bytes of a line in a block, see ::buffer_read_line
+///
+/// Safe to call from several threads at once
+///
+/// @return count of bytes read, < 0 on error
+///
+int buffer_read_packed(buffer_t *buffer, const line_t *line, uint64_t offset, uint8_t *data, size_t count);
+
+/// \brief Take a line that is being freed out of its block
+///
+/// With no line, drops the blocks decoded for reading instead, as when
+/// the lines they are of are gone
+///
+/// @param[in] buffer - buffer line was in
+/// @param[in] line   - line, does nothing unless it is in a block, NULL to drop decoded blocks
+///
+void buffer_forget_packed(buffer_t *buffer, line_t *line);
+
+/// \brief Note a line's text was used, so it isn't packed by the next pass
+///
+/// @param[in] buffer - buffer line is in
+/// @param[in] line   - line used
+///
+void buffer_touch_line(buffer_t *buffer, line_t *line);
+
+/// \brief Run a packing pass if lines in memory have grown enough since the last one
+///
+/// For the end of calls that edit a buffer
+///
+/// @param[in] buffer - buffer just edited
+///
+void buffer_check_packing(buffer_t *buffer);
+
+/// \brief Free what packing holds
+///
+/// For ::buffer_destroy
+///
+/// @param[in] buffer - buffer being destroyed
+///
+void buffer_forget_packing(buffer_t *buffer);
+
+#endif
@@ -0,0 +1,2119 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bregex.h"
+#include "butil.h"
+
+#include <unistd.h>
+
+/// \file
+///
+
+/// Most NFA states a pattern can compile to
+#define REGEX_MAX_STATES		(64*1024)
+
+/// Most repeat count in {m,n}
+#define REGEX_MAX_REPEAT		1000
+
+/// Most non-ASCII code points a class lists before matching any
+#define REGEX_MAX_CLASS_LIST	256
+
+/// Hash buckets for DFA states
+#define REGEX_DFA_BUCKETS		1024
+
+/// Least memory a DFA can be capped at
+#define REGEX_MIN_DFA_CAP		(64*1024)
+
+/// Bytes of file a search thread buffers at once
+#define REGEX_WINDOW_SIZE		(1024*1024)
+
+/// A set of bytes
+///
+typedef struct tag_regex_byteset
+{
+	uint32_t		bits[8];
+}
+regex_byteset_t;
+
+/// NFA state types
+///
+typedef enum
+{
+	nfaSet,				///< consume a byte in set, go to out
+	nfaEpsilon,			///< go to out
+	nfaSplit,			///< go to out and out1
+	nfaBol,				///< go to out at beginning of line
+	nfaEol,				///< go to out at end of line
+	nfaMatch			///< pattern matched
+}
+regex_nfa_type_t;
+
+/// NFA state
+///
+typedef struct tag_regex_nfa
+{
+	regex_nfa_type_t type;
+	int				out;
+	int				out1;
+	int				set;				///< index of byte set, for nfaSet
+}
+regex_nfa_t;
+
+/// Character class, a set of code points
+///
+typedef struct tag_regex_class
+{
+	uint32_t		ascii[4];			///< code points 0-127
+	uint32_t	   *ranges;				///< pairs of first,last code points above 127
+	size_t			nranges;			///< count of pairs
+	bool			negated;			///< class matches code points NOT in it
+}
+regex_class_t;
+
+/// Parse tree node types
+///
+typedef enum
+{
+	astClass,
+	astEmpty,
+	astCat,
+	astAlt,
+	astRepeat,
+	astBol,
+	astEol
+}
+regex_ast_type_t;
+
+/// Parse tree node
+///
+typedef struct tag_regex_ast
+{
+	regex_ast_type_t type;
+	int				left;
+	int				right;
+	int				min;				///< least repeats
+	int				max;				///< most repeats, -1 for no limit
+	int				cls;				///< index of class, for astClass
+}
+regex_ast_t;
+
+/// DFA state, a set of NFA states
+///
+typedef struct tag_regex_dstate
+{
+	struct tag_regex_dstate *chain;		///< next state in hash bucket
+	uint32_t		hash;
+	bool			begin;				///< state is at beginning of line
+	bool			match;				///< an NFA match state is in the set
+	int				endmatch;			///< matches if line ends here, -1 unknown
+	int				nstates;			///< count of NFA states in set
+	int			   *states;				///< sorted NFA states
+	struct tag_regex_dstate **next;		///< transition for each byte class, NULL if not built yet
+}
+regex_dstate_t;
+
+/// Compiled regular expression
+///
+struct tag_bregex
+{
+	text_encoding_t	encoding;			///< encoding matched
+	size_t			unit;				///< bytes per code unit in encoding
+	bool			bigendian;			///< code units are big-endian
+	regex_options_t	options;
+	// parse
+	const char	   *pattern;
+	size_t			pattern_length;
+	size_t			pattern_index;
+	regex_ast_t	   *ast;
+	int				nast;
+	int				ast_size;
+	regex_class_t  *classes;
+	int				nclasses;
+	int				classes_size;
+	// nfa
+	regex_nfa_t	   *nfa;
+	int				nnfa;
+	int				nfa_size;
+	regex_byteset_t *sets;
+	int				nsets;
+	int				sets_size;
+	int				start;
+	// dfa
+	uint8_t			byteclass[256];		///< equivalence class of each byte
+	uint8_t			classbyte[256];		///< a byte in each class
+	int				nbyteclasses;
+	regex_dstate_t *buckets[REGEX_DFA_BUCKETS];
+	regex_dstate_t *dstart[2];			///< start states, [0] mid-line, [1] at beginning
+	size_t			dfa_memory;
+	size_t			dfa_cap;
+	size_t			flushes;
+	// scratch
+	int			   *mark;				///< generation each NFA state was last added
+	int				generation;
+	int			   *list;				///< NFA states being collected
+	int				nlist;
+	int			   *stack;
+};
+
+//-----------------------------------------------------------------------------
+// byte sets and classes
+//-----------------------------------------------------------------------------
+
+static inline void regex_set_add(regex_byteset_t *set, int byte)
+{
+    set->bits[byte >> 5] |= (1u << (byte & 31));
+}
+
+static inline bool regex_set_has(const regex_byteset_t *set, int byte)
+{
+    return (set->bits[byte >> 5] & (1u << (byte & 31))) != 0;
+}
+
+static void regex_set_range(regex_byteset_t *set, int first, int last)
+{
+    int b;
+
+    for (b = first; b <= last; b++)
+    {
+        regex_set_add(set, b);
+    }
+}
+
+static inline void regex_class_add_ascii(regex_class_t *cls, uint32_t code)
+{
+    cls->ascii[code >> 5] |= (1u << (code & 31));
+}
+
+static int regex_class_add(bregex_t *regex, regex_class_t *cls, uint32_t first, uint32_t last)
+{
+    uint32_t code;
+    uint32_t *ranges;
+
+    for (code = first; code <= last && code < 128; code++)
+    {
+        regex_class_add_ascii(cls, code);
+
+        if (regex->options & regexIgnoreCase)
+        {
+            if (code >= 'a' && code <= 'z')
+            {
+                regex_class_add_ascii(cls, code - ('a' - 'A'));
+            }
+            else if (code >= 'A' && code <= 'Z')
+            {
+                regex_class_add_ascii(cls, code + ('a' - 'A'));
+            }
+        }
+    }
+    if (last < 128)
+    {
+        return 0;
+    }
+    if (first < 128)
+    {
+        first = 128;
+    }
+    ranges = (uint32_t*)realloc(cls->ranges, (cls->nranges + 1) * 2 * sizeof(uint32_t));
+    if (! ranges)
+    {
+        return -1;
+    }
+    cls->ranges = ranges;
+    cls->ranges[cls->nranges * 2] = first;
+    cls->ranges[cls->nranges * 2 + 1] = last;
+    cls->nranges++;
+    return 0;
+}
+
+static int regex_new_class(bregex_t *regex)
+{
+    regex_class_t *classes;
+
+    if (regex->nclasses >= regex->classes_size)
+    {
+        regex->classes_size = regex->classes_size ? regex->classes_size * 2 : 16;
+        classes = (regex_class_t*)realloc(regex->classes, regex->classes_size * sizeof(regex_class_t));
+        if (! classes)
+        {
+            return -1;
+        }
+        regex->classes = classes;
+    }
+    memset(&regex->classes[regex->nclasses], 0, sizeof(regex_class_t));
+    return regex->nclasses++;
+}
+
+//-----------------------------------------------------------------------------
+// parser
+//-----------------------------------------------------------------------------
+
+static int regex_new_ast(bregex_t *regex, regex_ast_type_t type, int left, int right)
+{
+    regex_ast_t *ast;
+
+    if (regex->nast >= regex->ast_size)
+    {
+        regex->ast_size = regex->ast_size ? regex->ast_size * 2 : 64;
+        ast = (regex_ast_t*)realloc(regex->ast, regex->ast_size * sizeof(regex_ast_t));
+        if (! ast)
+        {
+            return -1;
+        }
+        regex->ast = ast;
+    }
+    ast = &regex->ast[regex->nast];
+    ast->type = type;
+    ast->left = left;
+    ast->right = right;
+    ast->min = 0;
+    ast->max = 0;
+    ast->cls = -1;
+    return regex->nast++;
+}
+
+static bool regex_at_end(bregex_t *regex)
+{
+    return regex->pattern_index >= regex->pattern_length;
+}
+
+static int regex_peek(bregex_t *regex)
+{
+    if (regex_at_end(regex))
+    {
+        return -1;
+    }
+    return (uint8_t)regex->pattern[regex->pattern_index];
+}
+
+/// \brief Get next code point from pattern
+///
+static uint32_t regex_next(bregex_t *regex)
+{
+    uint32_t code;
+    size_t used;
+
+    used = butil_utf8_decode((uint8_t*)regex->pattern + regex->pattern_index,
+                    regex->pattern_length - regex->pattern_index, &code);
+    if (used == 0)
+    {
+        used = 1;
+        code = (uint8_t)regex->pattern[regex->pattern_index];
+    }
+    regex->pattern_index += used;
+    return code;
+}
+
+/// \brief Add the members of a \\d \\w \\s style escape to a class
+///
+/// @return 1 if escape was a class escape, 0 if not, < 0 on error
+///
+static int regex_class_escape(bregex_t *regex, regex_class_t *cls, uint32_t escape, bool *negate)
+{
+    int result = 0;
+
+    *negate = (escape == 'D' || escape == 'W' || escape == 'S');
+
+    switch (escape)
+    {
+    case 'd':
+    case 'D':
+        result = regex_class_add(regex, cls, '0', '9');
+        break;
+    case 'w':
+    case 'W':
+        result  = regex_class_add(regex, cls, '0', '9');
+        result |= regex_class_add(regex, cls, 'a', 'z');
+        result |= regex_class_add(regex, cls, 'A', 'Z');
+        result |= regex_class_add(regex, cls, '_', '_');
+        break;
+    case 's':
+    case 'S':
+        result  = regex_class_add(regex, cls, ' ', ' ');
+        result |= regex_class_add(regex, cls, '\t', '\r');
+        break;
+    default:
+        return 0;
+    }
+    return result ? -1 : 1;
+}
+
+/// \brief Get the code point of a literal escape like \\t
+///
+static uint32_t regex_literal_escape(uint32_t escape)
+{
+    switch (escape)
+    {
+    case 't':   return '\t';
+    case 'n':   return '\n';
+    case 'r':   return '\r';
+    case 'f':   return '\f';
+    case 'v':   return '\v';
+    case '0':   return '\0';
+    default:    return escape;
+    }
+}
+
+static int regex_parse_alt(bregex_t *regex, int depth);
+
+/// \brief Parse a bracketed class, after the [
+///
+static int regex_parse_bracket(bregex_t *regex)
+{
+    regex_class_t *cls;
+    regex_class_t sub;
+    uint32_t first;
+    uint32_t last;
+    bool negate;
+    bool started;
+    int index;
+    int result;
+    int i;
+
+    index = regex_new_class(regex);
+    if (index < 0)
+    {
+        return -1;
+    }
+    if (regex_peek(regex) == '^')
+    {
+        regex->pattern_index++;
+        regex->classes[index].negated = true;
+    }
+    started = false;
+
+    while (! regex_at_end(regex))
+    {
+        if (regex_peek(regex) == ']' && started)
+        {
+            regex->pattern_index++;
+            return index;
+        }
+        started = true;
+        first = regex_next(regex);
+
+        if (first == '\\' && ! regex_at_end(regex))
+        {
+            first = regex_next(regex);
+
+            memset(&sub, 0, sizeof(sub));
+            result = regex_class_escape(regex, &sub, first, &negate);
+            if (result < 0)
+            {
+                return -1;
+            }
+            if (result > 0)
+            {
+                // merge the escape's members, complementing the ASCII part if negated
+                //
+                cls = &regex->classes[index];
+                for (i = 0; i < 4; i++)
+                {
+                    cls->ascii[i] |= negate ? ~sub.ascii[i] : sub.ascii[i];
+                }
+                if (negate && regex_class_add(regex, cls, 128, 0x10FFFF))
+                {
+                    return -1;
+                }
+                continue;
+            }
+            first = regex_literal_escape(first);
+        }
+        last = first;
+
+        if (
+                regex_peek(regex) == '-'
+            &&  (regex->pattern_index + 1) < regex->pattern_length
+            &&  regex->pattern[regex->pattern_index + 1] != ']'
+        )
+        {
+            regex->pattern_index++;
+            last = regex_next(regex);
+            if (last == '\\' && ! regex_at_end(regex))
+            {
+                last = regex_literal_escape(regex_next(regex));
+            }
+            if (last < first)
+            {
+                butil_log(2, "%s: Bad range in class\n", __FUNCTION__);
+                return -1;
+            }
+        }
+        if (regex_class_add(regex, &regex->classes[index], first, last))
+        {
+            return -1;
+        }
+    }
+    butil_log(2, "%s: Unterminated class\n", __FUNCTION__);
+    return -1;
+}
+
+/// \brief Parse a decimal number in a {m,n}
+///
+static int regex_parse_count(bregex_t *regex)
+{
+    int count;
+    int c;
+
+    count = -1;
+    while ((c = regex_peek(regex)) >= '0' && c <= '9')
+    {
+        count = (count < 0 ? 0 : count * 10) + (c - '0');
+        if (count > REGEX_MAX_REPEAT)
+        {
+            return -2;
+        }
+        regex->pattern_index++;
+    }
+    return count;
+}
+
+/// \brief Parse an atom: literal, class, group or anchor
+///
+static int regex_parse_atom(bregex_t *regex, int depth)
+{
+    uint32_t code;
+    bool negate;
+    int node;
+    int index;
+    int result;
+    int c;
+
+    c = regex_peek(regex);
+    switch (c)
+    {
+    case '(':
+        regex->pattern_index++;
+        node = regex_parse_alt(regex, depth + 1);
+        if (node < 0)
+        {
+            return node;
+        }
+        if (regex_peek(regex) != ')')
+        {
+            butil_log(2, "%s: Missing )\n", __FUNCTION__);
+            return -1;
+        }
+        regex->pattern_index++;
+        return node;
+
+    case '[':
+        regex->pattern_index++;
+        index = regex_parse_bracket(regex);
+        if (index < 0)
+        {
+            return -1;
+        }
+        node = regex_new_ast(regex, astClass, -1, -1);
+        if (node >= 0)
+        {
+            regex->ast[node].cls = index;
+        }
+        return node;
+
+    case '^':
+        regex->pattern_index++;
+        return regex_new_ast(regex, astBol, -1, -1);
+
+    case '$':
+        regex->pattern_index++;
+        return regex_new_ast(regex, astEol, -1, -1);
+
+    case '.':
+        regex->pattern_index++;
+        index = regex_new_class(regex);
+        if (index < 0)
+        {
+            return -1;
+        }
+        regex->classes[index].negated = true;
+        node = regex_new_ast(regex, astClass, -1, -1);
+        if (node >= 0)
+        {
+            regex->ast[node].cls = index;
+        }
+        return node;
+
+    default:
+        break;
+    }
+    index = regex_new_class(regex);
+    if (index < 0)
+    {
+        return -1;
+    }
+    code = regex_next(regex);
+    if (code == '\\')
+    {
+        if (regex_at_end(regex))
+        {
+            butil_log(2, "%s: Trailing \\\n", __FUNCTION__);
+            return -1;
+        }
+        code = regex_next(regex);
+        result = regex_class_escape(regex, &regex->classes[index], code, &negate);
+        if (result < 0)
+        {
+            return -1;
+        }
+        if (result > 0)
+        {
+            regex->classes[index].negated = negate;
+            code = 0x110000;
+        }
+        else
+        {
+            code = regex_literal_escape(code);
+        }
+    }
+    if (code < 0x110000)
+    {
+        if (regex_class_add(regex, &regex->classes[index], code, code))
+        {
+            return -1;
+        }
+    }
+    node = regex_new_ast(regex, astClass, -1, -1);
+    if (node >= 0)
+    {
+        regex->ast[node].cls = index;
+    }
+    return node;
+}
+
+/// \brief Parse an atom and any repeat operators after it
+///
+static int regex_parse_repeat(bregex_t *regex, int depth)
+{
+    size_t save;
+    int node;
+    int repeat;
+    int min;
+    int max;
+    int c;
+
+    node = regex_parse_atom(regex, depth);
+    if (node < 0)
+    {
+        return node;
+    }
+    while (! regex_at_end(regex))
+    {
+        c = regex_peek(regex);
+        if (c == '*')
+        {
+            min = 0;
+            max = -1;
+        }
+        else if (c == '+')
+        {
+            min = 1;
+            max = -1;
+        }
+        else if (c == '?')
+        {
+            min = 0;
+            max = 1;
+        }
+        else if (c == '{')
+        {
+            save = regex->pattern_index;
+            regex->pattern_index++;
+            min = regex_parse_count(regex);
+            max = min;
+            if (regex_peek(regex) == ',')
+            {
+                regex->pattern_index++;
+                max = regex_parse_count(regex);
+            }
+            if (min == -2 || max == -2)
+            {
+                butil_log(2, "%s: Repeat count too large\n", __FUNCTION__);
+                return -1;
+            }
+            if (min < 0 || regex_peek(regex) != '}' || (max >= 0 && max < min))
+            {
+                // not a repeat, treat the { as a literal
+                //
+                regex->pattern_index = save;
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+        regex->pattern_index++;
+        repeat = regex_new_ast(regex, astRepeat, node, -1);
+        if (repeat < 0)
+        {
+            return repeat;
+        }
+        regex->ast[repeat].min = min;
+        regex->ast[repeat].max = max;
+        node = repeat;
+    }
+    return node;
+}
+
+/// \brief Parse a concatenation of repeats
+///
+static int regex_parse_cat(bregex_t *regex, int depth)
+{
+    int node;
+    int next;
+    int c;
+
+    node = -1;
+    while (! regex_at_end(regex))
+    {
+        c = regex_peek(regex);
+        if (c == '|' || c == ')')
+        {
+            break;
+        }
+        next = regex_parse_repeat(regex, depth);
+        if (next < 0)
+        {
+            return -1;
+        }
+        if (node < 0)
+        {
+            node = next;
+        }
+        else
+        {
+            node = regex_new_ast(regex, astCat, node, next);
+            if (node < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    if (node < 0)
+    {
+        node = regex_new_ast(regex, astEmpty, -1, -1);
+    }
+    return node;
+}
+
+/// \brief Parse alternatives
+///
+static int regex_parse_alt(bregex_t *regex, int depth)
+{
+    int node;
+    int next;
+
+    if (depth > 256)
+    {
+        butil_log(2, "%s: Pattern nested too deep\n", __FUNCTION__);
+        return -1;
+    }
+    node = regex_parse_cat(regex, depth);
+    while (node >= 0 && regex_peek(regex) == '|')
+    {
+        regex->pattern_index++;
+        next = regex_parse_cat(regex, depth);
+        if (next < 0)
+        {
+            return -1;
+        }
+        node = regex_new_ast(regex, astAlt, node, next);
+    }
+    return node;
+}
+
+//-----------------------------------------------------------------------------
+// NFA construction, each fragment has a start state and an epsilon end state
+//-----------------------------------------------------------------------------
+
+typedef struct tag_regex_frag
+{
+	int start;
+	int end;
+}
+regex_frag_t;
+
+static int regex_new_state(bregex_t *regex, regex_nfa_type_t type, int out, int out1)
+{
+    regex_nfa_t *nfa;
+
+    if (regex->nnfa >= REGEX_MAX_STATES)
+    {
+        butil_log(2, "%s: Pattern too complex\n", __FUNCTION__);
+        return -1;
+    }
+    if (regex->nnfa >= regex->nfa_size)
+    {
+        regex->nfa_size = regex->nfa_size ? regex->nfa_size * 2 : 64;
+        nfa = (regex_nfa_t*)realloc(regex->nfa, regex->nfa_size * sizeof(regex_nfa_t));
+        if (! nfa)
+        {
+            return -1;
+        }
+        regex->nfa = nfa;
+    }
+    nfa = &regex->nfa[regex->nnfa];
+    nfa->type = type;
+    nfa->out = out;
+    nfa->out1 = out1;
+    nfa->set = -1;
+    return regex->nnfa++;
+}
+
+static int regex_new_set(bregex_t *regex, const regex_byteset_t *set)
+{
+    regex_byteset_t *sets;
+
+    if (regex->nsets >= regex->sets_size)
+    {
+        regex->sets_size = regex->sets_size ? regex->sets_size * 2 : 32;
+        sets = (regex_byteset_t*)realloc(regex->sets, regex->sets_size * sizeof(regex_byteset_t));
+        if (! sets)
+        {
+            return -1;
+        }
+        regex->sets = sets;
+    }
+    regex->sets[regex->nsets] = *set;
+    return regex->nsets++;
+}
+
+static int regex_frag_simple(bregex_t *regex, regex_nfa_type_t type, regex_frag_t *frag)
+{
+    frag->end = regex_new_state(regex, nfaEpsilon, -1, -1);
+    if (frag->end < 0)
+    {
+        return -1;
+    }
+    frag->start = regex_new_state(regex, type, frag->end, -1);
+    return (frag->start < 0) ? -1 : 0;
+}
+
+static int regex_frag_set(bregex_t *regex, const regex_byteset_t *set, regex_frag_t *frag)
+{
+    int index;
+
+    index = regex_new_set(regex, set);
+    if (index < 0)
+    {
+        return -1;
+    }
+    if (regex_frag_simple(regex, nfaSet, frag))
+    {
+        return -1;
+    }
+    regex->nfa[frag->start].set = index;
+    return 0;
+}
+
+static void regex_frag_cat(bregex_t *regex, regex_frag_t *a, const regex_frag_t *b)
+{
+    regex->nfa[a->end].out = b->start;
+    a->end = b->end;
+}
+
+static int regex_frag_alt(bregex_t *regex, regex_frag_t *a, const regex_frag_t *b)
+{
+    int split;
+    int end;
+
+    end = regex_new_state(regex, nfaEpsilon, -1, -1);
+    if (end < 0)
+    {
+        return -1;
+    }
+    split = regex_new_state(regex, nfaSplit, a->start, b->start);
+    if (split < 0)
+    {
+        return -1;
+    }
+    regex->nfa[a->end].out = end;
+    regex->nfa[b->end].out = end;
+    a->start = split;
+    a->end = end;
+    return 0;
+}
+
+/// \brief Add an alternative to a fragment which may not exist yet
+///
+static int regex_frag_either(bregex_t *regex, regex_frag_t *frag, bool *have, const regex_frag_t *alt)
+{
+    if (! *have)
+    {
+        *frag = *alt;
+        *have = true;
+        return 0;
+    }
+    return regex_frag_alt(regex, frag, alt);
+}
+
+/// \brief Emit one code unit matching sets of byte values
+///
+/// @param[in] values - byte sets in order of significance, least first
+///
+static int regex_emit_unit(bregex_t *regex, const regex_byteset_t *values, regex_frag_t *frag)
+{
+    regex_frag_t next;
+    size_t i;
+    size_t b;
+
+    for (i = 0; i < regex->unit; i++)
+    {
+        b = regex->bigendian ? (regex->unit - 1 - i) : i;
+        if (regex_frag_set(regex, &values[b], i ? &next : frag))
+        {
+            return -1;
+        }
+        if (i)
+        {
+            regex_frag_cat(regex, frag, &next);
+        }
+    }
+    return 0;
+}
+
+/// \brief Emit a code unit with a specific value
+///
+static int regex_emit_code(bregex_t *regex, uint32_t code, regex_frag_t *frag)
+{
+    regex_byteset_t values[4];
+    uint8_t utf8[8];
+    regex_frag_t next;
+    int len;
+    int i;
+
+    memset(values, 0, sizeof(values));
+
+    if (regex->unit == 1)
+    {
+        len = butil_utf8_encode(code, utf8);
+        for (i = 0; i < len; i++)
+        {
+            memset(values, 0, sizeof(regex_byteset_t));
+            regex_set_add(&values[0], utf8[i]);
+            if (regex_frag_set(regex, &values[0], i ? &next : frag))
+            {
+                return -1;
+            }
+            if (i)
+            {
+                regex_frag_cat(regex, frag, &next);
+            }
+        }
+        return 0;
+    }
+    for (i = 0; i < (int)regex->unit; i++)
+    {
+        regex_set_add(&values[i], (code >> (i * 8)) & 0xFF);
+    }
+    return regex_emit_unit(regex, values, frag);
+}
+
+/// \brief Emit a match of any code point above 127
+///
+static int regex_emit_any_high(bregex_t *regex, regex_frag_t *frag)
+{
+    regex_byteset_t values[4];
+    regex_byteset_t cont;
+    regex_frag_t alt;
+    regex_frag_t next;
+    bool have;
+    size_t i;
+    size_t j;
+    int n;
+
+    have = false;
+
+    if (regex->unit == 1)
+    {
+        // utf-8 lead byte followed by 1, 2, or 3 continuation bytes
+        //
+        memset(&cont, 0, sizeof(cont));
+        regex_set_range(&cont, 0x80, 0xBF);
+
+        for (n = 1; n <= 3; n++)
+        {
+            memset(values, 0, sizeof(regex_byteset_t));
+            regex_set_range(&values[0], (n == 1) ? 0xC0 : ((n == 2) ? 0xE0 : 0xF0), (n == 1) ? 0xDF : ((n == 2) ? 0xEF : 0xF7));
+            if (regex_frag_set(regex, &values[0], &alt))
+            {
+                return -1;
+            }
+            for (i = 0; i < (size_t)n; i++)
+            {
+                if (regex_frag_set(regex, &cont, &next))
+                {
+                    return -1;
+                }
+                regex_frag_cat(regex, &alt, &next);
+            }
+            if (regex_frag_either(regex, frag, &have, &alt))
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    // code unit where byte j is the most significant non-zero one, and
+    // for the low byte, it must be >= 128
+    //
+    for (j = 0; j < regex->unit; j++)
+    {
+        memset(values, 0, sizeof(values));
+        for (i = 0; i < regex->unit; i++)
+        {
+            if (i < j)
+            {
+                regex_set_range(&values[i], 0, 0xFF);
+            }
+            else if (i == j)
+            {
+                regex_set_range(&values[i], j ? 1 : 0x80, 0xFF);
+            }
+            else
+            {
+                regex_set_add(&values[i], 0);
+            }
+        }
+        if (regex_emit_unit(regex, values, &alt))
+        {
+            return -1;
+        }
+        if (regex_frag_either(regex, frag, &have, &alt))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// \brief Emit a match of one character in a class
+///
+static int regex_emit_class(bregex_t *regex, const regex_class_t *cls, regex_frag_t *frag)
+{
+    regex_byteset_t values[4];
+    regex_frag_t alt;
+    uint32_t listed;
+    uint32_t code;
+    uint32_t mask;
+    size_t r;
+    bool have;
+    int i;
+
+    have = false;
+
+    // ASCII members in the low byte of a unit, any higher bytes 0
+    //
+    memset(values, 0, sizeof(values));
+    for (i = 0; i < 128; i++)
+    {
+        mask = 1u << (i & 31);
+        if (((cls->ascii[i >> 5] & mask) != 0) != cls->negated)
+        {
+            regex_set_add(&values[0], i);
+        }
+    }
+    for (i = 1; i < (int)regex->unit; i++)
+    {
+        regex_set_add(&values[i], 0);
+    }
+    for (i = 0; i < 8; i++)
+    {
+        if (values[0].bits[i])
+        {
+            break;
+        }
+    }
+    if (i < 8)
+    {
+        if (regex_emit_unit(regex, values, &alt))
+        {
+            return -1;
+        }
+        if (regex_frag_either(regex, frag, &have, &alt))
+        {
+            return -1;
+        }
+    }
+    // non-ASCII members listed one at a time if few enough, else any
+    //
+    listed = 0;
+    for (r = 0; r < cls->nranges; r++)
+    {
+        listed += cls->ranges[r * 2 + 1] - cls->ranges[r * 2] + 1;
+    }
+    if (cls->negated || listed > REGEX_MAX_CLASS_LIST)
+    {
+        if (regex_emit_any_high(regex, &alt))
+        {
+            return -1;
+        }
+        if (regex_frag_either(regex, frag, &have, &alt))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        for (r = 0; r < cls->nranges; r++)
+        {
+            for (code = cls->ranges[r * 2]; code <= cls->ranges[r * 2 + 1]; code++)
+            {
+                if (regex->unit == 2 && code > 0xFFFF)
+                {
+                    continue;
+                }
+                if (regex_emit_code(regex, code, &alt))
+                {
+                    return -1;
+                }
+                if (regex_frag_either(regex, frag, &have, &alt))
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    if (! have)
+    {
+        // empty class never matches
+        //
+        memset(values, 0, sizeof(regex_byteset_t));
+        return regex_frag_set(regex, &values[0], frag);
+    }
+    return 0;
+}
+
+static int regex_compile_node(bregex_t *regex, int node, regex_frag_t *frag);
+
+/// \brief Compile a repeat by copying the sub-expression
+///
+static int regex_compile_repeat(bregex_t *regex, const regex_ast_t *ast, regex_frag_t *frag)
+{
+    regex_frag_t sub;
+    regex_frag_t opt;
+    int split;
+    int i;
+
+    if (regex_frag_simple(regex, nfaEpsilon, frag))
+    {
+        return -1;
+    }
+    for (i = 0; i < ast->min; i++)
+    {
+        if (regex_compile_node(regex, ast->left, &sub))
+        {
+            return -1;
+        }
+        regex_frag_cat(regex, frag, &sub);
+    }
+    if (ast->max < 0)
+    {
+        // star: split back into the sub-expression or out
+        //
+        if (regex_compile_node(regex, ast->left, &sub))
+        {
+            return -1;
+        }
+        if (regex_frag_simple(regex, nfaEpsilon, &opt))
+        {
+            return -1;
+        }
+        split = regex_new_state(regex, nfaSplit, sub.start, opt.start);
+        if (split < 0)
+        {
+            return -1;
+        }
+        regex->nfa[sub.end].out = split;
+        regex->nfa[frag->end].out = split;
+        frag->end = opt.end;
+        return 0;
+    }
+    for (i = ast->min; i < ast->max; i++)
+    {
+        if (regex_compile_node(regex, ast->left, &sub))
+        {
+            return -1;
+        }
+        if (regex_frag_simple(regex, nfaEpsilon, &opt))
+        {
+            return -1;
+        }
+        split = regex_new_state(regex, nfaSplit, sub.start, opt.start);
+        if (split < 0)
+        {
+            return -1;
+        }
+        regex->nfa[sub.end].out = opt.start;
+        regex->nfa[frag->end].out = split;
+        frag->end = opt.end;
+    }
+    return 0;
+}
+
+static int regex_compile_node(bregex_t *regex, int node, regex_frag_t *frag)
+{
+    regex_ast_t ast;
+    regex_frag_t right;
+
+    // copy, the ast array doesn't move but keep it simple
+    ast = regex->ast[node];
+
+    switch (ast.type)
+    {
+    case astClass:
+        return regex_emit_class(regex, &regex->classes[ast.cls], frag);
+    case astEmpty:
+        return regex_frag_simple(regex, nfaEpsilon, frag);
+    case astBol:
+        return regex_frag_simple(regex, nfaBol, frag);
+    case astEol:
+        return regex_frag_simple(regex, nfaEol, frag);
+    case astCat:
+        if (regex_compile_node(regex, ast.left, frag) || regex_compile_node(regex, ast.right, &right))
+        {
+            return -1;
+        }
+        regex_frag_cat(regex, frag, &right);
+        return 0;
+    case astAlt:
+        if (regex_compile_node(regex, ast.left, frag) || regex_compile_node(regex, ast.right, &right))
+        {
+            return -1;
+        }
+        return regex_frag_alt(regex, frag, &right);
+    case astRepeat:
+        return regex_compile_repeat(regex, &ast, frag);
+    }
+    return -1;
+}
+
+/// \brief Split bytes into classes that every byte set treats the same
+///
+static void regex_make_byteclasses(bregex_t *regex)
+{
+    uint8_t remap[512];
+    uint8_t nclasses;
+    int set;
+    int b;
+    int key;
+
+    memset(regex->byteclass, 0, sizeof(regex->byteclass));
+    regex->nbyteclasses = 1;
+
+    for (set = 0; set < regex->nsets; set++)
+    {
+        // refine each class by membership in this set
+        //
+        memset(remap, 0xFF, sizeof(remap));
+        nclasses = 0;
+        for (b = 0; b < 256; b++)
+        {
+            key = regex->byteclass[b] * 2 + (regex_set_has(&regex->sets[set], b) ? 1 : 0);
+            if (remap[key] == 0xFF)
+            {
+                remap[key] = nclasses++;
+            }
+            regex->byteclass[b] = remap[key];
+        }
+        regex->nbyteclasses = nclasses;
+    }
+    for (b = 255; b >= 0; b--)
+    {
+        regex->classbyte[regex->byteclass[b]] = (uint8_t)b;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// lazy DFA
+//-----------------------------------------------------------------------------
+
+/// \brief Add the epsilon closure of an NFA state to the list being built
+///
+static void regex_closure(bregex_t *regex, int state, bool begin)
+{
+    regex_nfa_t *nfa;
+    int sp;
+
+    sp = 0;
+    regex->stack[sp++] = state;
+
+    while (sp > 0)
+    {
+        state = regex->stack[--sp];
+        if (state < 0 || regex->mark[state] == regex->generation)
+        {
+            continue;
+        }
+        regex->mark[state] = regex->generation;
+        nfa = &regex->nfa[state];
+
+        switch (nfa->type)
+        {
+        case nfaEpsilon:
+            regex->stack[sp++] = nfa->out;
+            break;
+        case nfaSplit:
+            regex->stack[sp++] = nfa->out1;
+            regex->stack[sp++] = nfa->out;
+            break;
+        case nfaBol:
+            if (begin)
+            {
+                regex->stack[sp++] = nfa->out;
+            }
+            break;
+        case nfaEol:
+            // kept, followed only when the line ends
+        case nfaSet:
+        case nfaMatch:
+            regex->list[regex->nlist++] = state;
+            break;
+        }
+    }
+}
+
+static int regex_compare_int(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/// \brief Free all DFA states
+///
+static void regex_dfa_flush(bregex_t *regex)
+{
+    regex_dstate_t *dstate;
+    regex_dstate_t *next;
+    int i;
+
+    for (i = 0; i < REGEX_DFA_BUCKETS; i++)
+    {
+        for (dstate = regex->buckets[i]; dstate; dstate = next)
+        {
+            next = dstate->chain;
+            free(dstate);
+        }
+        regex->buckets[i] = NULL;
+    }
+    regex->dstart[0] = NULL;
+    regex->dstart[1] = NULL;
+    regex->dfa_memory = 0;
+}
+
+/// \brief Find or make the DFA state for the NFA states in the list
+///
+/// @param[out] flushed - set true if old states were freed to make room
+///
+static regex_dstate_t *regex_dfa_intern(bregex_t *regex, bool begin, bool *flushed)
+{
+    regex_dstate_t *dstate;
+    uint32_t hash;
+    size_t size;
+    int bucket;
+    int i;
+
+    qsort(regex->list, regex->nlist, sizeof(int), regex_compare_int);
+
+    hash = begin ? 0x9E3779B9 : 0;
+    for (i = 0; i < regex->nlist; i++)
+    {
+        hash = (hash ^ (uint32_t)regex->list[i]) * 16777619u;
+    }
+    bucket = hash % REGEX_DFA_BUCKETS;
+
+    for (dstate = regex->buckets[bucket]; dstate; dstate = dstate->chain)
+    {
+        if (
+                dstate->hash == hash
+            &&  dstate->begin == begin
+            &&  dstate->nstates == regex->nlist
+            &&  ! memcmp(dstate->states, regex->list, regex->nlist * sizeof(int))
+        )
+        {
+            return dstate;
+        }
+    }
+    size = sizeof(regex_dstate_t) + regex->nbyteclasses * sizeof(regex_dstate_t*) + regex->nlist * sizeof(int);
+
+    if ((regex->dfa_memory + size) > regex->dfa_cap)
+    {
+        regex_dfa_flush(regex);
+        regex->flushes++;
+        *flushed = true;
+        bucket = hash % REGEX_DFA_BUCKETS;
+    }
+    dstate = (regex_dstate_t*)malloc(size);
+    if (! dstate)
+    {
+        butil_log(0, "%s: Can't alloc DFA state\n", __FUNCTION__);
+        return NULL;
+    }
+    regex->dfa_memory += size;
+
+    dstate->hash = hash;
+    dstate->begin = begin;
+    dstate->endmatch = -1;
+    dstate->nstates = regex->nlist;
+    dstate->next = (regex_dstate_t**)(dstate + 1);
+    dstate->states = (int*)(dstate->next + regex->nbyteclasses);
+    memset(dstate->next, 0, regex->nbyteclasses * sizeof(regex_dstate_t*));
+    memcpy(dstate->states, regex->list, regex->nlist * sizeof(int));
+
+    dstate->match = false;
+    for (i = 0; i < regex->nlist; i++)
+    {
+        if (regex->nfa[regex->list[i]].type == nfaMatch)
+        {
+            dstate->match = true;
+            break;
+        }
+    }
+    dstate->chain = regex->buckets[bucket];
+    regex->buckets[bucket] = dstate;
+    return dstate;
+}
+
+/// \brief Get a start state
+///
+static regex_dstate_t *regex_dfa_start(bregex_t *regex, bool begin)
+{
+    bool flushed;
+
+    if (! regex->dstart[begin ? 1 : 0])
+    {
+        regex->generation++;
+        regex->nlist = 0;
+        regex_closure(regex, regex->start, begin);
+
+        flushed = false;
+        regex->dstart[begin ? 1 : 0] = regex_dfa_intern(regex, begin, &flushed);
+    }
+    return regex->dstart[begin ? 1 : 0];
+}
+
+/// \brief Build the transition out of a DFA state for a byte class
+///
+static regex_dstate_t *regex_dfa_step(bregex_t *regex, regex_dstate_t *dstate, int byteclass)
+{
+    regex_dstate_t *next;
+    regex_nfa_t *nfa;
+    bool flushed;
+    uint8_t byte;
+    int i;
+
+    byte = regex->classbyte[byteclass];
+
+    regex->generation++;
+    regex->nlist = 0;
+
+    for (i = 0; i < dstate->nstates; i++)
+    {
+        nfa = &regex->nfa[dstate->states[i]];
+        if (nfa->type == nfaSet && regex_set_has(&regex->sets[nfa->set], byte))
+        {
+            regex_closure(regex, nfa->out, false);
+        }
+    }
+    flushed = false;
+    next = regex_dfa_intern(regex, false, &flushed);
+    if (next && ! flushed)
+    {
+        dstate->next[byteclass] = next;
+    }
+    return next;
+}
+
+/// \brief Check if the line matches when it ends in a DFA state
+///
+static bool regex_dfa_endmatch(bregex_t *regex, regex_dstate_t *dstate)
+{
+    regex_nfa_t *nfa;
+    int i;
+
+    if (dstate->endmatch >= 0)
+    {
+        return dstate->endmatch ? true : false;
+    }
+    regex->generation++;
+    regex->nlist = 0;
+    dstate->endmatch = 0;
+
+    for (i = 0; i < dstate->nstates; i++)
+    {
+        nfa = &regex->nfa[dstate->states[i]];
+        if (nfa->type == nfaMatch)
+        {
+            dstate->endmatch = 1;
+            break;
+        }
+        if (nfa->type == nfaEol)
+        {
+            regex_closure(regex, nfa->out, dstate->begin);
+        }
+    }
+    // follow through any more $ anchors
+    //
+    for (i = 0; i < regex->nlist && ! dstate->endmatch; i++)
+    {
+        nfa = &regex->nfa[regex->list[i]];
+        if (nfa->type == nfaMatch)
+        {
+            dstate->endmatch = 1;
+        }
+        else if (nfa->type == nfaEol)
+        {
+            regex_closure(regex, nfa->out, dstate->begin);
+        }
+    }
+    return dstate->endmatch ? true : false;
+}
+
+bregex_t *regex_create(const char *pattern, text_encoding_t encoding, regex_options_t options, size_t dfa_cap)
+{
+    bregex_t *regex;
+    regex_frag_t frag;
+    regex_frag_t skip;
+    regex_frag_t loop;
+    regex_frag_t unit;
+    regex_byteset_t anybyte;
+    int root;
+    int match;
+    int split;
+    int i;
+
+    if (! pattern)
+    {
+        return NULL;
+    }
+    regex = (bregex_t*)malloc(sizeof(bregex_t));
+    if (! regex)
+    {
+        butil_log(0, "%s: Can't alloc regex\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(regex, 0, sizeof(bregex_t));
+
+    regex->encoding = encoding;
+    regex->options = options;
+    regex->dfa_cap = dfa_cap ? dfa_cap : REGEX_DEFAULT_DFA_CAP;
+    if (regex->dfa_cap < REGEX_MIN_DFA_CAP)
+    {
+        regex->dfa_cap = REGEX_MIN_DFA_CAP;
+    }
+    switch (encoding)
+    {
+    case textUCS2LE:
+        regex->unit = 2;
+        break;
+    case textUCS2BE:
+        regex->unit = 2;
+        regex->bigendian = true;
+        break;
+    case textUCS4LE:
+        regex->unit = 4;
+        break;
+    case textUCS4BE:
+        regex->unit = 4;
+        regex->bigendian = true;
+        break;
+    default:
+        regex->unit = 1;
+        break;
+    }
+    regex->pattern = pattern;
+    regex->pattern_length = strlen(pattern);
+    regex->pattern_index = 0;
+
+    root = regex_parse_alt(regex, 0);
+    if (root >= 0 && ! regex_at_end(regex))
+    {
+        butil_log(2, "%s: Unmatched )\n", __FUNCTION__);
+        root = -1;
+    }
+    if (root < 0 || regex_compile_node(regex, root, &frag))
+    {
+        regex_destroy(regex);
+        return NULL;
+    }
+    match = regex_new_state(regex, nfaMatch, -1, -1);
+    if (match < 0)
+    {
+        regex_destroy(regex);
+        return NULL;
+    }
+    regex->nfa[frag.end].out = match;
+
+    // the search is unanchored, so skip any number of code units first,
+    // a whole unit at a time so a match can't start mid-character
+    //
+    if (regex_frag_simple(regex, nfaEpsilon, &skip))
+    {
+        regex_destroy(regex);
+        return NULL;
+    }
+    memset(&anybyte, 0, sizeof(anybyte));
+    regex_set_range(&anybyte, 0, 0xFF);
+    for (i = 0; i < (int)regex->unit; i++)
+    {
+        if (regex_frag_set(regex, &anybyte, &unit))
+        {
+            regex_destroy(regex);
+            return NULL;
+        }
+        if (i == 0)
+        {
+            loop = unit;
+        }
+        else
+        {
+            regex_frag_cat(regex, &loop, &unit);
+        }
+    }
+    split = regex_new_state(regex, nfaSplit, loop.start, frag.start);
+    if (split < 0)
+    {
+        regex_destroy(regex);
+        return NULL;
+    }
+    regex->nfa[loop.end].out = split;
+    regex->nfa[skip.end].out = split;
+    regex->start = skip.start;
+    regex->pattern = NULL;
+
+    // done with the parse
+    //
+    for (i = 0; i < regex->nclasses; i++)
+    {
+        free(regex->classes[i].ranges);
+    }
+    free(regex->classes);
+    regex->classes = NULL;
+    free(regex->ast);
+    regex->ast = NULL;
+
+    regex_make_byteclasses(regex);
+
+    regex->mark  = (int*)malloc(regex->nnfa * sizeof(int));
+    regex->list  = (int*)malloc(regex->nnfa * sizeof(int));
+    regex->stack = (int*)malloc(regex->nnfa * 2 * sizeof(int));
+    if (!regex->mark || !regex->list || !regex->stack)
+    {
+        butil_log(0, "%s: Can't alloc regex scratch\n", __FUNCTION__);
+        regex_destroy(regex);
+        return NULL;
+    }
+    for (i = 0; i < regex->nnfa; i++)
+    {
+        regex->mark[i] = 0;
+    }
+    return regex;
+}
+
+void regex_destroy(bregex_t *regex)
+{
+    int i;
+
+    if (! regex)
+    {
+        return;
+    }
+    regex_dfa_flush(regex);
+
+    if (regex->classes)
+    {
+        for (i = 0; i < regex->nclasses; i++)
+        {
+            free(regex->classes[i].ranges);
+        }
+        free(regex->classes);
+    }
+    free(regex->ast);
+    free(regex->nfa);
+    free(regex->sets);
+    free(regex->mark);
+    free(regex->list);
+    free(regex->stack);
+    free(regex);
+}
+
+int regex_match_start(bregex_t *regex, regex_cursor_t *cursor)
+{
+    regex_dstate_t *dstate;
+
+    if (!regex || !cursor)
+    {
+        return -1;
+    }
+    dstate = regex_dfa_start(regex, true);
+    if (! dstate)
+    {
+        return -1;
+    }
+    cursor->state = dstate;
+    cursor->matched = dstate->match;
+    return 0;
+}
+
+int regex_match_feed(bregex_t *regex, regex_cursor_t *cursor, const uint8_t *data, size_t length)
+{
+    regex_dstate_t *dstate;
+    regex_dstate_t *next;
+    size_t i;
+
+    if (!regex || !cursor || !cursor->state)
+    {
+        return -1;
+    }
+    if (cursor->matched)
+    {
+        return 1;
+    }
+    dstate = (regex_dstate_t*)cursor->state;
+
+    for (i = 0; i < length; i++)
+    {
+        next = dstate->next[regex->byteclass[data[i]]];
+        if (! next)
+        {
+            next = regex_dfa_step(regex, dstate, regex->byteclass[data[i]]);
+            if (! next)
+            {
+                cursor->state = NULL;
+                return -1;
+            }
+        }
+        dstate = next;
+        if (dstate->match)
+        {
+            cursor->state = dstate;
+            cursor->matched = true;
+            return 1;
+        }
+    }
+    cursor->state = dstate;
+    return 0;
+}
+
+int regex_match_finish(bregex_t *regex, regex_cursor_t *cursor)
+{
+    if (!regex || !cursor || !cursor->state)
+    {
+        return -1;
+    }
+    if (cursor->matched)
+    {
+        return 1;
+    }
+    return regex_dfa_endmatch(regex, (regex_dstate_t*)cursor->state) ? 1 : 0;
+}
+
+int regex_match(bregex_t *regex, const uint8_t *data, size_t length)
+{
+    regex_cursor_t cursor;
+    int result;
+
+    result = regex_match_start(regex, &cursor);
+    if (result)
+    {
+        return result;
+    }
+    result = regex_match_feed(regex, &cursor, data, length);
+    if (result)
+    {
+        return result;
+    }
+    return regex_match_finish(regex, &cursor);
+}
+
+//-----------------------------------------------------------------------------
+// buffer search
+//-----------------------------------------------------------------------------
+
+/// \brief State of one search thread
+///
+typedef struct tag_regex_worker
+{
+	buffer_t	   *buffer;
+	const char	   *pattern;
+	regex_options_t	options;
+	size_t			dfa_cap;			///< DFA memory for each of this thread's expressions
+	line_t		   *first;				///< first line to search
+	size_t			firstnum;			///< line number of first line
+	size_t			count;				///< lines to search
+	size_t		   *lines;				///< matching lines found
+	size_t			nlines;				///< count of matching lines
+	size_t			lines_size;			///< allocated entries in lines
+	uint8_t		   *window;				///< file data
+	uint64_t		window_offset;		///< offset in file of window
+	size_t			window_count;		///< bytes valid in window
+	pthread_t		thread;
+	bool			started;			///< thread was started
+	int				result;
+}
+regex_worker_t;
+
+/// \brief Length of line content without its line ending
+///
+static size_t regex_strip_ending(const uint8_t *data, size_t length, size_t unit, bool bigendian)
+{
+    size_t low;
+    size_t i;
+    int pass;
+    bool ending;
+
+    low = bigendian ? (unit - 1) : 0;
+
+    // strip a LF and then a CR
+    //
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (length < unit)
+        {
+            break;
+        }
+        ending = (data[length - unit + low] == (pass ? '\r' : '\n'));
+        for (i = 0; ending && i < unit; i++)
+        {
+            if (i != low && data[length - unit + i] != 0)
+            {
+                ending = false;
+            }
+        }
+        if (! ending)
+        {
+            break;
+        }
+        length -= unit;
+    }
+    return length;
+}
+
+/// \brief Match a line too long for the window, or in pieces, by feeding it a window at a time
+///
+static int regex_match_long_line(regex_worker_t *worker, bregex_t *regex, line_t *line)
+{
+    regex_cursor_t cursor;
+    uint8_t tail[8];
+    uint64_t offset;
+    size_t length;
+    size_t tail_size;
+    size_t chunk;
+    int result;
+
+    // look at the end of the line to see how long the line ending is
+    //
+    tail_size = 2 * regex->unit;
+    if (tail_size > line->length)
+    {
+        tail_size = line->length;
+    }
+    result = buffer_read_line(worker->buffer, line, line->length - tail_size, tail, tail_size);
+    if (result != (int)tail_size)
+    {
+        return -1;
+    }
+    length = line->length - tail_size + regex_strip_ending(tail, tail_size, regex->unit, regex->bigendian);
+
+    result = regex_match_start(regex, &cursor);
+    offset = 0;
+
+    while (! result && length > 0)
+    {
+        chunk = (length > REGEX_WINDOW_SIZE) ? REGEX_WINDOW_SIZE : length;
+        result = buffer_read_line(worker->buffer, line, offset, worker->window, chunk);
+        if (result != (int)chunk)
+        {
+            return -1;
+        }
+        // window no longer holds what it did
+        worker->window_count = 0;
+
+        result = regex_match_feed(regex, &cursor, worker->window, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    if (result)
+    {
+        return result;
+    }
+    return regex_match_finish(regex, &cursor);
+}
+
+/// \brief Match one line, reading file data into the window as needed
+///
+static int regex_match_line(regex_worker_t *worker, bregex_t *native, bregex_t *encoded, line_t *line)
+{
+    const uint8_t *data;
+    size_t length;
+    int result;
+
+    if (line->location == lineInMemory)
+    {
+        length = regex_strip_ending((uint8_t*)line->position.data, line->length, 1, false);
+        return regex_match(native, (uint8_t*)line->position.data, length);
+    }
+    if (line->location != lineInFile || line->length > REGEX_WINDOW_SIZE)
+    {
+        // lines are only in pieces if their bytes are utf-8 text, packed lines are utf-8
+        return regex_match_long_line(worker, (line->location != lineInFile) ? native : encoded, line);
+    }
+    if (
+            line->position.offset < worker->window_offset
+        ||  (line->position.offset + line->length) > (worker->window_offset + worker->window_count)
+    )
+    {
+        result = buffer_read_at(worker->buffer, line->position.offset, worker->window, REGEX_WINDOW_SIZE);
+        if (result < (int)line->length)
+        {
+            butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+            return -1;
+        }
+        worker->window_offset = line->position.offset;
+        worker->window_count = result;
+    }
+    data = worker->window + (line->position.offset - worker->window_offset);
+    length = regex_strip_ending(data, line->length, encoded->unit, encoded->bigendian);
+    return regex_match(encoded, data, length);
+}
+
+/// \brief Search a run of lines
+///
+static void *regex_worker_thread(void *param)
+{
+    regex_worker_t *worker = (regex_worker_t*)param;
+    bregex_t *native;
+    bregex_t *encoded;
+    line_t *line;
+    size_t *lines;
+    size_t linenum;
+    size_t n;
+    int result;
+
+    worker->result = -1;
+    native = regex_create(worker->pattern, textUTF8, worker->options, worker->dfa_cap);
+    encoded = regex_create(worker->pattern, worker->buffer->original_encoding, worker->options, worker->dfa_cap);
+    worker->window = (uint8_t*)malloc(REGEX_WINDOW_SIZE);
+    worker->window_count = 0;
+    worker->window_offset = 0;
+
+    if (!native || !encoded || !worker->window)
+    {
+        regex_destroy(native);
+        regex_destroy(encoded);
+        free(worker->window);
+        worker->window = NULL;
+        return NULL;
+    }
+    result = 0;
+
+    for (n = 0, line = worker->first, linenum = worker->firstnum; n < worker->count && line; n++, linenum++, line = line->next)
+    {
+        result = regex_match_line(worker, native, encoded, line);
+        if (result < 0)
+        {
+            break;
+        }
+        if (result == 0)
+        {
+            continue;
+        }
+        result = 0;
+        worker->nlines++;
+
+        if (worker->options & regexCountOnly)
+        {
+            continue;
+        }
+        if (worker->nlines > worker->lines_size)
+        {
+            worker->lines_size = worker->lines_size ? worker->lines_size * 2 : 256;
+            lines = (size_t*)realloc(worker->lines, worker->lines_size * sizeof(size_t));
+            if (! lines)
+            {
+                result = -1;
+                break;
+            }
+            worker->lines = lines;
+        }
+        worker->lines[worker->nlines - 1] = linenum;
+    }
+    regex_destroy(native);
+    regex_destroy(encoded);
+    free(worker->window);
+    worker->window = NULL;
+    worker->result = result;
+    return NULL;
+}
+
+int buffer_regex_search(buffer_t *buffer, const char *pattern, regex_options_t options, int threads, regex_results_t *results)
+{
+    regex_worker_t *workers;
+    bregex_t *check;
+    line_t *line;
+    size_t linenum;
+    size_t per_thread;
+    size_t total;
+    int nworkers;
+    int i;
+    int result;
+
+    if (!buffer || !pattern || !results)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    results->lines = NULL;
+    results->count = 0;
+
+    // check syntax once up front so threads don't each complain
+    //
+    check = regex_create(pattern, textUTF8, options, 0);
+    if (! check)
+    {
+        butil_log(1, "%s: Bad pattern %s\n", __FUNCTION__, pattern);
+        return -1;
+    }
+    regex_destroy(check);
+
+    if (!buffer->lines || !buffer->line_count)
+    {
+        return 0;
+    }
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > REGEX_MAX_THREADS)
+    {
+        threads = REGEX_MAX_THREADS;
+    }
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+    // small buffers aren't worth a thread each
+    //
+    if ((buffer->line_count / 1024) < (size_t)threads)
+    {
+        threads = (int)(buffer->line_count / 1024) + 1;
+    }
+    workers = (regex_worker_t*)calloc(threads, sizeof(regex_worker_t));
+    if (! workers)
+    {
+        return -1;
+    }
+    // hand out consecutive runs of lines
+    //
+    per_thread = (buffer->line_count + threads - 1) / threads;
+    line = buffer->lines;
+    linenum = 0;
+
+    for (nworkers = 0; nworkers < threads && line; nworkers++)
+    {
+        workers[nworkers].buffer = buffer;
+        workers[nworkers].pattern = pattern;
+        workers[nworkers].options = options;
+        workers[nworkers].dfa_cap = REGEX_DEFAULT_DFA_CAP / (2 * threads);
+        workers[nworkers].first = line;
+        workers[nworkers].firstnum = linenum;
+        workers[nworkers].count = per_thread;
+
+        for (i = 0; i < (int)per_thread && line; i++)
+        {
+            line = line->next;
+            linenum++;
+        }
+    }
+    if (nworkers == 1)
+    {
+        regex_worker_thread(&workers[0]);
+    }
+    else
+    {
+        for (i = 0; i < nworkers; i++)
+        {
+            workers[i].started = (pthread_create(&workers[i].thread, NULL, regex_worker_thread, &workers[i]) == 0);
+            if (! workers[i].started)
+            {
+                // no thread, do it here
+                regex_worker_thread(&workers[i]);
+            }
+        }
+        for (i = 0; i < nworkers; i++)
+        {
+            if (workers[i].started)
+            {
+                pthread_join(workers[i].thread, NULL);
+            }
+        }
+    }
+    // merge, the runs are in line order already
+    //
+    result = 0;
+    total = 0;
+    for (i = 0; i < nworkers; i++)
+    {
+        if (workers[i].result)
+        {
+            result = workers[i].result;
+        }
+        total += workers[i].nlines;
+    }
+    if (! result && total && ! (options & regexCountOnly))
+    {
+        results->lines = (size_t*)malloc(total * sizeof(size_t));
+        if (! results->lines)
+        {
+            result = -1;
+        }
+        else
+        {
+            total = 0;
+            for (i = 0; i < nworkers; i++)
+            {
+                if (workers[i].nlines)
+                {
+                    memcpy(results->lines + total, workers[i].lines, workers[i].nlines * sizeof(size_t));
+                    total += workers[i].nlines;
+                }
+            }
+        }
+    }
+    if (! result)
+    {
+        results->count = total;
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        free(workers[i].lines);
+    }
+    free(workers);
+    return result;
+}
+
+void regex_results_free(regex_results_t *results)
+{
+    if (! results)
+    {
+        return;
+    }
+    if (results->lines)
+    {
+        free(results->lines);
+    }
+    results->lines = NULL;
+    results->count = 0;
+}
+
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BREGEX_H
+#define BREGEX_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Regular expressions are compiled to a byte level NFA for one text
+/// encoding, and run through a DFA that is built lazily, a state at a
+/// time, as input is seen. The DFA is thrown away and rebuilt if it
+/// grows past its memory cap.
+///
+/// Supported syntax: literals, . [] [^] \\d \\w \\s (and negations),
+/// * + ? {m} {m,} {m,n}, | ( ) ^ $
+///
+/// Matching is line oriented: ^ and $ match only at the start and end
+/// of the line, and a line "matches" if the pattern occurs anywhere in it.
+/// Negated classes and . match any non-ASCII character
+
+/// \brief Options for regular expressions
+///
+#define regexIgnoreCase		0x0001	///< fold ASCII letters when matching
+#define regexCountOnly		0x0002	///< only count matching lines, don't list them
+
+/// Options a regular expression can have
+///
+typedef uint32_t regex_options_t;
+
+/// Default memory allowed for DFA states of one search, in bytes
+#define REGEX_DEFAULT_DFA_CAP	(4*1024*1024) /* 4Mb */
+
+/// Most threads a buffer search will use
+#define REGEX_MAX_THREADS		32
+
+/// Compiled regular expression, opaque
+///
+typedef struct tag_bregex bregex_t;
+
+/// DFA position while feeding a line in pieces
+///
+typedef struct tag_regex_cursor
+{
+	void		   *state;				///< current DFA state
+	bool			matched;			///< set once the line is known to match
+}
+regex_cursor_t;
+
+/// Results of a buffer search
+///
+typedef struct tag_regex_results
+{
+	size_t		   *lines;				///< matching line numbers, in order (NULL if counting only)
+	size_t			count;				///< count of matching lines
+}
+regex_results_t;
+
+/// \brief Compile a regular expression
+///
+/// @param[in] pattern  - the expression, in utf-8
+/// @param[in] encoding - the text encoding of data to be matched
+/// @param[in] options  - see ::regex_options_t
+/// @param[in] dfa_cap  - bytes allowed for DFA states, 0 for default
+///
+/// @return the compiled expression, or NULL on error (bad syntax or no memory)
+///
+bregex_t *regex_create(const char *pattern, text_encoding_t encoding, regex_options_t options, size_t dfa_cap);
+
+/// \brief Destroy a compiled regular expression
+///
+/// @param[in] regex - expression from ::regex_create
+///
+void regex_destroy(bregex_t *regex);
+
+/// \brief Match a line against a regular expression
+///
+/// @param[in] regex  - compiled expression
+/// @param[in] data   - line content, in the expression's encoding, without line ending
+/// @param[in] length - length of data in bytes
+///
+/// @return 1 if the line matches, 0 if not, < 0 on error
+///
+int regex_match(bregex_t *regex, const uint8_t *data, size_t length);
+
+/// \brief Start matching a line which is fed in pieces
+///
+/// @param[in]  regex  - compiled expression
+/// @param[out] cursor - cursor to setup
+///
+/// @return 0 on success
+///
+int regex_match_start(bregex_t *regex, regex_cursor_t *cursor);
+
+/// \brief Feed a piece of a line to a match
+///
+/// @param[in] regex  - compiled expression
+/// @param[in] cursor - cursor from ::regex_match_start
+/// @param[in] data   - next piece of line content
+/// @param[in] length - length of data in bytes
+///
+/// @return 1 if the line is known to match, 0 if not yet, < 0 on error
+///
+int regex_match_feed(bregex_t *regex, regex_cursor_t *cursor, const uint8_t *data, size_t length);
+
+/// \brief Finish matching a line fed in pieces
+///
+/// @return 1 if the line matches, 0 if not, < 0 on error
+///
+int regex_match_finish(bregex_t *regex, regex_cursor_t *cursor);
+
+/// \brief Search a buffer for lines matching a regular expression
+///
+/// File lines are matched directly in file windows in the buffer's
+/// original encoding. The line list is split into chunks searched on
+/// separate threads, and the results are merged back in line order
+///
+/// @param[in]  buffer  - buffer to search
+/// @param[in]  pattern - regular expression, in utf-8
+/// @param[in]  options - see ::regex_options_t
+/// @param[in]  threads - threads to use, 0 for one per cpu
+/// @param[out] results - matching lines, free with ::regex_results_free
+///
+/// @return 0 on success
+///
+int buffer_regex_search(buffer_t *buffer, const char *pattern, regex_options_t options, int threads, regex_results_t *results);
+
+/// \brief Free the results of a buffer search
+///
+/// @param[in] results - results from ::buffer_regex_search
+///
+void regex_results_free(regex_results_t *results);
+
+#endif
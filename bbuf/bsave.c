@@ -0,0 +1,454 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bsave.h"
+#include "bfilesys.h"
+#include "butil.h"
+#include <sys/stat.h>
+
+/// \file
+///
+
+/// Lines written between checks for cancelling
+#define SAVE_CANCEL_LINES			(1024)
+
+/// \brief Has a save been cancelled
+///
+static bool save_cancelled(buffer_save_t *save)
+{
+    bool cancel;
+
+    pthread_mutex_lock(&save->buffer->save_lock);
+    cancel = save->cancel;
+    pthread_mutex_unlock(&save->buffer->save_lock);
+    return cancel;
+}
+
+/// \brief Tell a save's callback how it is going
+///
+static void save_report(buffer_save_t *save, save_status_t status, size_t lines, uint64_t bytes)
+{
+    save_progress_t progress;
+
+    if (! save->callback)
+    {
+        return;
+    }
+    progress.url = save->url;
+    progress.status = status;
+    progress.lines_written = lines;
+    progress.line_count = save->snapshot ? save->snapshot->line_count : lines;
+    progress.bytes_written = bytes;
+    save->callback(save->priv, &progress);
+}
+
+/// \brief Make sure a scratch buffer has room
+///
+static int save_size_scratch(uint8_t **scratch, size_t *size, size_t needed)
+{
+    uint8_t *newscratch;
+
+    if (*scratch && *size >= needed)
+    {
+        return 0;
+    }
+    newscratch = (uint8_t*)realloc(*scratch, needed);
+    if (! newscratch)
+    {
+        butil_log(0, "%s: Can't alloc %u\n", __FUNCTION__, (unsigned)needed);
+        return -1;
+    }
+    *scratch = newscratch;
+    *size = needed;
+    return 0;
+}
+
+/// \brief Write a save's snapshot to a file
+///
+/// @param[in]  save    - save to write
+/// @param[in]  outfile - file to write to
+/// @param[out] lines   - gets lines written
+/// @param[out] bytes   - gets bytes written
+///
+/// @return 0 on success, 1 if cancelled, < 0 on error
+///
+static int save_write(buffer_save_t *save, file_t *outfile, size_t *lines, uint64_t *bytes)
+{
+    snapshot_cursor_t cursor;
+    buffer_snapshot_t *snapshot;
+    uint8_t *content;
+    uint8_t *text;
+    uint8_t *encoded;
+    size_t text_size;
+    size_t encoded_size;
+    size_t length;
+    bool in_memory;
+    bool transcode;
+    int count;
+    int result;
+
+    *lines = 0;
+    *bytes = 0;
+    snapshot = save->snapshot;
+
+    result = file_write_BOM(outfile, save->encoding);
+    if (result)
+    {
+        butil_log(1, "%s: Can't write %s\n", __FUNCTION__, save->url);
+        return -1;
+    }
+    switch (save->encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+        transcode = false;
+        break;
+    default:
+        transcode = true;
+        break;
+    }
+    memset(&cursor, 0, sizeof(cursor));
+    text = NULL;
+    encoded = NULL;
+    text_size = 0;
+    encoded_size = 0;
+
+    while ((result = buffer_snapshot_next_line(snapshot, &cursor, &content, &length, &in_memory)) == 0)
+    {
+        // lines in the file in the same encoding are written as they are,
+        // anything else goes by way of utf-8
+        //
+        if (! in_memory && snapshot->original_encoding != save->encoding)
+        {
+            if (save_size_scratch(&text, &text_size, length * 4 + 4))
+            {
+                result = -1;
+                break;
+            }
+            length = buffer_decode_text(snapshot->original_encoding, content, length, text);
+            content = text;
+            in_memory = true;
+        }
+        if (in_memory && transcode)
+        {
+            if (save_size_scratch(&encoded, &encoded_size, length * 4 + 4))
+            {
+                result = -1;
+                break;
+            }
+            length = buffer_encode_text(save->encoding, content, length, encoded);
+            content = encoded;
+        }
+        count = outfile->file_write(outfile, content, length);
+        if (count < 0 || (size_t)count != length)
+        {
+            butil_log(1, "%s: Can't write %s\n", __FUNCTION__, save->url);
+            result = -1;
+            break;
+        }
+        (*lines)++;
+        *bytes += length;
+
+        if (! (*lines % SAVE_CANCEL_LINES) && save_cancelled(save))
+        {
+            result = 2;
+            break;
+        }
+        if (! (*lines % SAVE_PROGRESS_LINES))
+        {
+            save_report(save, saveRunning, *lines, *bytes);
+        }
+    }
+    buffer_snapshot_end(&cursor);
+    if (text)
+    {
+        free(text);
+    }
+    if (encoded)
+    {
+        free(encoded);
+    }
+    if (result == 1)
+    {
+        // past the last line
+        return 0;
+    }
+    return (result == 2) ? 1 : result;
+}
+
+/// \brief Give a new local file the permissions of the one it replaces
+///
+static void save_copy_mode(const char *from_path, const char *to_path)
+{
+    struct stat info;
+
+    if (! stat(from_path, &info))
+    {
+        chmod(to_path, info.st_mode & 07777);
+    }
+}
+
+/// \brief Thread writing a save
+///
+static void *save_thread(void *priv)
+{
+    buffer_save_t *save = (buffer_save_t*)priv;
+    buffer_t *buffer = save->buffer;
+    char path[MAX_PATH];
+    char temp[MAX_PATH];
+    const char *target;
+    file_t *outfile;
+    size_t lines;
+    uint64_t bytes;
+    bool local;
+    int result;
+
+    // an earlier save to the same url has to stop writing first
+    //
+    pthread_mutex_lock(&buffer->save_lock);
+    while (save->superseded && ! save->superseded->finished)
+    {
+        pthread_cond_wait(&buffer->save_done, &buffer->save_lock);
+    }
+    save->superseded = NULL;
+    result = save->cancel ? 1 : 0;
+    pthread_mutex_unlock(&buffer->save_lock);
+
+    lines = 0;
+    bytes = 0;
+    local = false;
+    target = save->url;
+
+    if (! result)
+    {
+        // write a local file next to where it goes, and move it there once complete
+        //
+        local = (file_get_scheme(save->url, path, sizeof(path)) == schemeFILE);
+        if (local)
+        {
+            if (filesys_get_temp(path, temp, sizeof(temp)))
+            {
+                result = -1;
+            }
+            else
+            {
+                save_copy_mode(path, temp);
+                target = temp;
+            }
+        }
+    }
+    if (! result)
+    {
+        outfile = file_create(target, openForWrite);
+        if (! outfile)
+        {
+            butil_log(1, "%s: Can't open %s\n", __FUNCTION__, target);
+            result = -1;
+        }
+        else
+        {
+            result = save_write(save, outfile, &lines, &bytes);
+            if (! result && outfile->file_sync && outfile->file_sync(outfile))
+            {
+                butil_log(1, "%s: Can't sync %s\n", __FUNCTION__, target);
+                result = -1;
+            }
+            file_destroy(outfile);
+        }
+        if (local)
+        {
+            if (! result && filesys_move(temp, save->url))
+            {
+                result = -1;
+            }
+            if (result)
+            {
+                filesys_delete(temp);
+            }
+        }
+    }
+    if (! result)
+    {
+        save->status = saveDone;
+    }
+    else if (result > 0)
+    {
+        save->status = saveCancelled;
+    }
+    else
+    {
+        save->status = saveFailed;
+    }
+    save_report(save, save->status, lines, bytes);
+    buffer_snapshot_release(save->snapshot);
+    save->snapshot = NULL;
+
+    pthread_mutex_lock(&buffer->save_lock);
+    save->finished = true;
+    pthread_cond_broadcast(&buffer->save_done);
+    pthread_mutex_unlock(&buffer->save_lock);
+    return NULL;
+}
+
+/// \brief Free a buffer's saves that have ended
+///
+/// @param[in] buffer - buffer to free saves of
+///
+/// @return 0 if none of them failed, else < 0
+///
+static int save_reap(buffer_t *buffer)
+{
+    buffer_save_t **plink;
+    buffer_save_t *save;
+    buffer_save_t *other;
+    int result;
+
+    result = 0;
+    pthread_mutex_lock(&buffer->save_lock);
+    plink = &buffer->saves;
+    while (*plink)
+    {
+        save = *plink;
+        for (other = buffer->saves; other; other = other->next)
+        {
+            if (other->superseded == save)
+            {
+                break;
+            }
+        }
+        if (! save->finished || other)
+        {
+            plink = &save->next;
+            continue;
+        }
+        *plink = save->next;
+        pthread_join(save->thread, NULL);
+        if (save->status == saveFailed)
+        {
+            result = -1;
+        }
+        free(save);
+    }
+    pthread_mutex_unlock(&buffer->save_lock);
+    return result;
+}
+
+int buffer_save_async(buffer_t *buffer, const char *url, text_encoding_t encoding,
+                        save_callback_t callback, void *priv)
+{
+    buffer_save_t *save;
+    buffer_save_t *other;
+    int reaped;
+
+    if (!buffer || !url || !url[0])
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    // a failed save freed here isn't there for buffer_save_wait to see
+    //
+    reaped = save_reap(buffer);
+
+    save = (buffer_save_t*)malloc(sizeof(buffer_save_t));
+    if (! save)
+    {
+        butil_log(0, "%s: Can't alloc save\n", __FUNCTION__);
+        return -1;
+    }
+    memset(save, 0, sizeof(buffer_save_t));
+    save->buffer = buffer;
+    strncpy(save->url, url, sizeof(save->url) - 1);
+    save->encoding = encoding;
+    save->callback = callback;
+    save->priv = priv;
+    save->status = saveRunning;
+
+    save->snapshot = buffer_snapshot(buffer);
+    if (! save->snapshot)
+    {
+        free(save);
+        return -1;
+    }
+    // the thread waits on the lock, so it sees what it supersedes
+    //
+    pthread_mutex_lock(&buffer->save_lock);
+    if (pthread_create(&save->thread, NULL, save_thread, save))
+    {
+        pthread_mutex_unlock(&buffer->save_lock);
+        butil_log(0, "%s: Can't start save thread\n", __FUNCTION__);
+        buffer_snapshot_release(save->snapshot);
+        free(save);
+        return -1;
+    }
+    for (other = buffer->saves; other; other = other->next)
+    {
+        if (! other->finished && ! strcmp(other->url, save->url))
+        {
+            other->cancel = true;
+            if (! save->superseded)
+            {
+                // the newest, which itself waits on any older ones
+                save->superseded = other;
+            }
+        }
+    }
+    save->next = buffer->saves;
+    buffer->saves = save;
+    pthread_mutex_unlock(&buffer->save_lock);
+    return reaped ? 1 : 0;
+}
+
+void buffer_save_cancel(buffer_t *buffer)
+{
+    buffer_save_t *save;
+
+    if (! buffer)
+    {
+        return;
+    }
+    pthread_mutex_lock(&buffer->save_lock);
+    for (save = buffer->saves; save; save = save->next)
+    {
+        save->cancel = true;
+    }
+    pthread_mutex_unlock(&buffer->save_lock);
+}
+
+int buffer_save_wait(buffer_t *buffer)
+{
+    buffer_save_t *save;
+
+    if (! buffer)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&buffer->save_lock);
+    do
+    {
+        for (save = buffer->saves; save; save = save->next)
+        {
+            if (! save->finished)
+            {
+                pthread_cond_wait(&buffer->save_done, &buffer->save_lock);
+                break;
+            }
+        }
+    }
+    while (save);
+    pthread_mutex_unlock(&buffer->save_lock);
+
+    return save_reap(buffer);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BSAVE_H
+#define BSAVE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Saves a buffer on a thread of its own, writing a snapshot of the
+/// buffer taken when the save started, so the buffer can be edited while
+/// the save runs. A local file is written to a temporary file next to it
+/// which replaces it only once complete, so a save that fails or is
+/// cancelled leaves the file as it was
+///
+/// A new save to the same url as a save not yet finished cancels that
+/// save and starts writing once it has stopped. A save still waiting its
+/// turn is dropped without writing anything, so a burst of saves to one
+/// url writes the file once, as it was at the last of them
+
+/// Lines written between progress callbacks
+#define SAVE_PROGRESS_LINES			(64*1024)
+
+/// State of a save
+///
+typedef enum
+{
+	saveRunning,						///< still writing
+	saveDone,							///< written completely
+	saveFailed,							///< couldn't be written
+	saveCancelled						///< cancelled, or replaced by a later save
+}
+save_status_t;
+
+/// Progress of a save, as given to a save callback
+///
+typedef struct tag_save_progress
+{
+	const char	   *url;				///< url being written
+	save_status_t	status;				///< state of the save
+	size_t			lines_written;		///< lines written so far
+	size_t			line_count;			///< lines to write
+	uint64_t		bytes_written;		///< bytes written so far
+}
+save_progress_t;
+
+/// Save callback, called on the save's thread as it progresses and once
+/// when it ends, with a status other than saveRunning
+///
+/// @param[in] priv     - caller's context
+/// @param[in] progress - progress of save
+///
+typedef void (*save_callback_t)(void *priv, const save_progress_t *progress);
+
+/// A save of a buffer
+///
+typedef struct tag_buffer_save
+{
+	buffer_t	   *buffer;				///< buffer saved
+	buffer_snapshot_t *snapshot;		///< lines to write
+	char			url[MAX_PATH];		///< url to write
+	text_encoding_t	encoding;			///< encoding to write in
+	save_callback_t	callback;			///< progress callback, may be NULL
+	void		   *priv;				///< context for callback
+	bool			cancel;				///< stop writing, under the buffer's save lock
+	bool			finished;			///< thread has ended, under the buffer's save lock
+	save_status_t	status;				///< final state of save
+	struct tag_buffer_save *superseded;	///< earlier save to the same url to wait for
+	pthread_t		thread;				///< thread writing save
+	struct tag_buffer_save *next;		///< next save of the buffer
+}
+buffer_save_t;
+
+/// \brief Start saving a buffer in the background
+///
+/// The buffer is written as it is now, edits made after this returns
+/// are not saved. Saving over the buffer's own file is allowed, call
+/// ::buffer_reset_journal once it is done if the buffer has a journal
+///
+/// @param[in] buffer   - buffer to save
+/// @param[in] url      - url to write
+/// @param[in] encoding - text encoding to write in
+/// @param[in] callback - progress callback, may be NULL
+/// @param[in] priv     - context for callback
+///
+/// @return 0 if the save started, 1 if it started but an earlier save
+/// that ended since the last wait failed, < 0 on error
+///
+int buffer_save_async(buffer_t *buffer, const char *url, text_encoding_t encoding,
+						save_callback_t callback, void *priv);
+
+/// \brief Cancel all of a buffer's saves that haven't finished
+///
+/// @param[in] buffer - buffer to cancel saves of
+///
+void buffer_save_cancel(buffer_t *buffer);
+
+/// \brief Wait for all of a buffer's saves to end
+///
+/// Must not be called from a save callback
+///
+/// @param[in] buffer - buffer to wait for
+///
+/// @return 0 if none failed, < 0 if any save since the last wait failed,
+/// other than those ::buffer_save_async already returned
+///
+int buffer_save_wait(buffer_t *buffer);
+
+#endif
@@ -0,0 +1,866 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bsyntax.h"
+#include "butil.h"
+
+#include <unistd.h>
+
+/// \file
+///
+
+/// Bytes of file read at once when lexing lines in the file
+#define SYNTAX_WINDOW				(1024*1024)
+
+/// Fewest marked lines lexed on more than one thread
+#define SYNTAX_PARALLEL_LINES		(64*1024)
+
+/// Fewest lines a lexing thread is given
+#define SYNTAX_CHUNK_LINES			(4*1024)
+
+/// Most threads lexing uses
+#define SYNTAX_MAX_THREADS			32
+
+/// Attribute bits the lexer owns
+#define SYNTAX_ATTRIBUTES			(lineStartsSpanningComment | lineEndsSpanningComment | lineSyntaxValid \
+										| ((line_attribute_t)0xFF << LINE_SYNTAX_SHIFT))
+
+/// Reads lines of a buffer as utf-8 text for lexing
+///
+typedef struct tag_syntax_reader
+{
+	buffer_t	   *buffer;
+	uint8_t		   *window;				///< file data
+	uint64_t		window_offset;		///< offset in file of window
+	size_t			window_count;		///< bytes valid in window
+	uint8_t		   *whole;				///< a line too long for the window
+	size_t			whole_size;
+	uint8_t		   *scratch;			///< line decoded to utf-8
+	size_t			scratch_size;
+}
+syntax_reader_t;
+
+/// What lexing found for a line
+///
+typedef struct tag_syntax_lexed
+{
+	uint8_t			state;				///< state at end of line
+	uint8_t			flags;				///< spanning comment flags
+}
+syntax_lexed_t;
+
+/// A run of lines lexed on a thread of its own, before the state the run
+/// starts in is known
+///
+typedef struct tag_syntax_worker
+{
+	syntax_reader_t	reader;
+	const syntax_t *syntax;
+	line_t		   *first;				///< first line of run
+	size_t			count;				///< lines in run
+	uint8_t			entry;				///< state the run is assumed to start in
+	syntax_lexed_t *lexed;				///< each line, lexed from entry
+	syntax_lexed_t *alt;				///< lines lexed from inside a block comment, until they agree with lexed
+	size_t			alt_count;			///< lines in alt
+	pthread_t		thread;
+	bool			started;			///< thread was started
+	int				result;
+}
+syntax_worker_t;
+
+void syntax_init_c(syntax_t *syntax)
+{
+    memset(syntax, 0, sizeof(syntax_t));
+    strcpy(syntax->block_open, "/*");
+    strcpy(syntax->block_close, "*/");
+    strcpy(syntax->line_comment, "//");
+    strcpy(syntax->quotes, "\"'");
+    syntax->escape = '\\';
+}
+
+/// \brief Does a token start at a position in text
+///
+static inline size_t syntax_match(const uint8_t *text, size_t pos, size_t length, const char *token)
+{
+    size_t n;
+
+    if (! token[0] || text[pos] != (uint8_t)token[0])
+    {
+        return 0;
+    }
+    n = strlen(token);
+    if (n > (length - pos) || memcmp(text + pos, token, n))
+    {
+        return 0;
+    }
+    return n;
+}
+
+uint8_t syntax_lex_line(const syntax_t *syntax, uint8_t state, const uint8_t *text, size_t length,
+                        line_attribute_t *flags)
+{
+    const char *quote;
+    size_t content;
+    size_t i;
+    size_t n;
+    bool entered;
+    bool opened;
+    bool continued;
+
+    *flags = 0;
+    content = length;
+    while (content && (text[content - 1] == '\n' || text[content - 1] == '\r'))
+    {
+        content--;
+    }
+    entered = (state == lexBlockComment);
+    opened = false;
+    continued = false;
+
+    for (i = 0; i < content;)
+    {
+        switch (state)
+        {
+        case lexNormal:
+            if ((n = syntax_match(text, i, content, syntax->block_open)) != 0)
+            {
+                state = lexBlockComment;
+                opened = true;
+                i += n;
+            }
+            else if (syntax_match(text, i, content, syntax->line_comment))
+            {
+                state = lexLineComment;
+                i = content;
+            }
+            else
+            {
+                quote = text[i] ? strchr(syntax->quotes, text[i]) : NULL;
+                if (quote)
+                {
+                    state = lexString + (uint8_t)(quote - syntax->quotes);
+                }
+                i++;
+            }
+            break;
+
+        case lexBlockComment:
+            if ((n = syntax_match(text, i, content, syntax->block_close)) != 0)
+            {
+                // only the comment open when the line started spans into it
+                //
+                if (entered)
+                {
+                    *flags |= lineEndsSpanningComment;
+                    entered = false;
+                }
+                state = lexNormal;
+                opened = false;
+                i += n;
+            }
+            else
+            {
+                i++;
+            }
+            break;
+
+        case lexLineComment:
+            i = content;
+            break;
+
+        default:
+            if (syntax->escape && text[i] == (uint8_t)syntax->escape)
+            {
+                if ((i + 1) >= content)
+                {
+                    continued = true;
+                }
+                i += 2;
+            }
+            else
+            {
+                if (text[i] == (uint8_t)syntax->quotes[state - lexString])
+                {
+                    state = lexNormal;
+                }
+                i++;
+            }
+            break;
+        }
+    }
+    // only comments and strings with escaped newlines carry on past the line
+    //
+    if (state == lexLineComment)
+    {
+        if (! content || ! syntax->escape || text[content - 1] != (uint8_t)syntax->escape)
+        {
+            state = lexNormal;
+        }
+    }
+    else if (state >= lexString && ! continued)
+    {
+        state = lexNormal;
+    }
+    else if (state == lexBlockComment && opened)
+    {
+        *flags |= lineStartsSpanningComment;
+    }
+    return state;
+}
+
+/// \brief Get a line's utf-8 text
+///
+/// @param[in]  reader - reader of buffer
+/// @param[in]  line   - line to read
+/// @param[out] text   - gets text, valid until the next read
+/// @param[out] length - gets length of text in bytes
+///
+/// @return 0 on success
+///
+static int syntax_read_line(syntax_reader_t *reader, const line_t *line, const uint8_t **text, size_t *length)
+{
+    const uint8_t *content;
+    uint8_t *newdata;
+    int result;
+
+    if (line->location == lineInMemory)
+    {
+        *text = (const uint8_t*)(line->position.data ? line->position.data : "");
+        *length = line->length;
+        return 0;
+    }
+    if (line->location != lineInFile || line->length > SYNTAX_WINDOW)
+    {
+        if (reader->whole_size < line->length || ! reader->whole)
+        {
+            newdata = (uint8_t*)realloc(reader->whole, line->length + 1);
+            if (! newdata)
+            {
+                butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+                return -1;
+            }
+            reader->whole = newdata;
+            reader->whole_size = line->length + 1;
+        }
+        result = buffer_read_line(reader->buffer, line, 0, reader->whole, line->length);
+        if (result != (int)line->length)
+        {
+            butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+            return -1;
+        }
+        content = reader->whole;
+    }
+    else
+    {
+        if (! reader->window)
+        {
+            reader->window = (uint8_t*)malloc(SYNTAX_WINDOW);
+            if (! reader->window)
+            {
+                butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+                return -1;
+            }
+        }
+        if (
+                line->position.offset < reader->window_offset
+            ||  (line->position.offset + line->length) > (reader->window_offset + reader->window_count)
+        )
+        {
+            result = buffer_read_at(reader->buffer, line->position.offset, reader->window, SYNTAX_WINDOW);
+            if (result < (int)line->length)
+            {
+                butil_log(1, "%s: Can't read from file\n", __FUNCTION__);
+                return -1;
+            }
+            reader->window_offset = line->position.offset;
+            reader->window_count = result;
+        }
+        content = reader->window + (line->position.offset - reader->window_offset);
+    }
+    if (line->location == lineInBlock)
+    {
+        // packed text is already utf-8
+        *text = content;
+        *length = line->length;
+        return 0;
+    }
+    switch (reader->buffer->original_encoding)
+    {
+    case textBINARY:
+    case textASCII:
+    case textUTF8:
+        *text = content;
+        *length = line->length;
+        return 0;
+    default:
+        break;
+    }
+    if ((line->length * 4 + 4) > reader->scratch_size)
+    {
+        newdata = (uint8_t*)realloc(reader->scratch, line->length * 4 + 4);
+        if (! newdata)
+        {
+            butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+            return -1;
+        }
+        reader->scratch = newdata;
+        reader->scratch_size = line->length * 4 + 4;
+    }
+    *length = buffer_decode_text(reader->buffer->original_encoding, content, line->length, reader->scratch);
+    *text = reader->scratch;
+    return 0;
+}
+
+/// \brief Free what a reader allocated
+///
+static void syntax_reader_end(syntax_reader_t *reader)
+{
+    if (reader->window)
+    {
+        free(reader->window);
+    }
+    if (reader->whole)
+    {
+        free(reader->whole);
+    }
+    if (reader->scratch)
+    {
+        free(reader->scratch);
+    }
+}
+
+/// \brief Store the result of lexing in a line
+///
+/// Snapshot readers copy lines the buffer hasn't changed, so this is done
+/// under the version lock
+///
+static void syntax_set_line(buffer_t *buffer, line_t *line, uint8_t state, line_attribute_t flags)
+{
+    pthread_mutex_lock(&buffer->versions.lock);
+    line->attributes = (line->attributes & ~SYNTAX_ATTRIBUTES)
+                    | flags | lineSyntaxValid | ((line_attribute_t)state << LINE_SYNTAX_SHIFT);
+    pthread_mutex_unlock(&buffer->versions.lock);
+}
+
+/// \brief Mark a range of lines to lex
+///
+static void syntax_mark(buffer_t *buffer, size_t from, size_t to)
+{
+    if (buffer->syntax_dirty_from > buffer->syntax_dirty_to)
+    {
+        buffer->syntax_dirty_from = from;
+        buffer->syntax_dirty_to = to;
+        return;
+    }
+    if (from < buffer->syntax_dirty_from)
+    {
+        buffer->syntax_dirty_from = from;
+    }
+    if (to > buffer->syntax_dirty_to)
+    {
+        buffer->syntax_dirty_to = to;
+    }
+}
+
+/// \brief Nothing left to lex
+///
+static void syntax_clean(buffer_t *buffer)
+{
+    buffer->syntax_dirty_from = (size_t)-1;
+    buffer->syntax_dirty_to = 0;
+}
+
+int buffer_set_syntax(buffer_t *buffer, const syntax_t *syntax)
+{
+    line_t *line;
+
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! syntax)
+    {
+        if (buffer->syntax)
+        {
+            free(buffer->syntax);
+            buffer->syntax = NULL;
+        }
+        return 0;
+    }
+    if (! buffer->syntax)
+    {
+        buffer->syntax = (syntax_t*)malloc(sizeof(syntax_t));
+        if (! buffer->syntax)
+        {
+            butil_log(0, "%s: Can't alloc syntax\n", __FUNCTION__);
+            return -1;
+        }
+    }
+    *buffer->syntax = *syntax;
+
+    // states lexed with any other syntax are no good
+    //
+    pthread_mutex_lock(&buffer->versions.lock);
+    for (line = buffer->lines; line; line = line->next)
+    {
+        line->attributes &= ~lineSyntaxValid;
+    }
+    pthread_mutex_unlock(&buffer->versions.lock);
+
+    syntax_clean(buffer);
+    syntax_mark(buffer, 0, buffer->line_count);
+    return 0;
+}
+
+int buffer_set_syntax_threads(buffer_t *buffer, int threads)
+{
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    buffer->syntax_threads = threads;
+    return 0;
+}
+
+/// \brief Lex a run of lines from both of the states most lines start in
+///
+static void *syntax_lex_thread(void *param)
+{
+    syntax_worker_t *worker = (syntax_worker_t*)param;
+    line_t *line;
+    const uint8_t *text;
+    size_t length;
+    size_t n;
+    line_attribute_t flags;
+    uint8_t state;
+    uint8_t alt_state;
+    bool alt;
+    int result;
+
+    result = 0;
+    state = worker->entry;
+    alt_state = lexBlockComment;
+
+    // the first run starts where it is known to, the others could also
+    // be in a comment, which is lexed alongside until the two agree
+    //
+    alt = (worker->alt != NULL);
+
+    for (n = 0, line = worker->first; n < worker->count && line; n++, line = line->next)
+    {
+        result = syntax_read_line(&worker->reader, line, &text, &length);
+        if (result)
+        {
+            break;
+        }
+        state = syntax_lex_line(worker->syntax, state, text, length, &flags);
+        worker->lexed[n].state = state;
+        worker->lexed[n].flags = (uint8_t)flags;
+        if (alt)
+        {
+            alt_state = syntax_lex_line(worker->syntax, alt_state, text, length, &flags);
+            worker->alt[n].state = alt_state;
+            worker->alt[n].flags = (uint8_t)flags;
+            worker->alt_count = n + 1;
+            alt = (alt_state != state);
+        }
+    }
+    syntax_reader_end(&worker->reader);
+    worker->result = result;
+    return NULL;
+}
+
+/// \brief Lex a long run of marked lines on many threads
+///
+/// Each thread lexes its lines as if they start in normal code, and also
+/// as if in a block comment until that agrees with the first. The runs are
+/// then stitched together in order, and only a run that really starts in
+/// some other state, a continued string or line comment, is lexed again,
+/// up to where it agrees with what was lexed for it. The result is the
+/// same as lexing the lines one after another
+///
+/// @param[in]     buffer  - buffer being lexed
+/// @param[in]     threads - threads to use
+/// @param[in,out] pline   - first line to lex, gets the line after the last lexed
+/// @param[in,out] linenum - line number of line
+/// @param[in,out] state   - state line starts in, gets the state after the last lexed
+/// @param[out]    force   - gets true if the last line's state changed
+/// @param[out]    lexed   - gets count of lines lexed
+///
+/// @return 0 on success, lines aren't changed on error
+///
+static int syntax_lex_parallel(buffer_t *buffer, int threads, line_t **pline, size_t *linenum,
+                                uint8_t *state, bool *force, size_t *lexed)
+{
+    syntax_worker_t *workers;
+    syntax_worker_t *worker;
+    syntax_lexed_t *result_of;
+    line_t *line;
+    const uint8_t *text;
+    size_t length;
+    size_t total;
+    size_t per_thread;
+    size_t n;
+    line_attribute_t flags;
+    uint8_t entry;
+    uint8_t old;
+    int nworkers;
+    int i;
+    int result;
+
+    // lex the marked lines, or all of them if the file was just read
+    //
+    total = buffer->syntax_dirty_to;
+    if (total >= buffer->line_count)
+    {
+        total = buffer->line_count - 1;
+    }
+    total = total - *linenum + 1;
+
+    if ((total / SYNTAX_CHUNK_LINES) < (size_t)threads)
+    {
+        threads = (int)(total / SYNTAX_CHUNK_LINES) + 1;
+    }
+    workers = (syntax_worker_t*)calloc(threads, sizeof(syntax_worker_t));
+    if (! workers)
+    {
+        return -1;
+    }
+    result = 0;
+    per_thread = (total + threads - 1) / threads;
+    line = *pline;
+
+    for (nworkers = 0; nworkers < threads && line && total; nworkers++)
+    {
+        worker = &workers[nworkers];
+        worker->reader.buffer = buffer;
+        worker->syntax = buffer->syntax;
+        worker->first = line;
+        worker->count = (total < per_thread) ? total : per_thread;
+        worker->entry = nworkers ? lexNormal : *state;
+        worker->lexed = (syntax_lexed_t*)malloc(worker->count * sizeof(syntax_lexed_t));
+        if (nworkers)
+        {
+            worker->alt = (syntax_lexed_t*)malloc(worker->count * sizeof(syntax_lexed_t));
+        }
+        if (! worker->lexed || (nworkers && ! worker->alt))
+        {
+            butil_log(0, "%s: Can't alloc states\n", __FUNCTION__);
+            result = -1;
+            nworkers++;
+            break;
+        }
+        total -= worker->count;
+        for (n = 0; n < worker->count && line; n++)
+        {
+            line = line->next;
+        }
+    }
+    for (i = 0; i < nworkers && ! result; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, syntax_lex_thread, &workers[i]))
+        {
+            butil_log(0, "%s: Can't start thread\n", __FUNCTION__);
+            result = -1;
+            break;
+        }
+        workers[i].started = true;
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        if (workers[i].started)
+        {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].result)
+            {
+                result = -1;
+            }
+        }
+    }
+    // stitch the runs in order, now the state each starts in is known
+    //
+    entry = *state;
+    old = entry;
+    *lexed = 0;
+
+    for (i = 0; i < nworkers && ! result; i++)
+    {
+        worker = &workers[i];
+        result_of = worker->lexed;
+        n = 0;
+        if (entry != worker->entry && entry == lexBlockComment && worker->alt)
+        {
+            result_of = worker->alt;
+        }
+        else if (entry != worker->entry)
+        {
+            // lex again until back in step with what the thread found
+            //
+            memset(&worker->reader, 0, sizeof(worker->reader));
+            worker->reader.buffer = buffer;
+            for (line = worker->first; n < worker->count && line; n++, line = line->next)
+            {
+                result = syntax_read_line(&worker->reader, line, &text, &length);
+                if (result)
+                {
+                    break;
+                }
+                entry = syntax_lex_line(buffer->syntax, entry, text, length, &flags);
+                if (entry == worker->lexed[n].state)
+                {
+                    n++;
+                    break;
+                }
+                worker->lexed[n].state = entry;
+                worker->lexed[n].flags = (uint8_t)flags;
+            }
+            syntax_reader_end(&worker->reader);
+            if (result)
+            {
+                break;
+            }
+            if (n)
+            {
+                // the line that came back into step has its own flags
+                //
+                worker->lexed[n - 1].flags = (uint8_t)flags;
+            }
+        }
+        pthread_mutex_lock(&buffer->versions.lock);
+        for (n = 0, line = worker->first; n < worker->count && line; n++, line = line->next)
+        {
+            // the block comment lexing is only good until it agrees
+            //
+            if (result_of == worker->alt && n == worker->alt_count)
+            {
+                result_of = worker->lexed;
+            }
+            old = LINE_SYNTAX_STATE(line->attributes);
+            line->attributes = (line->attributes & ~SYNTAX_ATTRIBUTES)
+                            | result_of[n].flags | lineSyntaxValid
+                            | ((line_attribute_t)result_of[n].state << LINE_SYNTAX_SHIFT);
+            entry = result_of[n].state;
+        }
+        pthread_mutex_unlock(&buffer->versions.lock);
+        *lexed += n;
+        *linenum += n;
+        *pline = line;
+    }
+    if (! result)
+    {
+        *state = entry;
+        *force = (entry != old);
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        if (workers[i].lexed)
+        {
+            free(workers[i].lexed);
+        }
+        if (workers[i].alt)
+        {
+            free(workers[i].alt);
+        }
+    }
+    free(workers);
+    return result;
+}
+
+int buffer_update_syntax(buffer_t *buffer, size_t *relexed)
+{
+    syntax_reader_t reader;
+    line_t *line;
+    const uint8_t *text;
+    size_t length;
+    size_t linenum;
+    size_t count;
+    line_attribute_t flags;
+    uint8_t state;
+    uint8_t newstate;
+    bool force;
+    int threads;
+    int result;
+
+    if (relexed)
+    {
+        *relexed = 0;
+    }
+    if (! buffer)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    if (! buffer->syntax || buffer->syntax_dirty_from > buffer->syntax_dirty_to)
+    {
+        return 0;
+    }
+    if (buffer->syntax_dirty_from >= buffer->line_count)
+    {
+        syntax_clean(buffer);
+        return 0;
+    }
+    linenum = buffer->syntax_dirty_from;
+    result = buffer_select_line(buffer, linenum);
+    if (result)
+    {
+        return result;
+    }
+    line = buffer->curr_line;
+
+    // every line before the first marked one is current
+    //
+    state = line->prev ? LINE_SYNTAX_STATE(line->prev->attributes) : lexNormal;
+
+    memset(&reader, 0, sizeof(reader));
+    reader.buffer = buffer;
+    force = false;
+    count = 0;
+
+    threads = buffer->syntax_threads;
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > SYNTAX_MAX_THREADS)
+    {
+        threads = SYNTAX_MAX_THREADS;
+    }
+    if (threads > 1 && (buffer->syntax_dirty_to - linenum) >= SYNTAX_PARALLEL_LINES)
+    {
+        // a file just read or set to a new syntax, lex most of it at once,
+        // going on below if the state at the end of the marked lines changed
+        //
+        result = syntax_lex_parallel(buffer, threads, &line, &linenum, &state, &force, &count);
+        if (result)
+        {
+            // lines are only changed if it worked
+            syntax_reader_end(&reader);
+            return result;
+        }
+    }
+
+    for (; line; line = line->next, linenum++)
+    {
+        if ((line->attributes & lineSyntaxValid) && ! force)
+        {
+            // past the marked lines, and this line starts the way it did
+            // when it was lexed, so it and all after it are current
+            //
+            if (linenum > buffer->syntax_dirty_to)
+            {
+                break;
+            }
+            state = LINE_SYNTAX_STATE(line->attributes);
+            continue;
+        }
+        result = syntax_read_line(&reader, line, &text, &length);
+        if (result)
+        {
+            // lines before this one are done
+            buffer->syntax_dirty_from = linenum;
+            break;
+        }
+        newstate = syntax_lex_line(buffer->syntax, state, text, length, &flags);
+
+        // the next line was lexed from the old state, if that changed, so might it
+        //
+        force = (newstate != LINE_SYNTAX_STATE(line->attributes));
+        syntax_set_line(buffer, line, newstate, flags);
+        state = newstate;
+        count++;
+    }
+    syntax_reader_end(&reader);
+    if (! result)
+    {
+        syntax_clean(buffer);
+    }
+    if (relexed)
+    {
+        *relexed = count;
+    }
+    butil_log(5, "%s: Lexed %u lines\n", __FUNCTION__, (unsigned)count);
+    return result;
+}
+
+int buffer_get_syntax_state(buffer_t *buffer, size_t line, uint8_t *state)
+{
+    int result;
+
+    if (!buffer || !buffer->syntax || !state)
+    {
+        butil_log(1, "%s: Bad parameter\n", __FUNCTION__);
+        return -1;
+    }
+    result = buffer_update_syntax(buffer, NULL);
+    if (result)
+    {
+        return result;
+    }
+    result = buffer_select_line(buffer, line);
+    if (result)
+    {
+        return result;
+    }
+    *state = LINE_SYNTAX_STATE(buffer->curr_line->attributes);
+    return 0;
+}
+
+void buffer_syntax_changed(buffer_t *buffer, line_t *line, size_t linenum)
+{
+    if (!buffer || !buffer->syntax || !line)
+    {
+        return;
+    }
+    // the line was saved for snapshots before it changed, so none read it now
+    //
+    line->attributes &= ~lineSyntaxValid;
+    syntax_mark(buffer, linenum, linenum);
+}
+
+void buffer_syntax_moved(buffer_t *buffer, size_t linenum, size_t inserted, size_t deleted)
+{
+    size_t *ends[2];
+    size_t i;
+
+    if (!buffer || !buffer->syntax)
+    {
+        return;
+    }
+    if (buffer->syntax_dirty_from <= buffer->syntax_dirty_to)
+    {
+        // marked lines after the change move with it
+        //
+        ends[0] = &buffer->syntax_dirty_from;
+        ends[1] = &buffer->syntax_dirty_to;
+
+        for (i = 0; i < 2; i++)
+        {
+            if (*ends[i] >= linenum + deleted)
+            {
+                *ends[i] = *ends[i] - deleted + inserted;
+            }
+            else if (*ends[i] > linenum)
+            {
+                *ends[i] = linenum;
+            }
+        }
+    }
+    if (inserted)
+    {
+        syntax_mark(buffer, linenum, linenum + inserted - 1);
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BSYNTAX_H
+#define BSYNTAX_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bbuf.h"
+
+/// \file
+///
+/// Keeps the state of a simple lexer at the end of each line of a buffer,
+/// enough to know which lines start and end comment blocks that span
+/// lines. The state is cached in each line's attributes, along with the
+/// lineStartsSpanningComment and lineEndsSpanningComment flags
+///
+/// An edit only marks the lines it touches. Updating lexes from the first
+/// marked line and stops at the first line past the last marked one whose
+/// state at its end comes out the same as the cached state, since every
+/// line after it must then be unchanged as well. So typing in a large file
+/// lexes a few lines, unless it opens or closes a comment
+///
+/// Lexing all of a large file is split among threads, each lexing a run
+/// of lines before the state the run starts in is known, see
+/// ::buffer_set_syntax_threads
+
+/// State of the lexer between lines
+///
+typedef enum
+{
+	lexNormal,							///< code
+	lexBlockComment,					///< inside a block comment
+	lexLineComment,						///< line comment continued by an escaped newline
+	lexString							///< string continued by an escaped newline, plus index of quote
+}
+lex_state_t;
+
+/// Syntax - what a lexer looks for, strings are nul terminated, empty if not used
+///
+typedef struct tag_syntax
+{
+	char			block_open[8];		///< opens a block comment
+	char			block_close[8];		///< closes a block comment
+	char			line_comment[8];	///< starts a comment to end of line
+	char			quotes[4];			///< characters quoting strings
+	char			escape;				///< escapes the next character in a string, 0 for none
+}
+syntax_t;
+
+/// \brief Set up a syntax for C and languages like it
+///
+/// @param[out] syntax - syntax to set up
+///
+void syntax_init_c(syntax_t *syntax);
+
+/// \brief Lex one line
+///
+/// @param[in]  syntax - syntax to lex with
+/// @param[in]  state  - lexer state at the start of the line
+/// @param[in]  text   - utf-8 text of line, including its line ending
+/// @param[in]  length - length of text in bytes
+/// @param[out] flags  - gets lineStartsSpanningComment and lineEndsSpanningComment as they apply
+///
+/// @return lexer state at the end of the line
+///
+uint8_t syntax_lex_line(const syntax_t *syntax, uint8_t state, const uint8_t *text, size_t length,
+						line_attribute_t *flags);
+
+/// \brief Set the syntax a buffer's lines are lexed with
+///
+/// All lines are marked to lex on the next ::buffer_update_syntax
+///
+/// @param[in] buffer - buffer to lex
+/// @param[in] syntax - syntax to use, copied, NULL to stop keeping lexer state
+///
+/// @return 0 on success
+///
+int buffer_set_syntax(buffer_t *buffer, const syntax_t *syntax);
+
+/// \brief Set how many threads lex a buffer when many lines need it
+///
+/// A file just read, or given a new syntax, has all its lines lexed at
+/// once, which is split among threads
+///
+/// @param[in] buffer  - buffer to lex
+/// @param[in] threads - threads to use, 0 for one per processor, 1 to lex on the calling thread
+///
+/// @return 0 on success
+///
+int buffer_set_syntax_threads(buffer_t *buffer, int threads);
+
+/// \brief Lex the lines of a buffer changed since the last update
+///
+/// @param[in]  buffer  - buffer to lex
+/// @param[out] relexed - gets count of lines lexed, may be NULL
+///
+/// @return 0 on success
+///
+int buffer_update_syntax(buffer_t *buffer, size_t *relexed);
+
+/// \brief Get the lexer state at the end of a line, updating first if needed
+///
+/// @param[in]  buffer - buffer line is in
+/// @param[in]  line   - line number
+/// @param[out] state  - gets lexer state at end of line
+///
+/// @return 0 on success
+///
+int buffer_get_syntax_state(buffer_t *buffer, size_t line, uint8_t *state);
+
+/// \brief Mark a line whose content changed to lex again
+///
+/// For code that changes a buffer's lines
+///
+/// @param[in] buffer  - buffer line is in
+/// @param[in] line    - line that changed
+/// @param[in] linenum - its line number
+///
+void buffer_syntax_changed(buffer_t *buffer, line_t *line, size_t linenum);
+
+/// \brief Account for lines linked into or unlinked from a buffer
+///
+/// Lines linked in that haven't been lexed are marked by having no valid
+/// state already. Call after the lines are linked or unlinked
+///
+/// @param[in] buffer   - buffer lines moved in
+/// @param[in] linenum  - line number of first line linked or unlinked
+/// @param[in] inserted - count of lines linked in
+/// @param[in] deleted  - count of lines unlinked
+///
+void buffer_syntax_moved(buffer_t *buffer, size_t linenum, size_t inserted, size_t deleted);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "btrigram.h"
+#include "bfile.h"
+#include "bfilesys.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// Identifies a saved index
+#define TRIGRAM_MAGIC	0x49525442 /* BTRI */
+
+/// Version of saved index layout
+#define TRIGRAM_VERSION	1
+
+/// Bytes of bitmap per block
+#define TRIGRAM_BITMAP_BYTES	(TRIGRAM_BITS / 8)
+
+/// \brief Header of a saved index
+///
+typedef struct tag_trigram_header
+{
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		block_size;
+	uint32_t		bits;
+	uint64_t		file_size;
+	int64_t			mod_time;
+	uint64_t		block_count;
+}
+trigram_header_t;
+
+static inline uint8_t trigram_fold(uint8_t byte)
+{
+    return (byte >= 'A' && byte <= 'Z') ? (byte + ('a' - 'A')) : byte;
+}
+
+static inline uint32_t trigram_hash(uint8_t a, uint8_t b, uint8_t c)
+{
+    uint32_t key;
+
+    key = ((uint32_t)trigram_fold(a) << 16) | ((uint32_t)trigram_fold(b) << 8) | trigram_fold(c);
+    return ((key * 2654435761u) >> 16) & (TRIGRAM_BITS - 1);
+}
+
+trigram_index_t *trigram_create(size_t block_size)
+{
+    trigram_index_t *index;
+
+    index = (trigram_index_t*)malloc(sizeof(trigram_index_t));
+    if (! index)
+    {
+        butil_log(0, "%s: Can't alloc index\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(index, 0, sizeof(trigram_index_t));
+
+    if (! block_size)
+    {
+        block_size = TRIGRAM_DEFAULT_BLOCK_SIZE;
+    }
+    // keep blocks on code unit boundaries for any encoding
+    //
+    index->block_size = (block_size + 3) & ~3;
+    index->valid = true;
+    return index;
+}
+
+void trigram_destroy(trigram_index_t *index)
+{
+    if (! index)
+    {
+        return;
+    }
+    if (index->bitmaps)
+    {
+        free(index->bitmaps);
+    }
+    free(index);
+}
+
+/// \brief Make sure there is a bitmap for a block
+///
+static int trigram_size_blocks(trigram_index_t *index, size_t block)
+{
+    uint8_t *bitmaps;
+    size_t alloc;
+
+    if (block < index->blocks_alloced)
+    {
+        return 0;
+    }
+    alloc = index->blocks_alloced ? index->blocks_alloced * 2 : 16;
+    while (alloc <= block)
+    {
+        alloc *= 2;
+    }
+    bitmaps = (uint8_t*)realloc(index->bitmaps, alloc * TRIGRAM_BITMAP_BYTES);
+    if (! bitmaps)
+    {
+        butil_log(0, "%s: Can't alloc %u blocks\n", __FUNCTION__, alloc);
+        return -1;
+    }
+    memset(bitmaps + index->blocks_alloced * TRIGRAM_BITMAP_BYTES, 0, (alloc - index->blocks_alloced) * TRIGRAM_BITMAP_BYTES);
+    index->bitmaps = bitmaps;
+    index->blocks_alloced = alloc;
+    return 0;
+}
+
+/// \brief Mark a trigram in the block it starts in
+///
+static inline void trigram_mark(trigram_index_t *index, uint64_t pos, uint8_t a, uint8_t b, uint8_t c)
+{
+    uint8_t *bitmap;
+    uint32_t bit;
+
+    bitmap = index->bitmaps + (size_t)(pos / index->block_size) * TRIGRAM_BITMAP_BYTES;
+    bit = trigram_hash(a, b, c);
+    bitmap[bit >> 3] |= (1 << (bit & 7));
+}
+
+int trigram_add(trigram_index_t *index, uint64_t offset, const uint8_t *data, size_t count)
+{
+    size_t i;
+
+    if (!index || !data)
+    {
+        return -1;
+    }
+    if (! index->valid)
+    {
+        return -1;
+    }
+    if (offset != index->file_size)
+    {
+        butil_log(2, "%s: Data at %llu isn't next (%llu)\n", __FUNCTION__, offset, index->file_size);
+        index->valid = false;
+        return -1;
+    }
+    if (! count)
+    {
+        return 0;
+    }
+    if (trigram_size_blocks(index, (size_t)((offset + count - 1) / index->block_size)))
+    {
+        index->valid = false;
+        return -1;
+    }
+    // trigrams which start in the bytes carried from the last add
+    //
+    if (index->ncarry == 2)
+    {
+        trigram_mark(index, offset - 2, index->carry[0], index->carry[1], data[0]);
+    }
+    if (index->ncarry >= 1 && count >= 2)
+    {
+        trigram_mark(index, offset - 1, index->carry[index->ncarry - 1], data[0], data[1]);
+    }
+    for (i = 0; (i + 2) < count; i++)
+    {
+        trigram_mark(index, offset + i, data[i], data[i + 1], data[i + 2]);
+    }
+    // remember the last two bytes for the next add
+    //
+    if (count >= 2)
+    {
+        index->carry[0] = data[count - 2];
+        index->carry[1] = data[count - 1];
+        index->ncarry = 2;
+    }
+    else if (index->ncarry == 2)
+    {
+        index->carry[0] = index->carry[1];
+        index->carry[1] = data[0];
+    }
+    else
+    {
+        index->carry[index->ncarry++] = data[0];
+    }
+    index->file_size += count;
+    index->block_count = (size_t)((index->file_size + index->block_size - 1) / index->block_size);
+    return 0;
+}
+
+bool trigram_block_may_match(trigram_index_t *index, size_t block, const uint8_t *needle, size_t length)
+{
+    const uint8_t *bitmap;
+    const uint8_t *nextmap;
+    uint32_t bit;
+    size_t i;
+
+    if (!index || !index->valid || !needle || length < 3 || length > index->block_size)
+    {
+        return true;
+    }
+    if (block >= index->block_count)
+    {
+        // past what was indexed
+        return true;
+    }
+    bitmap = index->bitmaps + block * TRIGRAM_BITMAP_BYTES;
+    nextmap = ((block + 1) < index->block_count) ? (bitmap + TRIGRAM_BITMAP_BYTES) : NULL;
+
+    // a match starting in this block has trigrams starting in it or the next
+    //
+    for (i = 0; (i + 2) < length; i++)
+    {
+        bit = trigram_hash(needle[i], needle[i + 1], needle[i + 2]);
+        if (bitmap[bit >> 3] & (1 << (bit & 7)))
+        {
+            continue;
+        }
+        if (nextmap && (nextmap[bit >> 3] & (1 << (bit & 7))))
+        {
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+int trigram_sidecar_url(const char *url, char *sidecar, size_t nsidecar)
+{
+    int len;
+
+    if (!url || !sidecar)
+    {
+        return -1;
+    }
+    len = snprintf(sidecar, nsidecar, "%s%s", url, TRIGRAM_SIDECAR_EXTENSION);
+    if (len < 0 || (size_t)len >= nsidecar)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int trigram_save(trigram_index_t *index, const char *url)
+{
+    trigram_header_t header;
+    file_t *file;
+    size_t total;
+    size_t chunk;
+    int count;
+
+    if (!index || !url || !index->valid)
+    {
+        return -1;
+    }
+    file = file_create(url, openForWrite);
+    if (! file)
+    {
+        butil_log(2, "%s: Can't create %s\n", __FUNCTION__, url);
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = TRIGRAM_MAGIC;
+    header.version = TRIGRAM_VERSION;
+    header.block_size = (uint32_t)index->block_size;
+    header.bits = TRIGRAM_BITS;
+    header.file_size = index->file_size;
+    header.mod_time = (int64_t)index->mod_time;
+    header.block_count = index->block_count;
+
+    count = file->file_write(file, (uint8_t*)&header, sizeof(header));
+    if (count != sizeof(header))
+    {
+        file_destroy(file);
+        filesys_delete(url);
+        return -1;
+    }
+    total = index->block_count * TRIGRAM_BITMAP_BYTES;
+    while (total > 0)
+    {
+        chunk = (total > (1024 * 1024)) ? (1024 * 1024) : total;
+        count = file->file_write(file, index->bitmaps + (index->block_count * TRIGRAM_BITMAP_BYTES - total), chunk);
+        if (count != (int)chunk)
+        {
+            butil_log(2, "%s: Can't write %s\n", __FUNCTION__, url);
+            file_destroy(file);
+            filesys_delete(url);
+            return -1;
+        }
+        total -= chunk;
+    }
+    file_destroy(file);
+    return 0;
+}
+
+trigram_index_t *trigram_load(const char *url, uint64_t file_size, time_t mod_time)
+{
+    trigram_header_t header;
+    trigram_index_t *index;
+    file_t *file;
+    size_t total;
+    size_t got;
+    int count;
+
+    if (! url)
+    {
+        return NULL;
+    }
+    filesys_forget_info(url);
+    if (filesys_info(url, NULL, NULL))
+    {
+        return NULL;
+    }
+    file = file_create(url, openForRead);
+    if (! file)
+    {
+        return NULL;
+    }
+    count = file->file_read(file, (uint8_t*)&header, sizeof(header));
+    if (
+            count != sizeof(header)
+        ||  header.magic != TRIGRAM_MAGIC
+        ||  header.version != TRIGRAM_VERSION
+        ||  header.bits != TRIGRAM_BITS
+        ||  header.block_size == 0
+        ||  header.file_size != file_size
+        ||  header.mod_time != (int64_t)mod_time
+        ||  header.block_count != ((header.file_size + header.block_size - 1) / header.block_size)
+    )
+    {
+        butil_log(3, "%s: %s is stale or not an index\n", __FUNCTION__, url);
+        file_destroy(file);
+        return NULL;
+    }
+    index = trigram_create(header.block_size);
+    if (! index)
+    {
+        file_destroy(file);
+        return NULL;
+    }
+    if (header.block_count && trigram_size_blocks(index, (size_t)header.block_count - 1))
+    {
+        trigram_destroy(index);
+        file_destroy(file);
+        return NULL;
+    }
+    total = (size_t)header.block_count * TRIGRAM_BITMAP_BYTES;
+    got = 0;
+    while (got < total)
+    {
+        count = file->file_read(file, index->bitmaps + got, total - got);
+        if (count <= 0)
+        {
+            butil_log(2, "%s: %s is short\n", __FUNCTION__, url);
+            trigram_destroy(index);
+            file_destroy(file);
+            return NULL;
+        }
+        got += count;
+    }
+    file_destroy(file);
+
+    index->block_count = (size_t)header.block_count;
+    index->file_size = header.file_size;
+    index->mod_time = mod_time;
+    return index;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BTRIGRAM_H
+#define BTRIGRAM_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/// \file
+///
+/// A trigram index splits a file into fixed size blocks and keeps, for
+/// each block, a bitmap of the (hashed) three byte sequences which start
+/// in it. Letters are folded to lower case, so one index serves searches
+/// with and without case. A block whose bitmap, or'd with the next one's,
+/// is missing any trigram of a needle can't hold the start of a match
+///
+/// The index is of raw file bytes, in the file's encoding, and is kept
+/// in a sidecar file next to the file which is only trusted if the file's
+/// size and modification time still match
+
+/// Default bytes of file covered by one block
+#define TRIGRAM_DEFAULT_BLOCK_SIZE	(256*1024)
+
+/// Bits in the bitmap of each block
+#define TRIGRAM_BITS				(64*1024)
+
+/// Extension added to a file's name to make its sidecar index name
+#define TRIGRAM_SIDECAR_EXTENSION	".trigrams"
+
+/// Trigram index of a file
+///
+typedef struct tag_trigram_index
+{
+	size_t			block_size;			///< bytes of file per block
+	size_t			block_count;		///< blocks in index
+	size_t			blocks_alloced;		///< blocks room is allocated for
+	uint8_t		   *bitmaps;			///< TRIGRAM_BITS bits for each block
+	uint64_t		file_size;			///< bytes of file indexed
+	time_t			mod_time;			///< modification time of file indexed
+	uint8_t			carry[2];			///< last bytes added, for trigrams spanning adds
+	size_t			ncarry;				///< count of bytes in carry
+	bool			valid;				///< set false if data was added out of order
+}
+trigram_index_t;
+
+/// \brief Create an empty trigram index
+///
+/// @param[in] block_size - bytes of file per block, 0 for default
+///
+/// @return new index or NULL if no memory
+///
+trigram_index_t *trigram_create(size_t block_size);
+
+/// \brief Destroy a trigram index
+///
+/// @param[in] index - index to destroy
+///
+void trigram_destroy(trigram_index_t *index);
+
+/// \brief Add file data to an index
+///
+/// Data must be added in order, starting at the start of file
+///
+/// @param[in] index  - index to add to
+/// @param[in] offset - offset in file of data
+/// @param[in] data   - file data
+/// @param[in] count  - bytes of data
+///
+/// @return 0 on success
+///
+int trigram_add(trigram_index_t *index, uint64_t offset, const uint8_t *data, size_t count);
+
+/// \brief Check if a match of a needle could start in a block
+///
+/// @param[in] index  - index to check
+/// @param[in] block  - block number
+/// @param[in] needle - bytes to find, in the file's encoding
+/// @param[in] length - bytes of needle
+///
+/// @return false only if no match can start in the block
+///
+bool trigram_block_may_match(trigram_index_t *index, size_t block, const uint8_t *needle, size_t length);
+
+/// \brief Make the url of the sidecar index file for a file
+///
+/// @param[in]  url      - url of file
+/// @param[out] sidecar  - gets url of sidecar
+/// @param[in]  nsidecar - size of sidecar in bytes
+///
+/// @return 0 on success
+///
+int trigram_sidecar_url(const char *url, char *sidecar, size_t nsidecar);
+
+/// \brief Save an index to a file
+///
+/// @param[in] index - index to save
+/// @param[in] url   - url of file to save to
+///
+/// @return 0 on success
+///
+int trigram_save(trigram_index_t *index, const char *url);
+
+/// \brief Load an index from a file, if it matches the file indexed
+///
+/// @param[in] url       - url of saved index
+/// @param[in] file_size - current size of file indexed
+/// @param[in] mod_time  - current modification time of file indexed
+///
+/// @return the index, or NULL if missing, out of date or can't be read
+///
+trigram_index_t *trigram_load(const char *url, uint64_t file_size, time_t mod_time);
+
+#endif
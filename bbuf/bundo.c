@@ -14,8 +14,981 @@
  * limitations under the License.
  */
 #include "bbuf.h"
+#include "butil.h"
+#include "bfilesys.h"
 
 /// \file
 ///
 
+/// Records are kept aligned to this in the arena
+#define UNDO_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+/// Memory held by all logs, and the cap on it
+static pthread_mutex_t s_undo_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t s_undo_memory;
+static size_t s_undo_memory_cap = UNDO_DEFAULT_GLOBAL_MEMORY_CAP;
+
+/// \brief Count memory taken by a log
+///
+static void undo_memory_add(undo_log_t *log, size_t bytes)
+{
+    log->memory += bytes;
+    pthread_mutex_lock(&s_undo_memory_lock);
+    s_undo_memory += bytes;
+    pthread_mutex_unlock(&s_undo_memory_lock);
+}
+
+/// \brief Count memory given back by a log
+///
+static void undo_memory_sub(undo_log_t *log, size_t bytes)
+{
+    log->memory -= bytes;
+    pthread_mutex_lock(&s_undo_memory_lock);
+    s_undo_memory -= bytes;
+    pthread_mutex_unlock(&s_undo_memory_lock);
+}
+
+/// \brief Is a log, or all logs, holding more memory than allowed
+///
+static bool undo_over_cap(undo_log_t *log)
+{
+    bool over;
+
+    if (log->memory > log->memory_cap)
+    {
+        return true;
+    }
+    pthread_mutex_lock(&s_undo_memory_lock);
+    over = s_undo_memory > s_undo_memory_cap;
+    pthread_mutex_unlock(&s_undo_memory_lock);
+    return over;
+}
+
+void undo_set_global_memory_cap(size_t cap)
+{
+    pthread_mutex_lock(&s_undo_memory_lock);
+    s_undo_memory_cap = cap ? cap : UNDO_DEFAULT_GLOBAL_MEMORY_CAP;
+    pthread_mutex_unlock(&s_undo_memory_lock);
+}
+
+size_t undo_global_memory(void)
+{
+    size_t memory;
+
+    pthread_mutex_lock(&s_undo_memory_lock);
+    memory = s_undo_memory;
+    pthread_mutex_unlock(&s_undo_memory_lock);
+    return memory;
+}
+
+undo_log_t *undo_log_create(void)
+{
+    undo_log_t *log;
+
+    log = (undo_log_t*)malloc(sizeof(undo_log_t));
+    if (! log)
+    {
+        butil_log(0, "%s: Can't alloc undo log\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(log, 0, sizeof(undo_log_t));
+    log->memory_cap = UNDO_DEFAULT_MEMORY_CAP;
+    return log;
+}
+
+void undo_log_set_line_free(undo_log_t *log, undo_free_line_t free_line, void *priv)
+{
+    if (log)
+    {
+        log->free_line = free_line;
+        log->free_line_priv = priv;
+    }
+}
+
+void undo_log_set_memory_cap(undo_log_t *log, size_t cap)
+{
+    if (log)
+    {
+        log->memory_cap = cap ? cap : UNDO_DEFAULT_MEMORY_CAP;
+    }
+}
+
+/// \brief Make a log's spill file, if not already made
+///
+/// @return 0 on success
+///
+static int undo_spill_open(undo_log_t *log)
+{
+    if (log->spill_out)
+    {
+        return 0;
+    }
+    if (log->spill_failed)
+    {
+        return -1;
+    }
+    if (filesys_get_temp("undo_spill", log->spill_url, sizeof(log->spill_url)))
+    {
+        butil_log(1, "%s: Can't make spill file\n", __FUNCTION__);
+        log->spill_failed = true;
+        return -1;
+    }
+    log->spill_out = file_create(log->spill_url, openForAppend);
+    log->spill_in = file_create(log->spill_url, openForRead);
+    if (! log->spill_out || ! log->spill_in)
+    {
+        butil_log(1, "%s: Can't open spill file %s\n", __FUNCTION__, log->spill_url);
+        file_destroy(log->spill_out);
+        file_destroy(log->spill_in);
+        log->spill_out = NULL;
+        log->spill_in = NULL;
+        filesys_delete(log->spill_url);
+        log->spill_failed = true;
+        return -1;
+    }
+    log->spill_size = 0;
+    return 0;
+}
+
+/// \brief Remove a log's spill file
+///
+static void undo_spill_close(undo_log_t *log)
+{
+    if (! log->spill_out)
+    {
+        return;
+    }
+    file_destroy(log->spill_out);
+    file_destroy(log->spill_in);
+    log->spill_out = NULL;
+    log->spill_in = NULL;
+    filesys_delete(log->spill_url);
+    log->spill_size = 0;
+}
+
+/// \brief Append bytes to a log's spill file
+///
+/// @param[in]  log    - log to spill from
+/// @param[in]  data   - bytes to write
+/// @param[in]  count  - count of bytes
+/// @param[out] offset - where the bytes went in the file
+///
+/// @return 0 on success
+///
+static int undo_spill_write(undo_log_t *log, const uint8_t *data, size_t count, uint64_t *offset)
+{
+    size_t total;
+    int wc;
+
+    if (undo_spill_open(log))
+    {
+        return -1;
+    }
+    if (log->spill_out->file_seek(log->spill_out, log->spill_size) < 0)
+    {
+        return -1;
+    }
+    for (total = 0; total < count; total += wc)
+    {
+        wc = log->spill_out->file_write(log->spill_out, (uint8_t*)data + total, count - total);
+        if (wc <= 0)
+        {
+            butil_log(1, "%s: Can't write spill file\n", __FUNCTION__);
+            return -1;
+        }
+    }
+    *offset = log->spill_size;
+    log->spill_size += count;
+    return 0;
+}
+
+/// \brief Read bytes back from a log's spill file
+///
+/// @return 0 on success
+///
+static int undo_spill_read(undo_log_t *log, uint64_t offset, uint8_t *data, size_t count)
+{
+    size_t total;
+    int rc;
+
+    if (! log->spill_in)
+    {
+        return -1;
+    }
+    if (log->spill_in->file_seek(log->spill_in, offset) < 0)
+    {
+        return -1;
+    }
+    for (total = 0; total < count; total += rc)
+    {
+        rc = log->spill_in->file_read(log->spill_in, data + total, count - total);
+        if (rc <= 0)
+        {
+            butil_log(0, "%s: Can't read spill file\n", __FUNCTION__);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// \brief Bytes of memory the line content an undoSetLine record holds owns
+///
+static size_t undo_data_size(const undorec_t *rec)
+{
+    line_t line;
+
+    line.location = rec->location;
+    line.position.data = rec->position.data;
+    line.length = rec->length;
+    return line_data_size(&line);
+}
+
+/// \brief Spill the line content an undoSetLine record owns
+///
+/// Only content in memory is spilled, pieces of a long line stay
+///
+/// @return 0 on success
+///
+static int undo_spill_data(undo_log_t *log, undorec_t *rec)
+{
+    uint64_t offset;
+
+    if (
+            rec->type != undoSetLine || rec->location != lineInMemory
+        ||  ! rec->position.data || (rec->flags & undoDataSpilled)
+    )
+    {
+        return 0;
+    }
+    if (undo_spill_write(log, (uint8_t*)rec->position.data, rec->length, &offset))
+    {
+        return -1;
+    }
+    free(rec->position.data);
+    undo_memory_sub(log, rec->length + 1);
+    rec->position.offset = offset;
+    rec->flags |= undoDataSpilled;
+    return 0;
+}
+
+/// \brief Read back the line content of an undoSetLine record
+///
+/// @return 0 on success
+///
+static int undo_load_data(undo_log_t *log, undorec_t *rec)
+{
+    char *data;
+
+    if (! (rec->flags & undoDataSpilled))
+    {
+        return 0;
+    }
+    data = (char*)malloc(rec->length + 1);
+    if (! data)
+    {
+        butil_log(0, "%s: Can't alloc line\n", __FUNCTION__);
+        return -1;
+    }
+    if (undo_spill_read(log, rec->position.offset, (uint8_t*)data, rec->length))
+    {
+        free(data);
+        return -1;
+    }
+    data[rec->length] = '\0';
+    rec->position.data = data;
+    rec->flags &= ~undoDataSpilled;
+    undo_memory_add(log, rec->length + 1);
+    return 0;
+}
+
+/// \brief Spill a chunk of records, and the line content they own, to disk
+///
+/// @return 0 on success
+///
+static int undo_spill_chunk(undo_log_t *log, undo_chunk_t *chunk)
+{
+    undorec_t *rec;
+    size_t at;
+
+    for (at = 0; at < chunk->used; at += rec->size)
+    {
+        rec = (undorec_t*)(chunk->data + at);
+        if (undo_spill_data(log, rec))
+        {
+            return -1;
+        }
+    }
+    if (undo_spill_write(log, chunk->data, chunk->used, &chunk->spill_offset))
+    {
+        return -1;
+    }
+    free(chunk->data);
+    chunk->data = NULL;
+    undo_memory_sub(log, chunk->size);
+    butil_log(5, "%s: Spilled %u bytes of undo at %llu\n", __FUNCTION__, chunk->used, chunk->spill_offset);
+    return 0;
+}
+
+/// \brief Read a spilled chunk back into memory
+///
+/// Line content its records own stays spilled until needed
+///
+/// @return 0 on success
+///
+static int undo_page_in(undo_log_t *log, undo_chunk_t *chunk)
+{
+    if (chunk->data)
+    {
+        return 0;
+    }
+    chunk->data = (uint8_t*)malloc(chunk->size);
+    if (! chunk->data)
+    {
+        butil_log(0, "%s: Can't alloc undo chunk\n", __FUNCTION__);
+        return -1;
+    }
+    if (undo_spill_read(log, chunk->spill_offset, chunk->data, chunk->used))
+    {
+        free(chunk->data);
+        chunk->data = NULL;
+        return -1;
+    }
+    undo_memory_add(log, chunk->size);
+    return 0;
+}
+
+/// \brief Spill chunks until a log is under its memory caps
+///
+/// The chunk at the cursor and the one after it are kept, since undo
+/// and redo use them next. Of the rest, the oldest before the cursor
+/// go first, then the newest after it
+///
+static void undo_enforce_cap(undo_log_t *log)
+{
+    undo_chunk_t *chunk;
+    undo_chunk_t *victim;
+    undo_chunk_t *keep;
+
+    while (! log->spill_failed && undo_over_cap(log))
+    {
+        victim = NULL;
+        for (chunk = log->head; chunk && chunk != log->cursor_chunk; chunk = chunk->next)
+        {
+            if (chunk->data && chunk->used)
+            {
+                victim = chunk;
+                break;
+            }
+        }
+        keep = log->cursor_chunk ? log->cursor_chunk->next : NULL;
+        for (chunk = log->tail; ! victim && chunk && chunk != keep && chunk != log->cursor_chunk; chunk = chunk->prev)
+        {
+            if (chunk->data && chunk->used)
+            {
+                victim = chunk;
+            }
+        }
+        if (! victim)
+        {
+            break;
+        }
+        if (undo_spill_chunk(log, victim))
+        {
+            butil_log(1, "%s: Can't spill undo, keeping it in memory\n", __FUNCTION__);
+            log->spill_failed = true;
+        }
+    }
+}
+
+/// \brief Free a chain of lines
+///
+static void undo_free_lines(undo_log_t *log, line_t *first, size_t count)
+{
+    line_t *next;
+
+    while (first && count--)
+    {
+        next = first->next;
+        if (log->free_line)
+        {
+            log->free_line(log->free_line_priv, first);
+        }
+        else
+        {
+            line_destroy(first);
+        }
+        first = next;
+    }
+}
+
+/// \brief Free whatever a record owns when it is dropped from the log
+///
+/// @param[in] log     - log record is in
+/// @param[in] rec     - record to discard
+/// @param[in] applied - true if the record's edit is applied to the buffer
+///
+static void undo_discard(undo_log_t *log, undorec_t *rec, bool applied)
+{
+    switch (rec->type)
+    {
+    case undoInsertLines:
+        // lines that were undone are only held by the record
+        if (! applied)
+        {
+            undo_free_lines(log, rec->first, rec->inserted);
+        }
+        break;
+    case undoDeleteLines:
+        if (applied)
+        {
+            undo_free_lines(log, rec->first, rec->deleted);
+        }
+        break;
+    case undoSetLine:
+        if (rec->location != lineInFile && rec->position.data && ! (rec->flags & undoDataSpilled))
+        {
+            undo_memory_sub(log, undo_data_size(rec));
+            free(rec->position.data);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/// \brief Free a chunk of the arena
+///
+static void undo_free_chunk(undo_log_t *log, undo_chunk_t *chunk)
+{
+    if (chunk->data)
+    {
+        free(chunk->data);
+        undo_memory_sub(log, chunk->size);
+    }
+    free(chunk);
+}
+
+/// \brief Drop records from a position in the log to the end
+///
+/// @param[in] log     - log to drop from
+/// @param[in] chunk   - chunk of first record to drop
+/// @param[in] offset  - offset of first record to drop
+/// @param[in] applied - true if records are applied to the buffer (only when clearing)
+///
+static void undo_truncate(undo_log_t *log, undo_chunk_t *chunk, size_t offset, bool applied)
+{
+    undo_chunk_t *walk;
+    undo_chunk_t *next;
+    undorec_t *rec;
+    size_t at;
+
+    if (! chunk)
+    {
+        return;
+    }
+    for (walk = chunk, at = offset; walk; walk = walk->next, at = 0)
+    {
+        if (at < walk->used && undo_page_in(log, walk))
+        {
+            // lines its records own are lost
+            butil_log(0, "%s: Can't read back undo records\n", __FUNCTION__);
+            at = walk->used;
+        }
+        while (at < walk->used)
+        {
+            if (walk == log->cursor_chunk && at >= log->cursor_offset)
+            {
+                // records past the cursor have been undone
+                applied = false;
+            }
+            rec = (undorec_t*)(walk->data + at);
+            undo_discard(log, rec, applied);
+            at += rec->size;
+            log->records--;
+        }
+        if (walk == log->cursor_chunk)
+        {
+            applied = false;
+        }
+    }
+    // free whole chunks past the one truncated in
+    //
+    for (walk = chunk->next; walk; walk = next)
+    {
+        next = walk->next;
+        undo_free_chunk(log, walk);
+    }
+    chunk->next = NULL;
+    if (offset < chunk->used)
+    {
+        // (only the cursor chunk, which is in memory, or the head is truncated in)
+        chunk->last = chunk->data ? (offset - ((undorec_t*)(chunk->data + offset))->prev_size) : 0;
+        chunk->used = offset;
+    }
+    log->tail = chunk;
+}
+
+void undo_log_clear(undo_log_t *log)
+{
+    if (! log || ! log->head)
+    {
+        return;
+    }
+    undo_truncate(log, log->head, 0, true);
+
+    log->cursor_chunk = log->head;
+    log->cursor_offset = 0;
+    log->records = 0;
+    log->can_merge = false;
+    log->group_started = log->group_depth > 0;
+
+    // nothing is spilled anymore, start over
+    //
+    undo_spill_close(log);
+    log->spill_failed = false;
+}
+
+void undo_log_destroy(undo_log_t *log)
+{
+    if (! log)
+    {
+        return;
+    }
+    undo_log_clear(log);
+    if (log->head)
+    {
+        undo_free_chunk(log, log->head);
+    }
+    free(log);
+}
+
+/// \brief Make room for a new record at the cursor
+///
+/// Drops any records after the cursor, which can't be redone once
+/// something new is added
+///
+/// @param[in] log  - log to add to
+/// @param[in] size - bytes needed for record, including text
+///
+/// @return new record, zeroed except for its size, or NULL if no memory
+///
+static undorec_t *undo_new_record(undo_log_t *log, size_t size)
+{
+    undo_chunk_t *chunk;
+    undorec_t *rec;
+    size_t alloc;
+
+    size = UNDO_ALIGN(size);
+
+    if (log->cursor_chunk)
+    {
+        undo_truncate(log, log->cursor_chunk, log->cursor_offset, false);
+    }
+    chunk = log->tail;
+
+    if (! chunk || (chunk->used + size) > chunk->size)
+    {
+        alloc = (size > UNDO_CHUNK_SIZE) ? size : UNDO_CHUNK_SIZE;
+
+        if (chunk && chunk->used == 0)
+        {
+            // chunk left empty by truncation is too small, replace it
+            //
+            free(chunk->data);
+            undo_memory_sub(log, chunk->size);
+            chunk->data = (uint8_t*)malloc(alloc);
+            chunk->size = chunk->data ? alloc : 0;
+            undo_memory_add(log, chunk->size);
+            if (! chunk->data)
+            {
+                butil_log(0, "%s: Can't alloc undo chunk\n", __FUNCTION__);
+                return NULL;
+            }
+        }
+        else
+        {
+            chunk = (undo_chunk_t*)malloc(sizeof(undo_chunk_t));
+            if (chunk)
+            {
+                chunk->data = (uint8_t*)malloc(alloc);
+                if (! chunk->data)
+                {
+                    free(chunk);
+                    chunk = NULL;
+                }
+            }
+            if (! chunk)
+            {
+                butil_log(0, "%s: Can't alloc undo chunk\n", __FUNCTION__);
+                return NULL;
+            }
+            chunk->size = alloc;
+            chunk->used = 0;
+            chunk->last = 0;
+            chunk->spill_offset = 0;
+            chunk->next = NULL;
+            chunk->prev = log->tail;
+            if (log->tail)
+            {
+                log->tail->next = chunk;
+            }
+            else
+            {
+                log->head = chunk;
+            }
+            log->tail = chunk;
+            undo_memory_add(log, alloc);
+        }
+    }
+    rec = (undorec_t*)(chunk->data + chunk->used);
+    memset(rec, 0, sizeof(undorec_t));
+    rec->size = size;
+    rec->prev_size = chunk->used ? (chunk->used - chunk->last) : 0;
+    chunk->last = chunk->used;
+    chunk->used += size;
+
+    log->cursor_chunk = chunk;
+    log->cursor_offset = chunk->used;
+    log->records++;
+
+    if (log->group_depth > 0)
+    {
+        if (log->group_started)
+        {
+            log->group_started = false;
+        }
+        else
+        {
+            rec->flags |= undoChained;
+        }
+    }
+    log->can_merge = false;
+    return rec;
+}
+
+/// \brief Try to merge a text edit into the record before the cursor
+///
+/// Only pure insertions which continue the text just inserted, and pure
+/// deletions next to the text just deleted (backspace or delete) merge
+///
+/// @return true if merged
+///
+static bool undo_merge_text(undo_log_t *log, size_t line, size_t column,
+                const uint8_t *deleted, size_t ndeleted, const uint8_t *inserted, size_t ninserted)
+{
+    undo_chunk_t *chunk;
+    undorec_t *rec;
+    size_t need;
+
+    if (! log->can_merge)
+    {
+        return false;
+    }
+    chunk = log->cursor_chunk;
+    if (! chunk || ! chunk->data || log->cursor_offset != chunk->used || chunk->next || chunk->used == 0)
+    {
+        return false;
+    }
+    rec = (undorec_t*)(chunk->data + chunk->last);
+    if (rec->type != undoText || rec->line != line)
+    {
+        return false;
+    }
+    if ((rec->deleted + rec->inserted + ndeleted + ninserted) > UNDO_MERGE_LIMIT)
+    {
+        return false;
+    }
+    need = UNDO_ALIGN(sizeof(undorec_t) + rec->deleted + rec->inserted + ndeleted + ninserted);
+    if ((chunk->last + need) > chunk->size)
+    {
+        return false;
+    }
+    if (ninserted && ! ndeleted && ! rec->deleted && column == (rec->column + rec->inserted))
+    {
+        // typing
+        memcpy(UNDO_INSERTED_TEXT(rec) + rec->inserted, inserted, ninserted);
+        rec->inserted += ninserted;
+    }
+    else if (ndeleted && ! ninserted && ! rec->inserted && (column + ndeleted) == rec->column)
+    {
+        // backspace, deleted text goes in front
+        memmove(UNDO_DELETED_TEXT(rec) + ndeleted, UNDO_DELETED_TEXT(rec), rec->deleted);
+        memcpy(UNDO_DELETED_TEXT(rec), deleted, ndeleted);
+        rec->deleted += ndeleted;
+        rec->column = column;
+    }
+    else if (ndeleted && ! ninserted && ! rec->inserted && column == rec->column)
+    {
+        // forward delete
+        memcpy(UNDO_DELETED_TEXT(rec) + rec->deleted, deleted, ndeleted);
+        rec->deleted += ndeleted;
+    }
+    else
+    {
+        return false;
+    }
+    rec->size = need;
+    chunk->used = chunk->last + need;
+    log->cursor_offset = chunk->used;
+    return true;
+}
+
+int undo_add_text(undo_log_t *log, size_t line, size_t column,
+                const uint8_t *deleted, size_t ndeleted, const uint8_t *inserted, size_t ninserted)
+{
+    undorec_t *rec;
+
+    if (! log)
+    {
+        return -1;
+    }
+    if (undo_merge_text(log, line, column, deleted, ndeleted, inserted, ninserted))
+    {
+        log->can_merge = true;
+        return 0;
+    }
+    rec = undo_new_record(log, sizeof(undorec_t) + ndeleted + ninserted);
+    if (! rec)
+    {
+        return -1;
+    }
+    rec->type = undoText;
+    rec->line = line;
+    rec->column = column;
+    rec->deleted = ndeleted;
+    rec->inserted = ninserted;
+    if (ndeleted)
+    {
+        memcpy(UNDO_DELETED_TEXT(rec), deleted, ndeleted);
+    }
+    if (ninserted)
+    {
+        memcpy(UNDO_INSERTED_TEXT(rec), inserted, ninserted);
+    }
+    undo_enforce_cap(log);
+    log->can_merge = true;
+    return 0;
+}
+
+int undo_add_lines(undo_log_t *log, undo_type_t type, size_t line, size_t count, line_t *first, line_t *last)
+{
+    undorec_t *rec;
+
+    if (! log || (type != undoInsertLines && type != undoDeleteLines))
+    {
+        return -1;
+    }
+    rec = undo_new_record(log, sizeof(undorec_t));
+    if (! rec)
+    {
+        return -1;
+    }
+    rec->type = type;
+    rec->line = line;
+    if (type == undoInsertLines)
+    {
+        rec->inserted = count;
+    }
+    else
+    {
+        rec->deleted = count;
+    }
+    rec->first = first;
+    rec->last = last;
+    undo_enforce_cap(log);
+    return 0;
+}
+
+int undo_add_line_content(undo_log_t *log, size_t linenum, const line_t *line)
+{
+    undorec_t *rec;
+
+    if (! log || ! line)
+    {
+        return -1;
+    }
+    rec = undo_new_record(log, sizeof(undorec_t));
+    if (! rec)
+    {
+        return -1;
+    }
+    rec->type = undoSetLine;
+    rec->line = linenum;
+    rec->location = line->location;
+    if (line->location != lineInFile)
+    {
+        rec->position.data = line->position.data;
+        undo_memory_add(log, line_data_size(line));
+    }
+    else
+    {
+        rec->position.offset = line->position.offset;
+    }
+    rec->length = line->length;
+    undo_enforce_cap(log);
+    return 0;
+}
+
+int undo_swap_line_content(undo_log_t *log, undorec_t *rec, line_t *line)
+{
+    line_t saved;
+
+    if (! log || ! rec || ! line || rec->type != undoSetLine)
+    {
+        return -1;
+    }
+    if (undo_load_data(log, rec))
+    {
+        return -1;
+    }
+    saved = *line;
+
+    line->location = rec->location;
+    if (rec->location != lineInFile)
+    {
+        line->position.data = rec->position.data;
+        undo_memory_sub(log, undo_data_size(rec));
+    }
+    else
+    {
+        line->position.offset = rec->position.offset;
+    }
+    line->length = rec->length;
+
+    rec->location = saved.location;
+    if (saved.location != lineInFile)
+    {
+        rec->position.data = saved.position.data;
+        undo_memory_add(log, line_data_size(&saved));
+    }
+    else
+    {
+        rec->position.offset = saved.position.offset;
+    }
+    rec->length = saved.length;
+    return 0;
+}
+
+void undo_begin_group(undo_log_t *log)
+{
+    if (! log)
+    {
+        return;
+    }
+    if (log->group_depth++ == 0)
+    {
+        log->group_started = true;
+    }
+    log->can_merge = false;
+}
+
+void undo_end_group(undo_log_t *log)
+{
+    if (! log || log->group_depth <= 0)
+    {
+        return;
+    }
+    log->group_depth--;
+    log->can_merge = false;
+}
+
+void undo_seal(undo_log_t *log)
+{
+    if (log)
+    {
+        log->can_merge = false;
+    }
+}
+
+undorec_t *undo_step_back(undo_log_t *log)
+{
+    undo_chunk_t *chunk;
+    size_t offset;
+
+    if (! log || ! log->cursor_chunk)
+    {
+        return NULL;
+    }
+    chunk = log->cursor_chunk;
+    offset = log->cursor_offset;
+
+    while (offset == 0)
+    {
+        if (! chunk->prev)
+        {
+            return NULL;
+        }
+        chunk = chunk->prev;
+        offset = chunk->used;
+    }
+    if (undo_page_in(log, chunk))
+    {
+        return NULL;
+    }
+    if (offset == chunk->used)
+    {
+        offset = chunk->last;
+    }
+    else
+    {
+        offset -= ((undorec_t*)(chunk->data + offset))->prev_size;
+    }
+    log->cursor_chunk = chunk;
+    log->cursor_offset = offset;
+    log->can_merge = false;
+
+    undo_enforce_cap(log);
+    return (undorec_t*)(chunk->data + offset);
+}
+
+undorec_t *undo_peek_forward(undo_log_t *log)
+{
+    undo_chunk_t *chunk;
+    size_t offset;
+
+    if (! log || ! log->cursor_chunk)
+    {
+        return NULL;
+    }
+    chunk = log->cursor_chunk;
+    offset = log->cursor_offset;
+
+    while (offset >= chunk->used)
+    {
+        if (! chunk->next)
+        {
+            return NULL;
+        }
+        chunk = chunk->next;
+        offset = 0;
+    }
+    if (undo_page_in(log, chunk))
+    {
+        return NULL;
+    }
+    return (undorec_t*)(chunk->data + offset);
+}
+
+undorec_t *undo_step_forward(undo_log_t *log)
+{
+    undorec_t *rec;
+
+    rec = undo_peek_forward(log);
+    if (! rec)
+    {
+        return NULL;
+    }
+    // peek can have moved on to a following chunk
+    //
+    while (log->cursor_offset >= log->cursor_chunk->used)
+    {
+        log->cursor_chunk = log->cursor_chunk->next;
+        log->cursor_offset = 0;
+    }
+    log->cursor_offset += rec->size;
+    log->can_merge = false;
+
+    undo_enforce_cap(log);
+    return rec;
+}
 
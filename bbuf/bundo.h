@@ -18,15 +18,284 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "bline.h"
+#include "bfile.h"
 
 /// \file
 ///
+/// The undo log is an append-only arena of records, each a compact delta
+/// of one edit. A text edit keeps only the bytes it removed and inserted,
+/// and a line edit keeps a reference to the lines it unlinked or to the
+/// prior content of the line it changed, never a copy of whole lines, so
+/// undoing or redoing any edit costs the size of its record, not the file
+///
+/// Records before the log's cursor have been applied to the buffer, those
+/// after it have been undone and can be redone until a new edit is added
+///
+/// Memory held by a log is capped, per log and for all logs together.
+/// Past a cap, whole chunks furthest from the cursor, along with any line
+/// content their records own, are spilled to a temporary file and paged
+/// back in when undo or redo reaches them. Lines referenced by line
+/// records stay in memory
+
+/// Bytes in each chunk of the arena, larger records get a chunk to themselves
+#define UNDO_CHUNK_SIZE				(64*1024)
+
+/// Most bytes of text consecutive keystrokes are merged into one record
+#define UNDO_MERGE_LIMIT			(1024)
+
+/// Default bytes of memory a log can hold before spilling to disk
+#define UNDO_DEFAULT_MEMORY_CAP		(16*1024*1024) /* 16Mb */
+
+/// Default bytes of memory all logs together can hold before spilling to disk
+#define UNDO_DEFAULT_GLOBAL_MEMORY_CAP	(128*1024*1024) /* 128Mb */
+
+/// Types of edit an undo record represents
+///
+typedef enum
+{
+	undoText,							///< bytes deleted and/or inserted at a column in a line
+	undoInsertLines,					///< lines were linked into the buffer
+	undoDeleteLines,					///< lines were unlinked from the buffer
+	undoSetLine							///< a line's content was replaced
+}
+undo_type_t;
+
+/// \brief Flags of an undo record
+///
+#define undoChained					0x01	///< undo/redo along with the record before this one
+#define undoDataSpilled				0x02	///< the line content of an undoSetLine is in the spill file
 
 /// Undo - represents an atomic undoable operation
 ///
+/// For undoText, the deleted bytes follow the record in the arena, then
+/// the inserted bytes. For line records first and last are the chain of
+/// lines involved which, while unlinked from the buffer, belong to the
+/// record. For undoSetLine, location, position and length hold the other
+/// content of the line, which is swapped with the line's on undo and redo.
+/// While that content is spilled, position.offset is its offset in the
+/// spill file
+///
 typedef struct tag_undo_rec
 {
+	uint8_t			type;				///< an ::undo_type_t
+	uint8_t			flags;				///< undoChained etc.
+	size_t			size;				///< bytes of record in arena, including text
+	size_t			prev_size;			///< bytes of record before this in the same chunk, 0 if none
+	size_t			line;				///< first line (0 based) the edit applies to
+	size_t			column;				///< byte offset in line's utf-8 text, for undoText
+	size_t			deleted;			///< bytes of text, or count of lines, deleted
+	size_t			inserted;			///< bytes of text, or count of lines, inserted
+	line_t		   *first;				///< first line of chain, for line records
+	line_t		   *last;				///< last line of chain, for line records
+	int				location;			///< other location of line, for undoSetLine
+	union
+	{
+		uint64_t	offset;
+		char	   *data;
+	}
+	position;							///< other position of line, for undoSetLine
+	size_t			length;				///< other length of line, for undoSetLine
 }
 undorec_t;
 
+/// Deleted text of an undoText record
+#define UNDO_DELETED_TEXT(rec)		((uint8_t*)(rec) + sizeof(undorec_t))
+
+/// Inserted text of an undoText record
+#define UNDO_INSERTED_TEXT(rec)		(UNDO_DELETED_TEXT(rec) + (rec)->deleted)
+
+/// A chunk of the undo arena
+///
+typedef struct tag_undo_chunk
+{
+	uint8_t		   *data;				///< records, NULL if spilled
+	size_t			size;				///< bytes allocated for records, when in memory
+	size_t			used;				///< bytes of records in chunk
+	size_t			last;				///< offset of last record in chunk
+	uint64_t		spill_offset;		///< offset of records in spill file, if spilled
+	struct tag_undo_chunk *prev;		///< previous (older) chunk
+	struct tag_undo_chunk *next;		///< next (newer) chunk
+}
+undo_chunk_t;
+
+/// Callback to free a line dropped from an undo log
+///
+/// @param[in] priv - caller's context
+/// @param[in] line - line to free
+///
+typedef void (*undo_free_line_t)(void *priv, line_t *line);
+
+/// Undo log - the undo/redo history of a buffer
+///
+typedef struct tag_undo_log
+{
+	undo_chunk_t   *head;				///< oldest chunk
+	undo_chunk_t   *tail;				///< newest chunk
+	undo_chunk_t   *cursor_chunk;		///< chunk holding the cursor
+	size_t			cursor_offset;		///< offset of the cursor in its chunk
+	size_t			records;			///< count of records in log
+	size_t			memory;				///< bytes of chunks and line content in memory
+	size_t			memory_cap;			///< bytes of memory to hold before spilling
+	file_t		   *spill_out;			///< spill file, for writing
+	file_t		   *spill_in;			///< spill file, for reading
+	char			spill_url[MAX_PATH];///< url of spill file
+	uint64_t		spill_size;			///< bytes written to spill file
+	bool			spill_failed;		///< spill file couldn't be made or written
+	int				group_depth;		///< nesting of edit groups
+	bool			group_started;		///< next record added is the first of a group
+	bool			can_merge;			///< the record before the cursor can take more keystrokes
+	undo_free_line_t free_line;			///< frees lines dropped from the log, NULL to destroy them
+	void		   *free_line_priv;		///< context for free_line
+}
+undo_log_t;
+
+/// \brief Create an empty undo log
+///
+/// @return new log or NULL if no memory
+///
+undo_log_t *undo_log_create(void);
+
+/// \brief Destroy an undo log, freeing any lines its records own
+///
+/// @param[in] log - log to destroy
+///
+void undo_log_destroy(undo_log_t *log);
+
+/// \brief Empty an undo log, freeing any lines its records own
+///
+/// @param[in] log - log to clear
+///
+void undo_log_clear(undo_log_t *log);
+
+/// \brief Record a text edit
+///
+/// Discards any records that could be redone. If the edit continues the
+/// one recorded last, as typing or deleting characters one at a time
+/// does, it is merged into that record instead of adding another
+///
+/// @param[in] log      - log to add to
+/// @param[in] line     - line edited
+/// @param[in] column   - byte offset of edit in line's utf-8 text
+/// @param[in] deleted  - bytes removed from the line, may be NULL if ndeleted is 0
+/// @param[in] ndeleted - count of bytes removed
+/// @param[in] inserted - bytes inserted in the line, may be NULL if ninserted is 0
+/// @param[in] ninserted- count of bytes inserted
+///
+/// @return 0 on success, < 0 if no memory
+///
+int undo_add_text(undo_log_t *log, size_t line, size_t column,
+				const uint8_t *deleted, size_t ndeleted, const uint8_t *inserted, size_t ninserted);
+
+/// \brief Record lines linked into or unlinked from a buffer
+///
+/// @param[in] log   - log to add to
+/// @param[in] type  - undoInsertLines or undoDeleteLines
+/// @param[in] line  - line number of the first line
+/// @param[in] count - count of lines
+/// @param[in] first - first line of chain
+/// @param[in] last  - last line of chain
+///
+/// @return 0 on success, < 0 if no memory
+///
+int undo_add_lines(undo_log_t *log, undo_type_t type, size_t line, size_t count, line_t *first, line_t *last);
+
+/// \brief Record a line's content, before it is replaced
+///
+/// The record takes ownership of the line's current in-memory data, if
+/// any, so the caller must not free it when replacing the line's content
+///
+/// @param[in] log     - log to add to
+/// @param[in] linenum - line number of line
+/// @param[in] line    - the line
+///
+/// @return 0 on success, < 0 if no memory
+///
+int undo_add_line_content(undo_log_t *log, size_t linenum, const line_t *line);
+
+/// \brief Swap a line's content with that held by an undoSetLine record
+///
+/// @param[in] log  - log record is in
+/// @param[in] rec  - the record, before the cursor after an undo, else after it
+/// @param[in] line - line the record is for
+///
+/// @return 0 on success, < 0 if spilled content can't be read back
+///
+int undo_swap_line_content(undo_log_t *log, undorec_t *rec, line_t *line);
+
+/// \brief Set the memory a log can hold before spilling older records to disk
+///
+/// @param[in] log - log to set cap for
+/// @param[in] cap - bytes, 0 for default
+///
+void undo_log_set_memory_cap(undo_log_t *log, size_t cap);
+
+/// \brief Set how lines dropped from a log are freed
+///
+/// For when something other than the log may still be reading them
+///
+/// @param[in] log       - log to set
+/// @param[in] free_line - callback to free a line, NULL to destroy them at once
+/// @param[in] priv      - context for callback
+///
+void undo_log_set_line_free(undo_log_t *log, undo_free_line_t free_line, void *priv);
+
+/// \brief Set the memory all logs together can hold before spilling to disk
+///
+/// @param[in] cap - bytes, 0 for default
+///
+void undo_set_global_memory_cap(size_t cap);
+
+/// \brief Get the memory held by all logs
+///
+/// @return bytes of memory
+///
+size_t undo_global_memory(void);
+
+/// \brief Start a group of records which are undone and redone as one
+///
+/// Groups can nest, only the outermost group counts
+///
+/// @param[in] log - log to group in
+///
+void undo_begin_group(undo_log_t *log);
+
+/// \brief End a group of records started by ::undo_begin_group
+///
+/// @param[in] log - log to group in
+///
+void undo_end_group(undo_log_t *log);
+
+/// \brief Stop further edits merging into the last record
+///
+/// Call when the edit position moves, so typing after that is undone separately
+///
+/// @param[in] log - log to seal
+///
+void undo_seal(undo_log_t *log);
+
+/// \brief Move back over the record before the cursor
+///
+/// @param[in] log - log to step in
+///
+/// @return the record to undo, or NULL if there is none
+///
+undorec_t *undo_step_back(undo_log_t *log);
+
+/// \brief Move forward over the record after the cursor
+///
+/// @param[in] log - log to step in
+///
+/// @return the record to redo, or NULL if there is none
+///
+undorec_t *undo_step_forward(undo_log_t *log);
+
+/// \brief Get the record after the cursor without moving
+///
+/// @param[in] log - log to look in
+///
+/// @return the record that would be redone next, or NULL if there is none
+///
+undorec_t *undo_peek_forward(undo_log_t *log);
+
 #endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bversion.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// \brief Bucket of a line in the table of versions
+///
+static size_t version_hash(const version_store_t *store, const line_t *line)
+{
+    uint64_t h = (uint64_t)(uintptr_t)line;
+
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (store->table_size - 1);
+}
+
+/// \brief Find the newest version of a line, and the link to it in its bucket
+///
+static line_version_t *version_find(version_store_t *store, const line_t *line, line_version_t ***link)
+{
+    line_version_t **plink;
+
+    if (! store->table)
+    {
+        return NULL;
+    }
+    for (plink = &store->table[version_hash(store, line)]; *plink; plink = &(*plink)->chain)
+    {
+        if ((*plink)->line == line)
+        {
+            if (link)
+            {
+                *link = plink;
+            }
+            return *plink;
+        }
+    }
+    return NULL;
+}
+
+/// \brief Free a version and the content it owns
+///
+static void version_free(version_store_t *store, line_version_t *version)
+{
+    store->memory -= sizeof(line_version_t);
+    if (version->state.location != lineInFile && version->state.position.data)
+    {
+        store->memory -= line_data_size(&version->state);
+        free(version->state.position.data);
+    }
+    store->versions--;
+    free(version);
+}
+
+/// \brief Double the buckets in the table of versions
+///
+static void version_grow_table(version_store_t *store)
+{
+    line_version_t **table;
+    line_version_t **old;
+    line_version_t *version;
+    line_version_t *next;
+    size_t old_size;
+    size_t i;
+    size_t h;
+
+    old = store->table;
+    old_size = store->table_size;
+    table = (line_version_t**)calloc(old_size * 2, sizeof(line_version_t*));
+    if (! table)
+    {
+        // keep the longer chains
+        return;
+    }
+    store->table = table;
+    store->table_size = old_size * 2;
+
+    for (i = 0; i < old_size; i++)
+    {
+        for (version = old[i]; version; version = next)
+        {
+            next = version->chain;
+            h = version_hash(store, version->line);
+            version->chain = table[h];
+            table[h] = version;
+        }
+    }
+    free(old);
+}
+
+/// \brief Is there a live snapshot with a generation in a range
+///
+static bool version_seen(const version_store_t *store, uint32_t after, uint32_t upto)
+{
+    size_t i;
+
+    for (i = 0; i < store->nlive; i++)
+    {
+        if (store->live[i] > after)
+        {
+            return store->live[i] <= upto;
+        }
+    }
+    return false;
+}
+
+/// \brief Free versions and buried lines no live snapshot can see
+///
+static void version_sweep(version_store_t *store)
+{
+    line_version_t **plink;
+    line_version_t **pversion;
+    line_version_t *head;
+    line_version_t *version;
+    size_t i;
+    size_t kept;
+
+    for (i = 0; store->table && i < store->table_size; i++)
+    {
+        plink = &store->table[i];
+        while (*plink)
+        {
+            head = *plink;
+
+            // free unseen versions past the newest one first
+            //
+            pversion = &head->older;
+            while (*pversion)
+            {
+                version = *pversion;
+                if (version_seen(store, version->from, version->to))
+                {
+                    pversion = &version->older;
+                }
+                else
+                {
+                    *pversion = version->older;
+                    version_free(store, version);
+                }
+            }
+            if (version_seen(store, head->from, head->to))
+            {
+                plink = &head->chain;
+                continue;
+            }
+            // newest is unseen, the next older one takes its place in the chain
+            //
+            version = head->older;
+            if (version)
+            {
+                version->chain = head->chain;
+                *plink = version;
+            }
+            else
+            {
+                *plink = head->chain;
+            }
+            version_free(store, head);
+        }
+    }
+    // a buried line can be reached by snapshots at or before its death
+    //
+    for (i = 0, kept = 0; i < store->nburied; i++)
+    {
+        if (store->nlive && store->live[0] <= store->buried[i].died)
+        {
+            store->buried[kept++] = store->buried[i];
+        }
+        else
+        {
+            store->memory -= sizeof(line_t) + line_data_size(store->buried[i].line);
+            line_destroy(store->buried[i].line);
+        }
+    }
+    store->nburied = kept;
+}
+
+void version_store_init(version_store_t *store)
+{
+    memset(store, 0, sizeof(version_store_t));
+    pthread_mutex_init(&store->lock, NULL);
+}
+
+void version_store_deinit(version_store_t *store)
+{
+    if (! store)
+    {
+        return;
+    }
+    if (store->nlive)
+    {
+        butil_log(0, "%s: %u snapshots still open\n", __FUNCTION__, (unsigned)store->nlive);
+    }
+    store->nlive = 0;
+    version_sweep(store);
+    if (store->table)
+    {
+        free(store->table);
+    }
+    if (store->live)
+    {
+        free(store->live);
+    }
+    if (store->buried)
+    {
+        free(store->buried);
+    }
+    pthread_mutex_destroy(&store->lock);
+}
+
+int version_open(version_store_t *store, uint32_t *generation)
+{
+    uint32_t *live;
+
+    pthread_mutex_lock(&store->lock);
+    if (! store->table)
+    {
+        store->table = (line_version_t**)calloc(VERSION_TABLE_SIZE, sizeof(line_version_t*));
+        if (! store->table)
+        {
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+        store->table_size = VERSION_TABLE_SIZE;
+    }
+    if (store->nlive >= store->live_size)
+    {
+        live = (uint32_t*)realloc(store->live, (store->live_size + 8) * sizeof(uint32_t));
+        if (! live)
+        {
+            pthread_mutex_unlock(&store->lock);
+            return -1;
+        }
+        store->live = live;
+        store->live_size += 8;
+    }
+    // lines changed from now on are saved for this generation
+    //
+    store->generation++;
+    store->live[store->nlive++] = store->generation;
+    *generation = store->generation;
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+void version_close(version_store_t *store, uint32_t generation)
+{
+    size_t i;
+
+    pthread_mutex_lock(&store->lock);
+    for (i = 0; i < store->nlive; i++)
+    {
+        if (store->live[i] == generation)
+        {
+            memmove(store->live + i, store->live + i + 1, (store->nlive - i - 1) * sizeof(uint32_t));
+            store->nlive--;
+            break;
+        }
+    }
+    version_sweep(store);
+    pthread_mutex_unlock(&store->lock);
+}
+
+int version_preserve(version_store_t *store, line_t *line)
+{
+    line_version_t *version;
+    line_version_t **link;
+    line_version_t *newest;
+    size_t h;
+
+    if (! line)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&store->lock);
+
+    // nothing to save if no live snapshot sees the line as it is
+    //
+    if (! store->nlive || store->live[store->nlive - 1] <= line->generation)
+    {
+        line->generation = store->generation;
+        pthread_mutex_unlock(&store->lock);
+        return 0;
+    }
+    version = (line_version_t*)malloc(sizeof(line_version_t));
+    if (! version)
+    {
+        pthread_mutex_unlock(&store->lock);
+        butil_log(0, "%s: Can't alloc version\n", __FUNCTION__);
+        return -1;
+    }
+    version->state = *line;
+    if (line->location != lineInFile && line->position.data)
+    {
+        version->state.position.data = (char*)malloc(line_data_size(line));
+        if (! version->state.position.data)
+        {
+            free(version);
+            pthread_mutex_unlock(&store->lock);
+            butil_log(0, "%s: Can't alloc version\n", __FUNCTION__);
+            return -1;
+        }
+        memcpy(version->state.position.data, line->position.data, line_data_size(line));
+        store->memory += line_data_size(line);
+    }
+    version->line = line;
+    version->from = line->generation;
+    version->to = store->generation;
+
+    // the new version replaces any older one at the head of the line's versions
+    //
+    newest = version_find(store, line, &link);
+    if (newest)
+    {
+        version->older = newest;
+        version->chain = newest->chain;
+        newest->chain = NULL;
+        *link = version;
+    }
+    else
+    {
+        h = version_hash(store, line);
+        version->older = NULL;
+        version->chain = store->table[h];
+        store->table[h] = version;
+    }
+    store->versions++;
+    store->memory += sizeof(line_version_t);
+    line->generation = store->generation;
+
+    if (store->versions > store->table_size * 2)
+    {
+        version_grow_table(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+void version_bury(version_store_t *store, line_t *line)
+{
+    buried_line_t *buried;
+
+    if (! line)
+    {
+        return;
+    }
+    pthread_mutex_lock(&store->lock);
+    if (! store->nlive)
+    {
+        pthread_mutex_unlock(&store->lock);
+        line_destroy(line);
+        return;
+    }
+    if (store->nburied >= store->buried_size)
+    {
+        buried = (buried_line_t*)realloc(store->buried, (store->buried_size * 2 + 64) * sizeof(buried_line_t));
+        if (! buried)
+        {
+            // leaking the line is better than a snapshot reading freed memory
+            pthread_mutex_unlock(&store->lock);
+            butil_log(0, "%s: Can't keep line, leaked\n", __FUNCTION__);
+            return;
+        }
+        store->buried = buried;
+        store->buried_size = store->buried_size * 2 + 64;
+    }
+    store->buried[store->nburied].line = line;
+    store->buried[store->nburied].died = store->generation;
+    store->nburied++;
+    store->memory += sizeof(line_t) + line_data_size(line);
+    pthread_mutex_unlock(&store->lock);
+}
+
+int version_resolve(version_store_t *store, uint32_t generation, const line_t *line, line_t *state,
+                    uint8_t **data, size_t *data_size)
+{
+    const line_t *source;
+    line_version_t *version;
+    uint8_t *newdata;
+    size_t size;
+
+    if (! line)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&store->lock);
+    source = NULL;
+    if (line->generation < generation)
+    {
+        source = line;
+    }
+    else
+    {
+        for (version = version_find(store, line, NULL); version; version = version->older)
+        {
+            if (version->from < generation)
+            {
+                source = &version->state;
+                break;
+            }
+        }
+    }
+    if (! source)
+    {
+        pthread_mutex_unlock(&store->lock);
+        butil_log(0, "%s: Line has no version for generation %u\n", __FUNCTION__, generation);
+        return -1;
+    }
+    *state = *source;
+    if (source->location != lineInFile)
+    {
+        // pieces are copied whole, they don't point into themselves
+        //
+        size = (source->location == lineInMemory) ? source->length + 1 : line_data_size(source);
+        if (*data_size < size || ! *data)
+        {
+            newdata = (uint8_t*)realloc(*data, size);
+            if (! newdata)
+            {
+                pthread_mutex_unlock(&store->lock);
+                return -1;
+            }
+            *data = newdata;
+            *data_size = size;
+        }
+        if (source->position.data)
+        {
+            memcpy(*data, source->position.data, size);
+        }
+        else
+        {
+            (*data)[0] = '\0';
+        }
+        state->position.data = (char*)*data;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
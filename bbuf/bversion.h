@@ -0,0 +1,143 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BVERSION_H
+#define BVERSION_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bline.h"
+
+/// \file
+///
+/// A version store lets snapshots of a list of lines share the lines
+/// with the live list. Each snapshot is a generation. Before the live
+/// list changes a line that a snapshot can see, the line's state, its
+/// links and a copy of any in-memory content, is saved as a version of
+/// the line, which the snapshot reads instead of the line itself. Lines
+/// freed by the live list are kept until no snapshot can reach them
+///
+/// Snapshots may be read on other threads while the live list is
+/// changed, so lines are only read through ::version_resolve, which
+/// copies a consistent state of the line under the store's lock
+
+/// Initial buckets in the table of versions, a power of 2
+#define VERSION_TABLE_SIZE			(1024)
+
+/// A saved state of a line
+///
+typedef struct tag_line_version
+{
+	line_t			state;				///< the line as it was, data is owned by the version
+	const line_t   *line;				///< line this is a version of
+	uint32_t		from;				///< generation the state was made in
+	uint32_t		to;					///< newest generation that sees the state
+	struct tag_line_version *older;		///< next older version of the same line
+	struct tag_line_version *chain;		///< next line's versions in the same bucket
+}
+line_version_t;
+
+/// A line freed by the live list, waiting for snapshots that can reach it
+///
+typedef struct tag_buried_line
+{
+	line_t		   *line;				///< the line
+	uint32_t		died;				///< generation when it was freed
+}
+buried_line_t;
+
+/// Version store - versions of a list of lines seen by its snapshots
+///
+typedef struct tag_version_store
+{
+	pthread_mutex_t	lock;				///< protects all of the store, and line attributes changed outside of edits
+	uint32_t		generation;			///< snapshots taken so far
+	uint32_t	   *live;				///< generations of snapshots not yet closed, oldest first
+	size_t			nlive;				///< count of live snapshots
+	size_t			live_size;			///< entries allocated for live
+	line_version_t **table;				///< newest version of each line, hashed by line
+	size_t			table_size;			///< buckets in table
+	size_t			versions;			///< count of versions held
+	size_t			memory;				///< bytes held by versions and buried lines
+	buried_line_t  *buried;				///< lines waiting to be freed
+	size_t			nburied;			///< count of buried lines
+	size_t			buried_size;		///< entries allocated for buried
+}
+version_store_t;
+
+/// \brief Set up an empty version store
+///
+/// @param[in] store - store to set up
+///
+void version_store_init(version_store_t *store);
+
+/// \brief Free all of a version store
+///
+/// @param[in] store - store to free, which must have no live snapshots
+///
+void version_store_deinit(version_store_t *store);
+
+/// \brief Start a snapshot of the lines as they are now
+///
+/// @param[in]  store      - store of list
+/// @param[out] generation - gets generation of snapshot
+///
+/// @return 0 on success, < 0 if no memory
+///
+int version_open(version_store_t *store, uint32_t *generation);
+
+/// \brief End a snapshot, freeing what only it was holding
+///
+/// @param[in] store      - store of list
+/// @param[in] generation - generation of snapshot
+///
+void version_close(version_store_t *store, uint32_t generation);
+
+/// \brief Save a line's state before the live list changes it
+///
+/// Call before changing any of a line's content, location or links. A
+/// line made by the live list should have its generation set to the
+/// store's generation, so it isn't saved for snapshots that can't see it
+///
+/// @param[in] store - store of list
+/// @param[in] line  - line about to change
+///
+/// @return 0 on success, < 0 if no memory
+///
+int version_preserve(version_store_t *store, line_t *line);
+
+/// \brief Free a line the live list is done with, or once no snapshot can reach it
+///
+/// @param[in] store - store of list
+/// @param[in] line  - line to free, no longer linked in the live list
+///
+void version_bury(version_store_t *store, line_t *line);
+
+/// \brief Get the state of a line as a snapshot sees it
+///
+/// @param[in]     store      - store of list
+/// @param[in]     generation - generation of snapshot
+/// @param[in]     line       - line in the snapshot
+/// @param[out]    state      - gets state of line, with position.data pointing at data if not in the file
+/// @param[in,out] data       - buffer that gets a copy of in-memory content or pieces, realloced as needed
+/// @param[in,out] data_size  - bytes allocated for data
+///
+/// @return 0 on success, < 0 on error
+///
+int version_resolve(version_store_t *store, uint32_t generation, const line_t *line, line_t *state,
+					uint8_t **data, size_t *data_size);
+
+#endif
@@ -17,6 +17,8 @@
 #include "bfile_file.h"
 #include "bfile_http.h"
 #include "bfile_ftp.h"
+#include "bfile_zstream.h"
+#include "bfilesys.h"
 #include "butil.h"
 
 /// \file
@@ -78,6 +80,7 @@ file_t *file_create_with_credentials(const char *url, open_attribute_t open_for,
         return NULL;
     }
     file->position = 0;
+    file->opened_for = open_for;
     result = -1;
     
     scheme = file_get_scheme(url, path, sizeof(path));
@@ -113,7 +116,23 @@ file_t *file_create_with_credentials(const char *url, open_attribute_t open_for,
         butil_log(1, "Unsupported scheme %s for %s\n", butil_scheme_name(scheme), __FUNCTION__);
         break;
     }
+    // compressed files are read as the bytes they decompress to
+    //
+    if (! result && open_for == openForRead && file_zstream_wanted(file->url))
+    {
+        result = file_zstream_setup(file);
+        if (result)
+        {
+            file->file_close(file);
+        }
+    }
     
+    // info got about a file opened to write is out of date
+    //
+    if (open_for != openForRead)
+    {
+        filesys_forget_info(url);
+    }
     if (result)
     {
         butil_log(2, "Can't access url %s\n", url);
@@ -141,6 +160,10 @@ void file_destroy(file_t *file)
     {
         file->file_close(file);
     }
+    if (file->opened_for != openForRead)
+    {
+        filesys_forget_info(file->url);
+    }
     free(file);
 }
 
@@ -251,7 +274,7 @@ text_encoding_t file_sniff_encoding(uint8_t *data, size_t size)
     nbad_encodings = 0;
     nlow_binary = 0;
     
-    for (i = 0; i < size - 6; i++)
+    for (i = 0; (i + 6) < size; i++)
     {
         byte = data[i];
         if ((byte & 0x80) == 0x80)
@@ -110,6 +110,16 @@ typedef int (*file_write_t)(struct tag_file *file, uint8_t *buffer, size_t count
 ///
 typedef int (*file_seek_t)(struct tag_file *file, uint64_t position);
 
+/// File Sync function
+///
+/// \brief Make sure data written to a file is on stable storage
+///
+/// @param[in] file          - file to sync as returned from ::file_create
+///
+/// @return < 0 on error, 0 on success
+///
+typedef int (*file_sync_t)(struct tag_file *file);
+
 /// File - an object that provides methods for open/read/write/close/delete/rename
 ///        to access file data. 
 ///
@@ -121,8 +131,10 @@ typedef struct tag_file
 	file_read_t		file_read;			///< function to read
 	file_write_t	file_write;			///< function to write
 	file_seek_t		file_seek;			///< function to seek
+	file_sync_t		file_sync;			///< function to sync written data to storage
 	// private
 	uint64_t		position;			///< current position in file (seek)
+	open_attribute_t opened_for;		///< how the file was opened
 	void           *priv;				///< per-object private context
 }
 file_t;
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfile_cache.h"
+#include "butil.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/// \file
+///
+
+/// \brief The cache's directory and limit
+///
+static struct
+{
+    pthread_mutex_t lock;           ///< guards the directory's content
+    char            dir[MAX_PATH];  ///< directory, empty if the cache is off
+    uint64_t        limit;          ///< most bytes of bodies kept
+}
+s_cache = { PTHREAD_MUTEX_INITIALIZER, "", FILE_CACHE_LIMIT };
+
+/// \brief A cached body, when choosing which to remove
+///
+typedef struct tag_cache_item
+{
+    char        name[32];           ///< name of its meta file
+    uint64_t    used;               ///< nanosecond it was last used
+    uint64_t    size;               ///< bytes of body
+}
+cache_item_t;
+
+/// \brief Make the paths of the body and meta files of a url, the cache is locked
+///
+/// Files are named by a hash of the url, the url is kept in the meta file
+///
+static void cache_paths(const char *url, char *body, char *meta, size_t npath)
+{
+    uint64_t hash;
+    const char *pc;
+
+    // FNV-1a
+    //
+    hash = 14695981039346656037ULL;
+    for (pc = url; *pc; pc++)
+    {
+        hash ^= (uint8_t)*pc;
+        hash *= 1099511628211ULL;
+    }
+    snprintf(body, npath, "%s/%016llx.body", s_cache.dir, (unsigned long long)hash);
+    snprintf(meta, npath, "%s/%016llx.meta", s_cache.dir, (unsigned long long)hash);
+}
+
+/// \brief Note a body as just used, by the time of its meta file
+///
+/// The time is set from the clock rather than left to the file system,
+/// which can give the same time to files touched close together
+///
+static void cache_touch(const char *meta)
+{
+    struct timespec times[2];
+
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[1] = times[0];
+    utimensat(AT_FDCWD, meta, times, 0);
+}
+
+/// \brief Order cached bodies by when they were last used
+///
+static int cache_compare(const void *a, const void *b)
+{
+    uint64_t used_a = ((const cache_item_t *)a)->used;
+    uint64_t used_b = ((const cache_item_t *)b)->used;
+
+    return (used_a < used_b) ? -1 : (used_a > used_b) ? 1 : 0;
+}
+
+/// \brief Remove the bodies used least recently until the rest fit in the limit, the cache is locked
+///
+/// @param[in] keep - name of meta file of a body not to remove, may be NULL
+///
+static void cache_evict(const char *keep)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat fstate;
+    cache_item_t *items;
+    cache_item_t *more;
+    size_t count;
+    size_t alloced;
+    size_t length;
+    size_t i;
+    uint64_t total;
+    char path[MAX_PATH + 40];
+
+    dir = opendir(s_cache.dir);
+    if (! dir)
+    {
+        return;
+    }
+    items = NULL;
+    count = 0;
+    alloced = 0;
+    total = 0;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        length = strlen(entry->d_name);
+        if (length < 6 || length >= sizeof(items->name) || strcmp(entry->d_name + length - 5, ".meta"))
+        {
+            continue;
+        }
+        if (count >= alloced)
+        {
+            alloced = alloced ? alloced * 2 : 64;
+            more = (cache_item_t *)realloc(items, alloced * sizeof(cache_item_t));
+            if (! more)
+            {
+                break;
+            }
+            items = more;
+        }
+        snprintf(path, sizeof(path), "%s/%s", s_cache.dir, entry->d_name);
+        if (stat(path, &fstate))
+        {
+            continue;
+        }
+        strcpy(items[count].name, entry->d_name);
+        items[count].used = (uint64_t)fstate.st_mtim.tv_sec * 1000000000 + (uint64_t)fstate.st_mtim.tv_nsec;
+
+        snprintf(path + strlen(path) - 5, 6, ".body");
+        items[count].size = stat(path, &fstate) ? 0 : (uint64_t)fstate.st_size;
+        total += items[count].size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > s_cache.limit)
+    {
+        qsort(items, count, sizeof(cache_item_t), cache_compare);
+        for (i = 0; i < count && total > s_cache.limit; i++)
+        {
+            if (keep && ! strcmp(items[i].name, keep))
+            {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", s_cache.dir, items[i].name);
+            unlink(path);
+            snprintf(path + strlen(path) - 5, 6, ".body");
+            unlink(path);
+            total -= items[i].size;
+            butil_log(4, "%s: Removed %s\n", __FUNCTION__, path);
+        }
+    }
+    free(items);
+}
+
+/// \brief Copy a file
+///
+/// @return 0 on success
+///
+static int cache_copy(const char *from, const char *to)
+{
+    uint8_t data[64*1024];
+    ssize_t got;
+    int in;
+    int out;
+    int result;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+    {
+        return -1;
+    }
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0)
+    {
+        close(in);
+        return -1;
+    }
+    result = 0;
+    while ((got = read(in, data, sizeof(data))) > 0)
+    {
+        if (write(out, data, got) != got)
+        {
+            result = -1;
+            break;
+        }
+    }
+    if (got < 0)
+    {
+        result = -1;
+    }
+    close(in);
+    if (close(out))
+    {
+        result = -1;
+    }
+    return result;
+}
+
+int file_cache_set_dir(const char *dir)
+{
+    int result;
+
+    pthread_mutex_lock(&s_cache.lock);
+    s_cache.dir[0] = '\0';
+    result = 0;
+    if (dir && dir[0])
+    {
+        if (mkdir(dir, 0700) && errno != EEXIST)
+        {
+            butil_log(1, "%s: Can't make cache directory %s\n", __FUNCTION__, dir);
+            result = -1;
+        }
+        else
+        {
+            strncpy(s_cache.dir, dir, sizeof(s_cache.dir) - 64);
+            s_cache.dir[sizeof(s_cache.dir) - 64] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+    return result;
+}
+
+void file_cache_set_limit(uint64_t limit)
+{
+    pthread_mutex_lock(&s_cache.lock);
+    s_cache.limit = limit;
+    if (s_cache.dir[0])
+    {
+        cache_evict(NULL);
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+}
+
+bool file_cache_enabled(void)
+{
+    bool enabled;
+
+    pthread_mutex_lock(&s_cache.lock);
+    enabled = (s_cache.dir[0] != '\0');
+    pthread_mutex_unlock(&s_cache.lock);
+    return enabled;
+}
+
+int file_cache_lookup(const char *url, file_cache_entry_t *entry, char *path, size_t npath)
+{
+    FILE *in;
+    struct stat fstate;
+    char body[MAX_PATH + 40];
+    char meta[MAX_PATH + 40];
+    char line[MAX_PATH + 16];
+    size_t length;
+    bool same_url;
+    int result;
+
+    if (!url || !entry || !path || !npath)
+    {
+        return -1;
+    }
+    memset(entry, 0, sizeof(file_cache_entry_t));
+
+    pthread_mutex_lock(&s_cache.lock);
+    if (! s_cache.dir[0])
+    {
+        pthread_mutex_unlock(&s_cache.lock);
+        return -1;
+    }
+    cache_paths(url, body, meta, sizeof(body));
+
+    in = fopen(meta, "r");
+    if (! in)
+    {
+        pthread_mutex_unlock(&s_cache.lock);
+        return -1;
+    }
+    same_url = false;
+    while (fgets(line, sizeof(line), in))
+    {
+        length = strlen(line);
+        if (length && line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if (! strncmp(line, "url ", 4))
+        {
+            same_url = ! strcmp(line + 4, url);
+        }
+        else if (! strncmp(line, "etag ", 5))
+        {
+            snprintf(entry->etag, sizeof(entry->etag), "%s", line + 5);
+        }
+        else if (! strncmp(line, "modified ", 9))
+        {
+            snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", line + 9);
+        }
+        else if (! strncmp(line, "size ", 5))
+        {
+            entry->size = strtoull(line + 5, NULL, 10);
+        }
+        else if (! strncmp(line, "mtime ", 6))
+        {
+            entry->mod_time = (time_t)strtoll(line + 6, NULL, 10);
+        }
+    }
+    fclose(in);
+
+    // a body cut short, or another url's with the same hash, is no use
+    //
+    result = -1;
+    if (same_url && ! stat(body, &fstate) && (uint64_t)fstate.st_size == entry->size)
+    {
+        cache_touch(meta);
+        snprintf(path, npath, "%s", body);
+        result = 0;
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+    return result;
+}
+
+int file_cache_store(const char *url, const char *local_path, const file_cache_entry_t *entry, char *path, size_t npath)
+{
+    FILE *out;
+    struct stat fstate;
+    char body[MAX_PATH + 40];
+    char meta[MAX_PATH + 40];
+    char temp[MAX_PATH + 48];
+    bool copied;
+    int result;
+
+    if (!url || !local_path || !entry || stat(local_path, &fstate))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&s_cache.lock);
+    if (! s_cache.dir[0] || (uint64_t)fstate.st_size > s_cache.limit)
+    {
+        pthread_mutex_unlock(&s_cache.lock);
+        return -1;
+    }
+    cache_paths(url, body, meta, sizeof(body));
+
+    // the body is moved in, or copied in if in another file system
+    //
+    unlink(meta);
+    copied = false;
+    result = rename(local_path, body);
+    if (result && errno == EXDEV)
+    {
+        snprintf(temp, sizeof(temp), "%s.part", body);
+        result = cache_copy(local_path, temp);
+        if (! result)
+        {
+            result = rename(temp, body);
+        }
+        if (result)
+        {
+            unlink(temp);
+        }
+        copied = ! result;
+    }
+    if (result)
+    {
+        butil_log(2, "%s: Can't keep %s\n", __FUNCTION__, url);
+        pthread_mutex_unlock(&s_cache.lock);
+        return -1;
+    }
+    // the meta file is written last, so a body is only used once whole
+    //
+    snprintf(temp, sizeof(temp), "%s.part", meta);
+    out = fopen(temp, "w");
+    if (out)
+    {
+        fprintf(out, "url %s\netag %s\nmodified %s\nsize %llu\nmtime %lld\n", url,
+                entry->etag, entry->last_modified, (unsigned long long)fstate.st_size, (long long)entry->mod_time);
+        if (fclose(out) || rename(temp, meta))
+        {
+            unlink(temp);
+            result = -1;
+        }
+        else
+        {
+            cache_touch(meta);
+        }
+    }
+    else
+    {
+        result = -1;
+    }
+    if (result)
+    {
+        // a body without its meta file is never used, so put it back
+        //
+        butil_log(2, "%s: Can't note %s\n", __FUNCTION__, url);
+        if (copied || rename(body, local_path))
+        {
+            unlink(body);
+        }
+        pthread_mutex_unlock(&s_cache.lock);
+        return -1;
+    }
+    if (copied)
+    {
+        unlink(local_path);
+    }
+    if (path && npath)
+    {
+        snprintf(path, npath, "%s", body);
+    }
+    cache_evict(strrchr(meta, '/') + 1);
+    pthread_mutex_unlock(&s_cache.lock);
+    butil_log(4, "%s: Kept %s\n", __FUNCTION__, url);
+    return 0;
+}
+
+void file_cache_drop(const char *url)
+{
+    char body[MAX_PATH + 40];
+    char meta[MAX_PATH + 40];
+
+    if (! url)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_cache.lock);
+    if (s_cache.dir[0])
+    {
+        cache_paths(url, body, meta, sizeof(body));
+        unlink(meta);
+        unlink(body);
+    }
+    pthread_mutex_unlock(&s_cache.lock);
+}
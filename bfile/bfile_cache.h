@@ -0,0 +1,111 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFILE_CACHE_H
+#define BFILE_CACHE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "bfile.h"
+
+/// \file
+///
+/// A cache, in a directory kept between runs, of remote files read
+///
+/// Each url's body is kept with what tells if it changed: for http:// the
+/// ETag and Last-Modified of the response it came in, for ftp:// its size
+/// and modification time from SIZE and MDTM. Opening a cached http:// url
+/// asks for it with If-None-Match and If-Modified-Since, and a 304 reply
+/// reads the cached body. Opening a cached ftp:// url reads the cached
+/// body if SIZE and MDTM say the same as when it was cached
+///
+/// The cache is off until a directory is set with ::file_cache_set_dir.
+/// When the bodies in it add up to more than its limit, those used least
+/// recently are removed
+
+/// Default most bytes of bodies kept
+#define FILE_CACHE_LIMIT			(256*1024*1024)
+
+/// What tells if a cached body is still the file's
+///
+typedef struct tag_file_cache_entry
+{
+	char			etag[128];			///< http ETag, empty if none
+	char			last_modified[64];	///< http Last-Modified, empty if none
+	uint64_t		size;				///< size of body
+	time_t			mod_time;			///< ftp modification time, 0 if none
+}
+file_cache_entry_t;
+
+//-----------------------------------------------------------------------------
+/// \brief Set the directory the cache is kept in, making it if it needs to be
+///
+/// @param[in] dir - directory, NULL to turn the cache off
+///
+/// @return 0 on success
+///
+int file_cache_set_dir(const char *dir);
+
+//-----------------------------------------------------------------------------
+/// \brief Set the most bytes of bodies kept
+///
+/// @param[in] limit - bytes
+///
+void file_cache_set_limit(uint64_t limit);
+
+//-----------------------------------------------------------------------------
+/// \brief Check if the cache is on
+///
+bool file_cache_enabled(void);
+
+//-----------------------------------------------------------------------------
+/// \brief Look up a url in the cache
+///
+/// A url found is noted as just used
+///
+/// @param[in]  url   - url of file
+/// @param[out] entry - gets what tells if the body is still the file's
+/// @param[out] path  - gets path of cached body
+/// @param[in]  npath - bytes of room at path
+///
+/// @return 0 if found
+///
+int file_cache_lookup(const char *url, file_cache_entry_t *entry, char *path, size_t npath);
+
+//-----------------------------------------------------------------------------
+/// \brief Keep a local file as the cached body of a url
+///
+/// The local file is moved into the cache
+///
+/// @param[in]  url        - url of file
+/// @param[in]  local_path - local file holding the body
+/// @param[in]  entry      - what tells if the body is still the file's
+/// @param[out] path       - gets path of cached body, may be NULL
+/// @param[in]  npath      - bytes of room at path
+///
+/// @return 0 on success, non-0 if not kept and the local file is left as it was
+///
+int file_cache_store(const char *url, const char *local_path, const file_cache_entry_t *entry, char *path, size_t npath);
+
+//-----------------------------------------------------------------------------
+/// \brief Remove a url from the cache
+///
+/// @param[in] url - url of file
+///
+void file_cache_drop(const char *url);
+
+#endif
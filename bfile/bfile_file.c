@@ -66,6 +66,17 @@ static int file_file_seek(file_t *file, uint64_t position)
     return 0;
 }
 
+/// \brief Sync a file:// file
+///
+/// See ::file_sync_t for details
+///
+static int file_file_sync(file_t *file)
+{
+    int fd = (file ? (int)(uintptr_t)file->priv : -1);
+
+    return fsync(fd);
+}
+
 int file_file_setup(file_t *file, open_attribute_t open_for, credential_callback_t credential_callback)
 {
     int fd;
@@ -75,6 +86,7 @@ int file_file_setup(file_t *file, open_attribute_t open_for, credential_callback
     file->file_read     = file_file_read;
     file->file_write    = file_file_write;
     file->file_seek     = file_file_seek;
+    file->file_sync     = file_file_sync;
     
     // setup underlying stream
     switch (open_for)
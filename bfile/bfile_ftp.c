@@ -17,6 +17,9 @@
 #include "bfile.h"
 #include "bfilesys.h"
 #include "bftp.h"
+#include "bfile_writeback.h"
+#include "bfile_ftpio.h"
+#include "bfile_cache.h"
 #include "butil.h"
 
 /// \file
@@ -30,32 +33,84 @@ typedef struct tag_ftp_file
 	char local_path[MAX_PATH];		///< tempory file used to cache remote file content
 	file_t *file;					///< file open on local file path
 	credential_callback_t credential_callback;	///< callback to get user/pass
+	file_writeback_t writeback;		///< uploads writes to the local file, when opened to write
 }
 ftp_file_t;
 
+/// \brief Upload the local copy of a ftp:// file
+///
+/// See ::file_upload_t for details
+///
+static int file_ftp_upload(file_t *file)
+{
+	ftp_file_t *remote_file;
+	char user[64];
+	char pass[64];
+	int result;
+	
+	remote_file = (ftp_file_t*)file->priv;
+	
+	// get credentials for this url
+	//
+	user[0] = '\0';
+	pass[0] = '\0';
+	if (remote_file->credential_callback)
+	{
+		result = remote_file->credential_callback(file->url, user, sizeof(user), pass, sizeof(pass));
+		if (result)
+		{
+			user[0] = '\0';
+			pass[0] = '\0';
+		}
+	}
+	// do an ftp put of the local file to the remote file
+	//
+	result = bftp_put_file(
+					file->url,
+					remote_file->local_path,
+					user,
+					pass
+					);
+	if (result)
+	{
+		butil_log(1, "FTP Error putting %s\n", file->url);
+	}
+	return result;
+}
+
 /// \brief Close a ftp:// file
 ///
-/// See ::file_close_t for details
+/// Uploads the local copy if it was written since it last was,
+/// see ::file_close_t for details
 ///
 static int file_ftp_close(file_t *file)
 {
 	ftp_file_t *remote_file;
+	int result;
 
 	if (!file || !file->priv)
 	{
 		return -1;
 	}
 	remote_file = (ftp_file_t*)file->priv;
+	result = 0;
+	if (remote_file->writeback.upload)
+	{
+		result = file_writeback_flush(&remote_file->writeback);
+		file_writeback_deinit(&remote_file->writeback);
+	}
 	if (remote_file->file)
 	{
-		remote_file->file->file_close(file);
+		file_destroy(remote_file->file);
 		remote_file->file = NULL;
 	}
 	if (remote_file->local_path[0])
 	{
 		filesys_delete(remote_file->local_path);
 	}
-	return 0;
+	free(remote_file);
+	file->priv = NULL;
+	return result;
 }
 
 /// \brief Read a ftp:// file
@@ -80,71 +135,24 @@ static int file_ftp_read(file_t *file, uint8_t *buffer, size_t count)
 
 /// \brief Write a ftp:// file
 ///
-/// See ::file_write_t for details
+/// Writes go to the local file, which is uploaded on sync and close,
+/// see ::file_write_t for details
 ///
 static int file_ftp_write(file_t *file, uint8_t *buffer, size_t count)
 {
 	ftp_file_t *remote_file;
-	int result;
 	
 	if (!file || !file->priv)
 	{
 		return -1;
 	}
 	remote_file = (ftp_file_t*)file->priv;
-	if (remote_file->file)
+	if (! remote_file->writeback.upload)
 	{
-		result = remote_file->file->file_write(remote_file->file, buffer, count);
-		if (result)
-		{
-			return result;
-		}
-	}
-	if (remote_file->opened_for == openForWrite || remote_file->opened_for == openForAppend)
-	{
-		char user[64];
-		char pass[64];
-		
-		// get credentials for this url
-		//
-		user[0] = '\0';
-		pass[0] = '\0';
-		if (remote_file->credential_callback)
-		{
-			result = remote_file->credential_callback(file->url, user, sizeof(user), pass, sizeof(pass));
-			if (result)
-			{
-				user[0] = '\0';
-				pass[0] = '\0';
-			}
-		}
-		// close/flush the backing local file
-		//
-		remote_file->file->file_close(remote_file->file);
-		remote_file->file = NULL;
-		
-		// do an ftp put of the local file to the remote file
-		//
-	    result = bftp_put_file(
-	                    file->url,
-	                    remote_file->local_path,
-	                    user,
-	                    pass
-	                    );
-		if (result)
-		{
-			butil_log(1, "FTP Error putting %s\n", file->url);
-		}
-		// re-open the backing file
-		//
-		remote_file->file = file_create(remote_file->local_path, remote_file->opened_for);
-		if (! remote_file->file)
-		{
-			butil_log(1, "Can't re-open file at path %s\n", remote_file->local_path);
-			return -1;
-		}	
+		butil_log(1, "%s: %s is open for reading\n", __FUNCTION__, file->url);
+		return -1;
 	}
-    return result;
+	return file_writeback_write(&remote_file->writeback, buffer, count);
 }
 
 /// \brief Seek in a ftp:// file
@@ -167,15 +175,45 @@ static int file_ftp_seek(file_t *file, uint64_t position)
     return -1;
 }
 
+/// \brief Sync a ftp:// file
+///
+/// Uploads the local copy if it was written since it last was,
+/// see ::file_sync_t for details
+///
+static int file_ftp_sync(file_t *file)
+{
+	ftp_file_t *remote_file;
+
+	if (!file || !file->priv)
+	{
+		return -1;
+	}
+	remote_file = (ftp_file_t*)file->priv;
+	if (remote_file->writeback.upload)
+	{
+		return file_writeback_flush(&remote_file->writeback);
+	}
+	if (remote_file->file)
+	{
+		return remote_file->file->file_sync(remote_file->file);
+	}
+    return -1;
+}
+
 int file_ftp_setup(file_t *file, open_attribute_t open_for, credential_callback_t credential_callback)
 {
 	ftp_file_t *remote_file;
+	file_cache_entry_t entry;
+	char cached[MAX_PATH];
+	uint64_t size;
+	time_t mod_time;
 	int result;
 	
     file->file_close    = file_ftp_close;
     file->file_read     = file_ftp_read;
     file->file_write    = file_ftp_write;
     file->file_seek     = file_ftp_seek;
+    file->file_sync     = file_ftp_sync;
 	
 	// alloc a remote file context
 	//
@@ -186,7 +224,9 @@ int file_ftp_setup(file_t *file, open_attribute_t open_for, credential_callback_
 		return -1;
 	}
 	
+	memset(remote_file, 0, sizeof(ftp_file_t));
 	remote_file->file = NULL;
+	remote_file->opened_for = open_for;
 	remote_file->credential_callback = credential_callback;
 
 	// get a temporary local file name
@@ -217,31 +257,87 @@ int file_ftp_setup(file_t *file, open_attribute_t open_for, credential_callback_
 				pass[0] = '\0';
 			}
 		}
-	    result = bftp_get_file(
-	                    file->url,
-	                    remote_file->local_path,
-	                    user,
-	                    pass
-	                    );
-		if (result)
+		// a file only read is read from the cache if it's there, and
+		// the server says its size and time are as they were
+		//
+		cached[0] = '\0';
+		mod_time = 0;
+		if (open_for == openForRead && file_cache_enabled())
+		{
+			if (ftpio_stat(file->url, user, pass, &size, &mod_time))
+			{
+				mod_time = 0;
+			}
+			if (
+					! mod_time
+				||	file_cache_lookup(file->url, &entry, cached, sizeof(cached))
+				||	entry.size != size
+				||	entry.mod_time != mod_time
+			)
+			{
+				cached[0] = '\0';
+			}
+		}
+		if (cached[0])
 		{
-			butil_log(1, "FTP Error getting %s\n", file->url);
-			free(remote_file);
-			return result;
+			butil_log(3, "%s: %s is unchanged, reading cached copy\n", __FUNCTION__, file->url);
+			filesys_delete(remote_file->local_path);
+			remote_file->local_path[0] = '\0';
+		}
+		else
+		{
+		    result = bftp_get_file(
+		                    file->url,
+		                    remote_file->local_path,
+		                    user,
+		                    pass
+		                    );
+			if (result)
+			{
+				butil_log(1, "FTP Error getting %s\n", file->url);
+				free(remote_file);
+				return result;
+			}
+			if (mod_time)
+			{
+				memset(&entry, 0, sizeof(entry));
+				entry.size = size;
+				entry.mod_time = mod_time;
+				if (! file_cache_store(file->url, remote_file->local_path, &entry, cached, sizeof(cached)))
+				{
+					remote_file->local_path[0] = '\0';
+				}
+			}
 		}
 	}
+	else
+	{
+		cached[0] = '\0';
+	}
 
 	file->priv = remote_file;
 	
 	// open the local backing-file
 	//
-	remote_file->file = file_create(remote_file->local_path, open_for);
+	remote_file->file = file_create(cached[0] ? cached : remote_file->local_path, open_for);
 	if (! remote_file->file)
 	{
-		butil_log(1, "Can't create file on path %s\n", remote_file->local_path);
+		butil_log(1, "Can't create file on path %s\n", cached[0] ? cached : remote_file->local_path);
 		free(remote_file);
 		return -1;
 	}
+	
+	// writes are uploaded on sync and close, a file opened to write
+	// is made even if nothing is written to it
+	//
+	if (open_for == openForWrite || open_for == openForAppend)
+	{
+		file_writeback_init(&remote_file->writeback, file, remote_file->file, file_ftp_upload);
+		if (open_for == openForWrite)
+		{
+			file_writeback_touch(&remote_file->writeback);
+		}
+	}
     return result;
 }
 
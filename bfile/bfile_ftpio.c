@@ -0,0 +1,288 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfile_ftpio.h"
+#include "butil.h"
+#include <ctype.h>
+
+/// \file
+///
+
+/// \brief Control connection to a server
+///
+typedef struct tag_ftpio_conn
+{
+    int         fd;             ///< socket
+    char        buffer[1024];   ///< bytes received and not yet used
+    size_t      count;          ///< count of bytes in buffer
+    size_t      used;           ///< bytes of buffer used
+}
+ftpio_conn_t;
+
+/// \brief Connect to a server
+///
+/// @return 0 on success
+///
+static int ftpio_connect(ftpio_conn_t *conn, const char *host, uint16_t port)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    struct timeval timeout;
+    char portname[16];
+
+    memset(conn, 0, sizeof(ftpio_conn_t));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portname, sizeof(portname), "%u", (unsigned)(port ? port : 21));
+
+    if (getaddrinfo(host, portname, &hints, &addrs))
+    {
+        butil_log(1, "%s: Can't resolve %s\n", __FUNCTION__, host);
+        return -1;
+    }
+    conn->fd = -1;
+    for (addr = addrs; addr; addr = addr->ai_next)
+    {
+        conn->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (conn->fd < 0)
+        {
+            continue;
+        }
+        timeout.tv_sec = FTPIO_TIMEOUT / 1000;
+        timeout.tv_usec = (FTPIO_TIMEOUT % 1000) * 1000;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        if (! connect(conn->fd, addr->ai_addr, addr->ai_addrlen))
+        {
+            break;
+        }
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (conn->fd < 0)
+    {
+        butil_log(1, "%s: Can't connect to %s:%s\n", __FUNCTION__, host, portname);
+        return -1;
+    }
+    return 0;
+}
+
+/// \brief Read a line of a reply, without its line ending
+///
+/// @return 0 on success
+///
+static int ftpio_read_line(ftpio_conn_t *conn, char *line, size_t nline)
+{
+    size_t length;
+    ssize_t got;
+    char c;
+
+    length = 0;
+    while (1)
+    {
+        if (conn->used >= conn->count)
+        {
+            do
+            {
+                got = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+            }
+            while (got < 0 && errno == EINTR);
+
+            if (got <= 0)
+            {
+                return -1;
+            }
+            conn->count = (size_t)got;
+            conn->used = 0;
+        }
+        c = conn->buffer[conn->used++];
+        if (c == '\n')
+        {
+            break;
+        }
+        if (c != '\r' && length < (nline - 1))
+        {
+            line[length++] = c;
+        }
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+/// \brief Read a reply, which can go on over lines
+///
+/// @param[out] text  - gets text after the code, of the last line
+/// @param[in]  ntext - bytes of room at text
+///
+/// @return reply code, < 0 on error
+///
+static int ftpio_get_reply(ftpio_conn_t *conn, char *text, size_t ntext)
+{
+    char line[512];
+    int code;
+
+    if (ftpio_read_line(conn, line, sizeof(line)))
+    {
+        butil_log(1, "%s: No reply\n", __FUNCTION__);
+        return -1;
+    }
+    if (strlen(line) < 3 || ! isdigit(line[0]) || ! isdigit(line[1]) || ! isdigit(line[2]))
+    {
+        butil_log(1, "%s: Bad reply %s\n", __FUNCTION__, line);
+        return -1;
+    }
+    code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+    // a reply of many lines ends with a line starting with its code and a space
+    //
+    if (line[3] == '-')
+    {
+        do
+        {
+            if (ftpio_read_line(conn, line, sizeof(line)))
+            {
+                return -1;
+            }
+        }
+        while (strlen(line) < 4 || line[3] != ' ' || (int)strtol(line, NULL, 10) != code);
+    }
+    if (text && ntext)
+    {
+        snprintf(text, ntext, "%s", line[3] ? line + 4 : "");
+    }
+    return code;
+}
+
+/// \brief Send a command and read its reply
+///
+/// @return reply code, < 0 on error
+///
+static int ftpio_command(ftpio_conn_t *conn, const char *command, const char *arg, char *text, size_t ntext)
+{
+    char line[MAX_PATH + 16];
+    int length;
+
+    length = snprintf(line, sizeof(line), "%s%s%s\r\n", command, arg ? " " : "", arg ? arg : "");
+    if (length >= (int)sizeof(line))
+    {
+        return -1;
+    }
+    butil_log(5, "FTP> %s %s\n", command, strcmp(command, "PASS") ? (arg ? arg : "") : "****");
+    if (send(conn->fd, line, length, MSG_NOSIGNAL) != length)
+    {
+        butil_log(1, "%s: Can't send %s\n", __FUNCTION__, command);
+        return -1;
+    }
+    return ftpio_get_reply(conn, text, ntext);
+}
+
+/// \brief Log in, and ask for the size and modification time of a file
+///
+/// @return 0 on success
+///
+static int ftpio_query(ftpio_conn_t *conn, const char *user, const char *pass, const char *path, uint64_t *size, time_t *mod_time)
+{
+    char text[512];
+    struct tm stamp;
+    int code;
+
+    if (ftpio_get_reply(conn, NULL, 0) != 220)
+    {
+        butil_log(1, "%s: Server won't take a login\n", __FUNCTION__);
+        return -1;
+    }
+    code = ftpio_command(conn, "USER", (user && user[0]) ? user : "anonymous", NULL, 0);
+    if (code == 331)
+    {
+        code = ftpio_command(conn, "PASS", (user && user[0]) ? (pass ? pass : "") : "anonymous@", NULL, 0);
+    }
+    if (code != 230)
+    {
+        butil_log(1, "%s: Can't log in\n", __FUNCTION__);
+        return -1;
+    }
+    // SIZE counts bytes as sent in the transfer type, binary is the file's own
+    //
+    ftpio_command(conn, "TYPE", "I", NULL, 0);
+
+    // the url's path is from the directory logged in to
+    //
+    if (path[0] == '/')
+    {
+        path++;
+    }
+    code = ftpio_command(conn, "SIZE", path, text, sizeof(text));
+    if (code != 213)
+    {
+        butil_log(2, "%s: No size for %s\n", __FUNCTION__, path);
+        return -1;
+    }
+    *size = strtoull(text, NULL, 10);
+
+    code = ftpio_command(conn, "MDTM", path, text, sizeof(text));
+    if (code == 213)
+    {
+        // YYYYMMDDHHMMSS, UTC
+        //
+        memset(&stamp, 0, sizeof(stamp));
+        if (sscanf(text, "%4d%2d%2d%2d%2d%2d", &stamp.tm_year, &stamp.tm_mon, &stamp.tm_mday,
+                    &stamp.tm_hour, &stamp.tm_min, &stamp.tm_sec) == 6)
+        {
+            stamp.tm_year -= 1900;
+            stamp.tm_mon -= 1;
+            *mod_time = timegm(&stamp);
+        }
+    }
+    return 0;
+}
+
+int ftpio_stat(const char *url, const char *user, const char *pass, uint64_t *size, time_t *mod_time)
+{
+    ftpio_conn_t conn;
+    butil_url_scheme_t scheme;
+    char host[256];
+    char path[MAX_PATH];
+    uint16_t port;
+    int result;
+
+    if (!url || !size || !mod_time)
+    {
+        return -1;
+    }
+    *size = 0;
+    *mod_time = 0;
+
+    if (butil_parse_url(url, &scheme, host, sizeof(host), &port, path, sizeof(path)) || scheme != schemeFTP)
+    {
+        butil_log(1, "%s: Bad url %s\n", __FUNCTION__, url);
+        return -1;
+    }
+    if (ftpio_connect(&conn, host, port))
+    {
+        return -1;
+    }
+    result = ftpio_query(&conn, user, pass, path, size, mod_time);
+    if (result)
+    {
+        butil_log(2, "%s: Can't get size of %s\n", __FUNCTION__, url);
+    }
+    ftpio_command(&conn, "QUIT", NULL, NULL, 0);
+    close(conn.fd);
+    return result;
+}
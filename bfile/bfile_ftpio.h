@@ -0,0 +1,47 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFILE_FTPIO_H
+#define BFILE_FTPIO_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "bfile.h"
+
+/// \file
+///
+/// Asks an ftp:// server about a file on its control connection, for
+/// what bftp, which only gets and puts whole files, can't: the size and
+/// modification time of a file, with SIZE and MDTM (RFC 3659)
+
+/// Milliseconds the control connection waits to send or receive
+#define FTPIO_TIMEOUT				(30000)
+
+//-----------------------------------------------------------------------------
+/// \brief Get the size and modification time of a file on an ftp:// server
+///
+/// @param[in]  url      - url of file
+/// @param[in]  user     - user to log in as, empty or NULL for anonymous
+/// @param[in]  pass     - password of user
+/// @param[out] size     - gets size of file in bytes
+/// @param[out] mod_time - gets time file was last modified, 0 if the server doesn't say
+///
+/// @return 0 on success, < 0 on error, like no such file
+///
+int ftpio_stat(const char *url, const char *user, const char *pass, uint64_t *size, time_t *mod_time);
+
+#endif
@@ -14,10 +14,14 @@
  * limitations under the License.
  */
 #include "bfile_http.h"
+#include "bfile_httpio.h"
+#include "bfile_writeback.h"
+#include "bfile_cache.h"
 #include "bfile.h"
 #include "bfilesys.h"
 #include "bhttp.h"
 #include "butil.h"
+#include <pthread.h>
 
 /// \file
 ///
@@ -30,32 +34,1020 @@ typedef struct tag_http_file
 	char local_path[MAX_PATH];		///< tempory file used to cache remote file content
 	file_t *file;					///< file open on local file path
 	credential_callback_t credential_callback;	///< callback to get user/pass
+	int fd;							///< sparse local file when fetched lazily, -1 if not
+	uint64_t size;					///< size of remote file, when fetched lazily
+	uint8_t *fetched;				///< bit per HTTP_RANGE_BLOCK of the local file, set once fetched
+	uint64_t readahead;				///< bytes to fetch ahead of a read that follows the last one
+	uint64_t last_end;				///< where the last read ended
+	char auth[256];					///< Authorization header line, empty if none
+	char etag[128];					///< ETag of the file fetched, empty if none
+	char last_modified[64];			///< Last-Modified of the file fetched, empty if none
+	char if_range[160];				///< If-Range header line for ranges of the file fetched, empty if none
+	bool unverified;				///< a range was fetched without a validator to check it against
+	file_writeback_t writeback;		///< uploads writes to the local file, when opened to write
+	bool streaming;					///< local file is fetched on a thread while it's read
+	pthread_t stream_thread;		///< thread fetching the local file
+	pthread_mutex_t stream_lock;	///< guards the fields that follow
+	pthread_cond_t stream_grew;		///< signalled as bytes are received, and when all are
+	httpio_conn_t *stream_conn;		///< connection being fetched from, NULL once done
+	uint64_t received;				///< bytes of the local file received
+	bool stream_done;				///< fetching ended
+	int stream_result;				///< 0 if all was fetched, < 0 if not
+	bool stream_stop;				///< file is being closed
 }
 http_file_t;
 
+/// \brief Check if a block of a lazily fetched file was fetched
+///
+static bool http_range_fetched(http_file_t *remote_file, uint64_t block)
+{
+	return (remote_file->fetched[block / 8] & (1 << (block % 8))) != 0;
+}
+
+/// \brief Note a range of a lazily fetched file as fetched
+///
+/// @param[in] start - offset of first byte, on a block
+/// @param[in] end   - offset after last byte, on a block or the end of file
+///
+static void http_range_mark(http_file_t *remote_file, uint64_t start, uint64_t end)
+{
+	uint64_t block;
+
+	for (block = start / HTTP_RANGE_BLOCK; block * HTTP_RANGE_BLOCK < end; block++)
+	{
+		remote_file->fetched[block / 8] |= (1 << (block % 8));
+	}
+}
+
+/// \brief Receive the body of a response into a range of the local file
+///
+/// @param[in] conn  - connection the response is on
+/// @param[in] fd    - local file
+/// @param[in] start - offset of first byte
+/// @param[in] end   - offset after last byte
+///
+/// @return 0 if all the range was received
+///
+static int http_range_receive(httpio_conn_t *conn, int fd, uint64_t start, uint64_t end)
+{
+	uint8_t data[64*1024];
+	uint64_t offset;
+	ssize_t wrote;
+	int result;
+
+	for (offset = start; offset < end; offset += result)
+	{
+		result = httpio_read(conn, data, (end - offset) < sizeof(data) ? (size_t)(end - offset) : sizeof(data));
+		if (result <= 0)
+		{
+			break;
+		}
+		wrote = pwrite(fd, data, result, offset);
+		if (wrote != result)
+		{
+			butil_log(1, "%s: Can't write local file\n", __FUNCTION__);
+			return -1;
+		}
+	}
+	return (offset == end) ? 0 : -1;
+}
+
+/// \brief Check a response is of the same file a lazily fetched file's HEAD was
+///
+/// A response without the validator to compare is taken as the same, ranges
+/// are asked for with If-Range so a server that knows it changed says so
+///
+/// @return 1 if it has the same validator, 0 if it has none to compare, < 0 if it's of a changed file
+///
+static int http_range_compare(const char *etag, const char *last_modified, httpio_reply_t *reply)
+{
+	if (etag[0] && reply->etag[0])
+	{
+		return strcmp(etag, reply->etag) ? -1 : 1;
+	}
+	if (last_modified[0] && reply->last_modified[0])
+	{
+		return strcmp(last_modified, reply->last_modified) ? -1 : 1;
+	}
+	return 0;
+}
+
+/// \brief Forget all fetched of a lazily fetched file that changed, so none
+/// of the old file is read along with the new
+///
+static void http_range_changed(file_t *file, http_file_t *remote_file)
+{
+	uint64_t nblocks;
+
+	butil_log(1, "%s: %s changed while it was read\n", __FUNCTION__, file->url);
+	nblocks = (remote_file->size + HTTP_RANGE_BLOCK - 1) / HTTP_RANGE_BLOCK;
+	memset(remote_file->fetched, 0, (size_t)(nblocks + 8) / 8);
+}
+
+/// \brief Fetch a range of a lazily fetched file into the local file
+///
+/// A server that sends the whole file instead gets the whole file
+/// fetched, which is the most that can be done with it. A file that
+/// changed since it was opened can't be read any more
+///
+/// @param[in] file        - file to fetch for
+/// @param[in] remote_file - its context
+/// @param[in] start       - offset of first byte, on a block
+/// @param[in] end         - offset after last byte, on a block or the end of file
+///
+/// @return 0 on success
+///
+static int http_range_fetch(file_t *file, http_file_t *remote_file, uint64_t start, uint64_t end)
+{
+	httpio_conn_t *conn;
+	httpio_reply_t reply;
+	char headers[640];
+	int same;
+	int result;
+
+	snprintf(headers, sizeof(headers), "Range: bytes=%llu-%llu\r\n%s%s",
+			(unsigned long long)start, (unsigned long long)(end - 1), remote_file->if_range, remote_file->auth);
+
+	result = httpio_request(file->url, "GET", headers, &conn, &reply);
+	if (result)
+	{
+		return result;
+	}
+	same = http_range_compare(remote_file->etag, remote_file->last_modified, &reply);
+	if (same < 0
+			|| (reply.status == 200 && reply.content_length >= 0 && (uint64_t)reply.content_length != remote_file->size))
+	{
+		httpio_close(conn);
+		http_range_changed(file, remote_file);
+		return -1;
+	}
+	if (reply.status == 200)
+	{
+		// the server ignored the range and is sending all of it
+		//
+		butil_log(3, "%s: %s sent whole for a range\n", __FUNCTION__, file->url);
+		start = 0;
+		end = remote_file->size;
+	}
+	else if (reply.status != 206 || !reply.has_range || reply.range_start != start)
+	{
+		butil_log(1, "%s: HTTP %d getting range of %s\n", __FUNCTION__, reply.status, file->url);
+		httpio_close(conn);
+		return -1;
+	}
+	result = http_range_receive(conn, remote_file->fd, start, end);
+	httpio_release(conn);
+	if (result)
+	{
+		butil_log(1, "%s: Short range of %s\n", __FUNCTION__, file->url);
+		return result;
+	}
+	http_range_mark(remote_file, start, end);
+	remote_file->unverified |= ! same;
+	return 0;
+}
+
+/// \brief Make sure the blocks under a read of a lazily fetched file are fetched
+///
+/// @return 0 on success
+///
+static int http_range_ensure(file_t *file, http_file_t *remote_file, uint64_t position, size_t count)
+{
+	uint64_t nblocks;
+	uint64_t first;
+	uint64_t last;
+	uint64_t block;
+	uint64_t run_end;
+	uint64_t end;
+	int result;
+
+	// reads that follow on from the last one are likely to go on,
+	// so fetch further ahead of each
+	//
+	if (position == remote_file->last_end)
+	{
+		remote_file->readahead *= 2;
+		if (remote_file->readahead > HTTP_RANGE_READAHEAD)
+		{
+			remote_file->readahead = HTTP_RANGE_READAHEAD;
+		}
+	}
+	else
+	{
+		remote_file->readahead = HTTP_RANGE_BLOCK;
+	}
+	remote_file->last_end = position + count;
+
+	nblocks = (remote_file->size + HTTP_RANGE_BLOCK - 1) / HTTP_RANGE_BLOCK;
+	first = position / HTTP_RANGE_BLOCK;
+	last = (position + count - 1) / HTTP_RANGE_BLOCK;
+
+	for (block = first; block <= last; block++)
+	{
+		if (http_range_fetched(remote_file, block))
+		{
+			continue;
+		}
+		// a run of blocks not fetched yet, from here through the read
+		// and its read ahead
+		//
+		run_end = block + remote_file->readahead / HTTP_RANGE_BLOCK;
+		if (run_end <= last)
+		{
+			run_end = last + 1;
+		}
+		if (run_end > nblocks)
+		{
+			run_end = nblocks;
+		}
+		for (end = block + 1; end < run_end && ! http_range_fetched(remote_file, end); end++)
+		{
+			;
+		}
+		result = http_range_fetch(file, remote_file, block * HTTP_RANGE_BLOCK,
+						(end * HTTP_RANGE_BLOCK < remote_file->size) ? end * HTTP_RANGE_BLOCK : remote_file->size);
+		if (result)
+		{
+			return result;
+		}
+		block = end - 1;
+	}
+	return 0;
+}
+
+/// \brief Read a lazily fetched file
+///
+static int http_range_read(file_t *file, http_file_t *remote_file, uint8_t *buffer, size_t count)
+{
+	ssize_t got;
+	int result;
+
+	if (file->position >= remote_file->size)
+	{
+		return 0;
+	}
+	if (count > (remote_file->size - file->position))
+	{
+		count = (size_t)(remote_file->size - file->position);
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+	result = http_range_ensure(file, remote_file, file->position, count);
+	if (result)
+	{
+		return result;
+	}
+	got = pread(remote_file->fd, buffer, count, file->position);
+	if (got < 0)
+	{
+		butil_log(1, "%s: Can't read local file\n", __FUNCTION__);
+		return -1;
+	}
+	file->position += got;
+	return (int)got;
+}
+
+/// \brief Set up fetching a file lazily, if its server takes ranges
+///
+/// @return 0 if set up, 1 if the file has to be fetched whole, < 0 on error
+///
+static int http_range_open(file_t *file, http_file_t *remote_file)
+{
+	httpio_conn_t *conn;
+	httpio_reply_t reply;
+	uint64_t nblocks;
+
+	if (httpio_request(file->url, "HEAD", remote_file->auth, &conn, &reply))
+	{
+		return 1;
+	}
+	httpio_release(conn);
+
+	if (reply.status != 200 || !reply.accept_ranges || reply.content_length < 0)
+	{
+		butil_log(3, "%s: %s can't be fetched in ranges\n", __FUNCTION__, file->url);
+		return 1;
+	}
+	remote_file->size = (uint64_t)reply.content_length;
+	snprintf(remote_file->etag, sizeof(remote_file->etag), "%s", reply.etag);
+	snprintf(remote_file->last_modified, sizeof(remote_file->last_modified), "%s", reply.last_modified);
+
+	// ranges are only of the file as it is now, a weak etag can't say that
+	//
+	if (reply.etag[0] && strncmp(reply.etag, "W/", 2))
+	{
+		snprintf(remote_file->if_range, sizeof(remote_file->if_range), "If-Range: %s\r\n", reply.etag);
+	}
+	else if (reply.last_modified[0])
+	{
+		snprintf(remote_file->if_range, sizeof(remote_file->if_range), "If-Range: %s\r\n", reply.last_modified);
+	}
+	nblocks = (remote_file->size + HTTP_RANGE_BLOCK - 1) / HTTP_RANGE_BLOCK;
+	remote_file->fetched = (uint8_t*)calloc((size_t)(nblocks + 8) / 8, 1);
+	if (! remote_file->fetched)
+	{
+		butil_log(0, "%s: Can't alloc block map\n", __FUNCTION__);
+		return -1;
+	}
+	// the local file has holes until blocks are fetched into it
+	//
+	remote_file->fd = open(remote_file->local_path, O_RDWR | O_TRUNC, 0600);
+	if (remote_file->fd < 0 || ftruncate(remote_file->fd, (off_t)remote_file->size))
+	{
+		butil_log(1, "%s: Can't make local file %s\n", __FUNCTION__, remote_file->local_path);
+		if (remote_file->fd >= 0)
+		{
+			close(remote_file->fd);
+			remote_file->fd = -1;
+		}
+		free(remote_file->fetched);
+		remote_file->fetched = NULL;
+		return -1;
+	}
+	remote_file->readahead = HTTP_RANGE_BLOCK;
+	remote_file->last_end = (uint64_t)-1;
+	butil_log(3, "%s: %s is %llu bytes, fetched lazily\n", __FUNCTION__,
+			file->url, (unsigned long long)remote_file->size);
+	return 0;
+}
+
+/// \brief How files fetched lazily are fetched at once on many connections instead
+///
+static struct
+{
+	pthread_mutex_t lock;			///< guards the settings
+	unsigned connections;			///< connections a file is fetched on, 1 to fetch lazily
+	uint64_t min_size;				///< smallest file fetched on many connections
+}
+s_parallel = { PTHREAD_MUTEX_INITIALIZER, 1, HTTP_PARALLEL_MIN_SIZE };
+
+/// \brief A range of a file fetched on a connection of its own
+///
+typedef struct tag_http_part
+{
+	const char *url;				///< url of file
+	const char *auth;				///< Authorization header line, empty if none
+	const char *if_range;			///< If-Range header line, empty if none
+	const char *etag;				///< ETag of the file, empty if none
+	const char *last_modified;		///< Last-Modified of the file, empty if none
+	int fd;							///< local file
+	uint64_t size;					///< size of whole file
+	uint64_t start;					///< offset of first byte of range
+	uint64_t end;					///< offset after last byte of range
+	httpio_conn_t *conn;			///< connection the range is fetched on
+	pthread_t thread;				///< thread fetching the range
+	bool started;					///< thread was started
+	bool changed;					///< file changed since it was opened
+	bool verified;					///< response had the file's validator
+	int result;						///< 0 if the range was fetched
+}
+http_part_t;
+
+/// \brief Ask for a range of a file
+///
+/// @return 0 on success
+///
+static int http_part_request(http_part_t *part, httpio_reply_t *reply)
+{
+	char headers[640];
+
+	snprintf(headers, sizeof(headers), "Range: bytes=%llu-%llu\r\n%s%s",
+			(unsigned long long)part->start, (unsigned long long)(part->end - 1), part->if_range, part->auth);
+	return httpio_request(part->url, "GET", headers, &part->conn, reply);
+}
+
+/// \brief Check a response is the range asked for, of the file as it was
+///
+static bool http_part_check(http_part_t *part, httpio_reply_t *reply)
+{
+	int same;
+
+	same = http_range_compare(part->etag, part->last_modified, reply);
+	if (same < 0)
+	{
+		butil_log(1, "%s: %s changed while it was fetched\n", __FUNCTION__, part->url);
+		part->changed = true;
+		return false;
+	}
+	part->verified = (same > 0);
+	if (reply->status != 206 || !reply->has_range || reply->range_start != part->start
+			|| (reply->range_total && reply->range_total != part->size)
+			|| (reply->content_length >= 0 && (uint64_t)reply->content_length != part->end - part->start))
+	{
+		butil_log(1, "%s: HTTP %d not range %llu-%llu of %s\n", __FUNCTION__, reply->status,
+				(unsigned long long)part->start, (unsigned long long)(part->end - 1), part->url);
+		return false;
+	}
+	return true;
+}
+
+/// \brief Fetch a range of a file into the local file
+///
+static void *http_part_thread(void *priv)
+{
+	http_part_t *part = (http_part_t*)priv;
+	httpio_reply_t reply;
+
+	part->result = -1;
+	if (http_part_request(part, &reply))
+	{
+		return NULL;
+	}
+	if (! http_part_check(part, &reply))
+	{
+		httpio_close(part->conn);
+		return NULL;
+	}
+	part->result = http_range_receive(part->conn, part->fd, part->start, part->end);
+	httpio_release(part->conn);
+	return NULL;
+}
+
+/// \brief Fetch all of a lazily fetched file when it's opened, its ranges
+/// on connections of their own at once, if it's big enough to be worth it
+///
+/// The first range is asked for before the others, so a server that sends
+/// the whole file for it instead is read from on that connection alone.
+/// Ranges that can't be fetched are left to be fetched when read
+///
+/// @return 0 if all was fetched, 1 if not fetched this way, < 0 on error
+///
+static int http_parallel_fetch(file_t *file, http_file_t *remote_file)
+{
+	http_part_t *parts;
+	httpio_reply_t reply;
+	uint64_t nblocks;
+	uint64_t per_part;
+	unsigned connections;
+	unsigned count;
+	unsigned i;
+	bool changed;
+	int result;
+
+	pthread_mutex_lock(&s_parallel.lock);
+	connections = s_parallel.connections;
+	if (remote_file->size < s_parallel.min_size)
+	{
+		connections = 1;
+	}
+	pthread_mutex_unlock(&s_parallel.lock);
+
+	nblocks = (remote_file->size + HTTP_RANGE_BLOCK - 1) / HTTP_RANGE_BLOCK;
+	if (connections > nblocks)
+	{
+		connections = (unsigned)nblocks;
+	}
+	if (connections < 2)
+	{
+		return 1;
+	}
+	// ranges are whole blocks, so each one fetched marks its blocks
+	//
+	per_part = ((nblocks + connections - 1) / connections) * HTTP_RANGE_BLOCK;
+	count = (unsigned)((remote_file->size + per_part - 1) / per_part);
+	parts = (http_part_t*)calloc(count, sizeof(http_part_t));
+	if (! parts)
+	{
+		butil_log(0, "%s: Can't alloc ranges\n", __FUNCTION__);
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+	{
+		parts[i].url = file->url;
+		parts[i].auth = remote_file->auth;
+		parts[i].if_range = remote_file->if_range;
+		parts[i].etag = remote_file->etag;
+		parts[i].last_modified = remote_file->last_modified;
+		parts[i].fd = remote_file->fd;
+		parts[i].size = remote_file->size;
+		parts[i].start = i * per_part;
+		parts[i].end = (parts[i].start + per_part < remote_file->size) ? parts[i].start + per_part : remote_file->size;
+	}
+	if (http_part_request(&parts[0], &reply))
+	{
+		free(parts);
+		return -1;
+	}
+	if (reply.status == 200)
+	{
+		// the server ignored the range and is sending all of it, or
+		// all of a file that changed
+		//
+		butil_log(3, "%s: %s sent whole for a range\n", __FUNCTION__, file->url);
+		result = -1;
+		if ((reply.content_length < 0 || (uint64_t)reply.content_length == remote_file->size)
+				&& http_range_compare(remote_file->etag, remote_file->last_modified, &reply) >= 0)
+		{
+			result = http_range_receive(parts[0].conn, remote_file->fd, 0, remote_file->size);
+		}
+		httpio_release(parts[0].conn);
+		if (! result)
+		{
+			http_range_mark(remote_file, 0, remote_file->size);
+			remote_file->unverified |= ! http_range_compare(remote_file->etag, remote_file->last_modified, &reply);
+		}
+		free(parts);
+		return result;
+	}
+	if (! http_part_check(&parts[0], &reply))
+	{
+		httpio_close(parts[0].conn);
+		free(parts);
+		return -1;
+	}
+	for (i = 1; i < count; i++)
+	{
+		parts[i].started = (pthread_create(&parts[i].thread, NULL, http_part_thread, &parts[i]) == 0);
+	}
+	parts[0].result = http_range_receive(parts[0].conn, remote_file->fd, parts[0].start, parts[0].end);
+	httpio_release(parts[0].conn);
+
+	changed = false;
+	for (i = 0; i < count; i++)
+	{
+		if (parts[i].started)
+		{
+			pthread_join(parts[i].thread, NULL);
+		}
+		else if (i > 0)
+		{
+			// no thread for it, so fetch it here
+			http_part_thread(&parts[i]);
+		}
+		changed |= parts[i].changed;
+	}
+	// ranges of a file that changed part way are of two files, keep none
+	//
+	result = changed ? -1 : 0;
+	for (i = 0; i < count && ! changed; i++)
+	{
+		if (parts[i].result)
+		{
+			result = -1;
+			continue;
+		}
+		http_range_mark(remote_file, parts[i].start, parts[i].end);
+		remote_file->unverified |= ! parts[i].verified;
+	}
+	free(parts);
+	butil_log(3, "%s: %s fetched on %u connections%s\n", __FUNCTION__, file->url, count,
+			result ? ", some ranges left to fetch when read" : "");
+	return result;
+}
+
+/// \brief Fetch the body of a response into the local file, as the file is read
+///
+static void *http_stream_thread(void *priv)
+{
+	http_file_t *remote_file;
+	httpio_conn_t *conn;
+	uint8_t data[64*1024];
+	uint64_t offset;
+	int result;
+
+	remote_file = (http_file_t*)priv;
+	conn = remote_file->stream_conn;
+	offset = 0;
+
+	do
+	{
+		result = httpio_read(conn, data, sizeof(data));
+		if (result > 0 && pwrite(remote_file->fd, data, result, (off_t)offset) != result)
+		{
+			butil_log(1, "%s: Can't write local file\n", __FUNCTION__);
+			result = -1;
+		}
+		pthread_mutex_lock(&remote_file->stream_lock);
+		if (result > 0)
+		{
+			offset += result;
+			remote_file->received = offset;
+		}
+		// the body is whole once its last byte is read, which can be
+		// before a file read to its end is closed
+		//
+		if (result <= 0 || conn->done || remote_file->stream_stop)
+		{
+			remote_file->stream_done = true;
+			remote_file->stream_result = (result < 0 || (remote_file->stream_stop && ! conn->done)) ? -1 : 0;
+			remote_file->stream_conn = NULL;
+		}
+		pthread_cond_broadcast(&remote_file->stream_grew);
+		pthread_mutex_unlock(&remote_file->stream_lock);
+	}
+	while (result > 0 && remote_file->stream_conn);
+
+	httpio_release(conn);
+	butil_log(4, "%s: Fetched %llu bytes\n", __FUNCTION__, (unsigned long long)offset);
+	return NULL;
+}
+
+/// \brief Start fetching a whole file, which can be read as it arrives
+///
+/// The request is made here, so a file that can't be got fails to open,
+/// and the body is fetched on a thread
+///
+/// @param[in] file        - file to fetch
+/// @param[in] remote_file - its context
+/// @param[in] headers     - header lines to send, Authorization and any conditions
+///
+/// @return 0 on success, 1 if the conditions say the file is unchanged, < 0 on error
+///
+static int http_stream_open(file_t *file, http_file_t *remote_file, const char *headers)
+{
+	httpio_conn_t *conn;
+	httpio_reply_t reply;
+
+	if (httpio_request(file->url, "GET", headers, &conn, &reply))
+	{
+		return -1;
+	}
+	if (reply.status == 304)
+	{
+		httpio_release(conn);
+		return 1;
+	}
+	if (reply.status != 200)
+	{
+		butil_log(1, "%s: HTTP %d getting %s\n", __FUNCTION__, reply.status, file->url);
+		httpio_close(conn);
+		return -1;
+	}
+	remote_file->fd = open(remote_file->local_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (remote_file->fd < 0)
+	{
+		butil_log(1, "%s: Can't make local file %s\n", __FUNCTION__, remote_file->local_path);
+		httpio_close(conn);
+		return -1;
+	}
+	snprintf(remote_file->etag, sizeof(remote_file->etag), "%s", reply.etag);
+	snprintf(remote_file->last_modified, sizeof(remote_file->last_modified), "%s", reply.last_modified);
+
+	pthread_mutex_init(&remote_file->stream_lock, NULL);
+	pthread_cond_init(&remote_file->stream_grew, NULL);
+	remote_file->stream_conn = conn;
+	remote_file->received = 0;
+	remote_file->stream_done = false;
+	remote_file->stream_stop = false;
+
+	if (pthread_create(&remote_file->stream_thread, NULL, http_stream_thread, remote_file))
+	{
+		butil_log(1, "%s: Can't start fetching %s\n", __FUNCTION__, file->url);
+		pthread_cond_destroy(&remote_file->stream_grew);
+		pthread_mutex_destroy(&remote_file->stream_lock);
+		httpio_close(conn);
+		close(remote_file->fd);
+		remote_file->fd = -1;
+		return -1;
+	}
+	remote_file->streaming = true;
+	butil_log(3, "%s: %s is read as it is fetched\n", __FUNCTION__, file->url);
+	return 0;
+}
+
+/// \brief Read a file being fetched, waiting for bytes not yet received
+///
+static int http_stream_read(file_t *file, http_file_t *remote_file, uint8_t *buffer, size_t count)
+{
+	uint64_t received;
+	ssize_t got;
+	int result;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&remote_file->stream_lock);
+	while (! remote_file->stream_done && remote_file->received <= file->position)
+	{
+		pthread_cond_wait(&remote_file->stream_grew, &remote_file->stream_lock);
+	}
+	received = remote_file->received;
+	result = remote_file->stream_result;
+	pthread_mutex_unlock(&remote_file->stream_lock);
+
+	if (file->position >= received)
+	{
+		// at the end, or where fetching failed
+		return result;
+	}
+	if (count > (received - file->position))
+	{
+		count = (size_t)(received - file->position);
+	}
+	got = pread(remote_file->fd, buffer, count, (off_t)file->position);
+	if (got < 0)
+	{
+		butil_log(1, "%s: Can't read local file\n", __FUNCTION__);
+		return -1;
+	}
+	file->position += got;
+	return (int)got;
+}
+
+/// \brief Stop fetching a file being read as it is fetched
+///
+static void http_stream_close(http_file_t *remote_file)
+{
+	pthread_mutex_lock(&remote_file->stream_lock);
+	remote_file->stream_stop = true;
+	if (remote_file->stream_conn)
+	{
+		// wake the thread from waiting on the server
+		shutdown(remote_file->stream_conn->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&remote_file->stream_lock);
+
+	pthread_join(remote_file->stream_thread, NULL);
+	pthread_cond_destroy(&remote_file->stream_grew);
+	pthread_mutex_destroy(&remote_file->stream_lock);
+	remote_file->streaming = false;
+}
+
+/// \brief Read a file from the cache if it's unchanged since cached
+///
+/// The file is asked for on condition it changed, so if it did it's
+/// fetched again with the same request
+///
+/// @return 0 if set up, 1 if the file isn't cached, < 0 on error
+///
+static int http_cache_open(file_t *file, http_file_t *remote_file)
+{
+	file_cache_entry_t entry;
+	char cached[MAX_PATH];
+	char headers[640];
+	int length;
+	int result;
+
+	if (file_cache_lookup(file->url, &entry, cached, sizeof(cached)))
+	{
+		return 1;
+	}
+	length = snprintf(headers, sizeof(headers), "%s", remote_file->auth);
+	if (entry.etag[0])
+	{
+		length += snprintf(headers + length, sizeof(headers) - length, "If-None-Match: %s\r\n", entry.etag);
+	}
+	if (entry.last_modified[0])
+	{
+		length += snprintf(headers + length, sizeof(headers) - length, "If-Modified-Since: %s\r\n", entry.last_modified);
+	}
+	result = http_stream_open(file, remote_file, headers);
+	if (result <= 0)
+	{
+		// changed, and being fetched again, or an error
+		return result;
+	}
+	remote_file->file = file_create(cached, openForRead);
+	if (! remote_file->file)
+	{
+		butil_log(1, "%s: Can't open cached copy %s\n", __FUNCTION__, cached);
+		return -1;
+	}
+	filesys_delete(remote_file->local_path);
+	remote_file->local_path[0] = '\0';
+	butil_log(3, "%s: %s is unchanged, reading cached copy\n", __FUNCTION__, file->url);
+	return 0;
+}
+
+/// \brief Keep a file fetched whole in the cache, for the next time it's opened
+///
+/// The local file is moved to the cache, only if all of it was checked
+/// to be of the file its validator is kept for
+///
+static void http_cache_keep(file_t *file, http_file_t *remote_file)
+{
+	file_cache_entry_t entry;
+
+	if ((! remote_file->etag[0] && ! remote_file->last_modified[0]) || ! file_cache_enabled())
+	{
+		// can't tell if it changed
+		return;
+	}
+	if (remote_file->unverified)
+	{
+		butil_log(3, "%s: %s was fetched in ranges not all checked, not kept\n", __FUNCTION__, file->url);
+		return;
+	}
+	memset(&entry, 0, sizeof(entry));
+	snprintf(entry.etag, sizeof(entry.etag), "%s", remote_file->etag);
+	snprintf(entry.last_modified, sizeof(entry.last_modified), "%s", remote_file->last_modified);
+	if (! file_cache_store(file->url, remote_file->local_path, &entry, NULL, 0))
+	{
+		remote_file->local_path[0] = '\0';
+	}
+}
+
+/// \brief Fetch a whole http:// file into the local file, or put the local file to it
+///
+/// http:// urls go over a connection from the pool, others with bhttp's client
+///
+/// @param[in] file        - file to transfer
+/// @param[in] remote_file - its context
+/// @param[in] method      - httpGet or httpPut
+///
+/// @return 0 on success
+///
+static int http_transfer(file_t *file, http_file_t *remote_file, http_method_t method)
+{
+	httpio_conn_t *conn;
+	httpio_reply_t reply;
+	http_client_t *client;
+	uint8_t data[64*1024];
+	struct stat fstate;
+	ssize_t wrote;
+	int fd;
+	int result;
+
+	butil_log(3, "%s:%d %s %s\n", __FUNCTION__, __LINE__, http_method_name(method), file->url);
+
+	if (file_get_scheme(file->url, NULL, 0) == schemeHTTP)
+	{
+		if (method == httpPut)
+		{
+			fd = open(remote_file->local_path, O_RDONLY);
+			if (fd < 0 || fstat(fd, &fstate))
+			{
+				butil_log(1, "%s: Can't open local file %s\n", __FUNCTION__, remote_file->local_path);
+				if (fd >= 0)
+				{
+					close(fd);
+				}
+				return -1;
+			}
+			result = httpio_upload(file->url, "PUT", remote_file->auth, fd, (uint64_t)fstate.st_size, &reply);
+			close(fd);
+			if (! result && (reply.status < 200 || reply.status >= 300))
+			{
+				butil_log(1, "%s: HTTP %d putting %s\n", __FUNCTION__, reply.status, file->url);
+				result = -1;
+			}
+			return result;
+		}
+		result = httpio_request(file->url, "GET", remote_file->auth, &conn, &reply);
+		if (result)
+		{
+			return result;
+		}
+		if (reply.status == 404 && remote_file->opened_for == openForAppend)
+		{
+			// nothing to append to yet
+			reply.status = 200;
+			conn->keepalive = false;
+			conn->done = true;
+		}
+		if (reply.status != 200)
+		{
+			butil_log(1, "%s: HTTP %d getting %s\n", __FUNCTION__, reply.status, file->url);
+			httpio_close(conn);
+			return -1;
+		}
+		fd = open(remote_file->local_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+		{
+			butil_log(1, "%s: Can't make local file %s\n", __FUNCTION__, remote_file->local_path);
+			httpio_close(conn);
+			return -1;
+		}
+		while ((result = httpio_read(conn, data, sizeof(data))) > 0)
+		{
+			wrote = write(fd, data, result);
+			if (wrote != result)
+			{
+				butil_log(1, "%s: Can't write local file\n", __FUNCTION__);
+				result = -1;
+				break;
+			}
+		}
+		close(fd);
+		httpio_release(conn);
+		return result;
+	}
+
+	client = http_client_create(NULL, true);
+	if (! client)
+	{
+		butil_log(1, "No memory for http client");
+		return -1;
+	}
+	client->keepalive = false;
+
+	do
+	{
+		result = http_client_request(
+									client,
+									method,
+									file->url,
+									httpTCP,
+									false,
+									remote_file->local_path,
+									NULL
+									);
+
+		while (! result)
+		{
+			result = http_client_slice(client);
+			if (result)
+			{
+				butil_log(2, "HTTP Client Error\n");
+				break;
+			}
+			if (client->state == httpDone)
+			{
+				butil_log(4, "HTTP Client Complete\n");
+				break;
+			}
+			result = http_wait_for_client_event(client, 0, 10000);
+			if (result < 0)
+			{
+				break;
+			}
+			result = 0;
+		}
+	}
+	while (!result && client->response >= 300 && client->response < 400);
+
+	butil_log(3, "HTTP Ends\n");
+	http_client_free(client);
+	return result;
+}
+
+/// \brief Upload the local copy of a http:// file
+///
+/// See ::file_upload_t for details
+///
+static int file_http_upload(file_t *file)
+{
+	return http_transfer(file, (http_file_t*)file->priv, httpPut);
+}
+
 /// \brief Close a http:// file
 ///
-/// See ::file_close_t for details
+/// Uploads the local copy if it was written since it last was,
+/// see ::file_close_t for details
 ///
 static int file_http_close(file_t *file)
 {
 	http_file_t *remote_file;
+	uint64_t nblocks;
+	uint64_t block;
+	bool whole;
+	int result;
 
 	if (!file || !file->priv)
 	{
 		return -1;
 	}
 	remote_file = (http_file_t*)file->priv;
+	result = 0;
+	if (remote_file->writeback.upload)
+	{
+		result = file_writeback_flush(&remote_file->writeback);
+		if (result)
+		{
+			butil_log(1, "HTTP Error putting %s\n", file->url);
+		}
+		file_writeback_deinit(&remote_file->writeback);
+	}
+	whole = false;
+	if (remote_file->streaming)
+	{
+		http_stream_close(remote_file);
+		whole = (remote_file->stream_result == 0);
+	}
 	if (remote_file->file)
 	{
-		remote_file->file->file_close(file);
+		file_destroy(remote_file->file);
 		remote_file->file = NULL;
 	}
+	if (remote_file->fd >= 0)
+	{
+		close(remote_file->fd);
+		remote_file->fd = -1;
+	}
+	if (remote_file->fetched)
+	{
+		nblocks = (remote_file->size + HTTP_RANGE_BLOCK - 1) / HTTP_RANGE_BLOCK;
+		for (block = 0; block < nblocks && http_range_fetched(remote_file, block); block++)
+		{
+			;
+		}
+		whole = (block == nblocks);
+		free(remote_file->fetched);
+	}
+	if (whole && remote_file->local_path[0])
+	{
+		http_cache_keep(file, remote_file);
+	}
 	if (remote_file->local_path[0])
 	{
 		filesys_delete(remote_file->local_path);
 	}
-	return 0;
+	free(remote_file);
+	file->priv = NULL;
+	return result;
 }
 
 /// \brief Read a http:// file
@@ -71,6 +1063,14 @@ static int file_http_read(file_t *file, uint8_t *buffer, size_t count)
 		return -1;
 	}
 	remote_file = (http_file_t*)file->priv;
+	if (remote_file->streaming)
+	{
+		return http_stream_read(file, remote_file, buffer, count);
+	}
+	if (remote_file->fd >= 0)
+	{
+		return http_range_read(file, remote_file, buffer, count);
+	}
 	if (remote_file->file)
 	{
 		return remote_file->file->file_read(remote_file->file, buffer, count);
@@ -80,115 +1080,24 @@ static int file_http_read(file_t *file, uint8_t *buffer, size_t count)
 
 /// \brief Write a http:// file
 ///
-/// See ::file_write_t for details
+/// Writes go to the local file, which is uploaded on sync and close,
+/// see ::file_write_t for details
 ///
 static int file_http_write(file_t *file, uint8_t *buffer, size_t count)
 {
 	http_file_t *remote_file;
-	int result;
 	
 	if (!file || !file->priv)
 	{
 		return -1;
 	}
 	remote_file = (http_file_t*)file->priv;
-	if (remote_file->file)
-	{
-		result = remote_file->file->file_write(remote_file->file, buffer, count);
-		if (result)
-		{
-			return result;
-		}
-	}
-	if (remote_file->opened_for == openForWrite || remote_file->opened_for == openForAppend)
+	if (remote_file->fd >= 0 || ! remote_file->writeback.upload)
 	{
-        http_client_t *client;
-		char user[64];
-		char pass[64];
-		
-		// get credentials for this url
-		//
-		user[0] = '\0';
-		pass[0] = '\0';
-		if (remote_file->credential_callback)
-		{
-			result = remote_file->credential_callback(file->url, user, sizeof(user), pass, sizeof(pass));
-			if (result)
-			{
-				user[0] = '\0';
-				pass[0] = '\0';
-			}
-		}
-		// close/flush the backing local file
-		//
-		remote_file->file->file_close(remote_file->file);
-		remote_file->file = NULL;
-		
-		// do an http put of the local file to the remote file
-		//
-		butil_log(3, "%s:%d %s %s\n", __FUNCTION__, __LINE__, http_method_name(httpPut), file->url);
-
-        client = http_client_create(NULL, true);
-        if (! client)
-        {
-           	butil_log(1, "No memory for http client");
-            return -1;
-        }
-		
-        client->keepalive = false;
-
-        do
-        {
-            result = http_client_request(
-										client,
-										httpPut,
-										file->url,
-										httpTCP,
-										false,
-										remote_file->local_path,
-										NULL
-										);
-
-            while (! result)
-            {
-                result = http_client_slice(client);
-                if (result)
-                {
-                    butil_log(2, "HTTP Client Error\n");
-                    break;
-                }
-                if (client->state == httpDone)
-                {
-                    butil_log(4, "HTTP Client Complete\n");
-                    break;
-                }
-				result = http_wait_for_client_event(client, 0, 10000);
-                if (result < 0)
-                {
-                    break;
-                }
-                result = 0;
-            }
-        }
-        while (!result && client->response >= 300 && client->response < 400);
-
-		if (result)
-		{
-			butil_log(1, "HTTP Error putting %s\n", file->url);
-		}
-        butil_log(3, "HTTP Ends\n");
-        http_client_free(client);
-		
-		// re-open the backing file
-		//
-		remote_file->file = file_create(remote_file->local_path, remote_file->opened_for);
-		if (! remote_file->file)
-		{
-			butil_log(1, "Can't re-open file at path %s\n", remote_file->local_path);
-			return -1;
-		}	
+		butil_log(1, "%s: %s is open for reading\n", __FUNCTION__, file->url);
+		return -1;
 	}
-    return result;
+	return file_writeback_write(&remote_file->writeback, buffer, count);
 }
 
 /// \brief Seek in a http:// file
@@ -204,6 +1113,12 @@ static int file_http_seek(file_t *file, uint64_t position)
 		return -1;
 	}
 	remote_file = (http_file_t*)file->priv;
+	if (remote_file->fd >= 0)
+	{
+		// blocks are fetched when read
+		file->position = position;
+		return 0;
+	}
 	if (remote_file->file)
 	{
 		return remote_file->file->file_seek(remote_file->file, position);
@@ -211,6 +1126,35 @@ static int file_http_seek(file_t *file, uint64_t position)
     return -1;
 }
 
+/// \brief Sync a http:// file
+///
+/// Uploads the local copy if it was written since it last was,
+/// see ::file_sync_t for details
+///
+static int file_http_sync(file_t *file)
+{
+	http_file_t *remote_file;
+
+	if (!file || !file->priv)
+	{
+		return -1;
+	}
+	remote_file = (http_file_t*)file->priv;
+	if (remote_file->fd >= 0)
+	{
+		return 0;
+	}
+	if (remote_file->writeback.upload)
+	{
+		return file_writeback_flush(&remote_file->writeback);
+	}
+	if (remote_file->file)
+	{
+		return remote_file->file->file_sync(remote_file->file);
+	}
+    return -1;
+}
+
 int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback_t credential_callback)
 {
 	http_file_t *remote_file;
@@ -220,6 +1164,7 @@ int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback
     file->file_read     = file_http_read;
     file->file_write    = file_http_write;
     file->file_seek     = file_http_seek;
+    file->file_sync     = file_http_sync;
 	
 	// alloc a remote file context
 	//
@@ -230,7 +1175,11 @@ int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback
 		return -1;
 	}
 	
+	memset(remote_file, 0, sizeof(http_file_t));
 	remote_file->file = NULL;
+	remote_file->fd = -1;
+	remote_file->opened_for = open_for;
+	remote_file->credential_callback = credential_callback;
 
 	// get a temporary local file name
 	//
@@ -242,81 +1191,47 @@ int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback
 		return -1;
 	}
 	
-	if (open_for == openForRead || open_for == openForAppend)
+	httpio_auth_header(file->url, credential_callback, remote_file->auth, sizeof(remote_file->auth));
+
+	// a file only read is read from the cache if it's unchanged there,
+	// else fetched as it is read: in the ranges read if the server can
+	// send ranges, else from the start on as it is read
+	//
+	if (open_for == openForRead && file_get_scheme(file->url, NULL, 0) == schemeHTTP)
 	{
-		// do an http get of the remote file into the temporary file
-		//
-        http_client_t *client;
-		char user[64];
-		char pass[64];
-		
-		// get credentials for this url
-		//
-		user[0] = '\0';
-		pass[0] = '\0';
-		if (remote_file->credential_callback)
+		result = http_cache_open(file, remote_file);
+		if (result > 0)
 		{
-			result = remote_file->credential_callback(file->url, user, sizeof(user), pass, sizeof(pass));
-			if (result)
+			result = http_range_open(file, remote_file);
+			if (result == 0)
 			{
-				user[0] = '\0';
-				pass[0] = '\0';
+				// what isn't fetched here is fetched as it's read
+				http_parallel_fetch(file, remote_file);
 			}
 		}
-
-		butil_log(3, "%s:%d %s %s\n", __FUNCTION__, __LINE__, http_method_name(httpGet), file->url);
-
-        client = http_client_create(NULL, true);
-        if (! client)
-        {
-           	butil_log(1, "No memory for http client");
+		if (result > 0)
+		{
+			result = http_stream_open(file, remote_file, remote_file->auth);
+		}
+		if (result)
+		{
+			filesys_delete(remote_file->local_path);
 			free(remote_file);
-            return -1;
-        }
-		
-        client->keepalive = false;
-
-        do
-        {
-            result = http_client_request(
-										client,
-										httpGet,
-										file->url,
-										httpTCP,
-										false,
-										remote_file->local_path,
-										NULL
-										);
-
-            while (! result)
-            {
-                result = http_client_slice(client);
-                if (result)
-                {
-                    butil_log(2, "HTTP Client Error\n");
-                    break;
-                }
-                if (client->state == httpDone)
-                {
-                    butil_log(4, "HTTP Client Complete\n");
-                    break;
-                }
-				result = http_wait_for_client_event(client, 0, 10000);
-                if (result < 0)
-                {
-                    break;
-                }
-                result = 0;
-            }
-        }
-        while (!result && client->response >= 300 && client->response < 400);
-
+			return -1;
+		}
+		file->priv = remote_file;
+		return 0;
+	}
+	
+	if (open_for == openForRead || open_for == openForAppend)
+	{
+		// do an http get of the remote file into the temporary file
+		//
+		result = http_transfer(file, remote_file, httpGet);
 		if (result)
 		{
 			butil_log(1, "HTTP Error getting %s\n", file->url);
 		}
-        butil_log(3, "HTTP Ends\n");
-        http_client_free(client);		
 	}
 
 	file->priv = remote_file;
@@ -330,6 +1245,25 @@ int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback
 		free(remote_file);
 		return -1;
 	}
+	
+	// writes are uploaded on sync and close, a file opened to write
+	// is made even if nothing is written to it
+	//
+	if (! result && (open_for == openForWrite || open_for == openForAppend))
+	{
+		file_writeback_init(&remote_file->writeback, file, remote_file->file, file_http_upload);
+		if (open_for == openForWrite)
+		{
+			file_writeback_touch(&remote_file->writeback);
+		}
+	}
     return result;
 }
 
+void file_http_set_parallel(unsigned connections, uint64_t min_size)
+{
+	pthread_mutex_lock(&s_parallel.lock);
+	s_parallel.connections = (connections > HTTP_PARALLEL_MAX) ? HTTP_PARALLEL_MAX : connections;
+	s_parallel.min_size = min_size;
+	pthread_mutex_unlock(&s_parallel.lock);
+}
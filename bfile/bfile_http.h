@@ -24,6 +24,33 @@
 
 /// \file
 ///
+/// A file read from an http:// server that takes Range requests is
+/// fetched lazily: its size is got with HEAD, and the blocks reads touch
+/// are fetched with ranged GETs into a sparse local file. Reads that
+/// follow on from the last one fetch more ahead each time, up to
+/// HTTP_RANGE_READAHEAD. Other http:// files read are fetched from the
+/// start on a thread once the response's headers arrive, and reads wait
+/// only for the bytes they need, so the start of a file can be read
+/// while the rest is on its way. https:// files, and files opened to
+/// append, are fetched whole when opened
+///
+/// On a fast link far away, one connection fetches far slower than the
+/// link can. A file fetched lazily that is big enough can instead be
+/// fetched whole when opened, in ranges on many connections at once, see
+/// ::file_http_set_parallel. A server that ignores ranges sends all of it
+/// on the first connection
+
+/// Bytes fetched at once, at least, when a file is fetched lazily
+#define HTTP_RANGE_BLOCK			(256*1024)
+
+/// Most bytes fetched ahead of reads that follow on from each other
+#define HTTP_RANGE_READAHEAD		(8*1024*1024)
+
+/// Default smallest file fetched on many connections
+#define HTTP_PARALLEL_MIN_SIZE		(16*1024*1024)
+
+/// Most connections a file is fetched on
+#define HTTP_PARALLEL_MAX			(16)
 
 
 //-----------------------------------------------------------------------------
@@ -36,4 +63,19 @@
 ///
 int file_http_setup(file_t *file, open_attribute_t open_for, credential_callback_t credential_callback);
 
+//-----------------------------------------------------------------------------
+/// \brief Set how many connections a big http:// file is fetched on
+///
+/// Files opened to read from a server that takes ranges, and at least
+/// min_size bytes, are fetched whole when opened, split in as many ranges
+/// as connections. Each range is written where it goes in the local file
+/// as it arrives. Ranges that fail are fetched when read, as they would
+/// be if the file were fetched lazily
+///
+/// @param[in] connections - connections to fetch on, 1 or 0 to fetch lazily,
+///                          at most HTTP_PARALLEL_MAX
+/// @param[in] min_size    - bytes in the smallest file fetched this way
+///
+void file_http_set_parallel(unsigned connections, uint64_t min_size);
+
 #endif
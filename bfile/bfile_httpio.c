@@ -0,0 +1,974 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfile_httpio.h"
+#include "butil.h"
+#include <strings.h>
+#include <ctype.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+/// \file
+///
+
+/// \brief Idle connections kept for reuse, with the pool's settings and counts
+///
+static struct
+{
+    pthread_mutex_t     lock;           ///< guards the pool
+    httpio_conn_t      *idle;           ///< list of idle connections, latest first
+    size_t              per_host;       ///< most idle connections for a host
+    uint32_t            idle_timeout;   ///< milliseconds an idle connection is kept
+    httpio_pool_stats_t stats;          ///< counts
+}
+s_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, HTTPIO_POOL_PER_HOST, HTTPIO_POOL_IDLE_TIMEOUT, { 0, 0, 0, 0 } };
+
+/// \brief Milliseconds since some fixed time
+///
+static uint64_t httpio_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/// \brief Close pooled connections idle too long, the pool is locked
+///
+static void httpio_pool_expire(uint64_t now)
+{
+    httpio_conn_t **pconn;
+    httpio_conn_t *conn;
+
+    pconn = &s_pool.idle;
+    while ((conn = *pconn) != NULL)
+    {
+        if ((now - conn->idle_since) >= s_pool.idle_timeout)
+        {
+            *pconn = conn->next;
+            s_pool.stats.idle--;
+            s_pool.stats.expired++;
+            httpio_close(conn);
+        }
+        else
+        {
+            pconn = &conn->next;
+        }
+    }
+}
+
+/// \brief Check an idle connection is still open, with nothing unasked sent on it
+///
+static bool httpio_still_open(httpio_conn_t *conn)
+{
+    ssize_t got;
+    uint8_t byte;
+
+    got = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/// \brief Take an idle connection to a host from the pool
+///
+/// @return connection, NULL if there is none
+///
+static httpio_conn_t *httpio_pool_take(const char *host, uint16_t port)
+{
+    httpio_conn_t **pconn;
+    httpio_conn_t *conn;
+
+    pthread_mutex_lock(&s_pool.lock);
+    httpio_pool_expire(httpio_now());
+    pconn = &s_pool.idle;
+    while ((conn = *pconn) != NULL)
+    {
+        if (conn->port != port || strcasecmp(conn->host, host))
+        {
+            pconn = &conn->next;
+            continue;
+        }
+        *pconn = conn->next;
+        s_pool.stats.idle--;
+        if (httpio_still_open(conn))
+        {
+            s_pool.stats.reused++;
+            break;
+        }
+        s_pool.stats.expired++;
+        httpio_close(conn);
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+
+    if (conn)
+    {
+        conn->next = NULL;
+        conn->reused = true;
+        conn->count = 0;
+        conn->used = 0;
+    }
+    return conn;
+}
+
+/// \brief Open a new connection to the server of an http:// url
+///
+static httpio_conn_t *httpio_open(const char *url)
+{
+    httpio_conn_t *conn;
+    butil_url_scheme_t scheme;
+    struct addrinfo hints;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    struct timeval timeout;
+    char portname[16];
+    int one;
+    int fd;
+    int result;
+
+    conn = (httpio_conn_t*)malloc(sizeof(httpio_conn_t));
+    if (! conn)
+    {
+        butil_log(0, "%s: Can't alloc connection\n", __FUNCTION__);
+        return NULL;
+    }
+    memset(conn, 0, sizeof(httpio_conn_t));
+    conn->fd = -1;
+
+    result = butil_parse_url(url, &scheme, conn->host, sizeof(conn->host), &conn->port, NULL, 0);
+    if (result || scheme != schemeHTTP)
+    {
+        butil_log(1, "%s: Can't connect for %s\n", __FUNCTION__, url);
+        free(conn);
+        return NULL;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portname, sizeof(portname), "%u", (unsigned)(conn->port ? conn->port : 80));
+
+    result = getaddrinfo(conn->host, portname, &hints, &addrs);
+    if (result)
+    {
+        butil_log(1, "%s: Can't resolve %s\n", __FUNCTION__, conn->host);
+        free(conn);
+        return NULL;
+    }
+    fd = -1;
+    for (addr = addrs; addr; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        timeout.tv_sec = HTTPIO_TIMEOUT / 1000;
+        timeout.tv_usec = (HTTPIO_TIMEOUT % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (! connect(fd, addr->ai_addr, addr->ai_addrlen))
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0)
+    {
+        butil_log(1, "%s: Can't connect to %s:%s\n", __FUNCTION__, conn->host, portname);
+        free(conn);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->keepalive = true;
+    conn->done = true;
+
+    pthread_mutex_lock(&s_pool.lock);
+    s_pool.stats.opened++;
+    pthread_mutex_unlock(&s_pool.lock);
+    return conn;
+}
+
+httpio_conn_t *httpio_connect(const char *url)
+{
+    httpio_conn_t *conn;
+    butil_url_scheme_t scheme;
+    char host[256];
+    uint16_t port;
+
+    if (! butil_parse_url(url, &scheme, host, sizeof(host), &port, NULL, 0) && scheme == schemeHTTP)
+    {
+        conn = httpio_pool_take(host, port);
+        if (conn)
+        {
+            return conn;
+        }
+    }
+    return httpio_open(url);
+}
+
+void httpio_close(httpio_conn_t *conn)
+{
+    if (! conn)
+    {
+        return;
+    }
+    if (conn->fd >= 0)
+    {
+        close(conn->fd);
+    }
+    free(conn);
+}
+
+void httpio_release(httpio_conn_t *conn)
+{
+    httpio_conn_t *other;
+    size_t count;
+
+    if (! conn)
+    {
+        return;
+    }
+    if (conn->fd < 0 || ! conn->done || ! conn->keepalive || conn->used < conn->count)
+    {
+        httpio_close(conn);
+        return;
+    }
+    pthread_mutex_lock(&s_pool.lock);
+    conn->idle_since = httpio_now();
+    httpio_pool_expire(conn->idle_since);
+
+    count = 0;
+    for (other = s_pool.idle; other; other = other->next)
+    {
+        if (other->port == conn->port && ! strcasecmp(other->host, conn->host))
+        {
+            count++;
+        }
+    }
+    if (count < s_pool.per_host)
+    {
+        conn->next = s_pool.idle;
+        s_pool.idle = conn;
+        s_pool.stats.idle++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+
+    // host has all the idle connections it can
+    httpio_close(conn);
+}
+
+void httpio_set_pool(size_t per_host, uint32_t idle_timeout)
+{
+    pthread_mutex_lock(&s_pool.lock);
+    s_pool.per_host = per_host;
+    s_pool.idle_timeout = idle_timeout;
+    pthread_mutex_unlock(&s_pool.lock);
+
+    if (! per_host)
+    {
+        httpio_flush_pool();
+    }
+}
+
+void httpio_flush_pool(void)
+{
+    httpio_conn_t *conn;
+
+    pthread_mutex_lock(&s_pool.lock);
+    while ((conn = s_pool.idle) != NULL)
+    {
+        s_pool.idle = conn->next;
+        s_pool.stats.idle--;
+        httpio_close(conn);
+    }
+    pthread_mutex_unlock(&s_pool.lock);
+}
+
+void httpio_get_pool_stats(httpio_pool_stats_t *stats)
+{
+    if (! stats)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_pool.lock);
+    httpio_pool_expire(httpio_now());
+    *stats = s_pool.stats;
+    pthread_mutex_unlock(&s_pool.lock);
+}
+
+/// \brief Send all of some bytes
+///
+/// @return 0 on success
+///
+static int httpio_send(httpio_conn_t *conn, const uint8_t *data, size_t count)
+{
+    ssize_t sent;
+
+    while (count > 0)
+    {
+        sent = send(conn->fd, data, count, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            butil_log(1, "%s: Can't send to %s\n", __FUNCTION__, conn->host);
+            conn->keepalive = false;
+            return -1;
+        }
+        data += sent;
+        count -= sent;
+    }
+    return 0;
+}
+
+/// \brief Receive more bytes into the buffer, once all of it is used
+///
+/// @return count of bytes not yet used, 0 if the server closed, < 0 on error
+///
+static int httpio_fill(httpio_conn_t *conn)
+{
+    ssize_t got;
+
+    if (conn->used < conn->count)
+    {
+        return (int)(conn->count - conn->used);
+    }
+    conn->used = 0;
+    conn->count = 0;
+    do
+    {
+        got = recv(conn->fd, conn->buffer, sizeof(conn->buffer), 0);
+    }
+    while (got < 0 && errno == EINTR);
+
+    if (got < 0)
+    {
+        butil_log(1, "%s: Can't receive from %s\n", __FUNCTION__, conn->host);
+        conn->keepalive = false;
+        return -1;
+    }
+    conn->count = (size_t)got;
+    return (int)got;
+}
+
+/// \brief Read a line, without its line ending
+///
+/// @return 0 on success
+///
+static int httpio_read_line(httpio_conn_t *conn, char *line, size_t nline)
+{
+    size_t length;
+    int result;
+    char c;
+
+    length = 0;
+    while (1)
+    {
+        result = httpio_fill(conn);
+        if (result <= 0)
+        {
+            conn->keepalive = false;
+            return -1;
+        }
+        c = (char)conn->buffer[conn->used++];
+        if (c == '\n')
+        {
+            break;
+        }
+        if (c != '\r' && length < (nline - 1))
+        {
+            line[length++] = c;
+        }
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+int httpio_send_request(httpio_conn_t *conn, const char *method, const char *url, const char *headers, int64_t content_length)
+{
+    butil_url_scheme_t scheme;
+    char host[256];
+    char path[MAX_PATH];
+    char request[MAX_PATH + 512];
+    uint16_t port;
+    int length;
+
+    if (!conn || !method || !url)
+    {
+        return -1;
+    }
+    if (butil_parse_url(url, &scheme, host, sizeof(host), &port, path, sizeof(path)))
+    {
+        butil_log(1, "%s: Bad url %s\n", __FUNCTION__, url);
+        return -1;
+    }
+    length = snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nHost: %s", method, path[0] ? path : "/", host);
+    if (port && port != 80)
+    {
+        length += snprintf(request + length, sizeof(request) - length, ":%u", (unsigned)port);
+    }
+    length += snprintf(request + length, sizeof(request) - length, "\r\n");
+    if (content_length >= 0)
+    {
+        length += snprintf(request + length, sizeof(request) - length,
+                            "Content-Length: %llu\r\n", (unsigned long long)content_length);
+    }
+    if (length >= (int)sizeof(request))
+    {
+        butil_log(1, "%s: Url too long %s\n", __FUNCTION__, url);
+        return -1;
+    }
+    butil_log(4, "%s %s\n", method, url);
+
+    conn->head = ! strcmp(method, "HEAD");
+    if (httpio_send(conn, (uint8_t*)request, length))
+    {
+        return -1;
+    }
+    if (headers && headers[0] && httpio_send(conn, (const uint8_t*)headers, strlen(headers)))
+    {
+        return -1;
+    }
+    return httpio_send(conn, (const uint8_t*)"\r\n", 2);
+}
+
+int httpio_write(httpio_conn_t *conn, const uint8_t *data, size_t count)
+{
+    if (!conn || (!data && count))
+    {
+        return -1;
+    }
+    return httpio_send(conn, data, count);
+}
+
+/// \brief Copy a header's value, trimmed of spaces
+///
+static void httpio_copy_value(const char *value, char *out, size_t nout)
+{
+    size_t length;
+
+    while (*value == ' ' || *value == '\t')
+    {
+        value++;
+    }
+    length = strlen(value);
+    while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t'))
+    {
+        length--;
+    }
+    if (length >= nout)
+    {
+        length = nout - 1;
+    }
+    memcpy(out, value, length);
+    out[length] = '\0';
+}
+
+int httpio_get_reply(httpio_conn_t *conn, httpio_reply_t *reply)
+{
+    char line[MAX_PATH + 64];
+    char value[MAX_PATH];
+    char *colon;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long total;
+    int major;
+    int minor;
+    bool close_after;
+
+    if (!conn || !reply)
+    {
+        return -1;
+    }
+    memset(reply, 0, sizeof(httpio_reply_t));
+    reply->content_length = -1;
+
+    // skip interim responses, like 100 Continue
+    //
+    do
+    {
+        if (httpio_read_line(conn, line, sizeof(line)))
+        {
+            butil_log(1, "%s: No response from %s\n", __FUNCTION__, conn->host);
+            return -1;
+        }
+        if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &reply->status) != 3)
+        {
+            butil_log(1, "%s: Bad response from %s\n", __FUNCTION__, conn->host);
+            conn->keepalive = false;
+            return -1;
+        }
+        reply->keepalive = (major > 1 || (major == 1 && minor >= 1));
+        close_after = ! reply->keepalive;
+        conn->chunked = false;
+
+        while (1)
+        {
+            if (httpio_read_line(conn, line, sizeof(line)))
+            {
+                return -1;
+            }
+            if (! line[0])
+            {
+                break;
+            }
+            colon = strchr(line, ':');
+            if (! colon)
+            {
+                continue;
+            }
+            *colon = '\0';
+            httpio_copy_value(colon + 1, value, sizeof(value));
+
+            if (! strcasecmp(line, "Content-Length"))
+            {
+                reply->content_length = strtoll(value, NULL, 10);
+            }
+            else if (! strcasecmp(line, "Content-Range"))
+            {
+                // bytes start-end/total, total can be *
+                //
+                total = 0;
+                if (sscanf(value, "bytes %llu-%llu/%llu", &start, &end, &total) >= 2)
+                {
+                    reply->has_range = true;
+                    reply->range_start = start;
+                    reply->range_total = total;
+                }
+            }
+            else if (! strcasecmp(line, "Accept-Ranges"))
+            {
+                reply->accept_ranges = (strstr(value, "bytes") != NULL);
+            }
+            else if (! strcasecmp(line, "Transfer-Encoding"))
+            {
+                conn->chunked = (strstr(value, "chunked") != NULL);
+            }
+            else if (! strcasecmp(line, "Connection"))
+            {
+                if (! strcasecmp(value, "close"))
+                {
+                    close_after = true;
+                }
+                else if (! strcasecmp(value, "keep-alive"))
+                {
+                    close_after = false;
+                }
+            }
+            else if (! strcasecmp(line, "ETag"))
+            {
+                httpio_copy_value(value, reply->etag, sizeof(reply->etag));
+            }
+            else if (! strcasecmp(line, "Last-Modified"))
+            {
+                httpio_copy_value(value, reply->last_modified, sizeof(reply->last_modified));
+            }
+            else if (! strcasecmp(line, "Location"))
+            {
+                httpio_copy_value(value, reply->location, sizeof(reply->location));
+            }
+        }
+    }
+    while (reply->status >= 100 && reply->status < 200);
+
+    reply->keepalive = ! close_after;
+
+    // how the body is framed
+    //
+    conn->done = false;
+    conn->chunks_started = false;
+    if (conn->head || reply->status == 204 || reply->status == 304)
+    {
+        conn->left = 0;
+        conn->done = true;
+        conn->chunked = false;
+    }
+    else if (conn->chunked)
+    {
+        conn->left = 0;
+    }
+    else if (reply->content_length >= 0)
+    {
+        conn->left = reply->content_length;
+        conn->done = (conn->left == 0);
+    }
+    else
+    {
+        conn->left = -1;
+        reply->keepalive = false;
+    }
+    conn->keepalive = reply->keepalive;
+    return 0;
+}
+
+/// \brief Start the next chunk of a chunked body
+///
+/// @return 0 on success
+///
+static int httpio_next_chunk(httpio_conn_t *conn, bool first)
+{
+    char line[128];
+
+    if (! first)
+    {
+        // the line ending after the last chunk's data
+        if (httpio_read_line(conn, line, sizeof(line)))
+        {
+            return -1;
+        }
+    }
+    if (httpio_read_line(conn, line, sizeof(line)))
+    {
+        return -1;
+    }
+    conn->left = strtoll(line, NULL, 16);
+    if (conn->left < 0)
+    {
+        return -1;
+    }
+    if (conn->left == 0)
+    {
+        // skip trailers
+        do
+        {
+            if (httpio_read_line(conn, line, sizeof(line)))
+            {
+                return -1;
+            }
+        }
+        while (line[0]);
+        conn->done = true;
+    }
+    return 0;
+}
+
+int httpio_read(httpio_conn_t *conn, uint8_t *data, size_t count)
+{
+    size_t take;
+    int result;
+
+    if (!conn || !data)
+    {
+        return -1;
+    }
+    if (conn->done || ! count)
+    {
+        return 0;
+    }
+    if (conn->chunked && conn->left == 0)
+    {
+        if (httpio_next_chunk(conn, ! conn->chunks_started))
+        {
+            conn->keepalive = false;
+            return -1;
+        }
+        conn->chunks_started = true;
+        if (conn->done)
+        {
+            return 0;
+        }
+    }
+    result = httpio_fill(conn);
+    if (result < 0)
+    {
+        return result;
+    }
+    if (result == 0)
+    {
+        if (conn->left < 0)
+        {
+            // body ends when the server closes
+            conn->done = true;
+            conn->keepalive = false;
+            return 0;
+        }
+        butil_log(1, "%s: Body from %s ends early\n", __FUNCTION__, conn->host);
+        conn->keepalive = false;
+        return -1;
+    }
+    take = (size_t)result;
+    if (take > count)
+    {
+        take = count;
+    }
+    if (conn->left >= 0 && take > (uint64_t)conn->left)
+    {
+        take = (size_t)conn->left;
+    }
+    memcpy(data, conn->buffer + conn->used, take);
+    conn->used += take;
+    if (conn->left >= 0)
+    {
+        conn->left -= take;
+        if (conn->left == 0 && ! conn->chunked)
+        {
+            conn->done = true;
+        }
+    }
+    return (int)take;
+}
+
+/// \brief Read and drop the rest of a response's body, so the connection can be released
+///
+static void httpio_discard(httpio_conn_t *conn)
+{
+    uint8_t data[1024];
+
+    while (httpio_read(conn, data, sizeof(data)) > 0)
+    {
+        ;
+    }
+}
+
+int httpio_request(const char *url, const char *method, const char *headers, httpio_conn_t **pconn, httpio_reply_t *reply)
+{
+    httpio_conn_t *conn;
+    char location[MAX_PATH];
+    int redirects;
+    int result;
+
+    if (!url || !method || !pconn || !reply)
+    {
+        return -1;
+    }
+    *pconn = NULL;
+    strncpy(location, url, sizeof(location) - 1);
+    location[sizeof(location) - 1] = '\0';
+
+    for (redirects = 0; redirects <= HTTPIO_MAX_REDIRECTS; redirects++)
+    {
+        conn = httpio_connect(location);
+        if (! conn)
+        {
+            return -1;
+        }
+        result = httpio_send_request(conn, method, location, headers, -1);
+        if (! result)
+        {
+            result = httpio_get_reply(conn, reply);
+        }
+        if (result && conn->reused)
+        {
+            // the server closed the kept connection as it was taken
+            //
+            butil_log(4, "%s: Kept connection to %s closed, connecting again\n", __FUNCTION__, conn->host);
+            httpio_close(conn);
+            conn = httpio_open(location);
+            if (! conn)
+            {
+                return -1;
+            }
+            result = httpio_send_request(conn, method, location, headers, -1);
+            if (! result)
+            {
+                result = httpio_get_reply(conn, reply);
+            }
+        }
+        if (result)
+        {
+            httpio_close(conn);
+            return -1;
+        }
+        if (
+                reply->status < 300 || reply->status >= 400
+            ||  reply->status == 304
+            ||  ! reply->location[0]
+            ||  ! strstr(reply->location, "://")
+        )
+        {
+            *pconn = conn;
+            return 0;
+        }
+        butil_log(3, "%s: %s redirected to %s\n", __FUNCTION__, location, reply->location);
+        strncpy(location, reply->location, sizeof(location) - 1);
+        location[sizeof(location) - 1] = '\0';
+        httpio_discard(conn);
+        httpio_release(conn);
+    }
+    butil_log(1, "%s: Too many redirects for %s\n", __FUNCTION__, url);
+    return -1;
+}
+
+/// \brief Send a request and a body read from a file, and receive the response
+///
+/// @return 0 on success
+///
+static int httpio_send_file(httpio_conn_t *conn, const char *url, const char *method, const char *headers, int fd, uint64_t length, httpio_reply_t *reply)
+{
+    uint8_t data[64*1024];
+    uint64_t offset;
+    ssize_t got;
+
+    if (httpio_send_request(conn, method, url, headers, (int64_t)length))
+    {
+        return -1;
+    }
+    for (offset = 0; offset < length; offset += got)
+    {
+        got = pread(fd, data, (length - offset) < sizeof(data) ? (size_t)(length - offset) : sizeof(data), (off_t)offset);
+        if (got <= 0)
+        {
+            butil_log(1, "%s: Can't read file to send\n", __FUNCTION__);
+            conn->keepalive = false;
+            return -2;
+        }
+        if (httpio_send(conn, data, got))
+        {
+            return -1;
+        }
+    }
+    return httpio_get_reply(conn, reply);
+}
+
+int httpio_upload(const char *url, const char *method, const char *headers, int fd, uint64_t length, httpio_reply_t *reply)
+{
+    httpio_conn_t *conn;
+    int result;
+
+    if (!url || !method || fd < 0 || !reply)
+    {
+        return -1;
+    }
+    conn = httpio_connect(url);
+    if (! conn)
+    {
+        return -1;
+    }
+    result = httpio_send_file(conn, url, method, headers, fd, length, reply);
+    if (result == -1 && conn->reused)
+    {
+        // the server closed the kept connection as it was taken
+        //
+        httpio_close(conn);
+        conn = httpio_open(url);
+        if (! conn)
+        {
+            return -1;
+        }
+        result = httpio_send_file(conn, url, method, headers, fd, length, reply);
+    }
+    if (result)
+    {
+        httpio_close(conn);
+        return -1;
+    }
+    httpio_discard(conn);
+    httpio_release(conn);
+    return 0;
+}
+
+void httpio_auth_header(const char *url, credential_callback_t credential_callback, char *header, size_t nheader)
+{
+    static const char s_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char user[64];
+    char pass[64];
+    char plain[130];
+    size_t length;
+    size_t out;
+    size_t i;
+    uint32_t bits;
+
+    if (!header || !nheader)
+    {
+        return;
+    }
+    header[0] = '\0';
+    if (!credential_callback)
+    {
+        return;
+    }
+    user[0] = '\0';
+    pass[0] = '\0';
+    if (credential_callback(url, user, sizeof(user), pass, sizeof(pass)) || ! user[0])
+    {
+        return;
+    }
+    length = snprintf(plain, sizeof(plain), "%s:%s", user, pass);
+    out = snprintf(header, nheader, "Authorization: Basic ");
+
+    for (i = 0; i < length && (out + 7) < nheader; i += 3)
+    {
+        bits = (uint32_t)(uint8_t)plain[i] << 16;
+        if ((i + 1) < length)
+        {
+            bits |= (uint32_t)(uint8_t)plain[i + 1] << 8;
+        }
+        if ((i + 2) < length)
+        {
+            bits |= (uint32_t)(uint8_t)plain[i + 2];
+        }
+        header[out++] = s_base64[(bits >> 18) & 0x3F];
+        header[out++] = s_base64[(bits >> 12) & 0x3F];
+        header[out++] = ((i + 1) < length) ? s_base64[(bits >> 6) & 0x3F] : '=';
+        header[out++] = ((i + 2) < length) ? s_base64[bits & 0x3F] : '=';
+    }
+    snprintf(header + out, nheader - out, "\r\n");
+}
+
+time_t httpio_parse_date(const char *date)
+{
+    static const char *s_months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm stamp;
+    char month[4];
+    const char *found;
+    int day;
+    int year;
+
+    if (! date)
+    {
+        return 0;
+    }
+    memset(&stamp, 0, sizeof(stamp));
+    month[0] = '\0';
+
+    if (sscanf(date, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year,
+                &stamp.tm_hour, &stamp.tm_min, &stamp.tm_sec) == 6)
+    {
+        ;
+    }
+    else if (sscanf(date, "%*[^,], %d-%3s-%d %d:%d:%d", &day, month, &year,
+                &stamp.tm_hour, &stamp.tm_min, &stamp.tm_sec) == 6)
+    {
+        // two digit years are from 1970 on
+        if (year < 70)
+        {
+            year += 2000;
+        }
+        else if (year < 100)
+        {
+            year += 1900;
+        }
+    }
+    else if (sscanf(date, "%*s %3s %d %d:%d:%d %d", month, &day,
+                &stamp.tm_hour, &stamp.tm_min, &stamp.tm_sec, &year) != 6)
+    {
+        return 0;
+    }
+    found = (strlen(month) == 3) ? strstr(s_months, month) : NULL;
+    if (! found || ((found - s_months) % 3) != 0)
+    {
+        return 0;
+    }
+    stamp.tm_mday = day;
+    stamp.tm_mon = (int)(found - s_months) / 3;
+    stamp.tm_year = year - 1900;
+    return timegm(&stamp);
+}
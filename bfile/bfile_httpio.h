@@ -0,0 +1,232 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFILE_HTTPIO_H
+#define BFILE_HTTPIO_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "bfile.h"
+
+/// \file
+///
+/// A small HTTP/1.1 client on plain sockets, for the requests the http
+/// client in bhttp can't make: ones with request headers, like Range,
+/// whose response headers are wanted, like Content-Range and ETag, and
+/// whose body is read a piece at a time
+///
+/// Only http:// is spoken, https:// files are still fetched whole with
+/// bhttp's client
+///
+/// Connections are kept open after a request, in a pool shared by every
+/// file, so the next request to the same host and port skips connecting.
+/// At most HTTPIO_POOL_PER_HOST idle connections are kept per host, each
+/// for HTTPIO_POOL_IDLE_TIMEOUT milliseconds, and a kept connection the
+/// server closed is found and dropped before it is used. A request on a
+/// kept connection that fails before any response is made again once on
+/// a new one, since the server may close a connection just as it's taken
+
+/// Bytes buffered from a connection
+#define HTTPIO_BUFFER				(16*1024)
+
+/// Milliseconds a connection waits to send or receive
+#define HTTPIO_TIMEOUT				(30000)
+
+/// Most redirects followed for a request
+#define HTTPIO_MAX_REDIRECTS		(5)
+
+/// Most idle connections kept for a host
+#define HTTPIO_POOL_PER_HOST		(4)
+
+/// Milliseconds an idle connection is kept
+#define HTTPIO_POOL_IDLE_TIMEOUT	(15000)
+
+/// Response to a request
+///
+typedef struct tag_httpio_reply
+{
+	int				status;				///< status code, 200 for example
+	int64_t			content_length;		///< Content-Length, -1 if not given
+	bool			has_range;			///< Content-Range was given
+	uint64_t		range_start;		///< first byte of Content-Range
+	uint64_t		range_total;		///< whole length from Content-Range, 0 if not given
+	bool			accept_ranges;		///< Accept-Ranges: bytes was given
+	bool			keepalive;			///< connection can take another request after this one
+	char			etag[128];			///< ETag, empty if not given
+	char			last_modified[64];	///< Last-Modified, empty if not given
+	char			location[MAX_PATH];	///< Location, empty if not given
+}
+httpio_reply_t;
+
+/// Connection to a server
+///
+typedef struct tag_httpio_conn
+{
+	int				fd;					///< socket
+	char			host[256];			///< host connected to
+	uint16_t		port;				///< port connected to
+	uint8_t			buffer[HTTPIO_BUFFER];	///< bytes received and not yet used
+	size_t			count;				///< count of bytes in buffer
+	size_t			used;				///< bytes of buffer used
+	bool			head;				///< request was HEAD, so the response has no body
+	bool			chunked;			///< body is sent in chunks
+	bool			chunks_started;		///< a chunk of the body was started
+	int64_t			left;				///< body bytes left, of the chunk if chunked, -1 if until close
+	bool			done;				///< whole body read
+	bool			keepalive;			///< connection can take another request
+	bool			reused;				///< connection was taken from the pool
+	uint64_t		idle_since;			///< millisecond it was put in the pool
+	struct tag_httpio_conn *next;		///< next idle connection in the pool
+}
+httpio_conn_t;
+
+/// Counts of the connection pool
+///
+typedef struct tag_httpio_pool_stats
+{
+	uint64_t		opened;				///< connections opened
+	uint64_t		reused;				///< connections taken from the pool
+	uint64_t		expired;			///< pooled connections closed idle too long, or found closed
+	uint64_t		idle;				///< connections in the pool now
+}
+httpio_pool_stats_t;
+
+/// \brief Connect to the server of an http:// url
+///
+/// An idle connection to the server is taken from the pool if there is one
+///
+/// @param[in] url - url to connect for
+///
+/// @return connection, NULL on error
+///
+httpio_conn_t *httpio_connect(const char *url);
+
+/// \brief Close a connection
+///
+/// @param[in] conn - connection to close, may be NULL
+///
+void httpio_close(httpio_conn_t *conn);
+
+/// \brief Put a connection back in the pool once done with it
+///
+/// It is closed instead if its response wasn't all read, the server
+/// won't keep it open, or its host has all the idle connections it can
+///
+/// @param[in] conn - connection to release, may be NULL
+///
+void httpio_release(httpio_conn_t *conn);
+
+/// \brief Set how many idle connections are kept per host, and for how long
+///
+/// @param[in] per_host     - most idle connections for a host, 0 to keep none
+/// @param[in] idle_timeout - milliseconds an idle connection is kept
+///
+void httpio_set_pool(size_t per_host, uint32_t idle_timeout);
+
+/// \brief Close all the idle connections in the pool
+///
+void httpio_flush_pool(void);
+
+/// \brief Get the pool's counts
+///
+/// @param[out] stats - gets the counts
+///
+void httpio_get_pool_stats(httpio_pool_stats_t *stats);
+
+/// \brief Send a request
+///
+/// @param[in] conn           - connection to send on
+/// @param[in] method         - method, "GET" for example
+/// @param[in] url            - url requested
+/// @param[in] headers        - more header lines, each ending in CRLF, may be NULL
+/// @param[in] content_length - bytes of body to send with ::httpio_write, < 0 for none
+///
+/// @return 0 on success
+///
+int httpio_send_request(httpio_conn_t *conn, const char *method, const char *url, const char *headers, int64_t content_length);
+
+/// \brief Send bytes of a request's body
+///
+/// @return 0 on success
+///
+int httpio_write(httpio_conn_t *conn, const uint8_t *data, size_t count);
+
+/// \brief Receive the status and headers of a response
+///
+/// @param[in]  conn  - connection request was sent on
+/// @param[out] reply - gets the response
+///
+/// @return 0 on success
+///
+int httpio_get_reply(httpio_conn_t *conn, httpio_reply_t *reply);
+
+/// \brief Read bytes of a response's body
+///
+/// @return count of bytes read, 0 at the end of the body, < 0 on error
+///
+int httpio_read(httpio_conn_t *conn, uint8_t *data, size_t count);
+
+/// \brief Connect, send a request with no body and receive the response's headers
+///
+/// Redirects are followed
+///
+/// @param[in]  url     - url to request
+/// @param[in]  method  - method, "GET" for example
+/// @param[in]  headers - more header lines, each ending in CRLF, may be NULL
+/// @param[out] pconn   - gets connection to read the body from, to be released
+/// @param[out] reply   - gets the response
+///
+/// @return 0 on success
+///
+int httpio_request(const char *url, const char *method, const char *headers, httpio_conn_t **pconn, httpio_reply_t *reply);
+
+/// \brief Send a request with a body read from a file, and receive the response
+///
+/// The response's body is read and dropped, and the connection released
+///
+/// @param[in]  url     - url to request
+/// @param[in]  method  - method, "PUT" for example
+/// @param[in]  headers - more header lines, each ending in CRLF, may be NULL
+/// @param[in]  fd      - file to send from its start
+/// @param[in]  length  - bytes of file to send
+/// @param[out] reply   - gets the response
+///
+/// @return 0 on success
+///
+int httpio_upload(const char *url, const char *method, const char *headers, int fd, uint64_t length, httpio_reply_t *reply);
+
+/// \brief Parse an HTTP date, like Last-Modified's
+///
+/// Dates like "Sun, 06 Nov 1994 08:49:37 GMT" are parsed, and the older
+/// "Sunday, 06-Nov-94 08:49:37 GMT" and "Sun Nov  6 08:49:37 1994"
+///
+/// @param[in] date - date to parse
+///
+/// @return POSIX seconds, 0 if date can't be parsed
+///
+time_t httpio_parse_date(const char *date);
+
+/// \brief Make an Authorization header line for a url, if credentials are given for it
+///
+/// @param[in]  url                 - url to make header for
+/// @param[in]  credential_callback - gets user and password, may be NULL
+/// @param[out] header              - gets header line ending in CRLF, empty if none
+/// @param[in]  nheader             - bytes of room at header
+///
+void httpio_auth_header(const char *url, credential_callback_t credential_callback, char *header, size_t nheader);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfile_writeback.h"
+#include "bfilesys.h"
+#include "butil.h"
+
+/// \file
+///
+
+/// \brief Files written back, and the thread that uploads them in the background
+///
+static struct
+{
+    pthread_mutex_t     lock;       ///< guards the list and settings
+    pthread_cond_t      wake;       ///< signalled when the interval changes
+    pthread_cond_t      released;   ///< signalled when the thread is done uploading files
+    file_writeback_t   *files;      ///< files written back
+    uint32_t            interval;   ///< milliseconds writes wait, 0 for no background uploads
+    bool                running;    ///< thread is running
+    uint32_t            generation; ///< changed to stop the running thread
+    pthread_t           thread;     ///< background thread
+}
+s_writeback = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, false, 0 };
+
+/// \brief Milliseconds since some fixed time
+///
+static uint64_t writeback_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/// \brief Upload a file's local copy if it has writes not uploaded, its lock is held
+///
+static int writeback_flush_locked(file_writeback_t *writeback)
+{
+    int result;
+
+    if (! writeback->dirty)
+    {
+        return 0;
+    }
+    if (writeback->local->file_sync && writeback->local->file_sync(writeback->local))
+    {
+        butil_log(1, "%s: Can't sync local copy of %s\n", __FUNCTION__, writeback->file->url);
+        return -1;
+    }
+    // writes made while uploading can't be, the lock is held
+    //
+    writeback->dirty = false;
+    result = writeback->upload(writeback->file);
+    if (result)
+    {
+        butil_log(1, "%s: Can't upload %s\n", __FUNCTION__, writeback->file->url);
+        writeback->dirty = true;
+        return result;
+    }
+    writeback->uploads++;
+    filesys_forget_info(writeback->file->url);
+    butil_log(4, "%s: Uploaded %s\n", __FUNCTION__, writeback->file->url);
+    return 0;
+}
+
+/// \brief Upload files with writes waiting longer than the interval
+///
+static void *writeback_thread(void *priv)
+{
+    file_writeback_t *writeback;
+    file_writeback_t *due;
+    file_writeback_t *next;
+    struct timespec until;
+    uint64_t now;
+    uint32_t wait;
+    uint32_t generation;
+
+    pthread_mutex_lock(&s_writeback.lock);
+    generation = s_writeback.generation;
+    while (s_writeback.interval && s_writeback.generation == generation)
+    {
+        // look twice an interval, so writes wait at most half again as long
+        //
+        wait = s_writeback.interval / 2;
+        if (wait < 10)
+        {
+            wait = 10;
+        }
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += wait / 1000;
+        until.tv_nsec += (long)(wait % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&s_writeback.wake, &s_writeback.lock, &until);
+        if (! s_writeback.interval || s_writeback.generation != generation)
+        {
+            break;
+        }
+        // only gather the files due under the lock, holding each so it
+        // isn't closed before it's uploaded
+        //
+        now = writeback_now();
+        due = NULL;
+        for (writeback = s_writeback.files; writeback; writeback = writeback->next)
+        {
+            // a file being written is looked at next time
+            //
+            if (pthread_mutex_trylock(&writeback->lock))
+            {
+                continue;
+            }
+            if (writeback->dirty && (now - writeback->dirty_since) >= s_writeback.interval)
+            {
+                writeback->refs++;
+                writeback->due = due;
+                due = writeback;
+            }
+            pthread_mutex_unlock(&writeback->lock);
+        }
+        if (! due)
+        {
+            continue;
+        }
+        // and upload them without it, so other files can be opened,
+        // closed, and flushed meanwhile
+        //
+        pthread_mutex_unlock(&s_writeback.lock);
+        for (writeback = due; writeback; writeback = writeback->due)
+        {
+            pthread_mutex_lock(&writeback->lock);
+            writeback_flush_locked(writeback);
+            pthread_mutex_unlock(&writeback->lock);
+        }
+        pthread_mutex_lock(&s_writeback.lock);
+        for (writeback = due; writeback; writeback = next)
+        {
+            next = writeback->due;
+            writeback->refs--;
+        }
+        pthread_cond_broadcast(&s_writeback.released);
+    }
+    pthread_mutex_unlock(&s_writeback.lock);
+    return NULL;
+}
+
+int file_writeback_init(file_writeback_t *writeback, file_t *file, file_t *local, file_upload_t upload)
+{
+    if (!writeback || !file || !local || !upload)
+    {
+        return -1;
+    }
+    memset(writeback, 0, sizeof(file_writeback_t));
+    pthread_mutex_init(&writeback->lock, NULL);
+    writeback->file = file;
+    writeback->local = local;
+    writeback->upload = upload;
+
+    pthread_mutex_lock(&s_writeback.lock);
+    writeback->next = s_writeback.files;
+    s_writeback.files = writeback;
+    pthread_mutex_unlock(&s_writeback.lock);
+    return 0;
+}
+
+void file_writeback_deinit(file_writeback_t *writeback)
+{
+    file_writeback_t **pwriteback;
+
+    if (! writeback || ! writeback->upload)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s_writeback.lock);
+    for (pwriteback = &s_writeback.files; *pwriteback; pwriteback = &(*pwriteback)->next)
+    {
+        if (*pwriteback == writeback)
+        {
+            *pwriteback = writeback->next;
+            break;
+        }
+    }
+    // the background thread may be uploading it
+    //
+    while (writeback->refs)
+    {
+        pthread_cond_wait(&s_writeback.released, &s_writeback.lock);
+    }
+    pthread_mutex_unlock(&s_writeback.lock);
+
+    if (writeback->dirty)
+    {
+        butil_log(2, "%s: Writes to %s not uploaded\n", __FUNCTION__, writeback->file->url);
+    }
+    pthread_mutex_destroy(&writeback->lock);
+    writeback->upload = NULL;
+}
+
+int file_writeback_write(file_writeback_t *writeback, uint8_t *buffer, size_t count)
+{
+    int result;
+
+    if (! writeback || ! writeback->upload)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&writeback->lock);
+    result = writeback->local->file_write(writeback->local, buffer, count);
+    if (result > 0 && ! writeback->dirty)
+    {
+        writeback->dirty = true;
+        writeback->dirty_since = writeback_now();
+    }
+    pthread_mutex_unlock(&writeback->lock);
+    return result;
+}
+
+void file_writeback_touch(file_writeback_t *writeback)
+{
+    if (! writeback || ! writeback->upload)
+    {
+        return;
+    }
+    pthread_mutex_lock(&writeback->lock);
+    if (! writeback->dirty)
+    {
+        writeback->dirty = true;
+        writeback->dirty_since = writeback_now();
+    }
+    pthread_mutex_unlock(&writeback->lock);
+}
+
+int file_writeback_flush(file_writeback_t *writeback)
+{
+    int result;
+
+    if (! writeback || ! writeback->upload)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&writeback->lock);
+    result = writeback_flush_locked(writeback);
+    pthread_mutex_unlock(&writeback->lock);
+    return result;
+}
+
+void file_writeback_set_interval(uint32_t interval)
+{
+    pthread_t thread;
+    bool stop;
+
+    pthread_mutex_lock(&s_writeback.lock);
+    s_writeback.interval = interval;
+    stop = false;
+    if (interval && ! s_writeback.running)
+    {
+        if (pthread_create(&s_writeback.thread, NULL, writeback_thread, NULL))
+        {
+            butil_log(1, "%s: Can't start write-back thread\n", __FUNCTION__);
+            s_writeback.interval = 0;
+        }
+        else
+        {
+            s_writeback.running = true;
+        }
+    }
+    else if (! interval && s_writeback.running)
+    {
+        stop = true;
+        thread = s_writeback.thread;
+        s_writeback.running = false;
+        s_writeback.generation++;
+    }
+    pthread_cond_broadcast(&s_writeback.wake);
+    pthread_mutex_unlock(&s_writeback.lock);
+
+    if (stop)
+    {
+        pthread_join(thread, NULL);
+    }
+}
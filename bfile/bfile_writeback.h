@@ -0,0 +1,111 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFILE_WRITEBACK_H
+#define BFILE_WRITEBACK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "bfile.h"
+
+/// \file
+///
+/// Write-back of remote files kept in a local copy
+///
+/// Writes to an http:// or ftp:// file go to its local copy, which is
+/// uploaded whole once: when the file is synced or closed. Writing a
+/// buffer a line at a time so costs one upload, not one per line
+///
+/// Optionally a background thread also uploads files that have had
+/// writes waiting longer than an interval, see ::file_writeback_set_interval,
+/// so a file kept open for a long time, like a journal, reaches its
+/// server without being synced
+
+/// Function that uploads the local copy of a remote file
+///
+/// @param[in] file - remote file
+///
+/// @return 0 on success
+///
+typedef int (*file_upload_t)(struct tag_file *file);
+
+/// Write-back state of a remote file
+///
+typedef struct tag_file_writeback
+{
+	pthread_mutex_t	lock;				///< held while the local copy is written or uploaded
+	bool			dirty;				///< local copy has writes not uploaded
+	uint64_t		dirty_since;		///< millisecond of the first write not uploaded
+	file_t		   *file;				///< remote file
+	file_t		   *local;				///< its local copy
+	file_upload_t	upload;				///< uploads the local copy
+	uint32_t		uploads;			///< count of uploads made
+	uint32_t		refs;				///< held by the background thread while it uploads, guarded by its list lock
+	struct tag_file_writeback *next;	///< next file the background flush looks at
+	struct tag_file_writeback *due;		///< next file the background flush uploads
+}
+file_writeback_t;
+
+//-----------------------------------------------------------------------------
+/// \brief Start writing back a remote file
+///
+/// @param[in] writeback - write-back state, in the file's context
+/// @param[in] file      - remote file
+/// @param[in] local     - its local copy, open for writing
+/// @param[in] upload    - function to upload the local copy
+///
+/// @return 0 on success
+///
+int file_writeback_init(file_writeback_t *writeback, file_t *file, file_t *local, file_upload_t upload);
+
+//-----------------------------------------------------------------------------
+/// \brief Stop writing back a remote file, without uploading it
+///
+/// @param[in] writeback - write-back state
+///
+void file_writeback_deinit(file_writeback_t *writeback);
+
+//-----------------------------------------------------------------------------
+/// \brief Write to the local copy of a remote file
+///
+/// @return number of bytes written, < 0 on error
+///
+int file_writeback_write(file_writeback_t *writeback, uint8_t *buffer, size_t count);
+
+//-----------------------------------------------------------------------------
+/// \brief Note the local copy has to be uploaded, though it wasn't written
+///
+/// A file opened for writing is, so the remote file is made even if
+/// nothing is written to it
+///
+void file_writeback_touch(file_writeback_t *writeback);
+
+//-----------------------------------------------------------------------------
+/// \brief Upload the local copy of a remote file, if it has writes not uploaded
+///
+/// @return 0 on success
+///
+int file_writeback_flush(file_writeback_t *writeback);
+
+//-----------------------------------------------------------------------------
+/// \brief Set how long writes wait before they're uploaded in the background
+///
+/// @param[in] interval - milliseconds, 0 (the default) to upload only on sync and close
+///
+void file_writeback_set_interval(uint32_t interval);
+
+#endif
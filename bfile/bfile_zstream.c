@@ -0,0 +1,728 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "bfile_zstream.h"
+#include "butil.h"
+#include <strings.h>
+#include <zlib.h>
+#if BFILE_SUPPORT_ZSTD
+#include <zstd.h>
+#endif
+
+/// \file
+///
+
+/// Compression formats read
+///
+typedef enum
+{
+    zstreamGZIP,
+    zstreamZSTD
+}
+zstream_format_t;
+
+/// \brief Place decompressing can start again from
+///
+typedef struct tag_zstream_checkpoint
+{
+	uint64_t		in;				///< offset in compressed file of first byte to decompress
+	uint64_t		out;			///< offset in decompressed bytes
+	int				bits;			///< bits of the byte before in still to decompress, for gzip
+	uint8_t			byte;			///< the byte before in, for gzip
+	uint8_t		   *window;			///< ZSTREAM_WINDOW bytes decompressed before out, NULL at the start of a member or frame
+}
+zstream_checkpoint_t;
+
+/// \brief context for a compressed file
+///
+typedef struct tag_zstream_file
+{
+	zstream_format_t format;		///< format of compressed file
+	file_t		   *file;			///< compressed file
+	z_stream		strm;			///< gzip decompressor
+	bool			raw;			///< gzip decompressor started in a member, from a checkpoint
+#if BFILE_SUPPORT_ZSTD
+	ZSTD_DStream   *zstd;			///< zstd decompressor
+#endif
+	bool			frame_done;		///< zstd decompressor is between frames
+	uint8_t		   *input;			///< bytes read from compressed file
+	size_t			input_count;	///< count of bytes in input
+	size_t			input_used;		///< bytes of input decompressed
+	uint64_t		input_end;		///< offset in compressed file of the byte after input
+	uint8_t			prev_byte;		///< last byte of the input before this one
+	uint8_t		   *window;			///< decompressed bytes, a ring for gzip
+	size_t			window_fill;	///< where decompressing into window is at
+	size_t			pending;		///< offset in window of decompressed bytes not yet read
+	size_t			npending;		///< count of decompressed bytes not yet read
+	uint64_t		out;			///< offset in decompressed bytes of the end of what was decompressed
+	bool			ended;			///< decompressed to the end of the file
+	zstream_checkpoint_t *checkpoints;	///< checkpoints, in order of offset
+	size_t			ncheckpoints;	///< count of checkpoints
+	size_t			nalloced;		///< room for checkpoints
+}
+zstream_file_t;
+
+bool file_zstream_wanted(const char *url)
+{
+    static const char *s_extensions[] = { ".gz", ".zst" };
+    size_t length;
+    size_t extlen;
+    int i;
+
+    if (! url)
+    {
+        return false;
+    }
+    length = strlen(url);
+    for (i = 0; i < (int)(sizeof(s_extensions) / sizeof(s_extensions[0])); i++)
+    {
+        extlen = strlen(s_extensions[i]);
+        if (length > extlen && ! strcasecmp(url + length - extlen, s_extensions[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// \brief Offset in compressed file of the next byte to decompress
+///
+static uint64_t zstream_in_offset(zstream_file_t *zs)
+{
+    return zs->input_end - (zs->input_count - zs->input_used);
+}
+
+/// \brief Read more of the compressed file if all of input is used
+///
+/// @return count of bytes not yet used in input, 0 at end of file, < 0 on error
+///
+static int zstream_fill_input(zstream_file_t *zs)
+{
+    int result;
+
+    if (zs->input_used < zs->input_count)
+    {
+        return (int)(zs->input_count - zs->input_used);
+    }
+    if (zs->input_count)
+    {
+        zs->prev_byte = zs->input[zs->input_count - 1];
+    }
+    result = zs->file->file_read(zs->file, zs->input, ZSTREAM_INPUT);
+    if (result < 0)
+    {
+        butil_log(2, "%s: Can't read compressed file\n", __FUNCTION__);
+        return result;
+    }
+    zs->input_count = result;
+    zs->input_used = 0;
+    zs->input_end += result;
+    return result;
+}
+
+/// \brief Note a checkpoint at where decompressing is
+///
+/// @param[in] zs          - compressed file
+/// @param[in] bits        - bits of the byte before still to decompress
+/// @param[in] with_window - keep the bytes decompressed before, in a gzip member
+///
+/// @return 0 on success
+///
+static int zstream_add_checkpoint(zstream_file_t *zs, int bits, bool with_window)
+{
+    zstream_checkpoint_t *checkpoint;
+    zstream_checkpoint_t *newcheckpoints;
+    size_t tail;
+
+    if (zs->ncheckpoints && zs->checkpoints[zs->ncheckpoints - 1].out >= zs->out)
+    {
+        // already past here
+        return 0;
+    }
+    if (zs->ncheckpoints >= zs->nalloced)
+    {
+        newcheckpoints = (zstream_checkpoint_t*)realloc(zs->checkpoints,
+                                (zs->nalloced ? zs->nalloced * 2 : 64) * sizeof(zstream_checkpoint_t));
+        if (! newcheckpoints)
+        {
+            butil_log(0, "%s: Can't alloc checkpoints\n", __FUNCTION__);
+            return -1;
+        }
+        zs->checkpoints = newcheckpoints;
+        zs->nalloced = zs->nalloced ? zs->nalloced * 2 : 64;
+    }
+    checkpoint = &zs->checkpoints[zs->ncheckpoints];
+    checkpoint->in = zstream_in_offset(zs);
+    checkpoint->out = zs->out;
+    checkpoint->bits = bits;
+    checkpoint->byte = zs->input_used ? zs->input[zs->input_used - 1] : zs->prev_byte;
+    checkpoint->window = NULL;
+
+    if (with_window)
+    {
+        checkpoint->window = (uint8_t*)malloc(ZSTREAM_WINDOW);
+        if (! checkpoint->window)
+        {
+            butil_log(0, "%s: Can't alloc window\n", __FUNCTION__);
+            return -1;
+        }
+        // the ring's oldest bytes are the ones after where it is filled to
+        //
+        tail = ZSTREAM_WINDOW - zs->window_fill;
+        memcpy(checkpoint->window, zs->window + zs->window_fill, tail);
+        memcpy(checkpoint->window + tail, zs->window, zs->window_fill);
+    }
+    zs->ncheckpoints++;
+    return 0;
+}
+
+/// \brief Start decompressing at a checkpoint
+///
+/// @return 0 on success
+///
+static int zstream_start(zstream_file_t *zs, const zstream_checkpoint_t *checkpoint)
+{
+    int result;
+
+    result = zs->file->file_seek(zs->file, checkpoint->in);
+    if (result)
+    {
+        butil_log(2, "%s: Can't reposition in compressed file\n", __FUNCTION__);
+        return -1;
+    }
+    zs->input_count = 0;
+    zs->input_used = 0;
+    zs->input_end = checkpoint->in;
+    zs->prev_byte = checkpoint->byte;
+    zs->out = checkpoint->out;
+    zs->pending = 0;
+    zs->npending = 0;
+    zs->window_fill = 0;
+    zs->ended = false;
+
+    if (zs->format == zstreamGZIP)
+    {
+        // within a member, inflate raw deflate from the block boundary
+        // with the text before it, else a whole member from its header
+        //
+        zs->raw = (checkpoint->window != NULL);
+        result = inflateReset2(&zs->strm, zs->raw ? -15 : 47);
+        if (result == Z_OK && zs->raw)
+        {
+            if (checkpoint->bits)
+            {
+                result = inflatePrime(&zs->strm, checkpoint->bits, checkpoint->byte >> (8 - checkpoint->bits));
+            }
+            if (result == Z_OK)
+            {
+                result = inflateSetDictionary(&zs->strm, checkpoint->window, ZSTREAM_WINDOW);
+            }
+            memcpy(zs->window, checkpoint->window, ZSTREAM_WINDOW);
+            zs->window_fill = ZSTREAM_WINDOW;
+        }
+        if (result != Z_OK)
+        {
+            butil_log(1, "%s: Can't restart inflate\n", __FUNCTION__);
+            return -1;
+        }
+        return 0;
+    }
+#if BFILE_SUPPORT_ZSTD
+    if (ZSTD_isError(ZSTD_initDStream(zs->zstd)))
+    {
+        butil_log(1, "%s: Can't restart zstd\n", __FUNCTION__);
+        return -1;
+    }
+#endif
+    zs->frame_done = true;
+    return 0;
+}
+
+/// \brief Decompress the next bytes of a gzip file into the window
+///
+/// @return 0 on success, with npending bytes decompressed, maybe none
+///
+static int zstream_inflate(zstream_file_t *zs)
+{
+    size_t produced;
+    int skip;
+    int result;
+
+    if (zs->window_fill >= ZSTREAM_WINDOW)
+    {
+        zs->window_fill = 0;
+    }
+    result = zstream_fill_input(zs);
+    if (result <= 0)
+    {
+        butil_log(1, "%s: Compressed file ends early\n", __FUNCTION__);
+        return -1;
+    }
+    zs->strm.next_in = zs->input + zs->input_used;
+    zs->strm.avail_in = (uInt)(zs->input_count - zs->input_used);
+    zs->strm.next_out = zs->window + zs->window_fill;
+    zs->strm.avail_out = (uInt)(ZSTREAM_WINDOW - zs->window_fill);
+
+    // stop at block boundaries, which can be checkpoints
+    //
+    result = inflate(&zs->strm, Z_BLOCK);
+
+    zs->input_used = zs->input_count - zs->strm.avail_in;
+    produced = (ZSTREAM_WINDOW - zs->window_fill) - zs->strm.avail_out;
+    zs->pending = zs->window_fill;
+    zs->npending = produced;
+    zs->window_fill += produced;
+    zs->out += produced;
+
+    if (result == Z_STREAM_END)
+    {
+        if (zs->raw)
+        {
+            // raw inflate leaves the member's crc and length
+            //
+            for (skip = 8; skip > 0; skip -= result)
+            {
+                result = zstream_fill_input(zs);
+                if (result <= 0)
+                {
+                    butil_log(1, "%s: Compressed file ends early\n", __FUNCTION__);
+                    return -1;
+                }
+                if (result > skip)
+                {
+                    result = skip;
+                }
+                zs->input_used += result;
+            }
+        }
+        // another member can follow
+        //
+        result = zstream_fill_input(zs);
+        if (result < 0)
+        {
+            return result;
+        }
+        if (result == 0)
+        {
+            zs->ended = true;
+            return 0;
+        }
+        zs->raw = false;
+        if (inflateReset2(&zs->strm, 47) != Z_OK)
+        {
+            return -1;
+        }
+        if (zs->out >= zs->checkpoints[zs->ncheckpoints - 1].out + ZSTREAM_SPAN)
+        {
+            return zstream_add_checkpoint(zs, 0, false);
+        }
+        return 0;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR)
+    {
+        butil_log(1, "%s: Bad compressed data\n", __FUNCTION__);
+        return -1;
+    }
+    // at the end of a block that isn't the member's last
+    //
+    if (
+            (zs->strm.data_type & 128)
+        &&  ! (zs->strm.data_type & 64)
+        &&  zs->out >= zs->checkpoints[zs->ncheckpoints - 1].out + ZSTREAM_SPAN
+    )
+    {
+        return zstream_add_checkpoint(zs, zs->strm.data_type & 7, true);
+    }
+    return 0;
+}
+
+#if BFILE_SUPPORT_ZSTD
+/// \brief Decompress the next bytes of a zstd file into the window
+///
+/// @return 0 on success, with npending bytes decompressed, maybe none
+///
+static int zstream_unzstd(zstream_file_t *zs)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t result;
+    int count;
+
+    count = zstream_fill_input(zs);
+    if (count < 0)
+    {
+        return count;
+    }
+    if (count == 0)
+    {
+        if (! zs->frame_done)
+        {
+            butil_log(1, "%s: Compressed file ends early\n", __FUNCTION__);
+            return -1;
+        }
+        zs->ended = true;
+        zs->npending = 0;
+        return 0;
+    }
+    in.src = zs->input;
+    in.size = zs->input_count;
+    in.pos = zs->input_used;
+    out.dst = zs->window;
+    out.size = ZSTREAM_WINDOW;
+    out.pos = 0;
+
+    result = ZSTD_decompressStream(zs->zstd, &out, &in);
+    if (ZSTD_isError(result))
+    {
+        butil_log(1, "%s: Bad compressed data: %s\n", __FUNCTION__, ZSTD_getErrorName(result));
+        return -1;
+    }
+    zs->input_used = in.pos;
+    zs->pending = 0;
+    zs->npending = out.pos;
+    zs->out += out.pos;
+
+    // every frame starts a checkpoint, seekable files have many small ones
+    //
+    zs->frame_done = (result == 0);
+    if (zs->frame_done)
+    {
+        return zstream_add_checkpoint(zs, 0, false);
+    }
+    return 0;
+}
+#endif
+
+/// \brief Decompress the next bytes of a file into the window
+///
+/// @return 0 on success, with npending bytes decompressed, maybe none
+///
+static int zstream_decompress(zstream_file_t *zs)
+{
+#if BFILE_SUPPORT_ZSTD
+    if (zs->format == zstreamZSTD)
+    {
+        return zstream_unzstd(zs);
+    }
+#endif
+    return zstream_inflate(zs);
+}
+
+/// \brief Free a compressed file's context, but not the compressed file
+///
+static void zstream_free(zstream_file_t *zs)
+{
+    size_t i;
+
+    inflateEnd(&zs->strm);
+#if BFILE_SUPPORT_ZSTD
+    if (zs->zstd)
+    {
+        ZSTD_freeDStream(zs->zstd);
+    }
+#endif
+    for (i = 0; i < zs->ncheckpoints; i++)
+    {
+        if (zs->checkpoints[i].window)
+        {
+            free(zs->checkpoints[i].window);
+        }
+    }
+    if (zs->checkpoints)
+    {
+        free(zs->checkpoints);
+    }
+    free(zs->input);
+    free(zs->window);
+    free(zs);
+}
+
+/// \brief Close a compressed file
+///
+/// See ::file_close_t for details
+///
+static int file_zstream_close(file_t *file)
+{
+    zstream_file_t *zs;
+
+    if (!file || !file->priv)
+    {
+        return -1;
+    }
+    zs = (zstream_file_t*)file->priv;
+    if (zs->file)
+    {
+        file_destroy(zs->file);
+    }
+    zstream_free(zs);
+    file->priv = NULL;
+    return 0;
+}
+
+/// \brief Read a compressed file
+///
+/// See ::file_read_t for details
+///
+static int file_zstream_read(file_t *file, uint8_t *buffer, size_t count)
+{
+    zstream_file_t *zs;
+    size_t total;
+    size_t take;
+
+    if (!file || !file->priv || !buffer)
+    {
+        return -1;
+    }
+    zs = (zstream_file_t*)file->priv;
+    total = 0;
+
+    while (total < count)
+    {
+        if (zs->npending)
+        {
+            take = count - total;
+            if (take > zs->npending)
+            {
+                take = zs->npending;
+            }
+            memcpy(buffer + total, zs->window + zs->pending, take);
+            zs->pending += take;
+            zs->npending -= take;
+            total += take;
+            continue;
+        }
+        if (zs->ended)
+        {
+            break;
+        }
+        if (zstream_decompress(zs))
+        {
+            if (total == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+    }
+    file->position += total;
+    return (int)total;
+}
+
+/// \brief Write a compressed file, which can't be done
+///
+/// See ::file_write_t for details
+///
+static int file_zstream_write(file_t *file, uint8_t *buffer, size_t count)
+{
+    butil_log(1, "%s: Compressed file %s is read only\n", __FUNCTION__, file ? file->url : "");
+    return -1;
+}
+
+/// \brief Seek in a compressed file
+///
+/// See ::file_seek_t for details
+///
+static int file_zstream_seek(file_t *file, uint64_t position)
+{
+    zstream_file_t *zs;
+    zstream_checkpoint_t *checkpoint;
+    uint64_t at;
+    size_t take;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    if (!file || !file->priv)
+    {
+        return -1;
+    }
+    zs = (zstream_file_t*)file->priv;
+    at = zs->out - zs->npending;
+
+    // the last checkpoint at or before position
+    //
+    for (lo = 0, hi = zs->ncheckpoints; (hi - lo) > 1; )
+    {
+        mid = (lo + hi) / 2;
+        if (zs->checkpoints[mid].out <= position)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    checkpoint = &zs->checkpoints[lo];
+
+    // read on from where decompressing is, unless going back or a
+    // checkpoint is nearer
+    //
+    if (position < at || (checkpoint->out > at && (position - at) > ZSTREAM_WINDOW))
+    {
+        if (zstream_start(zs, checkpoint))
+        {
+            return -1;
+        }
+        at = zs->out;
+    }
+    while (at < position)
+    {
+        if (zs->npending)
+        {
+            take = zs->npending;
+            if (take > (position - at))
+            {
+                take = (size_t)(position - at);
+            }
+            zs->pending += take;
+            zs->npending -= take;
+            at += take;
+            continue;
+        }
+        if (zs->ended)
+        {
+            // past the end, reads get nothing
+            break;
+        }
+        if (zstream_decompress(zs))
+        {
+            return -1;
+        }
+    }
+    file->position = position;
+    return 0;
+}
+
+/// \brief Sync a compressed file, nothing to do
+///
+/// See ::file_sync_t for details
+///
+static int file_zstream_sync(file_t *file)
+{
+    return 0;
+}
+
+int file_zstream_setup(file_t *file)
+{
+    zstream_file_t *zs;
+    zstream_format_t format;
+    file_t *inner;
+    uint8_t magic[4];
+    size_t count;
+    int result;
+
+    if (!file || !file->file_read || !file->file_seek)
+    {
+        return -1;
+    }
+    // sniff the format, and put the file back at its start
+    //
+    for (count = 0; count < sizeof(magic); count += result)
+    {
+        result = file->file_read(file, magic + count, sizeof(magic) - count);
+        if (result <= 0)
+        {
+            break;
+        }
+    }
+    if (file->file_seek(file, 0))
+    {
+        butil_log(2, "%s: Can't reposition in %s\n", __FUNCTION__, file->url);
+        return -1;
+    }
+    if (count >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+    {
+        format = zstreamGZIP;
+    }
+    else if (count >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+    {
+#if BFILE_SUPPORT_ZSTD
+        format = zstreamZSTD;
+#else
+        butil_log(2, "%s: No zstd support, %s read as is\n", __FUNCTION__, file->url);
+        return 0;
+#endif
+    }
+    else
+    {
+        // not compressed after all
+        return 0;
+    }
+    zs = (zstream_file_t*)malloc(sizeof(zstream_file_t));
+    inner = (file_t*)malloc(sizeof(file_t));
+    if (! zs || ! inner)
+    {
+        butil_log(0, "%s: Can't alloc compressed file\n", __FUNCTION__);
+        free(zs);
+        free(inner);
+        return -1;
+    }
+    memset(zs, 0, sizeof(zstream_file_t));
+    zs->format = format;
+    zs->input = (uint8_t*)malloc(ZSTREAM_INPUT);
+    zs->window = (uint8_t*)malloc(ZSTREAM_WINDOW);
+    result = (zs->input && zs->window) ? 0 : -1;
+
+    if (! result && format == zstreamGZIP)
+    {
+        // 47 inflates gzip or zlib headers, with the largest window
+        //
+        result = (inflateInit2(&zs->strm, 47) == Z_OK) ? 0 : -1;
+    }
+#if BFILE_SUPPORT_ZSTD
+    if (! result && format == zstreamZSTD)
+    {
+        zs->zstd = ZSTD_createDStream();
+        result = zs->zstd ? 0 : -1;
+    }
+#endif
+    if (! result)
+    {
+        // decompressing can always start at the start
+        //
+        result = zstream_add_checkpoint(zs, 0, false);
+    }
+    if (result)
+    {
+        butil_log(0, "%s: Can't set up decompressing %s\n", __FUNCTION__, file->url);
+        zstream_free(zs);
+        free(inner);
+        return -1;
+    }
+    // the compressed file moves under this one
+    //
+    memcpy(inner, file, sizeof(file_t));
+    zs->file = inner;
+
+    file->priv          = zs;
+    file->file_close    = file_zstream_close;
+    file->file_read     = file_zstream_read;
+    file->file_write    = file_zstream_write;
+    file->file_seek     = file_zstream_seek;
+    file->file_sync     = file_zstream_sync;
+    file->position      = 0;
+
+    result = zstream_start(zs, &zs->checkpoints[0]);
+    if (result)
+    {
+        // leave the file as it was, for the caller to close
+        //
+        memcpy(file, inner, sizeof(file_t));
+        zstream_free(zs);
+        free(inner);
+    }
+    return result;
+}
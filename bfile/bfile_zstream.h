@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 Brian Dodge
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef BFILE_ZSTREAM_H
+#define BFILE_ZSTREAM_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bfile.h"
+#include "bstreamio.h"
+
+/// \file
+///
+/// Reads a gzip or zstd compressed file as the bytes it decompresses to,
+/// with seeking
+///
+/// Files opened for reading whose names end in .gz or .zst, and that
+/// start with the format's magic bytes, are opened this way by
+/// ::file_create. Writing one writes plain bytes, so a file saved under
+/// its own name is read back plain
+///
+/// As a file is decompressed, checkpoints are noted that decompressing
+/// can start again from: for gzip, a deflate block boundary about every
+/// ZSTREAM_SPAN bytes with the 32K of text before it, as zlib's zran
+/// example does, and the start of each gzip member; for zstd the start of
+/// each frame, which a seekable zstd file has every few K. A seek goes
+/// back to the nearest checkpoint before the position, or reads on from
+/// where decompressing is when that is nearer, so reading lines of a
+/// buffer once it is read decompresses at most a span
+///
+/// zstd needs libzstd, build with BFILE_SUPPORT_ZSTD=1 and link it
+
+#ifndef BFILE_SUPPORT_ZSTD
+#define BFILE_SUPPORT_ZSTD 0
+#endif
+
+/// Bytes decompressed between gzip checkpoints
+#define ZSTREAM_SPAN				(1024*1024)
+
+/// Bytes of history deflate can refer back to
+#define ZSTREAM_WINDOW				(32*1024)
+
+/// Bytes of compressed file read at once
+#define ZSTREAM_INPUT				(64*1024)
+
+//-----------------------------------------------------------------------------
+/// \brief Check if a file should be opened decompressed, by its name
+///
+/// @param[in] url - url or path of file
+///
+/// @return true if the name ends in a compressed file extension
+///
+bool file_zstream_wanted(const char *url);
+
+//-----------------------------------------------------------------------------
+/// \brief Make a file opened for reading read decompressed
+///
+/// The file is left as it is if it doesn't start with gzip or zstd magic
+///
+/// @param[in] file - a file object already set up and open for reading
+///
+/// @return 0 on success, non-0 on error, leaving the file set up as it was
+///
+int file_zstream_setup(file_t *file);
+
+#endif
@@ -19,20 +19,158 @@
 #include "bfile_file.h"
 #include "bfile_http.h"
 #include "bfile_ftp.h"
+#include "bfile_httpio.h"
+#include "bfile_ftpio.h"
 #include "butil.h"
+#include <pthread.h>
 
 /// \file
 ///
 
+/// \brief Info kept about a file
+///
+typedef struct tag_filesys_info
+{
+    char            url[MAX_PATH];  ///< url of file, path for a file://, empty if unused
+    size_t          size;           ///< size of file
+    time_t          mod_time;       ///< last modification time of file
+    uint64_t        got_at;         ///< millisecond info was got
+}
+filesys_info_t;
+
+/// \brief Info kept about files
+///
+static struct
+{
+    pthread_mutex_t lock;           ///< guards the entries
+    uint32_t        ttl;            ///< milliseconds info is kept
+    filesys_info_t  entries[FILESYS_INFO_ENTRIES];  ///< info about files
+}
+s_info = { PTHREAD_MUTEX_INITIALIZER, FILESYS_INFO_TTL };
+
+/// \brief Milliseconds since some fixed time
+///
+static uint64_t filesys_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/// \brief Find info kept about a file, the info is locked
+///
+/// @return entry, NULL if none
+///
+static filesys_info_t *filesys_find_info(const char *key)
+{
+    int i;
+
+    for (i = 0; i < FILESYS_INFO_ENTRIES; i++)
+    {
+        if (s_info.entries[i].url[0] && ! strcmp(s_info.entries[i].url, key))
+        {
+            return &s_info.entries[i];
+        }
+    }
+    return NULL;
+}
+
+/// \brief Keep info about a file, in place of the oldest kept if there's no room
+///
+static void filesys_keep_info(const char *key, size_t size, time_t mod_time)
+{
+    filesys_info_t *entry;
+    int i;
+
+    pthread_mutex_lock(&s_info.lock);
+    entry = filesys_find_info(key);
+    for (i = 0; ! entry && i < FILESYS_INFO_ENTRIES; i++)
+    {
+        if (! s_info.entries[i].url[0])
+        {
+            entry = &s_info.entries[i];
+        }
+    }
+    if (! entry)
+    {
+        entry = &s_info.entries[0];
+        for (i = 1; i < FILESYS_INFO_ENTRIES; i++)
+        {
+            if (s_info.entries[i].got_at < entry->got_at)
+            {
+                entry = &s_info.entries[i];
+            }
+        }
+    }
+    strncpy(entry->url, key, sizeof(entry->url) - 1);
+    entry->url[sizeof(entry->url) - 1] = '\0';
+    entry->size = size;
+    entry->mod_time = mod_time;
+    entry->got_at = filesys_now();
+    pthread_mutex_unlock(&s_info.lock);
+}
+
+/// \brief Get info about a http:// file with a HEAD request
+///
+/// @return 0 on success
+///
+static int filesys_http_info(const char *url, size_t *size, time_t *mod_time)
+{
+    httpio_conn_t *conn;
+    httpio_reply_t reply;
+
+    if (httpio_request(url, "HEAD", NULL, &conn, &reply))
+    {
+        return -1;
+    }
+    httpio_release(conn);
+    if (reply.status != 200)
+    {
+        butil_log(2, "HTTP %d for %s\n", reply.status, url);
+        return -1;
+    }
+    *size = (reply.content_length > 0) ? (size_t)reply.content_length : 0;
+    *mod_time = httpio_parse_date(reply.last_modified);
+    return 0;
+}
+
 int filesys_info(const char *url, size_t *size, time_t *mod_time)
 {
     char path[MAX_PATH];
+    char http_url[MAX_PATH + 8];
+    const char *key;
     struct stat fstat;
+    filesys_info_t *entry;
     butil_url_scheme_t scheme;
+    uint64_t ftp_size;
+    size_t info_size;
+    time_t info_time;
     int result;
 
     scheme = file_get_scheme(url, path, sizeof(path));
-    
+
+    // files are known by the path of a file://, so with or without the scheme
+    //
+    key = (scheme == schemeFILE) ? path : url;
+
+    pthread_mutex_lock(&s_info.lock);
+    entry = filesys_find_info(key);
+    if (entry && (filesys_now() - entry->got_at) < s_info.ttl)
+    {
+        if (size)
+        {
+            *size = entry->size;
+        }
+        if (mod_time)
+        {
+            *mod_time = entry->mod_time;
+        }
+        pthread_mutex_unlock(&s_info.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&s_info.lock);
+
     switch (scheme)
     {
     case schemeFILE:
@@ -40,23 +178,87 @@ int filesys_info(const char *url, size_t *size, time_t *mod_time)
         if (result)
         {
             butil_log(2, "No such path: %s\n", path);
-            return -1;
+            break;
         }
-        if (size)
+        info_size = fstat.st_size;
+        info_time = fstat.st_mtime;
+        break;
+        
+    case schemeDAV:
+        // a dav:// server is an http:// one
+        //
+        snprintf(http_url, sizeof(http_url), "http%s", strstr(url, "://"));
+        result = filesys_http_info(http_url, &info_size, &info_time);
+        break;
+
+    case schemeHTTP:
+        result = filesys_http_info(url, &info_size, &info_time);
+        break;
+
+    case schemeFTP:
+        result = ftpio_stat(url, NULL, NULL, &ftp_size, &info_time);
+        info_size = (size_t)ftp_size;
+        break;
+
+    default:
+        butil_log(1, "Scheme %s not implemented for %s\n", butil_scheme_name(scheme), __FUNCTION__);
+        return -1;
+    }
+    if (result)
+    {
+        filesys_forget_info(key);
+        return -1;
+    }
+    filesys_keep_info(key, info_size, info_time);
+    if (size)
+    {
+        *size = info_size;
+    }
+    if (mod_time)
+    {
+        *mod_time = info_time;
+    }
+    return 0;
+}
+
+void filesys_set_info_ttl(uint32_t ttl)
+{
+    pthread_mutex_lock(&s_info.lock);
+    s_info.ttl = ttl;
+    pthread_mutex_unlock(&s_info.lock);
+}
+
+void filesys_forget_info(const char *url)
+{
+    filesys_info_t *entry;
+    char path[MAX_PATH];
+    int i;
+
+    pthread_mutex_lock(&s_info.lock);
+    if (! url)
+    {
+        for (i = 0; i < FILESYS_INFO_ENTRIES; i++)
         {
-            *size = fstat.st_size;
+            s_info.entries[i].url[0] = '\0';
         }
-        if (mod_time)
+    }
+    else if (file_get_scheme(url, path, sizeof(path)) == schemeFILE)
+    {
+        entry = filesys_find_info(path);
+        if (entry)
         {
-            *mod_time = fstat.st_mtime;
+            entry->url[0] = '\0';
         }
-        return 0;
-        
-    case schemeDAV:
-        return 0;
     }
-    butil_log(1, "Scheme %s not implemented for %s\n", butil_scheme_name(scheme), __FUNCTION__);
-    return -1;
+    else
+    {
+        entry = filesys_find_info(url);
+        if (entry)
+        {
+            entry->url[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&s_info.lock);
 }
 
 int filesys_delete(const char *url)
@@ -66,6 +268,7 @@ int filesys_delete(const char *url)
     int result;
 
     scheme = file_get_scheme(url, path, sizeof(path));
+    filesys_forget_info(url);
     
     if (scheme == schemeFILE)
     {
@@ -90,6 +293,8 @@ int filesys_move(const char *source_url, const char *destination_url)
 
     src_scheme = file_get_scheme(source_url, src_path, sizeof(src_path));
     dst_scheme = file_get_scheme(destination_url, dst_path, sizeof(dst_path));
+    filesys_forget_info(source_url);
+    filesys_forget_info(destination_url);
     
     if (src_scheme == schemeFILE && dst_scheme == schemeFILE)
     {
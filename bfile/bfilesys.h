@@ -18,20 +18,46 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 /// \file
 ///
+/// The info got about files is kept for FILESYS_INFO_TTL milliseconds, so
+/// asking again about a file, local or remote, soon after doesn't stat it
+/// again or ask its server again. Info about a file is forgotten when it
+/// is deleted, moved, or written through a ::file_t
+
+/// Default milliseconds info about a file is kept
+#define FILESYS_INFO_TTL		(5000)
+
+/// Most files info is kept about
+#define FILESYS_INFO_ENTRIES	(256)
 
 /// \brief Get info about a file
 ///
+/// file:// files are stat'd. http:// and dav:// files are asked about with
+/// HEAD, and the time is their Last-Modified, ftp:// files with SIZE and MDTM
+///
 /// @param[in]   url  		- url of file to get info for
 /// @param[out]  size     	- gets size of file, in bytes
-/// @param[out]  mod_time 	- gets last modification time of file in POSIX seconds
+/// @param[out]  mod_time 	- gets last modification time of file in POSIX seconds, 0 if unknown
 ///
 /// @return 0 on success, non-0 if url doesn't exist
 ///
 int filesys_info(const char *url, size_t *size, time_t *mod_time);
 
+/// \brief Set how long info about a file is kept
+///
+/// @param[in] ttl - milliseconds, 0 to keep none
+///
+void filesys_set_info_ttl(uint32_t ttl);
+
+/// \brief Forget info kept about a file, so the next ::filesys_info gets it again
+///
+/// @param[in] url - url of file, NULL to forget about all files
+///
+void filesys_forget_info(const char *url);
+
 /// \brief Delete an actual file
 ///
 /// @param[in] url - url of file to delete
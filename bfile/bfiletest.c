@@ -4,6 +4,13 @@
 #include "bfile.h"
 #include "bfilesys.h"
 #include "butil.h"
+#include <zlib.h>
+#include <pthread.h>
+#include "bfile_http.h"
+#include "bfile_httpio.h"
+#include "bfile_writeback.h"
+#include "bfile_cache.h"
+#include "bfile_ftpio.h"
 
 #define TEST_CHECK(condition, msg)		\
 	if (!(condition)) do { butil_log(0, "FAIL: %s:%d - %s, %s\n", __FUNCTION__, __LINE__, #condition, msg); return -1; } while(0)
@@ -143,6 +150,1214 @@ int filetest()
 	return 0;
 }
 
+/// \brief A loopback http server for testing, serving one body
+///
+typedef struct
+{
+	int listener;
+	uint16_t port;
+	const char *body;
+	size_t length;
+	bool ignore_ranges;
+	bool no_ranges;
+	useconds_t trickle;
+	const char *etag;
+	bool ignore_if_range;
+	bool bare_ranges;
+	int not_modified;
+	bool drop_after;
+	useconds_t put_delay;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int active;
+	int connections;
+	int requests;
+	size_t bytes_sent;
+	int puts;
+	char *uploaded;
+	size_t uploaded_length;
+}
+test_server_t;
+
+/// \brief Send all of some bytes
+///
+static int test_server_send(int fd, const char *data, size_t count)
+{
+	ssize_t sent;
+
+	while (count > 0)
+	{
+		sent = send(fd, data, count, MSG_NOSIGNAL);
+		if (sent <= 0)
+		{
+			return -1;
+		}
+		data += sent;
+		count -= sent;
+	}
+	return 0;
+}
+
+/// \brief Send part of the body, a piece at a time with a wait between if trickling
+///
+static int test_server_send_body(test_server_t *server, int fd, size_t start, size_t count, useconds_t trickle)
+{
+	size_t piece;
+
+	if (! trickle)
+	{
+		return test_server_send(fd, server->body + start, count);
+	}
+	while (count > 0)
+	{
+		piece = (count < 16384) ? count : 16384;
+		if (test_server_send(fd, server->body + start, piece))
+		{
+			return -1;
+		}
+		pthread_mutex_lock(&server->lock);
+		server->bytes_sent += piece;
+		pthread_mutex_unlock(&server->lock);
+		start += piece;
+		count -= piece;
+		usleep(trickle);
+	}
+	return 0;
+}
+
+/// \brief Answer requests on a connection until the client closes it
+///
+static void *test_server_connection(void *priv)
+{
+	test_server_t *server;
+	char request[4096];
+	char header[512];
+	char method[16];
+	char *range;
+	char *end;
+	char *body;
+	size_t count;
+	size_t length;
+	size_t start;
+	size_t last;
+	ssize_t got;
+	bool partial;
+	bool close_after;
+	bool ranges;
+	bool bare;
+	useconds_t trickle;
+	useconds_t delay;
+	char validators[192];
+	char *match;
+	int fd;
+
+	server = ((test_server_t**)priv)[0];
+	fd = (int)(intptr_t)((void**)priv)[1];
+	free(priv);
+	count = 0;
+
+	while (1)
+	{
+		// a request's headers, there are no bodies
+		//
+		request[count] = '\0';
+		end = strstr(request, "\r\n\r\n");
+		if (! end)
+		{
+			if (count >= sizeof(request) - 1)
+			{
+				break;
+			}
+			got = recv(fd, request + count, sizeof(request) - 1 - count, 0);
+			if (got <= 0)
+			{
+				break;
+			}
+			count += got;
+			continue;
+		}
+		*end = '\0';
+		sscanf(request, "%15s", method);
+		close_after = (strstr(request, "Connection: close") != NULL);
+
+		if (! strcmp(method, "PUT"))
+		{
+			// keep the body put, part of which may be received already
+			//
+			length = 0;
+			range = strstr(request, "Content-Length:");
+			if (range)
+			{
+				sscanf(range, "Content-Length: %zu", &length);
+			}
+			body = (char*)malloc(length + 1);
+			end += 4;
+			count -= (end - request);
+			start = (count < length) ? count : length;
+			memcpy(body, end, start);
+			count -= start;
+			memmove(request, end + start, count);
+			while (start < length && (got = recv(fd, body + start, length - start, 0)) > 0)
+			{
+				start += got;
+			}
+			pthread_mutex_lock(&server->lock);
+			server->requests++;
+			server->puts++;
+			free(server->uploaded);
+			server->uploaded = body;
+			server->uploaded_length = start;
+			delay = server->put_delay;
+			pthread_mutex_unlock(&server->lock);
+			if (delay)
+			{
+				usleep(delay);
+			}
+			if (start < length || test_server_send(fd, "HTTP/1.1 204 No Content\r\n\r\n", 27))
+			{
+				break;
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&server->lock);
+		ranges = ! server->no_ranges;
+		trickle = server->trickle;
+		partial = ranges && ! server->ignore_ranges;
+		bare = server->bare_ranges;
+		validators[0] = '\0';
+		if (server->etag)
+		{
+			snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: Mon, 01 Jan 2024 00:00:00 GMT\r\n", server->etag);
+			match = strstr(request, "If-None-Match: ");
+			if (match && ! strncmp(match + 15, server->etag, strlen(server->etag)))
+			{
+				server->requests++;
+				server->not_modified++;
+				validators[0] = '\0';
+			}
+			else
+			{
+				match = NULL;
+			}
+			// a range of a file that changed is sent as all of the file
+			//
+			range = strstr(request, "If-Range: ");
+			if (range && ! server->ignore_if_range && strncmp(range + 10, server->etag, strlen(server->etag)))
+			{
+				partial = false;
+			}
+		}
+		else
+		{
+			match = NULL;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		if (match)
+		{
+			if (test_server_send(fd, "HTTP/1.1 304 Not Modified\r\n\r\n", 29))
+			{
+				break;
+			}
+			end += 4;
+			count -= (end - request);
+			memmove(request, end, count);
+			continue;
+		}
+
+		start = 0;
+		last = server->length - 1;
+		range = strstr(request, "Range: bytes=");
+		if (range && partial)
+		{
+			sscanf(range, "Range: bytes=%zu-%zu", &start, &last);
+			if (last >= server->length)
+			{
+				last = server->length - 1;
+			}
+		}
+		else
+		{
+			partial = false;
+		}
+		if (partial)
+		{
+			snprintf(header, sizeof(header),
+					"HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\nContent-Range: bytes %zu-%zu/%zu\r\n%s\r\n",
+					last - start + 1, start, last, server->length, bare ? "" : validators);
+		}
+		else
+		{
+			snprintf(header, sizeof(header),
+					"HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s%s\r\n", server->length,
+					ranges ? "Accept-Ranges: bytes\r\n" : "", validators);
+		}
+		pthread_mutex_lock(&server->lock);
+		server->requests++;
+		if (strcmp(method, "HEAD") && ! trickle)
+		{
+			server->bytes_sent += last - start + 1;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		if (test_server_send(fd, header, strlen(header)))
+		{
+			break;
+		}
+		if (strcmp(method, "HEAD") && test_server_send_body(server, fd, start, last - start + 1, trickle))
+		{
+			break;
+		}
+		pthread_mutex_lock(&server->lock);
+		close_after |= server->drop_after;
+		pthread_mutex_unlock(&server->lock);
+		if (close_after)
+		{
+			break;
+		}
+		// keep any of the next request already received
+		//
+		end += 4;
+		count -= (end - request);
+		memmove(request, end, count);
+	}
+	close(fd);
+	pthread_mutex_lock(&server->lock);
+	server->active--;
+	pthread_mutex_unlock(&server->lock);
+	return NULL;
+}
+
+/// \brief Accept connections, each answered on a thread of its own
+///
+static void *test_server_thread(void *priv)
+{
+	test_server_t *server = (test_server_t*)priv;
+	pthread_t thread;
+	void **params;
+	int fd;
+
+	while ((fd = accept(server->listener, NULL, NULL)) >= 0)
+	{
+		params = (void**)malloc(2 * sizeof(void*));
+		params[0] = server;
+		params[1] = (void*)(intptr_t)fd;
+		pthread_mutex_lock(&server->lock);
+		server->active++;
+		server->connections++;
+		pthread_mutex_unlock(&server->lock);
+		pthread_create(&thread, NULL, test_server_connection, params);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int test_server_start(test_server_t *server, const char *body, size_t length)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+
+	memset(server, 0, sizeof(test_server_t));
+	server->body = body;
+	server->length = length;
+	pthread_mutex_init(&server->lock, NULL);
+
+	server->listener = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_CHECK(server->listener >= 0, "Can't make socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(bind(server->listener, (struct sockaddr*)&addr, sizeof(addr)) == 0, "Can't bind");
+	TEST_CHECK(listen(server->listener, 16) == 0, "Can't listen");
+	addrlen = sizeof(addr);
+	getsockname(server->listener, (struct sockaddr*)&addr, &addrlen);
+	server->port = ntohs(addr.sin_port);
+	TEST_CHECK(pthread_create(&server->thread, NULL, test_server_thread, server) == 0, "Can't start server");
+	return 0;
+}
+
+static void test_server_stop(test_server_t *server)
+{
+	int active;
+
+	// connections kept open are what keeps the server's open
+	httpio_flush_pool();
+	shutdown(server->listener, SHUT_RDWR);
+	close(server->listener);
+	pthread_join(server->thread, NULL);
+	do
+	{
+		pthread_mutex_lock(&server->lock);
+		active = server->active;
+		pthread_mutex_unlock(&server->lock);
+		if (active)
+		{
+			usleep(1000);
+		}
+	}
+	while (active);
+	free(server->uploaded);
+	server->uploaded = NULL;
+}
+
+int httprangetest()
+{
+	test_server_t server;
+	file_t *file;
+	char url[64];
+	char *text;
+	char *check;
+	char *changed;
+	size_t textlen;
+	size_t total;
+	int result;
+	int i;
+
+	text = (char*)malloc(3 * 1024 * 1024 + 100);
+	check = (char*)malloc(3 * 1024 * 1024 + 100);
+	changed = (char*)malloc(3 * 1024 * 1024 + 100);
+	TEST_CHECK(text != NULL && check != NULL && changed != NULL, "Can't alloc text");
+	for (textlen = 0; textlen < 3 * 1024 * 1024; )
+	{
+		textlen += sprintf(text + textlen, "remote line at %zu\n", textlen);
+	}
+	TEST_CHECK(test_server_start(&server, text, textlen) == 0, "Can't start server");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/big.log", (unsigned)server.port);
+
+	// opening only asks for the size
+	//
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(server.requests == 1 && server.bytes_sent == 0, "Fetched when opened");
+
+	// a read far in fetches only around it
+	//
+	TEST_CHECK(file->file_seek(file, 2 * 1024 * 1024 + 5) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 100 && ! memcmp(check, text + 2 * 1024 * 1024 + 5, 100), "Wrong text read");
+	TEST_CHECK(server.bytes_sent <= 2 * HTTP_RANGE_BLOCK, "Fetched too much for a read");
+
+	// reading it all fetches the rest, once, in few requests
+	//
+	TEST_CHECK(file->file_seek(file, 0) == 0, "Seek failed");
+	total = 0;
+	while ((result = file->file_read(file, (uint8_t*)check + total, 65536)) > 0)
+	{
+		total += result;
+	}
+	TEST_CHECK(result == 0 && total == textlen && ! memcmp(check, text, textlen), "Wrong text read through");
+	TEST_CHECK(server.bytes_sent == textlen, "Fetched more than once");
+	TEST_CHECK(server.requests < 12, "Too many requests");
+	TEST_CHECK(file->file_write(file, (uint8_t*)"x", 1) < 0, "Wrote file open for read");
+	file_destroy(file);
+
+	// a server that says it takes ranges, but sends it all anyway
+	//
+	server.ignore_ranges = true;
+	server.bytes_sent = 0;
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(file->file_seek(file, 1000) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 100 && ! memcmp(check, text + 1000, 100), "Wrong text read");
+	TEST_CHECK(file->file_seek(file, textlen - 10) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 10 && ! memcmp(check, text + textlen - 10, 10), "Wrong end read");
+	TEST_CHECK(server.bytes_sent == textlen, "Fetched more than once");
+	file_destroy(file);
+
+	// a file that changes while it's read isn't read as a mix of old and new,
+	// whether the server sees the If-Range or only sends the new ETag
+	//
+	memset(changed, 'x', textlen);
+	for (i = 0; i < 2; i++)
+	{
+		pthread_mutex_lock(&server.lock);
+		server.ignore_ranges = false;
+		server.ignore_if_range = (i == 1);
+		server.body = text;
+		server.etag = "\"v1\"";
+		pthread_mutex_unlock(&server.lock);
+		file = file_create(url, openForRead);
+		TEST_CHECK(file != NULL, "Can't open remote file");
+		result = file->file_read(file, (uint8_t*)check, 100);
+		TEST_CHECK(result == 100 && ! memcmp(check, text, 100), "Wrong text read");
+		pthread_mutex_lock(&server.lock);
+		server.body = changed;
+		server.etag = "\"v2\"";
+		pthread_mutex_unlock(&server.lock);
+		TEST_CHECK(file->file_seek(file, 2 * 1024 * 1024) == 0, "Seek failed");
+		TEST_CHECK(file->file_read(file, (uint8_t*)check, 100) < 0, "Read a file that changed");
+		TEST_CHECK(file->file_seek(file, 0) == 0, "Seek failed");
+		TEST_CHECK(file->file_read(file, (uint8_t*)check, 100) < 0, "Read what was fetched of the old file");
+		file_destroy(file);
+	}
+
+	test_server_stop(&server);
+	free(changed);
+	free(check);
+	free(text);
+	return 0;
+}
+
+int httpparalleltest()
+{
+	test_server_t server;
+	file_t *file;
+	char url[64];
+	char *text;
+	char *check;
+	size_t textlen;
+	size_t total;
+	int connections;
+	int result;
+
+	text = (char*)malloc(3 * 1024 * 1024 + 100);
+	check = (char*)malloc(3 * 1024 * 1024 + 100);
+	TEST_CHECK(text != NULL && check != NULL, "Can't alloc text");
+	for (textlen = 0; textlen < 3 * 1024 * 1024; )
+	{
+		textlen += sprintf(text + textlen, "parallel line at %zu\n", textlen);
+	}
+	TEST_CHECK(test_server_start(&server, text, textlen) == 0, "Can't start server");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/big.log", (unsigned)server.port);
+	file_http_set_parallel(4, 1024 * 1024);
+
+	// a big file is fetched when opened, a range on each connection,
+	// sent slowly enough that none is done before all are asked for
+	//
+	pthread_mutex_lock(&server.lock);
+	server.trickle = 2000;
+	pthread_mutex_unlock(&server.lock);
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	pthread_mutex_lock(&server.lock);
+	TEST_CHECK(server.bytes_sent == textlen, "Not all fetched when opened");
+	TEST_CHECK(server.requests == 5, "Not fetched in ranges");
+	connections = server.connections;
+	server.trickle = 0;
+	pthread_mutex_unlock(&server.lock);
+	TEST_CHECK(connections >= 4, "Ranges not fetched at once");
+	total = 0;
+	while ((result = file->file_read(file, (uint8_t*)check + total, 65536)) > 0)
+	{
+		total += result;
+	}
+	TEST_CHECK(result == 0 && total == textlen && ! memcmp(check, text, textlen), "Wrong text read");
+	TEST_CHECK(server.bytes_sent == textlen, "Fetched more than once");
+	file_destroy(file);
+
+	// a file too small is fetched lazily
+	//
+	file_http_set_parallel(4, textlen + 1);
+	pthread_mutex_lock(&server.lock);
+	server.bytes_sent = 0;
+	server.requests = 0;
+	pthread_mutex_unlock(&server.lock);
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(server.requests == 1 && server.bytes_sent == 0, "Fetched when opened");
+	file_destroy(file);
+
+	// a server that ignores ranges sends it all on one connection
+	//
+	file_http_set_parallel(4, 1024 * 1024);
+	pthread_mutex_lock(&server.lock);
+	server.ignore_ranges = true;
+	server.bytes_sent = 0;
+	server.requests = 0;
+	pthread_mutex_unlock(&server.lock);
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(server.requests == 2 && server.bytes_sent == textlen, "Not fetched on one connection");
+	TEST_CHECK(file->file_seek(file, textlen - 10) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 10 && ! memcmp(check, text + textlen - 10, 10), "Wrong end read");
+	TEST_CHECK(server.bytes_sent == textlen, "Fetched more than once");
+	file_destroy(file);
+
+	file_http_set_parallel(1, HTTP_PARALLEL_MIN_SIZE);
+	test_server_stop(&server);
+	free(check);
+	free(text);
+	return 0;
+}
+
+int httppooltest()
+{
+	test_server_t server;
+	httpio_pool_stats_t before;
+	httpio_pool_stats_t after;
+	file_t *file;
+	file_t *other;
+	char url[64];
+	char *text;
+	char check[100];
+	size_t textlen;
+	size_t offset;
+	int requests;
+	int result;
+
+	text = (char*)malloc(2 * 1024 * 1024 + 100);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	for (textlen = 0; textlen < 2 * 1024 * 1024; )
+	{
+		textlen += sprintf(text + textlen, "pooled line at %zu\n", textlen);
+	}
+	TEST_CHECK(test_server_start(&server, text, textlen) == 0, "Can't start server");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/pool.log", (unsigned)server.port);
+	httpio_flush_pool();
+	httpio_get_pool_stats(&before);
+
+	// reads all over one file, and another, take one connection between them
+	//
+	file = file_create(url, openForRead);
+	other = file_create(url, openForRead);
+	TEST_CHECK(file != NULL && other != NULL, "Can't open remote file");
+	for (offset = 7; offset < textlen; offset += 3 * HTTP_RANGE_BLOCK / 2)
+	{
+		TEST_CHECK(file->file_seek(file, offset) == 0, "Seek failed");
+		result = file->file_read(file, (uint8_t*)check, sizeof(check));
+		TEST_CHECK(result == sizeof(check) && ! memcmp(check, text + offset, sizeof(check)), "Wrong text read");
+		TEST_CHECK(other->file_seek(other, textlen - offset - 100) == 0, "Seek failed");
+		result = other->file_read(other, (uint8_t*)check, sizeof(check));
+		TEST_CHECK(result == sizeof(check) && ! memcmp(check, text + textlen - offset - 100, sizeof(check)), "Wrong text read");
+	}
+	requests = server.requests;
+	httpio_get_pool_stats(&after);
+	TEST_CHECK(requests > 6 && server.connections == 1, "Connection not reused");
+	TEST_CHECK(after.opened - before.opened == 1, "Opened more than one connection");
+	TEST_CHECK(after.reused - before.reused == (uint64_t)(requests - 1), "Reuse not counted");
+	TEST_CHECK(after.idle == 1, "Connection not kept");
+
+	// an idle connection is closed once it is idle too long
+	//
+	httpio_set_pool(HTTPIO_POOL_PER_HOST, 50);
+	usleep(120000);
+	httpio_get_pool_stats(&after);
+	TEST_CHECK(after.idle == 0 && after.expired - before.expired == 1, "Idle connection not closed");
+	file_destroy(file);
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(server.connections == 2, "Expired connection used");
+	httpio_set_pool(HTTPIO_POOL_PER_HOST, HTTPIO_POOL_IDLE_TIMEOUT);
+
+	// a kept connection the server drops is connected again
+	//
+	pthread_mutex_lock(&server.lock);
+	server.drop_after = true;
+	pthread_mutex_unlock(&server.lock);
+	for (offset = 3 * HTTP_RANGE_BLOCK + 1; offset < 5 * HTTP_RANGE_BLOCK; offset += HTTP_RANGE_BLOCK)
+	{
+		TEST_CHECK(other->file_seek(other, offset) == 0, "Seek failed");
+		result = other->file_read(other, (uint8_t*)check, sizeof(check));
+		TEST_CHECK(result == sizeof(check) && ! memcmp(check, text + offset, sizeof(check)), "Dropped connection read wrong");
+	}
+	pthread_mutex_lock(&server.lock);
+	server.drop_after = false;
+	pthread_mutex_unlock(&server.lock);
+	file_destroy(other);
+	file_destroy(file);
+
+	// with no connections kept each request connects
+	//
+	httpio_set_pool(0, HTTPIO_POOL_IDLE_TIMEOUT);
+	requests = server.requests - server.connections;
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(file->file_read(file, (uint8_t*)check, sizeof(check)) == sizeof(check), "Read failed");
+	file_destroy(file);
+	TEST_CHECK(server.requests - server.connections == requests, "Connection kept with no pool");
+	httpio_set_pool(HTTPIO_POOL_PER_HOST, HTTPIO_POOL_IDLE_TIMEOUT);
+
+	// a file fetched whole uses the pool too
+	//
+	requests = server.connections;
+	file = file_create(url, openForAppend);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	file_destroy(file);
+	file = file_create(url, openForAppend);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	file_destroy(file);
+	TEST_CHECK(server.connections == requests + 1, "Whole fetch not pooled");
+
+	test_server_stop(&server);
+	free(text);
+	return 0;
+}
+
+/// \brief Count of PUTs made, and check the last put body
+///
+static int test_server_puts(test_server_t *server, const char *text, size_t length)
+{
+	int puts;
+
+	pthread_mutex_lock(&server->lock);
+	puts = server->puts;
+	if (text && (server->uploaded_length != length || memcmp(server->uploaded, text, length)))
+	{
+		puts = -1;
+	}
+	pthread_mutex_unlock(&server->lock);
+	return puts;
+}
+
+int httpwritetest()
+{
+	test_server_t server;
+	file_t *file;
+	file_t *other;
+	struct timespec started;
+	struct timespec now;
+	long elapsed;
+	char url[64];
+	char line[64];
+	char *text;
+	size_t textlen;
+	size_t length;
+	int lines;
+	int result;
+
+	text = (char*)malloc(256 * 1024);
+	TEST_CHECK(text != NULL, "Can't alloc text");
+	TEST_CHECK(test_server_start(&server, "", 0) == 0, "Can't start server");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/saved.txt", (unsigned)server.port);
+
+	// writes a line at a time are uploaded once, on sync
+	//
+	file = file_create(url, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	for (lines = 0, textlen = 0; lines < 5000; lines++)
+	{
+		length = snprintf(line, sizeof(line), "saved line %d\n", lines);
+		result = file->file_write(file, (uint8_t*)line, length);
+		TEST_CHECK(result == (int)length, "Write failed");
+		memcpy(text + textlen, line, length);
+		textlen += length;
+	}
+	TEST_CHECK(test_server_puts(&server, NULL, 0) == 0, "Uploaded before sync");
+	TEST_CHECK(file->file_sync(file) == 0, "Sync failed");
+	TEST_CHECK(test_server_puts(&server, text, textlen) == 1, "Not uploaded once on sync");
+	TEST_CHECK(file->file_sync(file) == 0 && test_server_puts(&server, NULL, 0) == 1, "Uploaded again with no writes");
+
+	// and the rest on close
+	//
+	result = file->file_write(file, (uint8_t*)"last\n", 5);
+	TEST_CHECK(result == 5, "Write failed");
+	memcpy(text + textlen, "last\n", 5);
+	textlen += 5;
+	file_destroy(file);
+	TEST_CHECK(test_server_puts(&server, text, textlen) == 2, "Not uploaded on close");
+
+	// a file opened to write and not written is made empty
+	//
+	file = file_create(url, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	file_destroy(file);
+	TEST_CHECK(test_server_puts(&server, "", 0) == 3, "Empty file not made");
+
+	// writes left waiting are uploaded in the background
+	//
+	file_writeback_set_interval(50);
+	file = file_create(url, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	result = file->file_write(file, (uint8_t*)"background\n", 11);
+	TEST_CHECK(result == 11, "Write failed");
+	for (lines = 0; lines < 100 && test_server_puts(&server, NULL, 0) < 4; lines++)
+	{
+		usleep(10000);
+	}
+	TEST_CHECK(test_server_puts(&server, "background\n", 11) == 4, "Not uploaded in the background");
+	file_destroy(file);
+	TEST_CHECK(test_server_puts(&server, NULL, 0) == 4, "Uploaded again with no writes");
+
+	// other files are opened while one is uploaded in the background
+	//
+	pthread_mutex_lock(&server.lock);
+	server.put_delay = 500000;
+	pthread_mutex_unlock(&server.lock);
+	file = file_create(url, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	result = file->file_write(file, (uint8_t*)"slow\n", 5);
+	TEST_CHECK(result == 5, "Write failed");
+	for (lines = 0; lines < 100 && test_server_puts(&server, NULL, 0) < 5; lines++)
+	{
+		usleep(10000);
+	}
+	TEST_CHECK(test_server_puts(&server, NULL, 0) == 5, "Not uploading in the background");
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	other = file_create(url, openForWrite);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	TEST_CHECK(other != NULL, "Can't open remote file");
+	elapsed = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000;
+	TEST_CHECK(elapsed < 250, "Open waited for a background upload");
+	file_destroy(other);
+	file_destroy(file);
+	pthread_mutex_lock(&server.lock);
+	server.put_delay = 0;
+	pthread_mutex_unlock(&server.lock);
+	file_writeback_set_interval(0);
+
+	test_server_stop(&server);
+	free(text);
+	return 0;
+}
+
+int httpstreamtest()
+{
+	test_server_t server;
+	file_t *file;
+	char url[64];
+	char *text;
+	char *check;
+	size_t textlen;
+	size_t total;
+	size_t sent;
+	int result;
+
+	text = (char*)malloc(1024 * 1024 + 100);
+	check = (char*)malloc(1024 * 1024 + 100);
+	TEST_CHECK(text != NULL && check != NULL, "Can't alloc text");
+	for (textlen = 0; textlen < 1024 * 1024; )
+	{
+		textlen += sprintf(text + textlen, "streamed line at %zu\n", textlen);
+	}
+	TEST_CHECK(test_server_start(&server, text, textlen) == 0, "Can't start server");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/stream.log", (unsigned)server.port);
+
+	// a server that can't send ranges, sending slowly
+	//
+	pthread_mutex_lock(&server.lock);
+	server.no_ranges = true;
+	server.trickle = 5000;
+	pthread_mutex_unlock(&server.lock);
+
+	// the start of the file can be read well before all of it is sent
+	//
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	pthread_mutex_lock(&server.lock);
+	sent = server.bytes_sent;
+	pthread_mutex_unlock(&server.lock);
+	TEST_CHECK(result > 0 && ! memcmp(check, text, result), "Wrong text read");
+	TEST_CHECK(sent < textlen / 2, "Read waited for the whole file");
+
+	// reading on waits for the rest
+	//
+	total = result;
+	while ((result = file->file_read(file, (uint8_t*)check + total, 65536)) > 0)
+	{
+		total += result;
+	}
+	TEST_CHECK(result == 0 && total == textlen && ! memcmp(check, text, textlen), "Wrong text read through");
+
+	// and seeking back reads what was received
+	//
+	TEST_CHECK(file->file_seek(file, 1000) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 100 && ! memcmp(check, text + 1000, 100), "Wrong text read after seek");
+	file_destroy(file);
+
+	// closing a file part way through fetching it stops the fetch
+	//
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	TEST_CHECK(file->file_seek(file, 200000) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result > 0 && ! memcmp(check, text + 200000, result), "Wrong text read ahead");
+	file_destroy(file);
+
+	test_server_stop(&server);
+	free(check);
+	free(text);
+	return 0;
+}
+
+/// \brief Read all of a remote file and check it
+///
+static int read_remote(const char *url, const char *text, size_t textlen, size_t limit)
+{
+	file_t *file;
+	char *check;
+	size_t total;
+	int result;
+
+	check = (char*)malloc(textlen + 65536);
+	TEST_CHECK(check != NULL, "Can't alloc text");
+	file = file_create(url, openForRead);
+	TEST_CHECK(file != NULL, "Can't open remote file");
+	total = 0;
+	while (total < limit && (result = file->file_read(file, (uint8_t*)check + total, 65536)) > 0)
+	{
+		total += result;
+	}
+	file_destroy(file);
+	TEST_CHECK(total >= textlen || total >= limit, "Short read");
+	TEST_CHECK(! memcmp(check, text, total < textlen ? total : textlen), "Wrong text read");
+	free(check);
+	return 0;
+}
+
+/// \brief Make a local file holding some text
+///
+static int make_test_file(const char *name, const char *text, size_t length)
+{
+	FILE *out;
+
+	out = fopen(name, "w");
+	TEST_CHECK(out != NULL, "Can't make file");
+	TEST_CHECK(fwrite(text, 1, length, out) == length, "Can't write file");
+	TEST_CHECK(fclose(out) == 0, "Can't close file");
+	return 0;
+}
+
+/// \brief Check a local file holds some text
+///
+static int check_test_file(const char *name, const char *text, size_t length)
+{
+	FILE *in;
+	char check[256];
+	size_t got;
+
+	in = fopen(name, "r");
+	TEST_CHECK(in != NULL, "Can't open file");
+	got = fread(check, 1, sizeof(check), in);
+	fclose(in);
+	TEST_CHECK(got == length && ! memcmp(check, text, length), "Wrong text in file");
+	return 0;
+}
+
+int httpcachetest()
+{
+	test_server_t server;
+	file_cache_entry_t entry;
+	char dir[64];
+	char url[64];
+	char path[MAX_PATH];
+	char local[80];
+	char part[MAX_PATH + 16];
+	char *text;
+	char *changed;
+	size_t textlen;
+	size_t sent;
+	int requests;
+
+	text = (char*)malloc(600 * 1024);
+	changed = (char*)malloc(600 * 1024);
+	TEST_CHECK(text != NULL && changed != NULL, "Can't alloc text");
+	for (textlen = 0; textlen < 512 * 1024; )
+	{
+		sprintf(changed + textlen, "changed line %8zu\n", textlen);
+		textlen += sprintf(text + textlen, "cached line %9zu\n", textlen);
+	}
+	strcpy(dir, "bfilecache.XXXXXX");
+	TEST_CHECK(mkdtemp(dir) != NULL, "Can't make cache dir");
+	TEST_CHECK(file_cache_set_dir(dir) == 0, "Can't set cache dir");
+
+	TEST_CHECK(test_server_start(&server, text, textlen) == 0, "Can't start server");
+	pthread_mutex_lock(&server.lock);
+	server.no_ranges = true;
+	server.etag = "\"v1\"";
+	pthread_mutex_unlock(&server.lock);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/cached.log", (unsigned)server.port);
+
+	// a file read whole is kept, and read from the cache while unchanged
+	//
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read remote file");
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) == 0, "Not cached");
+	TEST_CHECK(! strcmp(entry.etag, "\"v1\"") && entry.size == textlen, "Cached wrong");
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read cached file");
+	pthread_mutex_lock(&server.lock);
+	sent = server.bytes_sent;
+	TEST_CHECK(server.not_modified == 1, "Not asked for on condition");
+	pthread_mutex_unlock(&server.lock);
+	TEST_CHECK(sent == textlen, "Fetched again while unchanged");
+
+	// a changed file is fetched again, and kept in place of the old
+	//
+	pthread_mutex_lock(&server.lock);
+	server.body = changed;
+	server.etag = "\"v2\"";
+	pthread_mutex_unlock(&server.lock);
+	TEST_CHECK(read_remote(url, changed, textlen, textlen) == 0, "Can't read changed file");
+	TEST_CHECK(read_remote(url, changed, textlen, textlen) == 0, "Can't read cached changed file");
+	pthread_mutex_lock(&server.lock);
+	sent = server.bytes_sent;
+	TEST_CHECK(server.not_modified == 2, "Changed file not cached");
+	server.body = text;
+	server.etag = "\"v1\"";
+	server.no_ranges = false;
+	pthread_mutex_unlock(&server.lock);
+	TEST_CHECK(sent == 2 * textlen, "Fetched again while unchanged");
+
+	// a file fetched in ranges is kept once all of it is fetched
+	//
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/partial.log", (unsigned)server.port);
+	TEST_CHECK(read_remote(url, text, textlen, 1000) == 0, "Can't read remote file");
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) != 0, "Part of a file cached");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/ranged.log", (unsigned)server.port);
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read remote file");
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) == 0, "Ranged file not cached");
+	requests = server.requests;
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read cached file");
+	TEST_CHECK(server.requests == requests + 1, "Cached file fetched again");
+
+	// but not if its ranges came without a validator to check they're of the same file
+	//
+	pthread_mutex_lock(&server.lock);
+	server.bare_ranges = true;
+	pthread_mutex_unlock(&server.lock);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/unchecked.log", (unsigned)server.port);
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read remote file");
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) != 0, "Unchecked ranges cached");
+	pthread_mutex_lock(&server.lock);
+	server.bare_ranges = false;
+	pthread_mutex_unlock(&server.lock);
+
+	// the cache is kept under its limit by removing what was used longest ago
+	//
+	file_cache_set_limit(5 * textlen / 2);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/cached.log", (unsigned)server.port);
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) == 0, "Not cached");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/third.log", (unsigned)server.port);
+	TEST_CHECK(read_remote(url, text, textlen, textlen) == 0, "Can't read remote file");
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) == 0, "Newest not kept");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/ranged.log", (unsigned)server.port);
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) != 0, "Oldest not removed");
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/cached.log", (unsigned)server.port);
+	TEST_CHECK(file_cache_lookup(url, &entry, path, sizeof(path)) == 0, "Recently used removed");
+
+	// a body whose meta file can't be written isn't kept, the local file is left
+	//
+	snprintf(local, sizeof(local), "%s.local", dir);
+	TEST_CHECK(make_test_file(local, "kept\n", 5) == 0, "Can't make local file");
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.etag, "\"v1\"");
+	TEST_CHECK(file_cache_store("http://127.0.0.1/meta.log", local, &entry, path, sizeof(path)) == 0, "Can't keep file");
+	snprintf(part, sizeof(part), "%.*s.meta.part", (int)(strlen(path) - 5), path);
+	TEST_CHECK(mkdir(part, 0700) == 0, "Can't block meta file");
+	TEST_CHECK(make_test_file(local, "again\n", 6) == 0, "Can't make local file");
+	TEST_CHECK(file_cache_store("http://127.0.0.1/meta.log", local, &entry, NULL, 0) != 0, "Kept without a meta file");
+	TEST_CHECK(access(path, F_OK) != 0, "Body left without a meta file");
+	TEST_CHECK(check_test_file(local, "again\n", 6) == 0, "Local file not left as it was");
+	TEST_CHECK(file_cache_lookup("http://127.0.0.1/meta.log", &entry, path, sizeof(path)) != 0, "Found without a meta file");
+	rmdir(part);
+	unlink(local);
+
+	// empty the cache
+	//
+	file_cache_set_limit(0);
+	TEST_CHECK(rmdir(dir) == 0, "Cache not emptied");
+	file_cache_set_dir(NULL);
+	file_cache_set_limit(FILE_CACHE_LIMIT);
+
+	test_server_stop(&server);
+	free(changed);
+	free(text);
+	return 0;
+}
+
+/// \brief A loopback ftp server for testing, answering one login's commands
+///
+static void *test_ftp_server(void *priv)
+{
+	char line[256];
+	const char *reply;
+	ssize_t got;
+	size_t count;
+	int listener;
+	int fd;
+
+	listener = (int)(intptr_t)priv;
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	test_server_send(fd, "220-Test server\r\n220 Ready\r\n", 28);
+	count = 0;
+	while ((got = recv(fd, line + count, 1, 0)) > 0)
+	{
+		if (line[count] != '\n' && count < sizeof(line) - 2)
+		{
+			count++;
+			continue;
+		}
+		line[count] = '\0';
+		count = 0;
+		if (! strncmp(line, "USER", 4))
+		{
+			reply = "331 Password\r\n";
+		}
+		else if (! strncmp(line, "PASS", 4))
+		{
+			reply = "230 Logged in\r\n";
+		}
+		else if (! strncmp(line, "SIZE dir/file.txt", 17))
+		{
+			reply = "213 123456\r\n";
+		}
+		else if (! strncmp(line, "MDTM dir/file.txt", 17))
+		{
+			reply = "213 20200102030405\r\n";
+		}
+		else if (! strncmp(line, "SIZE", 4))
+		{
+			reply = "550 No such file\r\n";
+		}
+		else if (! strncmp(line, "QUIT", 4))
+		{
+			test_server_send(fd, "221 Bye\r\n", 9);
+			break;
+		}
+		else
+		{
+			reply = "200 OK\r\n";
+		}
+		test_server_send(fd, reply, strlen(reply));
+	}
+	close(fd);
+	return NULL;
+}
+
+int ftpstattest()
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	pthread_t thread;
+	char url[64];
+	uint64_t size;
+	time_t mod_time;
+	int listener;
+	int result;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_CHECK(listener >= 0, "Can't make socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0, "Can't bind");
+	TEST_CHECK(listen(listener, 4) == 0, "Can't listen");
+	addrlen = sizeof(addr);
+	getsockname(listener, (struct sockaddr*)&addr, &addrlen);
+
+	// size and time of a file
+	//
+	pthread_create(&thread, NULL, test_ftp_server, (void*)(intptr_t)listener);
+	snprintf(url, sizeof(url), "ftp://127.0.0.1:%u/dir/file.txt", (unsigned)ntohs(addr.sin_port));
+	result = ftpio_stat(url, "user", "secret", &size, &mod_time);
+	pthread_join(thread, NULL);
+	TEST_CHECK(result == 0 && size == 123456, "Wrong size");
+	TEST_CHECK(mod_time == 1577934245, "Wrong modification time");
+
+	// and of one that isn't there
+	//
+	pthread_create(&thread, NULL, test_ftp_server, (void*)(intptr_t)listener);
+	snprintf(url, sizeof(url), "ftp://127.0.0.1:%u/dir/none.txt", (unsigned)ntohs(addr.sin_port));
+	result = ftpio_stat(url, NULL, NULL, &size, &mod_time);
+	pthread_join(thread, NULL);
+	TEST_CHECK(result < 0, "Size of no file");
+
+	close(listener);
+	return 0;
+}
+
+int fileinfotest()
+{
+	test_server_t server;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	pthread_t thread;
+	file_t *file;
+	FILE *out;
+	char url[64];
+	char filename[MAX_PATH];
+	size_t size;
+	time_t mod_time;
+	int listener;
+	int result;
+
+	// dates in each form
+	//
+	TEST_CHECK(httpio_parse_date("Sun, 06 Nov 1994 08:49:37 GMT") == 784111777, "Wrong date");
+	TEST_CHECK(httpio_parse_date("Sunday, 06-Nov-94 08:49:37 GMT") == 784111777, "Wrong old date");
+	TEST_CHECK(httpio_parse_date("Sun Nov  6 08:49:37 1994") == 784111777, "Wrong asctime date");
+	TEST_CHECK(httpio_parse_date("yesterday") == 0, "Parsed a bad date");
+
+	// http:// files are asked about once while their info is kept
+	//
+	TEST_CHECK(test_server_start(&server, "0123456789", 10) == 0, "Can't start server");
+	pthread_mutex_lock(&server.lock);
+	server.etag = "\"v1\"";
+	pthread_mutex_unlock(&server.lock);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%u/info.log", (unsigned)server.port);
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 10 && mod_time == 1704067200, "Wrong http info");
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 10 && server.requests == 1, "Asked again for kept info");
+	filesys_forget_info(url);
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && server.requests == 2, "Kept info not forgotten");
+	snprintf(url, sizeof(url), "dav://127.0.0.1:%u/info.log", (unsigned)server.port);
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 10 && server.requests == 3, "Wrong dav info");
+	filesys_set_info_ttl(0);
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && server.requests == 4, "Info kept when it shouldn't be");
+	filesys_set_info_ttl(FILESYS_INFO_TTL);
+	test_server_stop(&server);
+
+	// local files are forgotten about when written through a file
+	//
+	result = create_temp_file(&file, filename, sizeof(filename));
+	TEST_CHECK(result == 0, "Can't create temp file");
+	TEST_CHECK(file->file_write(file, (uint8_t*)"hello\n", 6) == 6, "Can't write file");
+	file_destroy(file);
+	result = filesys_info(filename, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 6, "Wrong file info");
+	out = fopen(filename, "a");
+	TEST_CHECK(out != NULL, "Can't open file");
+	fputs("world\n", out);
+	fclose(out);
+	result = filesys_info(filename, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 6, "Info not kept");
+	file = file_create(filename, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open file to write");
+	TEST_CHECK(file->file_write(file, (uint8_t*)"written\n", 8) == 8, "Can't write file");
+	file_destroy(file);
+	result = filesys_info(filename, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 8, "Info not forgotten once written");
+	filesys_delete(filename);
+	TEST_CHECK(filesys_info(filename, &size, &mod_time) != 0, "Info kept once deleted");
+
+	// ftp:// files are asked about with SIZE and MDTM
+	//
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_CHECK(listener >= 0, "Can't make socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	TEST_CHECK(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0, "Can't bind");
+	TEST_CHECK(listen(listener, 4) == 0, "Can't listen");
+	addrlen = sizeof(addr);
+	getsockname(listener, (struct sockaddr*)&addr, &addrlen);
+	pthread_create(&thread, NULL, test_ftp_server, (void*)(intptr_t)listener);
+	snprintf(url, sizeof(url), "ftp://127.0.0.1:%u/dir/file.txt", (unsigned)ntohs(addr.sin_port));
+	result = filesys_info(url, &size, &mod_time);
+	pthread_join(thread, NULL);
+	TEST_CHECK(result == 0 && size == 123456 && mod_time == 1577934245, "Wrong ftp info");
+
+	// the server is gone, so this has to be what was kept
+	//
+	close(listener);
+	result = filesys_info(url, &size, &mod_time);
+	TEST_CHECK(result == 0 && size == 123456, "Kept ftp info not used");
+	filesys_forget_info(NULL);
+	return 0;
+}
+
 int httpfiletest()
 {
 	file_t *file;
@@ -178,6 +1393,109 @@ int ftpfiletest()
 	file_destroy(file);
 }
 
+/// \brief Write text to a gzip file as two members
+///
+static int write_gzip_file(const char *name, const char *text, size_t length)
+{
+	gzFile gz;
+	size_t half;
+
+	half = length / 2;
+	gz = gzopen(name, "wb");
+	TEST_CHECK(gz != NULL, "Can't create gzip file");
+	TEST_CHECK(gzwrite(gz, text, half) == (int)half, "Can't write gzip file");
+	gzclose(gz);
+	gz = gzopen(name, "ab");
+	TEST_CHECK(gz != NULL, "Can't append gzip file");
+	TEST_CHECK(gzwrite(gz, text + half, length - half) == (int)(length - half), "Can't write gzip file");
+	gzclose(gz);
+	return 0;
+}
+
+int zstreamtest()
+{
+	file_t *file;
+	char filename[MAX_PATH];
+	char *text;
+	char *check;
+	size_t textlen;
+	size_t total;
+	uint64_t position;
+	uint32_t seed;
+	int pass;
+	int result;
+
+	text = (char*)malloc(6 * 1024 * 1024);
+	check = (char*)malloc(6 * 1024 * 1024);
+	TEST_CHECK(text != NULL && check != NULL, "Can't alloc text");
+
+	// lines that compress, but not to nothing
+	//
+	for (textlen = 0, seed = 1; textlen < 5 * 1024 * 1024; )
+	{
+		seed = seed * 1103515245 + 12345;
+		textlen += sprintf(text + textlen, "%u: log line %u of %u\n", (unsigned)textlen, seed >> 16, seed & 0xFFF);
+	}
+	result = filesys_get_temp("bziptemp", filename, sizeof(filename) - 4);
+	TEST_CHECK(result == 0, "Can't get temp file");
+	strcat(filename, ".gz");
+	TEST_CHECK(write_gzip_file(filename, text, textlen) == 0, "Can't make gzip file");
+
+	// read straight through, which checkpoints it
+	//
+	file = file_create(filename, openForRead);
+	TEST_CHECK(file != NULL, "Can't open gzip file");
+	total = 0;
+	while ((result = file->file_read(file, (uint8_t*)check + total, 100000)) > 0)
+	{
+		total += result;
+	}
+	TEST_CHECK(result == 0, "Read error");
+	TEST_CHECK(total == textlen && ! memcmp(check, text, textlen), "Wrong text read");
+	TEST_CHECK(file->file_write(file, (uint8_t*)text, 10) < 0, "Wrote compressed file");
+
+	// seek around, back and forward, past the member boundary
+	//
+	for (pass = 0, seed = 7; pass < 200; pass++)
+	{
+		seed = seed * 1103515245 + 12345;
+		position = (seed >> 8) % (textlen - 1000);
+		if (pass == 0)
+		{
+			position = textlen / 2 - 10;
+		}
+		TEST_CHECK(file->file_seek(file, position) == 0, "Seek failed");
+		result = file->file_read(file, (uint8_t*)check, 1000);
+		TEST_CHECK(result == 1000 && ! memcmp(check, text + position, 1000), "Wrong text after seek");
+	}
+	TEST_CHECK(file->file_seek(file, textlen - 5) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 1000);
+	TEST_CHECK(result == 5 && ! memcmp(check, text + textlen - 5, 5), "Wrong end of file");
+	TEST_CHECK(file->file_seek(file, textlen + 100) == 0, "Seek failed");
+	TEST_CHECK(file->file_read(file, (uint8_t*)check, 1000) == 0, "Read past end");
+	TEST_CHECK(file->file_seek(file, 0) == 0, "Seek failed");
+	result = file->file_read(file, (uint8_t*)check, 1000);
+	TEST_CHECK(result == 1000 && ! memcmp(check, text, 1000), "Wrong start of file");
+	file_destroy(file);
+
+	// a file named as compressed that isn't reads as it is
+	//
+	file = file_create(filename, openForWrite);
+	TEST_CHECK(file != NULL, "Can't open for write");
+	TEST_CHECK(file->file_write(file, (uint8_t*)"plain\n", 6) == 6, "Can't write");
+	file_destroy(file);
+	file = file_create(filename, openForRead);
+	TEST_CHECK(file != NULL, "Can't open plain file");
+	result = file->file_read(file, (uint8_t*)check, 100);
+	TEST_CHECK(result == 6 && ! memcmp(check, "plain\n", 6), "Wrong plain text");
+	file_destroy(file);
+
+	filesys_delete(filename);
+	free(check);
+	free(text);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	
@@ -187,6 +1505,42 @@ int main(int argc, char **argv)
 	{
 		return -1;
 	}
+	if (zstreamtest())
+	{
+		return -1;
+	}
+	if (httprangetest())
+	{
+		return -1;
+	}
+	if (httpparalleltest())
+	{
+		return -1;
+	}
+	if (httppooltest())
+	{
+		return -1;
+	}
+	if (httpwritetest())
+	{
+		return -1;
+	}
+	if (httpstreamtest())
+	{
+		return -1;
+	}
+	if (httpcachetest())
+	{
+		return -1;
+	}
+	if (ftpstattest())
+	{
+		return -1;
+	}
+	if (fileinfotest())
+	{
+		return -1;
+	}
 	if (httpfiletest())
 	{
 		return -1;